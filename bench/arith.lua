@@ -0,0 +1,12 @@
+-- ops: 10000000
+-- Floating point arithmetic in a tight loop
+local n = 10000000
+local i = 0
+local x = 0
+local y = 1
+while i < n do
+  x = x + i * 0.5 - y / 3
+  y = y * 1.0000001 + 1
+  i = i + 1
+end
+assert(x ~= 0 and y > n)
@@ -0,0 +1,160 @@
+
+import os
+import sys
+import re
+import time
+import argparse
+import platform
+import tempfile
+
+from os.path import join, basename, splitext
+from subprocess import Popen, DEVNULL
+from threading import Thread
+
+# Runs every Lua script in a folder with the LuaJ CLI (and optionally a
+# reference Lua interpreter), and reports the wall time, operations per second,
+# and peak memory usage for each one.
+#
+# Each benchmark starts with a comment giving the number of operations it
+# performs (loop iterations, calls, etc.), which is used for the operations per
+# second figure:
+#
+#   -- ops: 1000000
+#
+# Usage: bench.py [--lua <path>] [--warmup <n>] [--reps <n>] <folder> <luaj>
+
+COLOR_NONE    = "\x1B[0m"
+COLOR_RED     = "\x1B[31m"
+COLOR_GREEN   = "\x1B[32m"
+COLOR_BLUE    = "\x1B[34m"
+
+def print_color(color):
+	if platform.system() != "Windows" and sys.stdout.isatty():
+		sys.stdout.write(color)
+
+# Prints an error message to the standard output
+def print_error(message):
+	print_color(COLOR_RED)
+	sys.stdout.write("[Error] ")
+	print_color(COLOR_NONE)
+	print(message)
+
+# Returns the number of operations declared at the top of a benchmark, or None
+def read_ops(path):
+	with open(path, "r") as f:
+		for line in f:
+			match = re.match(r"^--\s*ops:\s*(\d+)", line)
+			if match:
+				return int(match.group(1))
+	return None
+
+# Returns the peak resident set size in KB for a running process, or None.
+# Only supported on Linux
+def read_peak_rss(pid):
+	try:
+		with open("/proc/%d/status" % pid, "r") as f:
+			for line in f:
+				if line.startswith("VmHWM:"):
+					return int(line.split()[1])
+	except (IOError, ValueError):
+		pass
+	return None
+
+# Runs a benchmark once. Returns the wall time in seconds and the peak resident
+# set size in KB (or None if it's not known), or None if the script failed.
+#
+# The peak RSS is polled from '/proc' while the benchmark runs. 'ru_maxrss'
+# from 'wait4' can't be used, since it includes the memory used by this
+# script in the process before it's replaced by the benchmark
+def run_once(cli_path, path):
+	errors = tempfile.TemporaryFile()
+	start = time.perf_counter()
+	proc = Popen([cli_path, path], stdin=DEVNULL, stdout=DEVNULL, stderr=errors)
+	peak = [None]
+	def poll():
+		while proc.returncode is None:
+			rss = read_peak_rss(proc.pid)
+			if rss is not None:
+				peak[0] = rss # High water mark only ever increases
+			time.sleep(0.001)
+	poller = Thread(target=poll)
+	poller.start()
+	status = proc.wait()
+	elapsed = time.perf_counter() - start
+	poller.join()
+	if status != 0:
+		print_error(basename(path) + " failed with status " + str(status))
+		errors.seek(0)
+		error = errors.read()
+		if len(error) > 0:
+			print(error.decode("ascii", "replace"))
+		return None
+	return (elapsed, peak[0])
+
+# Runs a benchmark 'warmup' times without measuring it, then 'reps' times.
+# Returns the median wall time and the largest peak RSS, or None if any run
+# failed
+def run(cli_path, path, warmup, reps):
+	for _ in range(warmup):
+		if run_once(cli_path, path) is None:
+			return None
+	times = []
+	rss = None
+	for _ in range(reps):
+		result = run_once(cli_path, path)
+		if result is None:
+			return None
+		times.append(result[0])
+		if result[1] is not None:
+			rss = max(rss or 0, result[1])
+	times.sort()
+	return (times[len(times) // 2], rss)
+
+def format_result(result, ops):
+	if result is None:
+		return "%10s %12s %10s" % ("failed", "-", "-")
+	elapsed, rss = result
+	ops_per_sec = "%.3g" % (ops / elapsed) if ops else "-"
+	rss = "%dKB" % rss if rss is not None else "-"
+	return "%9.3fs %12s %10s" % (elapsed, ops_per_sec, rss)
+
+parser = argparse.ArgumentParser()
+parser.add_argument("folder", help="folder containing the benchmarks")
+parser.add_argument("luaj", help="path to the LuaJ CLI binary")
+parser.add_argument("--lua", help="path to a reference Lua binary")
+parser.add_argument("--warmup", type=int, default=1,
+	help="unmeasured runs before timing each benchmark")
+parser.add_argument("--reps", type=int, default=5,
+	help="measured runs for each benchmark")
+args = parser.parse_args()
+
+paths = sorted(join(args.folder, f) for f in os.listdir(args.folder)
+	if splitext(f)[1] == ".lua")
+
+header = "%-12s %10s %12s %10s" % ("benchmark", "time", "ops/sec", "peak rss")
+if args.lua:
+	header += "   %10s %12s %10s   %s" % ("lua time", "ops/sec", "peak rss",
+		"speedup")
+print_color(COLOR_BLUE)
+print(header)
+print_color(COLOR_NONE)
+
+failed = False
+for path in paths:
+	name = splitext(basename(path))[0]
+	ops = read_ops(path)
+	luaj = run(args.luaj, path, args.warmup, args.reps)
+	line = "%-12s %s" % (name, format_result(luaj, ops))
+	failed = failed or luaj is None
+	if args.lua:
+		ref = run(args.lua, path, args.warmup, args.reps)
+		line += "   " + format_result(ref, ops)
+		failed = failed or ref is None
+		if luaj is not None and ref is not None:
+			speedup = ref[0] / luaj[0]
+			print_color(COLOR_GREEN if speedup >= 1 else COLOR_RED)
+			line += "   %.2fx" % speedup
+	print(line)
+	print_color(COLOR_NONE)
+
+sys.exit(1 if failed else 0)
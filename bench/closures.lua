@@ -0,0 +1,17 @@
+-- ops: 10000000
+-- Calls to closures that update a shared upvalue
+local function counter()
+  local n = 0
+  return function(step)
+    n = n + step
+    return n
+  end
+end
+local inc = counter()
+local i = 0
+local last = 0
+while i < 10000000 do
+  last = inc(2)
+  i = i + 1
+end
+assert(last == 20000000)
@@ -0,0 +1,15 @@
+-- ops: 2000000
+-- Appending to strings that are then thrown away
+local n = 2000000
+local i = 0
+local s = ""
+local total = 0
+while i < n do
+  s = s .. "ab"
+  i = i + 1
+  if i % 1000 == 0 then
+    total = total + 1
+    s = ""
+  end
+end
+assert(total == n / 1000)
@@ -0,0 +1,19 @@
+-- ops: 5000000
+-- Branches on comparisons and logical operators
+local n = 5000000
+local i = 0
+local a, b, c = 0, 0, 0
+while i < n do
+  local m = i % 7
+  if m == 0 or m == 3 then
+    a = a + 1
+  elseif m < 3 and i > 100 then
+    b = b + 1
+  elseif not (m == 6) then
+    c = c + 1
+  else
+    a = a - 1
+  end
+  i = i + 1
+end
+assert(a + b + c > 0)
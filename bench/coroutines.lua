@@ -0,0 +1,23 @@
+-- ops: 10000000
+-- Values passed through a pipeline of coroutines (one resume and one yield
+-- each)
+local n = 5000000
+local source = coroutine.create(function()
+  local i = 0
+  while true do
+    i = i + 1
+    coroutine.yield(i)
+  end
+end)
+local filter = coroutine.create(function()
+  while true do
+    local ok, v = coroutine.resume(source)
+    coroutine.yield(v * 2)
+  end
+end)
+local sum = 0
+for i = 1, n do
+  local ok, v = coroutine.resume(filter)
+  sum = sum + v
+end
+assert(sum == n * (n + 1))
@@ -0,0 +1,14 @@
+-- ops: 10000000
+-- Numeric 'for' loops over record indices
+local n = 1000
+local records = {}
+for i = 1, n do
+  records[i] = i % 7
+end
+local sum = 0
+for pass = 1, 10000 do
+  for i = 1, n do
+    sum = sum + records[i]
+  end
+end
+assert(sum == 30030000)
@@ -0,0 +1,17 @@
+-- ops: 5000000
+-- Protected calls to a handler, one in every thousand of which fails
+local function handler(i)
+  if i % 1000 == 0 then
+    error("failed", 0)
+  end
+  return i
+end
+local n = 5000000
+local failed = 0
+for i = 1, n do
+  local ok, v = pcall(handler, i)
+  if not ok then
+    failed = failed + 1
+  end
+end
+assert(failed == n / 1000)
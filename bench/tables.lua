@@ -0,0 +1,17 @@
+-- ops: 9000000
+-- Array and field accesses
+local n = 3000000
+local t = {}
+local i = 1
+while i <= n do
+  t[i] = i
+  i = i + 1
+end
+local p = {x = 0, y = 0}
+i = 1
+while i <= n do
+  p.x = p.x + t[i]
+  p.y = p.y - t[n - i + 1]
+  i = i + 1
+end
+assert(p.x == -p.y)
@@ -0,0 +1,191 @@
+// Multi-threaded stress benchmark
+// Uses the Lua C API and the LuaJ extensions only
+//
+// Usage: luaj_threads [-t <threads>] [-r <runs>] <file name>
+//
+//   -t <threads> Largest number of threads to run at once (default: the
+//                number of CPUs). Runs with 1, 2, 4, ... threads up to this
+//   -r <runs>    Number of times each thread runs the script (default: 10)
+//
+// Each run creates a new state, loads the script, calls it, and closes the
+// state again, so the threads stress state creation, the parser, the
+// allocator, and the JIT as well as the script itself. The script is loaded
+// in two ways: by parsing its source in every run, and from a shared chunk
+// (see 'luaJ_newchunk') that's parsed once up front. For each number of
+// threads, the wall time and total runs per second are reported for both.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <luaj.h>
+
+typedef struct {
+    const char *src; // Parsed in every run if 'chunk' is NULL
+    size_t len;
+    const char *chunk_name;
+    const luaJ_Chunk *chunk;
+    int runs;
+    int failed;
+} Worker;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+static void * work(void *ud) {
+    Worker *w = (Worker *) ud;
+    for (int i = 0; i < w->runs && !w->failed; i++) {
+        lua_State *L = luaL_newstate();
+        if (!L) {
+            w->failed = 1;
+            break;
+        }
+        luaL_openlibs(L);
+        int status = w->chunk ? luaJ_loadchunk(L, w->chunk) :
+                luaL_loadbuffer(L, w->src, w->len, w->chunk_name);
+        if (!status) {
+            status = lua_pcall(L, 0, 0, 0);
+        }
+        if (status) {
+            fprintf(stderr, "%s\n", lua_tostring(L, -1));
+            w->failed = 1;
+        }
+        lua_close(L);
+    }
+    return NULL;
+}
+
+// Runs 'num_threads' workers at once. Returns the wall time, or a negative
+// number if any of them failed.
+static double run(Worker *proto, int num_threads) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    Worker *workers = malloc(sizeof(Worker) * num_threads);
+    double start = now();
+    int started = 0;
+    for (; started < num_threads; started++) {
+        workers[started] = *proto;
+        if (pthread_create(&threads[started], NULL, work,
+                           &workers[started]) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            break;
+        }
+    }
+    int failed = started < num_threads;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= workers[i].failed;
+    }
+    double elapsed = now() - start;
+    free(threads);
+    free(workers);
+    return failed ? -1.0 : elapsed;
+}
+
+// Reads the whole of 'path' into memory.
+static char * read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    size_t size = 4096;
+    char *buf = malloc(size);
+    *len = 0;
+    size_t n;
+    while (buf && (n = fread(buf + *len, 1, size - *len, f)) > 0) {
+        *len += n;
+        if (*len == size) {
+            size *= 2;
+            char *grown = realloc(buf, size);
+            if (!grown) {
+                free(buf);
+            }
+            buf = grown;
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int runs = 10;
+    int arg = 1;
+    while (arg + 1 < argc && (strcmp(argv[arg], "-t") == 0 ||
+                              strcmp(argv[arg], "-r") == 0)) {
+        int n = atoi(argv[arg + 1]);
+        if (n <= 0) {
+            fprintf(stderr, "%s: invalid option argument\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (argv[arg][1] == 't') {
+            max_threads = n;
+        } else {
+            runs = n;
+        }
+        arg += 2;
+    }
+    if (arg >= argc) {
+        fprintf(stderr, "%s: expected <file name>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    Worker proto = {0};
+    proto.chunk_name = argv[arg];
+    proto.runs = runs;
+    char *src = read_file(argv[arg], &proto.len);
+    if (!src) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[arg]);
+        return EXIT_FAILURE;
+    }
+    proto.src = src;
+
+    // Parse the script once for the shared chunk
+    lua_State *L = luaL_newstate();
+    luaJ_Chunk *chunk = NULL;
+    if (L && luaL_loadbuffer(L, src, proto.len, argv[arg]) == 0) {
+        chunk = luaJ_newchunk(L);
+    } else if (L) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    }
+    if (!chunk) {
+        fprintf(stderr, "%s: cannot compile %s\n", argv[0], argv[arg]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %10s %12s %10s %12s\n", "threads", "parse", "runs/sec",
+           "shared", "runs/sec");
+    int status = EXIT_SUCCESS;
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        Worker parsed = proto;
+        Worker shared = proto;
+        shared.chunk = chunk;
+        double t_parsed = run(&parsed, n);
+        double t_shared = run(&shared, n);
+        if (t_parsed < 0 || t_shared < 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        double total = (double) n * runs;
+        printf("%-8d %9.3fs %12.1f %9.3fs %12.1f\n", n, t_parsed,
+               total / t_parsed, t_shared, total / t_shared);
+        if (n == max_threads) {
+            break;
+        }
+    }
+    lua_close(L);
+    luaJ_freechunk(chunk);
+    free(src);
+    return status;
+}
@@ -1,11 +1,34 @@
-
 // LuaJ command line interpreter
 // Uses the Lua C API only
+//
+// Usage: luaj [-b <listing>] [-p <profile>] [-c <counts>] [-m]
+//             [-o <output> [-s]] [-e <chunk>]... [<file name>]...
+//
+// The chunks given with '-e' and the scripts are run one after the other in
+// the same state, in the order they're given, stopping at the first error.
+//
+//   -e <chunk>   Run the string 'chunk'
+//   -b <listing> Write bytecode and trace listings to the file 'listing', or
+//                to the standard output if 'listing' is '-'
+//   -p <profile> Profile the script, writing folded stacks (for flame graphs)
+//                to the file 'profile', or to the standard output if it's '-'
+//   -o <output>  Compile the script (there must be only one) to a precompiled
+//                chunk in 'output' instead of running it
+//   -s           Strip the debug info (such as line numbers) from the chunk
+//   -c <counts>  Write the interpreter's counters as JSON to the file 'counts',
+//                or to the standard output if it's '-', before exiting. Needs
+//                a build with the LUAJ_STATS option
+//   -m           Print how much memory each allocation site is using to the
+//                standard error before exiting
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
+#include <luaj.h>
 
 static void write(char *prog_name, char *msg) {
     if (prog_name) {
@@ -14,18 +37,161 @@ static void write(char *prog_name, char *msg) {
     fprintf(stderr, "%s\n", msg);
 }
 
+static int file_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    (void) L;
+    return fwrite(p, 1, sz, (FILE *) ud) != sz;
+}
+
+// Prints the error message left on the stack by a failed load or call.
+static void report(lua_State *L, int status) {
+    if (status && lua_isstring(L, -1)) {
+        write(NULL, (char *) lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+// Opens the file for an option's argument; '-' is the standard output.
+static FILE * open_output(char *name) {
+    return strcmp(name, "-") == 0 ? stdout : fopen(name, "w");
+}
+
+// Prints the state's memory use, broken down by allocation site.
+static void print_mem(lua_State *L) {
+    static const char * const SITES[] = {
+        "string", "table", "function", "stack", "parser", "jit", "other",
+    };
+    luaJ_MemStats m;
+    luaJ_memstats(L, &m);
+    fprintf(stderr, "memory: %zu bytes in use, %zu peak\n", m.bytes, m.peak);
+    for (int i = 0; i < LUAJ_MEM_SITES; i++) {
+        fprintf(stderr, "  %-8s %12zu bytes %10zu allocs\n", SITES[i],
+                m.site_bytes[i], m.site_allocs[i]);
+    }
+}
+
+// Writes the function on top of the stack to 'out_name'.
+static int dump(lua_State *L, char *prog_name, char *out_name, int strip) {
+    FILE *f = fopen(out_name, "wb");
+    if (!f) {
+        write(prog_name, "cannot open output file");
+        return EXIT_FAILURE;
+    }
+    int status = luaJ_dump(L, file_writer, f, strip);
+    if (fclose(f) != 0 || status) {
+        write(prog_name, "cannot write output file");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// A chunk to run: the argument to '-e', or a script's file name.
+typedef struct {
+    char *src;
+    int is_str;
+} Chunk;
+
+static int load_chunk(lua_State *L, Chunk *c) {
+    if (c->is_str) {
+        return luaL_loadbuffer(L, c->src, strlen(c->src), "(command line)");
+    }
+    return luaL_loadfile(L, c->src);
+}
+
 int main(int argc, char *argv[]) {
     char *prog_name = argv[0];
     lua_State *L = luaL_newstate();
-    if (!L) {
+    Chunk *chunks = malloc(sizeof(Chunk) * (size_t) argc);
+    if (!L || !chunks) {
         write(prog_name, "insufficient memory to start lua");
         return EXIT_FAILURE;
     }
-    if (argc < 2) {
+    luaL_openlibs(L);
+    char *out_name = NULL;
+    FILE *listing = NULL, *profile = NULL, *counters = NULL;
+    int strip = 0, mem = 0;
+    int num_chunks = 0;
+    for (int arg = 1; arg < argc; arg++) {
+        char *opt = argv[arg];
+        if (opt[0] != '-') {
+            chunks[num_chunks++] = (Chunk) {opt, 0};
+            continue;
+        } else if (strcmp(opt, "-s") == 0) {
+            strip = 1;
+            continue;
+        } else if (strcmp(opt, "-m") == 0) {
+            mem = 1;
+            continue;
+        } else if (strcmp(opt, "-o") != 0 && strcmp(opt, "-b") != 0 &&
+                   strcmp(opt, "-p") != 0 && strcmp(opt, "-e") != 0 &&
+                   strcmp(opt, "-c") != 0) {
+            write(prog_name, "unrecognized option");
+            return EXIT_FAILURE;
+        } else if (arg + 1 >= argc) {
+            write(prog_name, "option needs an argument");
+            return EXIT_FAILURE;
+        }
+        char *opt_arg = argv[++arg];
+        if (opt[1] == 'e') {
+            chunks[num_chunks++] = (Chunk) {opt_arg, 1};
+        } else if (opt[1] == 'o') {
+            out_name = opt_arg;
+        } else if (opt[1] == 'p') {
+            if (!(profile = open_output(opt_arg))) {
+                write(prog_name, "cannot open profile file");
+                return EXIT_FAILURE;
+            }
+        } else if (opt[1] == 'c') {
+            if (!(counters = open_output(opt_arg))) {
+                write(prog_name, "cannot open counters file");
+                return EXIT_FAILURE;
+            }
+        } else if (!(listing = open_output(opt_arg))) {
+            write(prog_name, "cannot open listing file");
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_chunks == 0) {
         write(prog_name, "expected <file name>");
         return EXIT_FAILURE;
+    } else if (out_name && num_chunks > 1) {
+        write(prog_name, "can only compile one script at a time");
+        return EXIT_FAILURE;
+    }
+    if (listing) {
+        luaJ_dumpbc(L, listing);
+    }
+    if (profile && !out_name) {
+        luaJ_profile(L, profile, 0);
+    }
+    int status = 0;
+    for (int i = 0; i < num_chunks && !status; i++) {
+        status = load_chunk(L, &chunks[i]);
+        if (status) {
+            report(L, status);
+        } else if (out_name) {
+            status = dump(L, prog_name, out_name, strip);
+        } else {
+            status = lua_pcall(L, 0, 0, 0);
+            report(L, status);
+        }
+    }
+    luaJ_profile(L, NULL, 0); // Write out the samples
+    if (counters && luaJ_stats(L, counters) != 0) {
+        write(prog_name, "counters need a build with LUAJ_STATS");
+    }
+    if (mem) {
+        print_mem(L);
     }
-    int status = luaL_loadfile(L, argv[1]) || lua_pcall(L, 0, 0, 0);
     lua_close(L);
+    free(chunks);
+    if (listing && listing != stdout) {
+        fclose(listing);
+    }
+    if (profile && profile != stdout) {
+        fclose(profile);
+    }
+    if (counters && counters != stdout) {
+        fclose(counters);
+    }
     return status;
 }
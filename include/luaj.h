@@ -0,0 +1,140 @@
+/*
+** LuaJ extensions to the Lua API
+*/
+
+#ifndef luaj_h
+#define luaj_h
+
+#include <stdio.h>
+
+#include "lua.h"
+
+/*
+** Threads. Every state is independent: the string table, allocator pools,
+** garbage collector, compiled traces, and inline caches all belong to a
+** single state, and the library has no global mutable data. Different states
+** can be used from different threads at the same time with no locking, but a
+** single state (and anything pushed from it) must only be used by one thread
+** at a time. The environment variables below are read by 'lua_newstate', so
+** they mustn't be changed while another thread creates a state. An error
+** with no 'lua_pcall' to catch it still exits the whole process.
+**
+** Function prototypes can't be shared between states, since the interpreter
+** and JIT write to them as they run and their strings belong to one state.
+** Instead, a shared chunk is an immutable, precompiled image of the function
+** on top of the stack (like 'lua_dump', which it uses), so a script can be
+** parsed once and then loaded into any number of states. 'luaJ_loadchunk'
+** pushes the function like 'lua_load' and never writes to the chunk, so it
+** can be called for the same chunk from several threads at once. The states
+** a chunk was loaded into must be closed before it's freed, since their
+** functions keep its chunk name for error messages. 'luaJ_newchunk' returns
+** NULL if the value on top of the stack isn't a Lua function without
+** upvalues, or if there isn't enough memory.
+*/
+typedef struct luaJ_Chunk luaJ_Chunk;
+
+LUA_API luaJ_Chunk * (luaJ_newchunk) (lua_State *L);
+LUA_API int (luaJ_loadchunk) (lua_State *L, const luaJ_Chunk *c);
+LUA_API void (luaJ_freechunk) (luaJ_Chunk *c);
+
+/*
+** Same as 'lua_dump', but if 'strip' is non-zero the chunk is written without
+** its debug info: the line of each instruction, the names of the functions,
+** and the lines they span. The functions loaded from it take up less memory,
+** but errors in them have no line numbers.
+*/
+LUA_API int (luaJ_dump) (lua_State *L, lua_Writer writer, void *data,
+                         int strip);
+
+/*
+** Memory accounting. Every allocation the state makes is counted against one
+** of the coarse sites below, and 'luaJ_memstats' fills in the bytes in use
+** (the same as the LUA_GCCOUNT total, in bytes), the most that's been in use
+** at once, and the bytes and number of allocations for each site. Growing an
+** existing block counts as an allocation.
+**
+** If a limit is set with 'luaJ_setmemlimit', an allocation that would take
+** the bytes in use over it fails with a LUA_ERRMEM error instead, which can be
+** caught with 'pcall' like any other error, and the collector starts cycles
+** earlier as the limit gets closer. A limit of 0 (the default) means there's
+** none. If the limit is set below the bytes already in use, every allocation
+** that grows fails until enough is freed. The collector's own working memory
+** isn't held to the limit, so the bytes in use can go slightly over it while
+** a cycle runs. Returns the previous limit. The limit can also be set with the
+** LUAJ_MEM_LIMIT environment variable, in bytes, which is read by
+** 'lua_newstate'.
+*/
+#define LUAJ_MEM_STRING    0
+#define LUAJ_MEM_TABLE     1
+#define LUAJ_MEM_FUNCTION  2 /* Prototypes, closures, and upvalues */
+#define LUAJ_MEM_STACK     3 /* Value and call stacks, and coroutines */
+#define LUAJ_MEM_PARSER    4 /* Freed once a chunk is loaded */
+#define LUAJ_MEM_JIT       5 /* Traces and the JIT's working memory */
+#define LUAJ_MEM_OTHER     6
+#define LUAJ_MEM_SITES     7
+
+typedef struct luaJ_MemStats {
+  size_t bytes, peak, limit;
+  size_t site_bytes[LUAJ_MEM_SITES];
+  size_t site_allocs[LUAJ_MEM_SITES];
+} luaJ_MemStats;
+
+LUA_API void (luaJ_memstats) (lua_State *L, luaJ_MemStats *stats);
+LUA_API size_t (luaJ_setmemlimit) (lua_State *L, size_t limit);
+
+/*
+** Debug listings. When a sink is set, the bytecode for every chunk is written
+** to it once the chunk is loaded, as is every trace once the JIT has finished
+** recording it. Pass NULL to turn listings off (the default).
+**
+** The sink can also be set with the LUAJ_DUMP_BC environment variable, which
+** is read by 'lua_newstate'. It can be "stdout", "stderr", or a file name.
+*/
+LUA_API void (luaJ_dumpbc) (lua_State *L, FILE *out);
+
+/*
+** Sampling profiler. While a sink is set, the interpreter records the Lua call
+** stack about once every 'interval' bytecode instructions (or a default, if
+** 'interval' is 0). When the profile is stopped, by passing NULL or closing
+** the state, the samples are written to the sink as folded stacks, which can
+** be fed to 'flamegraph.pl'. There's a line for each distinct stack, listing
+** its functions from the outermost caller inwards, the line the innermost one
+** was running, and the number of samples:
+**
+**   <unknown>@fib.lua:1-12;fib@fib.lua:1-7;fib@fib.lua:1-7 (line 5) 42
+**
+** Setting a new sink starts a new profile. The profiler can also be started
+** with the LUAJ_PROFILE environment variable, which works like LUAJ_DUMP_BC.
+*/
+LUA_API void (luaJ_profile) (lua_State *L, FILE *out, int interval);
+
+/*
+** Interpreter counters. These are only kept when LuaJ is built with the
+** LUAJ_STATS CMake option. The interpreter then counts every instruction it
+** executes by opcode (but not the ones in compiled traces), and for each Lua
+** function, its calls, the calls that passed fewer arguments than it has
+** parameters, and the returns from it with fewer values than the caller
+** wanted. 'luaJ_stats' writes them to 'out' as JSON, with the most executed
+** opcodes and most called functions first:
+**
+**   {"ops": {"MOV": 5120, "CALL": 177, ...},
+**    "functions": [{"name": "fib", "chunk": "fib.lua", "line": 1,
+**                   "calls": 177, "missing_args": 0, "missing_rets": 0}, ...]}
+**
+** Functions are kept alive once they've been called, so they can still be
+** reported. Returns 0, or -1 if the counters weren't compiled in.
+*/
+LUA_API int (luaJ_stats) (lua_State *L, FILE *out);
+
+/*
+** Builtins are C functions with an optional fast path for math intrinsics:
+** when a builtin is called from Lua with a single number argument, 'fast' is
+** called directly, with no stack traffic. Otherwise (or if 'fast' is NULL),
+** 'f' is called like any other C function.
+*/
+typedef double (*luaJ_Builtin) (double n);
+
+LUA_API void (luaJ_pushbuiltin) (lua_State *L, lua_CFunction f,
+                                 luaJ_Builtin fast);
+
+#endif
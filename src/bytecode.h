@@ -26,6 +26,7 @@
 //             representing an immutable string object
 // * func (F): An index into the current function's constants table ('fn->k')
 //             representing a function prototype object
+// * table (T): A stack slot holding a table
 //
 // Bytecode specification:
 //
@@ -58,6 +59,29 @@
 //             A -- Destination stack slot
 //             D -- 16-bit unsigned index into the function's constants table
 //
+//   FNEW      Creates a closure for a function prototype from the constants
+//             table, capturing its upvalues (see 'Fn.upvals'). Functions
+//             without upvalues are loaded with 'KFN' instead
+//             A -- Destination stack slot
+//             D -- 16-bit unsigned index into the function's constants table
+//
+//   GGET      Reads the global variable named by a constant string. Keeps an
+//             inline cache, like 'TGETS'
+//             A -- Destination stack slot
+//             D -- 16-bit unsigned index into the function's constants table
+//
+//   GSET      Assigns to the global variable named by a constant string
+//             A -- Stack slot of the value to assign
+//             D -- 16-bit unsigned index into the function's constants table
+//
+//   UGET      Reads an upvalue of the current closure
+//             A -- Destination stack slot
+//             D -- Upvalue index
+//
+//   USET      Assigns to an upvalue of the current closure
+//             A -- Stack slot of the value to assign
+//             D -- Upvalue index
+//
 //   KNIL      Sets stack slots 'A' through 'D' to nil
 //             A -- First stack slot to set to nil
 //             D -- Last stack slot to set to nil
@@ -93,6 +117,40 @@
 //             C -- Last stack slot to concatenate (a string)
 //
 //
+// -- Table Operations --
+//
+//   TNEW      Creates a new, empty table and stores it in 'A'
+//             A -- Destination stack slot
+//             B -- Number of array slots to pre-allocate
+//             C -- Number of hash slots to pre-allocate
+//
+//   TGETV     Indexes the table in 'B' with the key in 'C'
+//                 A = B[C]
+//             A -- Destination stack slot
+//             B -- Stack slot of the table
+//             C -- Stack slot of the key
+//
+//   TGETS     Indexes the table in 'B' with a constant string key. Keeps an
+//             inline cache of the key's location in 'fn->ic'
+//                 A = B[C]
+//             A -- Destination stack slot
+//             B -- Stack slot of the table
+//             C -- 8-bit unsigned index into the constants table
+//
+//   TSETV     Assigns to a key in the table in 'B'
+//                 B[C] = A
+//             A -- Stack slot of the value to assign
+//             B -- Stack slot of the table
+//             C -- Stack slot of the key
+//
+//   TSETS     Assigns to a constant string key in the table in 'B'. Keeps an
+//             inline cache, like 'TGETS'
+//                 B[C] = A
+//             A -- Stack slot of the value to assign
+//             B -- Stack slot of the table
+//             C -- 8-bit unsigned index into the constants table
+//
+//
 // -- Conditional Operations --
 //
 // Conditional jumps consist of two instructions: a conditional instruction
@@ -132,6 +190,33 @@
 //             E -- 24-bit signed jump offset, relative to the PC of the
 //                  instruction AFTER the 'JMP' instruction
 //
+//   JLOOP     A 'JMP' back to a loop header for a loop with a compiled trace.
+//             Never emitted by the parser; the JIT patches a loop's closing
+//             'JMP' into a 'JLOOP' once the loop's trace is compiled.
+//             E -- 24-bit signed jump offset, as for 'JMP'
+//
+//   FORPREP   Starts a numeric 'for' loop, with the index, limit, and step in
+//             'A', 'A+1', and 'A+2'. Followed by a 'JMP' past the end of the
+//             loop, which is skipped if the loop runs at least once (in which
+//             case the index is copied into the loop variable 'A+3')
+//             A -- First of the loop's 4 stack slots
+//
+//   FORPREPI  'FORPREP' for a loop with a constant integer step, which isn't
+//             kept in 'A+2'. The sign of the step is known, so the bounds
+//             check is a single comparison
+//             A -- First of the loop's 4 stack slots
+//             D -- 16-bit signed integer step (never 0)
+//
+//   FORLOOP   Adds the step to the index at the end of each iteration. If the
+//             loop is still in bounds, copies the index into the loop variable
+//             and runs the following 'JMP' back to the start of the body;
+//             otherwise skips over the 'JMP'
+//             A -- First of the loop's 4 stack slots
+//
+//   FORLOOPI  'FORLOOP' for a loop with a constant integer step
+//             A -- First of the loop's 4 stack slots
+//             D -- 16-bit signed integer step (never 0)
+//
 //   CALL      Calls the function in stack slot 'A' with 'B' arguments in
 //             contiguous stack slots immediately after 'A'. Expects 'C' return
 //             values:
@@ -140,6 +225,11 @@
 //             B -- Number of arguments
 //             C -- Number of return values
 //
+//   UCLO      Closes the open upvalues for stack slots 'D' and above; emitted
+//             when a block with captured locals goes out of scope. Returns
+//             close the function's upvalues on their own
+//             D -- First stack slot to close
+//
 //   RET0      Returns from a function with no return values
 //                 return
 //
@@ -152,6 +242,59 @@
 //                 return A, A+1, ..., A+D-1
 //             A -- Stack slot of first value to return
 //             D -- Number of values to return
+//
+//
+// -- Fused Operations --
+//
+// Superinstructions are never emitted directly by the parser. Once a function
+// has been parsed, a peephole pass replaces the first instruction in some
+// common pairs with a fused opcode that does the work of both, saving a
+// dispatch. The second instruction is left in place: the fused instruction
+// reads its operands from there, and anything that jumps straight to it (or a
+// trace that exits to it) still works. The JIT's recorder undoes the fusion,
+// so traces only ever contain unfused pairs.
+//
+//   IST_JMP   A conditional instruction fused with its following forward
+//   ...       'JMP'. Jumps straight to the 'JMP's target if the condition
+//   GEVN_JMP  holds, otherwise skips over the 'JMP'. 'EQVV_JMP' to 'GEVN_JMP'
+//             are in the same order as 'EQVV' to 'GEVN' (see 'bc_fuse')
+//
+//
+// -- Specialised Operations --
+//
+// Also never emitted directly by the parser. Another pass works out which
+// stack slots must hold numbers at each instruction (e.g., because they were
+// just loaded with 'KINT' or written by an arithmetic instruction), and
+// replaces arithmetic instructions and fused comparisons whose stack slot
+// operands are all known to be numbers with variants that don't check their
+// operands' types. The JIT's recorder undoes this along with the fusion.
+//
+//   ADDVV_NUM     'ADDVV' to 'POW' without type checks, in the same order (see
+//   ...           'bc_num')
+//   POW_NUM
+//
+//   LTVV_JMP_NUM  'LTVV_JMP' to 'GEVN_JMP' without type checks, in the same
+//   ...           order
+//   GEVN_JMP_NUM
+//
+//
+// -- Wide Operations --
+//
+// Instructions with an 8-bit constant operand can only refer to the first 256
+// entries in the constants table. For later constants, the parser emits the
+// wide variant of the instruction instead, followed by a 'KX' word holding
+// the constant's index. The wide instruction's own constant operand is unused
+// (0) and its other operands are the same. The interpreter steps over the
+// 'KX' along with the instruction, and nothing jumps to it. Wide instructions
+// aren't specialised.
+//
+//   ADDVN_KX  'ADDVN' to 'MODNV' (the ones with a constant operand), 'TGETS',
+//   ...       and 'TSETS', with their constant in the following 'KX' (see
+//   TSETS_KX  'bc_wide')
+//
+//   KX        Constant index for the wide instruction before it; does
+//             nothing if it's ever executed
+//             E -- 24-bit unsigned index into the constants table
 
 // Jump offsets are stored as 24-bit signed values, calculated by:
 //
@@ -166,7 +309,6 @@
 
 #define BYTECODE       \
     X(NOP, 0)          \
-    X(ASSERT, 1)       \
                        \
     /* Storage */      \
     X(MOV, 2)          \
@@ -175,6 +317,11 @@
     X(KNUM, 2)         \
     X(KSTR, 2)         \
     X(KFN, 2)          \
+    X(FNEW, 2)         \
+    X(GGET, 2)         \
+    X(GSET, 2)         \
+    X(UGET, 2)         \
+    X(USET, 2)         \
     X(KNIL, 2)         \
                        \
     /* Arithmetic */   \
@@ -195,6 +342,13 @@
     X(POW, 3)          \
     X(CONCAT, 3)       \
                        \
+    /* Tables */       \
+    X(TNEW, 3)         \
+    X(TGETV, 3)        \
+    X(TGETS, 3)        \
+    X(TSETV, 3)        \
+    X(TSETS, 3)        \
+                       \
     /* Conditions */   \
     X(NOT, 2)          \
     X(IST, 1)          \
@@ -220,10 +374,73 @@
                        \
     /* Control Flow */ \
     X(JMP, 1)          \
+    X(JLOOP, 1)        \
+    X(FORPREP, 2)      \
+    X(FORPREPI, 2)     \
+    X(FORLOOP, 2)      \
+    X(FORLOOPI, 2)     \
     X(CALL, 3)         \
+    X(UCLO, 1)         \
     X(RET0, 0)         \
     X(RET1, 1)         \
-    X(RET, 2)
+    X(RET, 2)          \
+                       \
+    /* Fused */        \
+    X(IST_JMP, 1)      \
+    X(ISF_JMP, 1)      \
+    X(EQVV_JMP, 2)     \
+    X(EQVP_JMP, 2)     \
+    X(EQVN_JMP, 2)     \
+    X(EQVS_JMP, 2)     \
+    X(NEQVV_JMP, 2)    \
+    X(NEQVP_JMP, 2)    \
+    X(NEQVN_JMP, 2)    \
+    X(NEQVS_JMP, 2)    \
+    X(LTVV_JMP, 2)     \
+    X(LTVN_JMP, 2)     \
+    X(LEVV_JMP, 2)     \
+    X(LEVN_JMP, 2)     \
+    X(GTVV_JMP, 2)     \
+    X(GTVN_JMP, 2)     \
+    X(GEVV_JMP, 2)     \
+    X(GEVN_JMP, 2)     \
+                       \
+    /* Specialised */  \
+    X(ADDVV_NUM, 3)    \
+    X(ADDVN_NUM, 3)    \
+    X(SUBVV_NUM, 3)    \
+    X(SUBVN_NUM, 3)    \
+    X(SUBNV_NUM, 3)    \
+    X(MULVV_NUM, 3)    \
+    X(MULVN_NUM, 3)    \
+    X(DIVVV_NUM, 3)    \
+    X(DIVVN_NUM, 3)    \
+    X(DIVNV_NUM, 3)    \
+    X(MODVV_NUM, 3)    \
+    X(MODVN_NUM, 3)    \
+    X(MODNV_NUM, 3)    \
+    X(POW_NUM, 3)      \
+    X(LTVV_JMP_NUM, 2) \
+    X(LTVN_JMP_NUM, 2) \
+    X(LEVV_JMP_NUM, 2) \
+    X(LEVN_JMP_NUM, 2) \
+    X(GTVV_JMP_NUM, 2) \
+    X(GTVN_JMP_NUM, 2) \
+    X(GEVV_JMP_NUM, 2) \
+    X(GEVN_JMP_NUM, 2) \
+                       \
+    /* Wide */         \
+    X(ADDVN_KX, 3)     \
+    X(SUBVN_KX, 3)     \
+    X(SUBNV_KX, 3)     \
+    X(MULVN_KX, 3)     \
+    X(DIVVN_KX, 3)     \
+    X(DIVNV_KX, 3)     \
+    X(MODVN_KX, 3)     \
+    X(MODNV_KX, 3)     \
+    X(TGETS_KX, 3)     \
+    X(TSETS_KX, 3)     \
+    X(KX, 1)
 
 enum {
 #define X(name, _) BC_ ## name,
@@ -252,6 +469,89 @@ static inline uint8_t  bc_c(BcIns ins)  { return (uint8_t)  (ins >> 24); }
 static inline uint16_t bc_d(BcIns ins)  { return (uint16_t) (ins >> 16); }
 static inline uint32_t bc_e(BcIns ins)  { return (uint32_t) (ins >> 8);  }
 
+// Returns the fused opcode for the conditional instruction 'op' followed by a
+// 'JMP', or 'op' if it can't be fused.
+static inline uint8_t bc_fuse(uint8_t op) {
+    if (op >= BC_EQVV && op <= BC_GEVN) {
+        return op - BC_EQVV + BC_EQVV_JMP;
+    } else if (op == BC_IST) {
+        return BC_IST_JMP;
+    } else if (op == BC_ISF) {
+        return BC_ISF_JMP;
+    }
+    return op;
+}
+
+// Returns the opcode for 'op' that doesn't check its operands' types, or 'op'
+// if there isn't one.
+static inline uint8_t bc_num(uint8_t op) {
+    if (op >= BC_ADDVV && op <= BC_POW) {
+        return op - BC_ADDVV + BC_ADDVV_NUM;
+    } else if (op >= BC_LTVV_JMP && op <= BC_GEVN_JMP) {
+        return op - BC_LTVV_JMP + BC_LTVV_JMP_NUM;
+    }
+    return op;
+}
+
+// Returns the opcode a fused or specialised opcode was made from, or 'op' if
+// it's neither.
+static inline uint8_t bc_unfuse(uint8_t op) {
+    if (op >= BC_ADDVV_NUM && op <= BC_POW_NUM) {
+        return op - BC_ADDVV_NUM + BC_ADDVV;
+    } else if (op >= BC_LTVV_JMP_NUM && op <= BC_GEVN_JMP_NUM) {
+        return op - BC_LTVV_JMP_NUM + BC_LTVV;
+    } else if (op >= BC_EQVV_JMP && op <= BC_GEVN_JMP) {
+        return op - BC_EQVV_JMP + BC_EQVV;
+    } else if (op == BC_IST_JMP) {
+        return BC_IST;
+    } else if (op == BC_ISF_JMP) {
+        return BC_ISF;
+    }
+    return op;
+}
+
+// Returns the wide variant of 'op', or 'op' if it doesn't have an 8-bit
+// constant operand.
+static inline uint8_t bc_wide(uint8_t op) {
+    switch (op) {
+    case BC_ADDVN: return BC_ADDVN_KX;
+    case BC_SUBVN: return BC_SUBVN_KX;
+    case BC_SUBNV: return BC_SUBNV_KX;
+    case BC_MULVN: return BC_MULVN_KX;
+    case BC_DIVVN: return BC_DIVVN_KX;
+    case BC_DIVNV: return BC_DIVNV_KX;
+    case BC_MODVN: return BC_MODVN_KX;
+    case BC_MODNV: return BC_MODNV_KX;
+    case BC_TGETS: return BC_TGETS_KX;
+    case BC_TSETS: return BC_TSETS_KX;
+    default:       return op;
+    }
+}
+
+static inline int bc_is_wide(uint8_t op) {
+    return op >= BC_ADDVN_KX && op <= BC_TSETS_KX;
+}
+
+// Returns the opcode a wide opcode was made from, or 'op' if it isn't wide.
+static inline uint8_t bc_narrow(uint8_t op) {
+    static const uint8_t NARROW[] = {
+        BC_ADDVN, BC_SUBVN, BC_SUBNV, BC_MULVN, BC_DIVVN, BC_DIVNV, BC_MODVN,
+        BC_MODNV, BC_TGETS, BC_TSETS,
+    };
+    return bc_is_wide(op) ? NARROW[op - BC_ADDVN_KX] : op;
+}
+
+// Returns the constant index for the instruction at 'ins' that's either in
+// its 8-bit operand 'k8', or, for a wide instruction, in the 'KX' after it.
+static inline uint32_t bc_k(const BcIns *ins, uint8_t k8) {
+    return bc_is_wide(bc_op(*ins)) ? bc_e(ins[1]) : k8;
+}
+
+static inline int bc_is_fused(uint8_t op) {
+    return (op >= BC_IST_JMP && op <= BC_GEVN_JMP) ||
+        (op >= BC_LTVV_JMP_NUM && op <= BC_GEVN_JMP_NUM);
+}
+
 static inline void bc_set_op(BcIns *ins, uint8_t op) {
     *ins = (*ins & 0xffffff00) | op;
 }
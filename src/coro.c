@@ -0,0 +1,162 @@
+
+// Coroutines and the coroutine library
+// The library is adapted from 'lbaselib.c' in the Lua source code
+
+#include <assert.h>
+
+#include "coro.h"
+#include "gc.h"
+#include "vm.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+Coro * coro_new(State *L, uint64_t f) {
+    Coro *co = (Coro *) obj_new(L, OBJ_CORO, sizeof(Coro));
+    co->status = CO_SUSPENDED;
+    co->stack = NULL; // In case the allocations below fail
+    co->stack_size = 0;
+    co->call_stack = NULL;
+    co->num_calls = co->max_calls = 0;
+    co->open_upvals = NULL;
+    co->resumer = NULL;
+    co->next_coro = L->gc.coros;
+    L->gc.coros = co;
+    co->stack = mem_alloc(L, MEM_STACK, STACK_MIN * sizeof(uint64_t));
+    co->stack_size = STACK_MIN;
+    for (int i = 0; i < co->stack_size; i++) {
+        co->stack[i] = VAL_NIL; // The GC scans the whole stack
+    }
+    co->call_stack = mem_alloc(L, MEM_STACK, CALLS_MIN * sizeof(CallInfo));
+    co->max_calls = CALLS_MIN;
+    co->stack[0] = f;
+    co->base = co->top = co->stack + 1;
+    return co;
+}
+
+// The upvalues of a coroutine that's collected are closed by the GC before
+// the sweep (see 'gc.c'), since they might be freed alongside it.
+void coro_free(State *L, Coro *co) {
+    mem_free(L, MEM_STACK, co->stack, co->stack_size * sizeof(uint64_t));
+    mem_free(L, MEM_STACK, co->call_stack, co->max_calls * sizeof(CallInfo));
+    obj_free(L, (Obj *) co, sizeof(Coro));
+}
+
+#define SWAP(type, a, b) \
+    do { type tmp = (a); (a) = (b); (b) = tmp; } while (0)
+
+static void swap_stacks(State *L, Coro *co) {
+    SWAP(uint64_t *, L->stack, co->stack);
+    SWAP(uint64_t *, L->top, co->top);
+    SWAP(uint64_t *, L->base, co->base);
+    SWAP(int, L->stack_size, co->stack_size);
+    SWAP(CallInfo *, L->call_stack, co->call_stack);
+    SWAP(int, L->num_calls, co->num_calls);
+    SWAP(int, L->max_calls, co->max_calls);
+    SWAP(Upval *, L->open_upvals, co->open_upvals);
+    gc_barrier_back(L, (Obj *) co); // Holds a different stack now
+}
+
+#undef SWAP
+
+void coro_enter(State *L, Coro *co) {
+    assert(co->status == CO_SUSPENDED);
+    swap_stacks(L, co);
+    if (L->co) {
+        L->co->status = CO_NORMAL;
+    }
+    co->resumer = L->co;
+    co->status = CO_RUNNING;
+    L->co = co;
+}
+
+void coro_leave(State *L, int status) {
+    Coro *co = L->co;
+    assert(co && co->status == CO_RUNNING);
+    if (status == CO_DEAD) {
+        upvals_close(L, L->stack);
+    }
+    swap_stacks(L, co);
+    co->status = status;
+    L->co = co->resumer;
+    co->resumer = NULL;
+    if (L->co) {
+        L->co->status = CO_RUNNING;
+    }
+}
+
+
+// ---- Library ----
+
+static Coro * check_coro(lua_State *L, int idx) {
+    if (idx > lua_gettop(L) || !is_coro(L->base[idx - 1])) {
+        luaL_typerror(L, idx, "coroutine");
+    }
+    return v2coro(L->base[idx - 1]);
+}
+
+static int co_create(lua_State *L) {
+    uint64_t f = lua_gettop(L) >= 1 ? L->base[0] : VAL_NIL;
+    luaL_argcheck(L, is_fn(f) || is_closure(f), 1, "Lua function expected");
+    Coro *co = coro_new(L, f);
+    stack_push(L, coro2v(co));
+    gc_check(L);
+    return 1;
+}
+
+// Only reached for calls from C, or when the interpreter can't resume the
+// coroutine itself because of an error.
+int coro_resume(lua_State *L) {
+    Coro *co = check_coro(L, 1);
+    if (co->status != CO_SUSPENDED) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, co->status == CO_DEAD ?
+                "cannot resume dead coroutine" :
+                "cannot resume non-suspended coroutine");
+        return 2;
+    }
+    int num_args = lua_gettop(L) - 1;
+    int status = execute_resume(L, co, num_args);
+    lua_pushboolean(L, status == 0);
+    lua_insert(L, 2);
+    return lua_gettop(L) - 1; // Status plus the values or error message
+}
+
+// Yields from Lua are handled by the interpreter.
+int coro_yield(lua_State *L) {
+    if (!L->co) {
+        return luaL_error(L, "attempt to yield from outside a coroutine");
+    }
+    return luaL_error(L, "attempt to yield across a C-call boundary");
+}
+
+static int co_running(lua_State *L) {
+    if (L->co) {
+        stack_push(L, coro2v(L->co));
+    } else {
+        lua_pushnil(L); // Main thread
+    }
+    return 1;
+}
+
+static int co_status(lua_State *L) {
+    static const char * const NAMES[] = {
+        [CO_SUSPENDED] = "suspended", [CO_RUNNING] = "running",
+        [CO_NORMAL] = "normal", [CO_DEAD] = "dead",
+    };
+    lua_pushstring(L, NAMES[check_coro(L, 1)->status]);
+    return 1;
+}
+
+static const luaL_Reg CO_FNS[] = {
+    {"create", co_create},
+    {"resume", coro_resume},
+    {"running", co_running},
+    {"status", co_status},
+    {"yield", coro_yield},
+    {NULL, NULL},
+};
+
+LUALIB_API int luaopen_coroutine(lua_State *L) {
+    luaL_register(L, LUA_COLIBNAME, CO_FNS);
+    return 1;
+}
@@ -0,0 +1,68 @@
+
+#ifndef LUAJ_CORO_H
+#define LUAJ_CORO_H
+
+// Coroutines ('thread' values in Lua) each have their own stack and call
+// stack, which start out small and grow on demand like the main thread's.
+//
+// Only the running coroutine's stacks are in the state ('L->stack',
+// 'L->call_stack', and so on), so the rest of the VM doesn't need to know
+// which coroutine is running. Resuming a coroutine swaps the state's stacks
+// with the ones saved in the coroutine object, which then holds the
+// resumer's stacks until the coroutine yields and swaps them back again.
+//
+// A suspended coroutine is stopped in a call to 'coroutine.yield', which has
+// a 'CallInfo' on its call stack like any other call; resuming it returns
+// from that call. The interpreter handles calls to 'coroutine.resume' and
+// 'coroutine.yield' from Lua itself by switching stacks and carrying on in
+// the same loop (see 'execute'). Called from C, 'resume' runs the coroutine
+// in a nested call to the interpreter instead, and 'yield' raises an error,
+// since there'd be no way to suspend the C function as well.
+
+#include "value.h"
+
+enum {
+    CO_SUSPENDED, // Not started yet, or stopped in 'coroutine.yield'
+    CO_RUNNING,
+    CO_NORMAL,    // Resumed another coroutine, and waiting for it to yield
+    CO_DEAD,      // Returned from its function, or raised an error
+};
+
+typedef struct Coro {
+    ObjHeader;
+    int status;
+
+    // The coroutine's stacks while it isn't running, or the resumer's while
+    // it is. The function is at the bottom of the stack until it's started
+    uint64_t *stack, *top, *base;
+    int stack_size;
+    CallInfo *call_stack;
+    int num_calls, max_calls;
+    struct Upval *open_upvals;
+
+    struct Coro *resumer; // Only while running; NULL for the main thread
+    struct Coro *next_coro; // In 'L->gc.coros'
+} Coro;
+
+// Returns a new suspended coroutine that calls the Lua function 'f'.
+Coro * coro_new(State *L, uint64_t f);
+void coro_free(State *L, Coro *co);
+
+// Switches to running the suspended coroutine 'co'.
+void coro_enter(State *L, Coro *co);
+
+// Switches from the running coroutine back to its resumer. 'status' is the
+// coroutine's new status: CO_SUSPENDED when it yields, or CO_DEAD, in which
+// case any upvalues still open on its stack are closed.
+void coro_leave(State *L, int status);
+
+// The 'coroutine.resume' and 'coroutine.yield' library functions, which the
+// interpreter recognises in calls from Lua.
+int coro_resume(lua_State *L);
+int coro_yield(lua_State *L);
+
+static inline uint64_t coro2v(Coro *co)  { return ptr2v(co); }
+static inline Coro * v2coro(uint64_t v) { return (Coro *) v2ptr(v); }
+static inline int is_coro(uint64_t v) { return is_obj(v, OBJ_CORO); }
+
+#endif
@@ -3,80 +3,136 @@
 #include <ctype.h>
 
 #include "debug.h"
+#include "jit.h"
 
 typedef struct {
     char *name;
     int num_args;
 } DebugInfo;
 
-static DebugInfo BC_DEBUG_INFO[] = {
+static const DebugInfo BC_DEBUG_INFO[] = {
 #define X(name, num_args) { #name, num_args },
     BYTECODE
 #undef X
 };
 
-static void print_ins(State *L, Fn *f, int idx, const BcIns *ins) {
-    printf("%.4d", idx);
+static void print_ins(FILE *out, Fn *f, int idx, const BcIns *ins) {
+    fprintf(out, "%.4d", idx);
     int op = bc_op(*ins);
     DebugInfo info = BC_DEBUG_INFO[op];
-    printf("\t%s", info.name);
-    if (op == BC_JMP) {
-        printf("\t=> %.4d\n", idx + (int) bc_e(*ins) - JMP_BIAS);
+    fprintf(out, "\t%s", info.name);
+    if (op == BC_JMP || op == BC_JLOOP) {
+        fprintf(out, "\t=> %.4d\n", idx + (int) bc_e(*ins) - JMP_BIAS);
+        return;
+    } else if (op == BC_KX) {
+        fprintf(out, "\t%u\n", bc_e(*ins));
         return;
     }
     switch (info.num_args) {
-        case 1: printf("\t%d\t\t", bc_d(*ins)); break;
-        case 2: printf("\t%d\t%d\t", bc_a(*ins), bc_d(*ins)); break;
-        case 3: printf("\t%d\t%d\t%d", bc_a(*ins), bc_b(*ins), bc_c(*ins)); break;
+        case 1: fprintf(out, "\t%d\t\t", bc_d(*ins)); break;
+        case 2: fprintf(out, "\t%d\t%d\t", bc_a(*ins), bc_d(*ins)); break;
+        case 3:
+            fprintf(out, "\t%d\t%d\t%d", bc_a(*ins), bc_b(*ins), bc_c(*ins));
+            break;
         default: break;
     }
-    switch (op) {
-    case BC_KINT:
-        printf("\t; %d", (int16_t) bc_d(*ins));
+    // Fused instructions have the same operands, and wide ones have the same
+    // constant, in the 'BC_KX' after them
+    switch (bc_narrow(bc_unfuse(op))) {
+    case BC_KINT: case BC_FORPREPI: case BC_FORLOOPI:
+        fprintf(out, "\t; %d", (int16_t) bc_d(*ins));
         break;
     case BC_KNUM:
-        printf("\t; %g", v2n(f->k[bc_d(*ins)]));
+        fprintf(out, "\t; %g", v2n(f->k[bc_d(*ins)]));
         break;
     case BC_KPRIM: case BC_EQVP: case BC_NEQVP:
-        printf("\t; ");
+        fprintf(out, "\t; ");
         switch (bc_d(*ins)) {
-            case TAG_NIL:   printf("nil"); break;
-            case TAG_TRUE:  printf("true"); break;
-            case TAG_FALSE: printf("false"); break;
+            case TAG_NIL:   fprintf(out, "nil"); break;
+            case TAG_TRUE:  fprintf(out, "true"); break;
+            case TAG_FALSE: fprintf(out, "false"); break;
         }
         break;
-    case BC_KSTR: case BC_KFN: case BC_EQVS: case BC_NEQVS:
-        printf("\t; %s", print_val(L, f->k[bc_d(*ins)]));
+    case BC_KSTR: case BC_KFN: case BC_FNEW: case BC_EQVS: case BC_NEQVS:
+    case BC_GGET: case BC_GSET:
+        fprintf(out, "\t; ");
+        print_val(out, f->k[bc_d(*ins)]);
+        break;
+    case BC_TGETS: case BC_TSETS:
+        fprintf(out, "\t; ");
+        print_val(out, f->k[bc_k(ins, bc_c(*ins))]);
         break;
     case BC_SUBNV: case BC_DIVNV: case BC_MODNV:
-        printf("\t; %g", v2n(f->k[bc_b(*ins)]));
+        fprintf(out, "\t; %g", v2n(f->k[bc_k(ins, bc_b(*ins))]));
         break;
     case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN: case BC_MODVN:
-        printf("\t; %g", v2n(f->k[bc_c(*ins)]));
+        fprintf(out, "\t; %g", v2n(f->k[bc_k(ins, bc_c(*ins))]));
         break;
     case BC_EQVN: case BC_NEQVN:
     case BC_LTVN: case BC_LEVN: case BC_GTVN: case BC_GEVN:
-        printf("\t; %g", v2n(f->k[bc_d(*ins)]));
+        fprintf(out, "\t; %g", v2n(f->k[bc_d(*ins)]));
         break;
     default: break;
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
-static void print_bc(State *L, Fn *f) {
+static void print_bc(FILE *out, Fn *f) {
     for (int idx = 0; idx < f->num_ins; idx++) {
-        print_ins(L, f, idx, &f->ins[idx]);
+        print_ins(out, f, idx, &f->ins[idx]);
+    }
+}
+
+static void print_upvals(FILE *out, Fn *f) {
+    for (int i = 0; i < f->num_upvals; i++) {
+        uint16_t uv = f->upvals[i];
+        fprintf(out, "; upvalue %d: ", i);
+        if (uv & UV_NONE) {
+            fprintf(out, "folded\n");
+        } else if (uv & UV_LOCAL) {
+            fprintf(out, "slot %d%s\n", uv & 0xff,
+                (uv & UV_VALUE) ? " (by value)" : "");
+        } else {
+            fprintf(out, "upvalue %d\n", uv);
+        }
     }
 }
 
-void print_fn(State *L, Fn *f) {
-    printf("-- %s --\n", print_val(L, fn2v(f)));
-    print_bc(L, f);
+void print_fn(FILE *out, Fn *f) {
+    fprintf(out, "-- ");
+    print_val(out, fn2v(f));
+    fprintf(out, " --\n");
+    print_upvals(out, f);
+    print_bc(out, f);
     for (int i = 0; i < f->num_k; i++) {
         if (is_fn(f->k[i])) {
             Fn *f2 = v2fn(f->k[i]);
-            printf("\n");
-            print_fn(L, f2);
+            fprintf(out, "\n");
+            print_fn(out, f2);
+        }
+    }
+}
+
+static char * const TYPE_NAMES[] = {
+    [TY_NONE] = "-", [TY_NIL] = "nil", [TY_BOOL] = "bool", [TY_NUM] = "num",
+    [TY_STR] = "str", [TY_FN] = "fn", [TY_TABLE] = "table", [TY_OBJ] = "obj",
+};
+
+void print_trace(FILE *out, Trace *t) {
+    int line = fn_line(t->fn, t->start_pc);
+    fprintf(out, "\n-- trace: %s at ", t->type == TRACE_LOOP ? "loop" : "call");
+    print_val(out, fn2v(t->fn));
+    fprintf(out, ":%d --\n", line);
+    for (int i = 0; i < t->num_ins; i++) {
+        TraceIns *r = &t->ins[i];
+        DebugInfo info = BC_DEBUG_INFO[bc_op(r->ins)];
+        fprintf(out, "%.4d\t%s\t", r->pc, info.name);
+        uint8_t tys[] = { r->a, r->b, r->c, r->d };
+        for (int j = 0; j < 4; j++) {
+            if (tys[j] != TY_NONE) {
+                fprintf(out, " %s", TYPE_NAMES[tys[j]]);
+            }
         }
+        fprintf(out, "\n");
     }
 }
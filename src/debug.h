@@ -2,8 +2,20 @@
 #ifndef LUAJ_DEBUG_H
 #define LUAJ_DEBUG_H
 
+// Debug listings of bytecode and traces. These are only written if a sink has
+// been set, with 'luaJ_dumpbc' or the LUAJ_DUMP_BC environment variable (see
+// 'luaj.h').
+
+#include <stdio.h>
+
 #include "value.h"
 
-void print_fn(State *L, Fn *f);
+struct Trace;
+
+// Prints the bytecode for 'f' and all functions nested within it
+void print_fn(FILE *out, Fn *f);
+
+// Prints a trace that's finished recording
+void print_trace(FILE *out, struct Trace *t);
 
 #endif
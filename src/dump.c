@@ -0,0 +1,260 @@
+
+#include <string.h>
+#include <assert.h>
+
+#include "dump.h"
+
+// LUA_SIGNATURE, 'J', format version, little-endian; the NULL terminator pads
+// the header to 8 bytes
+#define HEADER     "\033LuaJ\006\001"
+#define HEADER_LEN 8
+
+// Placeholders for string and function constants
+#define K_STR (TAG_PTR | OBJ_STR)
+#define K_FN  (TAG_PTR | OBJ_FN)
+
+#define NO_NAME UINT32_MAX
+
+static int is_little_endian(void) {
+    uint16_t v = 1;
+    return *(uint8_t *) &v == 1;
+}
+
+int is_dump(Reader *r) {
+    size_t len = strlen(LUA_SIGNATURE);
+    return (size_t) (r->end - r->p) >= len &&
+        memcmp(r->p, LUA_SIGNATURE, len) == 0;
+}
+
+
+// ---- Dumping ----
+
+typedef struct {
+    State *L;
+    lua_Writer writer;
+    void *ud;
+    size_t pos; // Bytes written so far, for alignment
+    int strip;  // Leave out the debug info
+    int status;
+} Dumper;
+
+static void dump_bytes(Dumper *d, const void *p, size_t n) {
+    if (d->status == 0 && n > 0) {
+        d->status = d->writer(d->L, p, n, d->ud);
+    }
+    d->pos += n;
+}
+
+static void dump_align(Dumper *d) {
+    static const char zeros[8] = {0};
+    dump_bytes(d, zeros, (8 - d->pos % 8) % 8);
+}
+
+static void dump_u32(Dumper *d, uint32_t v) {
+    dump_bytes(d, &v, sizeof(v));
+}
+
+static void dump_fn(Dumper *d, Fn *f) {
+    int num_lines = d->strip ? 0 : f->num_lines;
+    dump_u32(d, (uint32_t) f->num_params);
+    dump_u32(d, (uint32_t) f->max_stack);
+    dump_u32(d, (uint32_t) (d->strip ? -1 : f->start_line));
+    dump_u32(d, (uint32_t) (d->strip ? -1 : f->end_line));
+    dump_u32(d, (uint32_t) f->num_ins);
+    dump_u32(d, (uint32_t) f->num_k);
+    dump_u32(d, (uint32_t) f->num_upvals);
+    dump_u32(d, (uint32_t) num_lines);
+    if (f->name && !d->strip) {
+        dump_u32(d, (uint32_t) f->name->len);
+        dump_bytes(d, str_val(f->name), f->name->len);
+    } else {
+        dump_u32(d, NO_NAME);
+    }
+    dump_align(d);
+
+    for (int i = 0; i < f->num_ins; i++) {
+        BcIns ins = f->ins[i];
+        if (bc_op(ins) == BC_JLOOP) { // Traces aren't dumped
+            bc_set_op(&ins, BC_JMP);
+        }
+        dump_u32(d, ins);
+    }
+    dump_align(d);
+    dump_bytes(d, f->lines, num_lines);
+    dump_align(d);
+    dump_bytes(d, f->upvals, sizeof(uint16_t) * f->num_upvals);
+    dump_align(d);
+
+    for (int i = 0; i < f->num_k; i++) {
+        uint64_t k = f->k[i];
+        if (is_str(k)) {
+            k = K_STR;
+        } else if (is_fn(k)) {
+            k = K_FN;
+        }
+        dump_bytes(d, &k, sizeof(k));
+    }
+    for (int i = 0; i < f->num_k; i++) {
+        uint64_t k = f->k[i];
+        if (is_str(k)) {
+            uint64_t len = v2str(k)->len;
+            dump_bytes(d, &len, sizeof(len));
+            dump_bytes(d, str_val(v2str(k)), len);
+            dump_align(d);
+        } else if (is_fn(k)) {
+            dump_fn(d, v2fn(k));
+        }
+    }
+}
+
+int fn_dump(State *L, Fn *f, lua_Writer writer, void *ud, int strip) {
+    Dumper d = {0};
+    d.L = L;
+    d.writer = writer;
+    d.ud = ud;
+    d.strip = strip;
+    dump_bytes(&d, HEADER, HEADER_LEN);
+    dump_fn(&d, f);
+    return d.status;
+}
+
+
+// ---- Undumping ----
+
+typedef struct {
+    State *L;
+    Reader *r;
+    const char *base; // Start of the chunk, for alignment
+} Undumper;
+
+__attribute__((noreturn))
+static void err_bad_dump(Undumper *u, char *msg) {
+    ErrInfo info = {0};
+    info.chunk_name = u->r->chunk_name;
+    err_syntax(u->L, &info, "%s precompiled chunk", msg);
+}
+
+// Returns a pointer to the next 'n' bytes in the chunk.
+static const char * undump_bytes(Undumper *u, size_t n) {
+    Reader *r = u->r;
+    if ((size_t) (r->end - r->p) < n) {
+        err_bad_dump(u, "truncated");
+    }
+    const char *p = r->p;
+    r->p += n;
+    return p;
+}
+
+static void undump_align(Undumper *u) {
+    size_t pos = (size_t) (u->r->p - u->base);
+    undump_bytes(u, (8 - pos % 8) % 8);
+}
+
+static uint32_t undump_u32(Undumper *u) {
+    uint32_t v;
+    memcpy(&v, undump_bytes(u, sizeof(v)), sizeof(v));
+    return v;
+}
+
+static uint64_t undump_u64(Undumper *u) {
+    uint64_t v;
+    memcpy(&v, undump_bytes(u, sizeof(v)), sizeof(v));
+    return v;
+}
+
+// Copies 'n' bytes out of the chunk into 'dst'.
+static void undump_into(Undumper *u, void *dst, size_t n) {
+    memcpy(dst, undump_bytes(u, n), n);
+    undump_align(u);
+}
+
+static Fn * undump_fn(Undumper *u) {
+    uint32_t num_params = undump_u32(u);
+    uint32_t max_stack = undump_u32(u);
+    uint32_t start_line = undump_u32(u);
+    uint32_t end_line = undump_u32(u);
+    uint32_t num_ins = undump_u32(u);
+    uint32_t num_k = undump_u32(u);
+    uint32_t num_upvals = undump_u32(u);
+    uint32_t num_lines = undump_u32(u);
+    uint32_t name_len = undump_u32(u);
+    size_t remaining = (size_t) (u->r->end - u->r->p);
+    if (num_ins == 0 || max_stack >= UINT8_MAX || num_k > UINT16_MAX + 1 ||
+            num_upvals > LUAI_MAXUPVALUES ||
+            (num_lines > 0 && num_lines < num_ins) || // 1 to 5 bytes each
+            num_lines > (uint64_t) num_ins * 5 ||
+            (size_t) num_ins * sizeof(BcIns) + num_lines +
+                (size_t) num_k * sizeof(uint64_t) > remaining) {
+        err_bad_dump(u, "malformed"); // Check before allocating anything
+    }
+    Str *name = NULL;
+    if (name_len != NO_NAME) {
+        name = str_new(u->L, undump_bytes(u, name_len), name_len);
+    }
+    undump_align(u);
+
+    Fn *f = fn_new(u->L, name, u->r->chunk_name);
+    f->num_params = (int) num_params;
+    f->max_stack = (int) max_stack;
+    f->start_line = (int) start_line;
+    f->end_line = (int) end_line;
+    f->ins = mem_realloc(u->L, MEM_FN, f->ins,
+            sizeof(BcIns) * f->max_ins, sizeof(BcIns) * num_ins);
+    mem_free(u->L, MEM_FN, f->line_info, sizeof(int) * f->max_ins); // Unused
+    f->line_info = NULL;
+    if (num_lines > 0) {
+        f->lines = mem_alloc(u->L, MEM_FN, num_lines);
+        f->num_lines = (int) num_lines;
+    }
+    f->ic = mem_realloc(u->L, MEM_FN, f->ic,
+            sizeof(uint32_t) * f->max_ins, sizeof(uint32_t) * num_ins);
+    f->max_ins = (int) num_ins;
+    if (num_k > (uint32_t) f->max_k) {
+        f->k = mem_realloc(u->L, MEM_FN, f->k,
+                sizeof(uint64_t) * f->max_k, sizeof(uint64_t) * num_k);
+        f->max_k = (int) num_k;
+    }
+
+    undump_into(u, f->ins, sizeof(BcIns) * num_ins);
+    if (num_lines > 0) {
+        undump_into(u, f->lines, num_lines);
+    } else {
+        undump_align(u);
+    }
+    memset(f->ic, 0, sizeof(uint32_t) * num_ins);
+    f->num_ins = (int) num_ins;
+    if (num_upvals > 0) {
+        f->upvals = mem_alloc(u->L, MEM_FN, sizeof(uint16_t) * num_upvals);
+        f->num_upvals = (int) num_upvals;
+        undump_into(u, f->upvals, sizeof(uint16_t) * num_upvals);
+    }
+    undump_into(u, f->k, sizeof(uint64_t) * num_k);
+    for (uint32_t i = 0; i < num_k; i++) { // 'f->num_k' is 0 until it's done
+        if (f->k[i] == K_STR) {
+            uint64_t len = undump_u64(u);
+            if (len > (uint64_t) (u->r->end - u->r->p)) {
+                err_bad_dump(u, "truncated");
+            }
+            f->k[i] = str2v(str_new(u->L, undump_bytes(u, len), len));
+            undump_align(u);
+        } else if (f->k[i] == K_FN) {
+            f->k[i] = fn2v(undump_fn(u));
+        } else if (is_ptr(f->k[i])) {
+            err_bad_dump(u, "malformed");
+        }
+    }
+    f->num_k = (int) num_k;
+    return f;
+}
+
+void fn_undump(State *L, Reader *r) {
+    Undumper u = {0};
+    u.L = L;
+    u.r = r;
+    u.base = r->p;
+    const char *header = undump_bytes(&u, HEADER_LEN);
+    if (memcmp(header, HEADER, HEADER_LEN) != 0 || !is_little_endian()) {
+        err_bad_dump(&u, "incompatible");
+    }
+    stack_push(L, fn2v(undump_fn(&u)));
+}
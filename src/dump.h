@@ -0,0 +1,50 @@
+
+#ifndef LUAJ_DUMP_H
+#define LUAJ_DUMP_H
+
+// Precompiled chunks are a binary serialisation of a function prototype, so
+// that a script can be loaded without parsing it again.
+//
+// A chunk starts with an 8 byte header: LUA_SIGNATURE, then 'J', the format
+// version, and 1 for little-endian. After that comes the top level function:
+//
+//   u32 num_params, max_stack, start_line, end_line, num_ins, num_k,
+//       num_upvals, num_lines, name_len
+//   u8  name[name_len]             -- Omitted if 'name_len' is UINT32_MAX
+//   u32 ins[num_ins]
+//   u8  lines[num_lines]           -- Encoded like 'Fn.lines'
+//   u16 upvals[num_upvals]
+//   u64 k[num_k]
+//   ...followed by each string or function constant in 'k', in order:
+//   u64 len, u8 chars[len]         -- Strings
+//   <function>                     -- Functions, in the same format as above
+//
+// Each array starts on an 8 byte boundary (relative to the start of the
+// chunk), padded with zeros. Constants are stored as NaN-boxed values, so
+// numbers and primitives can be copied in as they are; string and function
+// constants hold a placeholder (see 'K_STR' and 'K_FN') that's replaced with
+// the object that follows. Values are stored in the host's byte order, and
+// the header is checked so chunks from a big-endian host are rejected.
+//
+// Only the bytecode is stored, not anything the JIT has learnt; patched
+// 'BC_JLOOP's are turned back into 'BC_JMP's. Chunks are trusted: the loader
+// checks the chunk isn't truncated, but not the bytecode itself.
+
+#include "state.h"
+#include "reader.h"
+#include "value.h"
+
+// Returns 1 if the reader's source is a precompiled chunk.
+int is_dump(Reader *r);
+
+// Writes 'f' to 'writer'. Returns 0, or the first non-zero value returned by
+// 'writer'. If 'strip' is set, the debug info (line info, function names,
+// and the lines each function spans) is left out; errors in the loaded
+// functions then have no line numbers.
+int fn_dump(State *L, Fn *f, lua_Writer writer, void *ud, int strip);
+
+// Loads the precompiled chunk in 'r' and pushes the function prototype onto
+// the top of the stack, like 'parse'.
+void fn_undump(State *L, Reader *r);
+
+#endif
@@ -0,0 +1,392 @@
+
+#include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "gc.h"
+#include "jit.h"
+#include "profile.h"
+#include "stats.h"
+#include "table.h"
+#include "coro.h"
+
+// Objects swept per step
+#define GC_SWEEP_MAX 40
+
+static uint8_t other_white(State *L) {
+    return L->gc.white ^ GC_WHITES;
+}
+
+void gc_init(State *L) {
+    GC *gc = &L->gc;
+    gc->objs = NULL;
+    gc->phase = GC_PAUSE;
+    gc->white = GC_WHITE0;
+    gc->gray = NULL;
+    gc->num_gray = gc->max_gray = 0;
+    gc->gray_lost = 0;
+    gc->sweep = NULL;
+    gc->pause = LUAI_GCPAUSE;
+    gc->stepmul = LUAI_GCMUL;
+    gc->stopped = 0;
+    gc->coros = NULL;
+    gc->estimate = gc->total;
+    gc->threshold = gc->estimate / 100 * gc->pause;
+}
+
+static void free_obj(State *L, Obj *o) {
+    switch (o->type) {
+    case OBJ_STR: str_free(L, (Str *) o); break;
+    case OBJ_FN:  fn_free(L, (Fn *) o); break;
+    case OBJ_CLOSURE: closure_free(L, (Closure *) o); break;
+    case OBJ_UPVAL: upval_free(L, (Upval *) o); break;
+    case OBJ_CFN: cfn_free(L, (CFn *) o); break;
+    case OBJ_TABLE: table_free(L, (Table *) o); break;
+    case OBJ_CORO: coro_free(L, (Coro *) o); break;
+    default: UNREACHABLE();
+    }
+}
+
+void gc_free_all(State *L) {
+    Obj *o = L->gc.objs;
+    while (o) {
+        Obj *next = o->next;
+        free_obj(L, o);
+        o = next;
+    }
+    L->gc.objs = NULL;
+    mem_free(L, MEM_OTHER, L->gc.gray, sizeof(Obj *) * L->gc.max_gray);
+    L->gc.gray = NULL;
+    L->gc.num_gray = L->gc.max_gray = 0;
+}
+
+void gc_link(State *L, Obj *o) {
+    o->color = L->gc.white;
+    o->next = L->gc.objs;
+    L->gc.objs = o;
+}
+
+
+// ---- Marking ----
+
+// Turns 'o' gray. The gray stack is the collector's own memory, so it isn't
+// held to the memory limit, and growing it never raises an error: a step
+// that fails part way through would leave objects marked whose children
+// never get traversed. If it can't grow, 'o' is left gray off the stack and
+// 'find_lost_gray' picks it up later by walking every object instead.
+static void push_gray(State *L, Obj *o) {
+    GC *gc = &L->gc;
+    if (gc->num_gray >= gc->max_gray) {
+        int max = gc->max_gray > 0 ? gc->max_gray * 2 : 64;
+        Obj **gray = mem_realloc_try(L, MEM_OTHER, gc->gray,
+                sizeof(Obj *) * gc->max_gray,
+                sizeof(Obj *) * max);
+        if (!gray) {
+            o->color = 0; // Gray
+            gc->gray_lost = 1;
+            return;
+        }
+        gc->gray = gray;
+        gc->max_gray = max;
+    }
+    gc->gray[gc->num_gray++] = o;
+    o->color = 0; // Gray
+}
+
+static void mark_obj(State *L, Obj *o) {
+    if (!is_white(o)) {
+        return; // Already gray or black
+    }
+    if (o->type == OBJ_STR || o->type == OBJ_CFN) {
+        o->color = GC_BLACK; // No children
+    } else {
+        push_gray(L, o);
+    }
+}
+
+static void mark_val(State *L, uint64_t v) {
+    if (is_ptr(v)) {
+        mark_obj(L, v2obj(v));
+    }
+}
+
+static void mark_roots(State *L) {
+    // Stack slots that are no longer in use only ever hold stale copies of
+    // values, so it's safe to mark the whole stack
+    for (int i = 0; i < L->stack_size; i++) {
+        mark_val(L, L->stack[i]);
+    }
+    for (int i = 0; i < L->num_calls; i++) {
+        if (L->call_stack[i].fn) { // NULL for C functions called from C
+            mark_obj(L, (Obj *) L->call_stack[i].fn);
+        }
+    }
+    mark_val(L, L->globals);
+    mark_obj(L, (Obj *) L->mem_err);
+    for (Upval *uv = L->open_upvals; uv; uv = uv->next_open) {
+        mark_obj(L, (Obj *) uv);
+    }
+    if (L->co) { // Holds the stacks of the coroutine that resumed it
+        mark_obj(L, (Obj *) L->co);
+    }
+    if (L->prof) { // Keep sampled functions alive until they're written out
+        Profile *p = L->prof;
+        for (int i = 0; i < p->num_frames; i++) {
+            mark_obj(L, (Obj *) p->frames[i].fn);
+        }
+    }
+#ifdef LUAJ_STATS
+    for (int i = 0; i < L->stats->num_fns; i++) { // Kept for the report
+        mark_obj(L, (Obj *) L->stats->fns[i]);
+    }
+#endif
+}
+
+static size_t traverse_fn(State *L, Fn *f) {
+    if (f->name) {
+        mark_obj(L, (Obj *) f->name);
+    }
+    for (int i = 0; i < f->num_k; i++) {
+        mark_val(L, f->k[i]);
+    }
+    for (Trace *t = f->traces; t; t = t->next) {
+        for (int i = 0; i < t->num_ins; i++) {
+            mark_obj(L, (Obj *) t->ins[i].fn);
+        }
+    }
+    return sizeof(Fn) +
+        f->max_ins * (sizeof(BcIns) + sizeof(int) + sizeof(uint32_t)) +
+        f->max_k * sizeof(uint64_t) +
+        f->num_upvals * sizeof(uint16_t);
+}
+
+static size_t traverse_closure(State *L, Closure *c) {
+    mark_obj(L, (Obj *) c->fn);
+    for (int i = 0; i < c->num_upvals; i++) {
+        if (c->upvals[i]) {
+            mark_obj(L, (Obj *) c->upvals[i]);
+        }
+    }
+    return sizeof(Closure) + c->num_upvals * sizeof(Upval *);
+}
+
+static size_t traverse_upval(State *L, Upval *uv) {
+    mark_val(L, *uv->v); // Also fine for open upvalues; it's a stack slot
+    return sizeof(Upval);
+}
+
+static size_t traverse_table(State *L, Table *t) {
+    for (uint32_t i = 0; i < t->num_arr; i++) {
+        mark_val(L, t->arr[i]);
+    }
+    for (uint32_t i = 0; i < t->hash_size; i++) {
+        Node *n = &t->hash[i];
+        mark_val(L, n->k); // Also keep keys with nil values, until a resize
+        mark_val(L, n->v);
+    }
+    return sizeof(Table) +
+        t->max_arr * sizeof(uint64_t) +
+        t->hash_size * sizeof(Node);
+}
+
+// Suspended coroutines are traversed like the running one's stacks in
+// 'mark_roots'. Switching coroutines changes the stacks that a coroutine
+// object holds, so 'coro_enter' and 'coro_leave' use a backward barrier.
+static size_t traverse_coro(State *L, Coro *co) {
+    if (co->status != CO_DEAD) { // Otherwise its stack is never read again
+        for (int i = 0; i < co->stack_size; i++) {
+            mark_val(L, co->stack[i]);
+        }
+        for (int i = 0; i < co->num_calls; i++) {
+            if (co->call_stack[i].fn) {
+                mark_obj(L, (Obj *) co->call_stack[i].fn);
+            }
+        }
+        for (Upval *uv = co->open_upvals; uv; uv = uv->next_open) {
+            mark_obj(L, (Obj *) uv);
+        }
+    }
+    if (co->resumer) {
+        mark_obj(L, (Obj *) co->resumer);
+    }
+    return sizeof(Coro) +
+        co->stack_size * sizeof(uint64_t) +
+        co->max_calls * sizeof(CallInfo);
+}
+
+// Blackens the gray object 'o'. Returns the amount of work done.
+static size_t blacken(State *L, Obj *o) {
+    o->color = GC_BLACK;
+    switch (o->type) {
+    case OBJ_FN: return traverse_fn(L, (Fn *) o);
+    case OBJ_CLOSURE: return traverse_closure(L, (Closure *) o);
+    case OBJ_UPVAL: return traverse_upval(L, (Upval *) o);
+    case OBJ_TABLE: return traverse_table(L, (Table *) o);
+    case OBJ_CORO: return traverse_coro(L, (Coro *) o);
+    default: UNREACHABLE(); return 0;
+    }
+}
+
+static size_t propagate(State *L) {
+    return blacken(L, L->gc.gray[--L->gc.num_gray]);
+}
+
+// Blackens the objects that 'push_gray' couldn't fit on the gray stack. It's
+// only called once the stack is empty, so every gray object is one of them.
+static size_t find_lost_gray(State *L) {
+    GC *gc = &L->gc;
+    size_t work = 0;
+    gc->gray_lost = 0;
+    for (Obj *o = gc->objs; o; o = o->next) {
+        if (o->color == 0) {
+            work += blacken(L, o);
+        }
+    }
+    return work;
+}
+
+static size_t propagate_all(State *L) {
+    size_t work = 0;
+    while (L->gc.num_gray > 0 || L->gc.gray_lost) {
+        work += L->gc.num_gray > 0 ? propagate(L) : find_lost_gray(L);
+    }
+    return work;
+}
+
+// Closes the open upvalues of coroutines that are about to be swept. Their
+// stacks are freed with them, but the upvalues might still be reachable from
+// closures. Has to be done before the sweep, since the upvalues that aren't
+// might be freed first.
+static void close_dead_coros(State *L) {
+    Coro **prev = &L->gc.coros;
+    while (*prev) {
+        Coro *co = *prev;
+        if (!is_white((Obj *) co)) {
+            prev = &co->next_coro;
+            continue;
+        }
+        while (co->open_upvals) {
+            Upval *uv = co->open_upvals;
+            uv->closed = *uv->v; // Marked by 'traverse_upval' if it's live
+            uv->v = &uv->closed;
+            co->open_upvals = uv->next_open;
+            uv->next_open = NULL;
+        }
+        *prev = co->next_coro;
+    }
+}
+
+static size_t atomic(State *L) {
+    GC *gc = &L->gc;
+    mark_roots(L); // The stack has changed since the cycle started
+    size_t work = propagate_all(L);
+    close_dead_coros(L);
+    gc->white = other_white(L); // Unmarked objects are now the "other" white
+    gc->sweep = &gc->objs;
+    gc->estimate = gc->total;
+    gc->phase = GC_SWEEP;
+    return work;
+}
+
+
+// ---- Sweeping ----
+
+static size_t sweep(State *L) {
+    GC *gc = &L->gc;
+    uint8_t dead = other_white(L);
+    int n = 0;
+    while (*gc->sweep && n < GC_SWEEP_MAX) {
+        Obj *o = *gc->sweep;
+        if (o->color & dead) {
+            *gc->sweep = o->next;
+            size_t before = gc->total;
+            free_obj(L, o);
+            size_t freed = before - gc->total;
+            gc->estimate = gc->estimate > freed ? gc->estimate - freed : 0;
+        } else {
+            o->color = gc->white;
+            gc->sweep = &o->next;
+        }
+        n++;
+    }
+    if (!*gc->sweep) {
+        gc->phase = GC_PAUSE;
+    }
+    return n * GC_SWEEP_COST;
+}
+
+static size_t single_step(State *L) {
+    GC *gc = &L->gc;
+    switch (gc->phase) {
+    case GC_PAUSE:
+        mark_roots(L);
+        gc->phase = GC_PROPAGATE;
+        return L->stack_size;
+    case GC_PROPAGATE:
+        if (gc->num_gray > 0) {
+            return propagate(L);
+        } else if (gc->gray_lost) {
+            return find_lost_gray(L);
+        }
+        return atomic(L);
+    case GC_SWEEP:
+        return sweep(L);
+    default: UNREACHABLE(); return 0;
+    }
+}
+
+static void set_threshold(State *L) {
+    GC *gc = &L->gc;
+    if (gc->stopped) {
+        gc->threshold = SIZE_MAX;
+    } else if (gc->phase == GC_PAUSE) {
+        gc->threshold = gc->estimate / 100 * gc->pause;
+        size_t limit = L->mem.limit;
+        if (limit) { // Start the next cycle halfway to the limit, at most
+            size_t cap = gc->estimate < limit ?
+                gc->estimate + (limit - gc->estimate) / 2 : gc->estimate;
+            gc->threshold = gc->threshold < cap ? gc->threshold : cap;
+        }
+    } else {
+        gc->threshold = gc->total + GC_STEP_SIZE;
+    }
+}
+
+void gc_step(State *L) {
+    GC *gc = &L->gc;
+    long work = (long) (GC_STEP_SIZE / 100 * gc->stepmul);
+    if (work <= 0) {
+        work = LONG_MAX; // 'stepmul' of 0 means "don't be incremental"
+    }
+    do {
+        work -= (long) single_step(L);
+    } while (work > 0 && gc->phase != GC_PAUSE);
+    set_threshold(L);
+}
+
+void gc_full(State *L) {
+    GC *gc = &L->gc;
+    while (gc->phase != GC_PAUSE) { // Finish the cycle in progress
+        single_step(L);
+    }
+    do { // Then perform a complete cycle
+        single_step(L);
+    } while (gc->phase != GC_PAUSE);
+    set_threshold(L);
+}
+
+void gc_barrier_(State *L, Obj *o, uint64_t v) {
+    if (L->gc.phase == GC_PROPAGATE) {
+        mark_obj(L, v2obj(v)); // Keep the invariant: no black -> white refs
+    } else {
+        o->color = L->gc.white; // Sweeping; don't need to restore invariant
+    }
+}
+
+void gc_barrier_back_(State *L, Obj *o) {
+    if (L->gc.phase == GC_PROPAGATE) {
+        push_gray(L, o);
+    } else {
+        o->color = L->gc.white;
+    }
+}
@@ -0,0 +1,99 @@
+
+#ifndef LUAJ_GC_H
+#define LUAJ_GC_H
+
+// The garbage collector is a precise, incremental, tri-color mark-and-sweep
+// collector. Every GC object is linked into 'L->gc.objs' when it's created.
+//
+// Objects start out white. Marking turns reachable objects gray (pushed onto
+// the gray stack) and then black once their children have been marked. The
+// roots are the Lua stack, the functions on the call stack, the globals table,
+// the open upvalues, the running coroutine, and any functions sampled by the
+// profiler; function prototypes keep their name and constants alive, closures
+// their prototype and upvalues, tables their keys and values, and coroutines
+// their stacks and the coroutine that resumed them.
+//
+// Marking is interleaved with the program in small steps; the stack is
+// re-scanned atomically at the end of the mark phase since stack writes don't
+// have a write barrier. Two whites are used so that sweeping can also be
+// incremental: objects created during the sweep get the new white and aren't
+// freed by the sweep that's in progress.
+//
+// GC steps are only ever triggered at safe points in the interpreter (via
+// 'gc_check'), where every live value is reachable from the roots. In
+// particular, nothing is collected while parsing.
+//
+// The pacing follows the Lua 5.1 collector. After a cycle, the next one starts
+// once memory grows to 'pause'% of what was in use. During a cycle, every
+// GC_STEP_SIZE bytes allocated triggers a step that does 'stepmul'% of that
+// amount of work.
+
+#include "value.h"
+
+#define GC_STEP_SIZE  1024 // Bytes
+#define GC_SWEEP_COST 16   // Work for sweeping a single object
+
+enum {
+    GC_PAUSE,     // Waiting for the next cycle to start
+    GC_PROPAGATE, // Marking
+    GC_SWEEP,     // Freeing unmarked objects
+};
+
+// Colors
+#define GC_WHITE0 1
+#define GC_WHITE1 2
+#define GC_BLACK  4
+#define GC_WHITES (GC_WHITE0 | GC_WHITE1)
+
+static inline int is_white(Obj *o) { return (o->color & GC_WHITES) != 0; }
+static inline int is_black(Obj *o) { return (o->color & GC_BLACK) != 0; }
+
+void gc_init(State *L);
+void gc_free_all(State *L);
+
+// Links a new object into the GC's object list.
+void gc_link(State *L, Obj *o);
+
+// Performs a single incremental step of work.
+void gc_step(State *L);
+
+// Performs a complete collection cycle.
+void gc_full(State *L);
+
+// Must be called when a reference to 'v' is stored in the object 'o'. Used for
+// objects that are rarely written to.
+void gc_barrier_(State *L, Obj *o, uint64_t v);
+
+static inline void gc_barrier(State *L, Obj *o, uint64_t v) {
+    if (is_black(o) && is_ptr(v) && is_white(v2obj(v))) {
+        gc_barrier_(L, o, v);
+    }
+}
+
+// Strings stay in the string table until they're swept, so 'str_new' can find
+// a string that's unreachable but hasn't been freed yet. Makes such an object
+// live again.
+static inline void gc_revive(State *L, Obj *o) {
+    if (L->gc.phase == GC_SWEEP && (o->color & (L->gc.white ^ GC_WHITES))) {
+        o->color = L->gc.white;
+    }
+}
+
+// Must be called before a reference is stored in the object 'o'. Instead of
+// marking the value being stored, 'o' is turned gray again so it's traversed
+// another time. Used for tables, which are written to often.
+void gc_barrier_back_(State *L, Obj *o);
+
+static inline void gc_barrier_back(State *L, Obj *o) {
+    if (is_black(o)) {
+        gc_barrier_back_(L, o);
+    }
+}
+
+static inline void gc_check(State *L) {
+    if (L->gc.total >= L->gc.threshold) {
+        gc_step(L);
+    }
+}
+
+#endif
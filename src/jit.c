@@ -0,0 +1,224 @@
+
+#include <assert.h>
+
+#include "jit.h"
+#include "debug.h"
+
+// Which operands of each instruction are stack slots that are read by the
+// instruction. Used to work out which value types to record.
+#define R_A 1
+#define R_B 2
+#define R_C 4
+#define R_D 8
+
+static const uint8_t READS[BC_LAST] = {
+    [BC_MOV] = R_D,
+    [BC_NEG] = R_D,
+    [BC_ADDVV] = R_B | R_C, [BC_ADDVN] = R_B,
+    [BC_SUBVV] = R_B | R_C, [BC_SUBVN] = R_B, [BC_SUBNV] = R_C,
+    [BC_MULVV] = R_B | R_C, [BC_MULVN] = R_B,
+    [BC_DIVVV] = R_B | R_C, [BC_DIVVN] = R_B, [BC_DIVNV] = R_C,
+    [BC_MODVV] = R_B | R_C, [BC_MODVN] = R_B, [BC_MODNV] = R_C,
+    [BC_POW] = R_B | R_C,
+    [BC_CONCAT] = R_B | R_C,
+    [BC_TGETV] = R_B | R_C, [BC_TGETS] = R_B,
+    [BC_TSETV] = R_A | R_B | R_C, [BC_TSETS] = R_A | R_B,
+    [BC_GSET] = R_A, [BC_USET] = R_A,
+    [BC_NOT] = R_D,
+    [BC_IST] = R_D, [BC_ISTC] = R_D, [BC_ISF] = R_D, [BC_ISFC] = R_D,
+    [BC_EQVV] = R_A | R_D, [BC_EQVP] = R_A, [BC_EQVN] = R_A, [BC_EQVS] = R_A,
+    [BC_NEQVV] = R_A | R_D, [BC_NEQVP] = R_A, [BC_NEQVN] = R_A,
+    [BC_NEQVS] = R_A,
+    [BC_LTVV] = R_A | R_D, [BC_LTVN] = R_A,
+    [BC_LEVV] = R_A | R_D, [BC_LEVN] = R_A,
+    [BC_GTVV] = R_A | R_D, [BC_GTVN] = R_A,
+    [BC_GEVV] = R_A | R_D, [BC_GEVN] = R_A,
+    [BC_FORPREP] = R_A, [BC_FORPREPI] = R_A,
+    [BC_FORLOOP] = R_A, [BC_FORLOOPI] = R_A,
+    [BC_CALL] = R_A,
+    [BC_RET1] = R_D,
+    [BC_RET] = R_A,
+    [BC_ADDVN_KX] = R_B, [BC_SUBVN_KX] = R_B, [BC_SUBNV_KX] = R_C,
+    [BC_MULVN_KX] = R_B, [BC_DIVVN_KX] = R_B, [BC_DIVNV_KX] = R_C,
+    [BC_MODVN_KX] = R_B, [BC_MODNV_KX] = R_C,
+    [BC_TGETS_KX] = R_B, [BC_TSETS_KX] = R_A | R_B,
+};
+
+static uint8_t type_of(uint64_t v) {
+    if (is_num(v)) {
+        return TY_NUM;
+    } else if (is_nil(v)) {
+        return TY_NIL;
+    } else if (is_false(v) || is_true(v)) {
+        return TY_BOOL;
+    } else if (is_str(v)) {
+        return TY_STR;
+    } else if (is_fn(v) || is_closure(v)) {
+        return TY_FN;
+    } else if (is_obj(v, OBJ_TABLE)) {
+        return TY_TABLE;
+    } else {
+        return TY_OBJ;
+    }
+}
+
+static Trace * trace_new(State *L, Fn *fn, int start_pc, int type) {
+    Trace *t = mem_alloc(L, MEM_JIT, sizeof(Trace));
+    t->next = NULL;
+    t->type = type;
+    t->fn = fn;
+    t->start_pc = start_pc;
+    t->end_pc = -1;
+    t->num_ins = 0;
+    t->max_ins = 64;
+    t->ins = mem_alloc(L, MEM_JIT, sizeof(TraceIns) * t->max_ins);
+    t->depth = 0;
+    t->mcode = NULL;
+    t->mcode_size = 0;
+    return t;
+}
+
+void trace_free(State *L, Trace *t) {
+    trace_free_mcode(t);
+    mem_free(L, MEM_JIT, t->ins, sizeof(TraceIns) * t->max_ins);
+    mem_free(L, MEM_JIT, t, sizeof(Trace));
+}
+
+static Trace * find_trace(Fn *fn, int start_pc, int type) {
+    for (Trace *t = fn->traces; t; t = t->next) {
+        if (t->start_pc == start_pc && t->type == type) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+int trace_start(State *L, Fn *fn, BcIns *ip, int type) {
+    int pc = (int) (ip - fn->ins);
+    if (type == TRACE_LOOP) {
+        fn->hot_loops[HOT_SLOT(pc)] = HOT_PENALTY;
+    } else {
+        fn->hot_call = HOT_PENALTY;
+    }
+    if (L->rec || find_trace(fn, pc, type)) {
+        return 0; // Already recording, or already have a trace for this PC
+    }
+    L->rec = trace_new(L, fn, pc, type);
+    return 1;
+}
+
+void trace_abort(State *L) {
+    if (L->rec) {
+        trace_free(L, L->rec);
+        L->rec = NULL;
+    }
+}
+
+static void trace_finish(State *L) {
+    Trace *t = L->rec;
+    t->next = t->fn->traces;
+    t->fn->traces = t;
+    L->rec = NULL;
+    if (t->type == TRACE_LOOP) {
+        TraceIns *last = &t->ins[t->num_ins - 1]; // Jump back to the header
+        assert(bc_op(last->ins) == BC_JMP);
+        t->end_pc = last->pc;
+        if (trace_compile(L, t)) {
+            bc_set_op(&t->fn->ins[t->end_pc], BC_JLOOP);
+        }
+    }
+    if (L->dump_bc) {
+        print_trace(L->dump_bc, t);
+    }
+}
+
+BcIns * trace_enter(Fn *fn, BcIns *ip, uint64_t *s) {
+    int pc = (int) (ip - fn->ins);
+    for (Trace *t = fn->traces; t; t = t->next) {
+        if (t->mcode && t->end_pc == pc) {
+            return &fn->ins[((TraceFn) t->mcode)(s, fn->k)];
+        }
+    }
+    return ip + (int) bc_e(*ip) - JMP_BIAS; // No trace; behave like a 'BC_JMP'
+}
+
+static void emit_ins(State *L, Trace *t, Fn *fn, BcIns *ip, uint64_t *s) {
+    if (t->num_ins >= t->max_ins) {
+        t->ins = mem_realloc(L, MEM_JIT, t->ins,
+                sizeof(TraceIns) * t->max_ins,
+                sizeof(TraceIns) * t->max_ins * 2);
+        t->max_ins *= 2;
+    }
+    BcIns ins = *ip;
+    bc_set_op(&ins, bc_unfuse(bc_op(ins))); // Backend only sees unfused pairs
+    uint8_t reads = READS[bc_op(ins)];
+    TraceIns *r = &t->ins[t->num_ins++];
+    r->ins = ins;
+    r->fn = fn;
+    r->pc = (int) (ip - fn->ins);
+    r->a = (reads & R_A) ? type_of(s[bc_a(ins)]) : TY_NONE;
+    r->b = (reads & R_B) ? type_of(s[bc_b(ins)]) : TY_NONE;
+    r->c = (reads & R_C) ? type_of(s[bc_c(ins)]) : TY_NONE;
+    r->d = (reads & R_D) ? type_of(s[bc_d(ins)]) : TY_NONE;
+}
+
+int trace_record(State *L, Fn *fn, BcIns *ip, uint64_t *s) {
+    Trace *t = L->rec;
+    if (!t) { // Aborted by a nested call to 'execute'
+        return 1;
+    }
+    if (t->num_ins > 0) {
+        // A fused comparison that was true skipped over its 'BC_JMP'; record
+        // the jump anyway, as if the pair hadn't been fused
+        TraceIns *last = &t->ins[t->num_ins - 1];
+        BcIns *jmp = &last->fn->ins[last->pc + 1];
+        if (bc_is_fused(bc_op(last->fn->ins[last->pc])) && ip != jmp + 1) {
+            emit_ins(L, t, last->fn, jmp, s);
+        }
+    }
+    if (t->type == TRACE_LOOP && t->num_ins > 0 && t->depth == 0 &&
+            fn == t->fn && ip == &fn->ins[t->start_pc]) {
+        trace_finish(L); // Back at the loop header
+        return 1;
+    }
+    if (t->num_ins >= TRACE_MAX_INS) {
+        trace_abort(L);
+        return 1;
+    }
+    emit_ins(L, t, fn, ip, s);
+    switch (bc_op(*ip)) {
+    case BC_JMP: case BC_JLOOP:
+        if ((int) bc_e(*ip) - JMP_BIAS < 0) {
+            int target = (int) (ip - fn->ins) + (int) bc_e(*ip) - JMP_BIAS;
+            if (t->type != TRACE_LOOP || t->depth > 0 || fn != t->fn ||
+                    target != t->start_pc) {
+                trace_abort(L); // Inner loop; it'll get its own trace
+                return 1;
+            }
+        }
+        break;
+    case BC_CALL:
+        if (!is_fn(s[bc_a(*ip)]) && !is_closure(s[bc_a(*ip)])) {
+            trace_abort(L); // C functions can't be followed into
+            return 1;
+        }
+        if (++t->depth > TRACE_MAX_DEPTH) {
+            trace_abort(L);
+            return 1;
+        }
+        break;
+    case BC_RET0: case BC_RET1: case BC_RET:
+        if (t->depth > 0) {
+            t->depth--;
+        } else if (t->type == TRACE_CALL) {
+            trace_finish(L); // Function returned to its caller
+            return 1;
+        } else {
+            trace_abort(L); // Returned out of the loop's function
+            return 1;
+        }
+        break;
+    default: break;
+    }
+    return 0;
+}
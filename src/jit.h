@@ -0,0 +1,108 @@
+
+#ifndef LUAJ_JIT_H
+#define LUAJ_JIT_H
+
+// The JIT compiler works on traces: linear sequences of bytecode instructions
+// that were actually executed by the interpreter, along with the types of the
+// values that were observed along the way.
+//
+// Every function prototype keeps a set of hotness counters. The interpreter
+// decrements a counter each time it takes a backward 'BC_JMP' (i.e., a loop
+// iterates) or each time a function is called. When a counter reaches 0, the
+// loop or function is considered hot and the recorder starts capturing the
+// instructions the interpreter executes into a trace.
+//
+// A loop trace finishes when execution returns to the loop header. A function
+// trace finishes when the function returns to its caller. Recording is aborted
+// if the trace gets too long, or if it leaves the loop or function it started
+// in (e.g., via an inner loop or an early return).
+//
+// Finished loop traces are handed to the backend ('jit_x64.c'). If the trace
+// compiles to machine code, the loop's closing 'BC_JMP' is patched into a
+// 'BC_JLOOP', which enters the machine code instead of jumping to the loop
+// header.
+
+#include "value.h"
+
+// Number of iterations or calls before a loop or function is considered hot
+#define HOT_LOOP 56
+#define HOT_CALL 112
+
+// Counter value after a trace is recorded or aborted, so we don't try to
+// record the same loop or function again straight away
+#define HOT_PENALTY UINT16_MAX
+
+// Loop headers are hashed into a function's 'hot_loops' counters by their PC
+#define HOT_SLOT(pc) ((pc) & (HOT_LOOP_SLOTS - 1))
+
+// Maximum number of instructions and nested calls in a trace
+#define TRACE_MAX_INS   512
+#define TRACE_MAX_DEPTH 8
+
+enum {
+    TRACE_LOOP, // Starts at a loop header
+    TRACE_CALL, // Starts at the first instruction in a function
+};
+
+// Value types observed by the recorder.
+enum {
+    TY_NONE, // Operand isn't a stack slot
+    TY_NIL,
+    TY_BOOL,
+    TY_NUM,
+    TY_STR,
+    TY_FN,
+    TY_TABLE,
+    TY_OBJ,
+};
+
+// A single instruction in a trace. The types are those of the stack slot
+// operands, observed immediately *before* the instruction was executed.
+typedef struct {
+    BcIns ins;
+    Fn *fn; // Function the instruction belongs to (traces can follow calls)
+    int pc; // Index of the instruction in 'fn->ins'
+    uint8_t a, b, c, d; // Observed type of each operand, or 'TY_NONE'
+} TraceIns;
+
+// Compiled machine code for a trace. Takes the stack base and constants table
+// for the function the trace starts in, and returns the PC (in that function)
+// to resume interpreting from.
+typedef int (*TraceFn)(uint64_t *s, uint64_t *k);
+
+typedef struct Trace {
+    struct Trace *next; // Linked list of traces that start in the same function
+    int type;
+    Fn *fn;       // Function the trace starts in
+    int start_pc; // Loop header or 0 for function traces
+    int end_pc;   // PC of the loop's closing 'BC_JMP' (loop traces only)
+    TraceIns *ins;
+    int num_ins, max_ins;
+    int depth; // Current call depth while recording
+    void *mcode; // Compiled machine code (a 'TraceFn'), or NULL
+    size_t mcode_size;
+} Trace;
+
+// Starts recording a trace at 'ip' in 'fn'. Returns 1 if recording started;
+// the interpreter should then call 'trace_record' before every instruction.
+int trace_start(State *L, Fn *fn, BcIns *ip, int type);
+
+// Records the instruction at 'ip' (before it's executed). Returns 1 if
+// recording has finished or was aborted.
+int trace_record(State *L, Fn *fn, BcIns *ip, uint64_t *s);
+
+// Throws away the trace currently being recorded (if any).
+void trace_abort(State *L);
+
+void trace_free(State *L, Trace *t);
+
+// Runs the compiled trace for the loop closed by the 'BC_JLOOP' at 'ip'.
+// Returns the instruction to continue interpreting from.
+BcIns * trace_enter(Fn *fn, BcIns *ip, uint64_t *s);
+
+// Implemented by the backend. 'trace_compile' returns 1 if machine code was
+// generated for the trace.
+int trace_compile(State *L, Trace *t);
+void trace_free_mcode(Trace *t);
+
+#endif
@@ -0,0 +1,626 @@
+
+// x86-64 backend for the trace compiler.
+//
+// Only loop traces made up entirely of numeric instructions are compiled. The
+// stack slots used by the trace are kept unboxed in XMM registers for the
+// whole loop (numbers are stored as raw doubles, so "unboxing" is just a
+// load). The type checks that the interpreter performs on every arithmetic
+// instruction are hoisted into guards at the start of the trace: every slot
+// written by the trace is written with a number, so a slot that's a number on
+// entry stays a number on every iteration.
+//
+// Comparisons become guards that check the branch goes the same way it did
+// while recording. If a guard fails, a side exit writes the registers back to
+// the stack and returns the PC of the instruction the interpreter should
+// continue from.
+//
+// Register usage:
+// * rbx -- stack base pointer 's'
+// * rbp -- constants table 'k'
+// * xmm0, xmm1 -- scratch
+// * xmm2 to xmm15 -- allocated to stack slots
+
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include "jit.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+enum { RAX = 0, RCX = 1, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+
+#define FIRST_REG 2  // First XMM register allocated to stack slots
+#define NUM_REGS  14 // xmm2 to xmm15
+#define NO_REG    (-1)
+
+// Condition codes for 'Jcc'
+enum { CC_B = 0x2, CC_AE = 0x3, CC_BE = 0x6, CC_A = 0x7 };
+
+typedef struct {
+    int pc;    // PC in the trace's function to resume interpreting from
+    int spill; // Write registers back to the stack before exiting?
+    int label; // Offset of the exit stub in the machine code
+} Exit;
+
+typedef struct {
+    int pos;  // Offset of the 32-bit displacement to patch
+    int exit; // Index of the exit to jump to
+} Fixup;
+
+typedef struct {
+    State *L;
+    Trace *t;
+
+    // Machine code buffer
+    uint8_t *code;
+    int len, max;
+
+    // Register allocation; 'NO_REG' for slots kept in memory
+    int reg[UINT8_MAX + 1];
+
+    Exit exits[TRACE_MAX_INS + 1];
+    int num_exits;
+    Fixup fixups[TRACE_MAX_INS + UINT8_MAX + 1]; // Comparisons and type guards
+    int num_fixups;
+} Asm;
+
+// A source or destination operand: either an XMM register or a memory
+// location '[base + disp]'.
+typedef struct {
+    int xmm;
+    int base;
+    int32_t disp;
+} Opnd;
+
+static void put(Asm *a, uint8_t b) {
+    if (a->len >= a->max) {
+        a->code = mem_realloc(a->L, MEM_JIT, a->code, a->max, a->max * 2);
+        a->max *= 2;
+    }
+    a->code[a->len++] = b;
+}
+
+static void put32(Asm *a, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        put(a, (uint8_t) (v >> (i * 8)));
+    }
+}
+
+static void put64(Asm *a, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        put(a, (uint8_t) (v >> (i * 8)));
+    }
+}
+
+static void patch32(Asm *a, int pos, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        a->code[pos + i] = (uint8_t) (v >> (i * 8));
+    }
+}
+
+static Opnd xmm(int r) {
+    return (Opnd) { r, 0, 0 };
+}
+
+static Opnd slot(Asm *a, int s) {
+    if (a->reg[s] != NO_REG) {
+        return xmm(a->reg[s]);
+    }
+    return (Opnd) { NO_REG, RBX, (int32_t) (s * sizeof(uint64_t)) };
+}
+
+static Opnd slot_mem(int s) {
+    return (Opnd) { NO_REG, RBX, (int32_t) (s * sizeof(uint64_t)) };
+}
+
+static Opnd konst(int idx) {
+    return (Opnd) { NO_REG, RBP, (int32_t) (idx * sizeof(uint64_t)) };
+}
+
+// Emits an SSE instruction '<prefix> 0F <op>' with an XMM register operand
+// 'reg' and a register or memory operand 'm'.
+static void emit_sse(Asm *a, uint8_t prefix, uint8_t op, int reg, Opnd m) {
+    put(a, prefix);
+    uint8_t rex = 0x40 | (reg >= 8 ? 0x4 : 0) | (m.xmm >= 8 ? 0x1 : 0);
+    if (rex != 0x40) {
+        put(a, rex);
+    }
+    put(a, 0x0f);
+    put(a, op);
+    if (m.xmm != NO_REG) {
+        put(a, 0xc0 | ((reg & 7) << 3) | (m.xmm & 7));
+    } else {
+        put(a, 0x80 | ((reg & 7) << 3) | m.base); // [base + disp32]
+        put32(a, (uint32_t) m.disp);
+    }
+}
+
+#define MOVSD_LOAD  0x10
+#define MOVSD_STORE 0x11
+#define ADDSD       0x58
+#define MULSD       0x59
+#define SUBSD       0x5c
+#define DIVSD       0x5e
+#define UCOMISD     0x2e
+#define XORPD       0x57
+
+static void emit_mov(Asm *a, Opnd dst, Opnd src) {
+    if (dst.xmm != NO_REG) {
+        if (dst.xmm != src.xmm) {
+            emit_sse(a, 0xf2, MOVSD_LOAD, dst.xmm, src);
+        }
+    } else if (src.xmm != NO_REG) {
+        emit_sse(a, 0xf2, MOVSD_STORE, src.xmm, dst);
+    } else { // Memory to memory
+        emit_sse(a, 0xf2, MOVSD_LOAD, 0, src);
+        emit_sse(a, 0xf2, MOVSD_STORE, 0, dst);
+    }
+}
+
+static void emit_mov_rax_imm(Asm *a, uint64_t v) {
+    put(a, 0x48); put(a, 0xb8); // mov rax, imm64
+    put64(a, v);
+}
+
+static void emit_movq_xmm_rax(Asm *a, int r) {
+    put(a, 0x66);
+    put(a, 0x48 | (r >= 8 ? 0x4 : 0)); // REX.W (+ REX.R)
+    put(a, 0x0f); put(a, 0x6e);
+    put(a, 0xc0 | ((r & 7) << 3) | RAX);
+}
+
+static void emit_jcc_exit(Asm *a, uint8_t cc, int exit) {
+    put(a, 0x0f); put(a, 0x80 | cc);
+    a->fixups[a->num_fixups++] = (Fixup) { a->len, exit };
+    put32(a, 0);
+}
+
+static int add_exit(Asm *a, int pc, int spill) {
+    a->exits[a->num_exits] = (Exit) { pc, spill, 0 };
+    return a->num_exits++;
+}
+
+// Writes all allocated registers back to their stack slots (or reloads them).
+static void emit_spill(Asm *a) {
+    for (int s = 0; s <= UINT8_MAX; s++) {
+        if (a->reg[s] != NO_REG) {
+            emit_mov(a, slot_mem(s), xmm(a->reg[s]));
+        }
+    }
+}
+
+static void emit_reload(Asm *a) {
+    for (int s = 0; s <= UINT8_MAX; s++) {
+        if (a->reg[s] != NO_REG) {
+            emit_mov(a, xmm(a->reg[s]), slot_mem(s));
+        }
+    }
+}
+
+static void emit_binop(Asm *a, uint8_t op, Opnd dst, Opnd l, Opnd r) {
+    emit_mov(a, xmm(0), l);
+    emit_sse(a, 0xf2, op, 0, r);
+    emit_mov(a, dst, xmm(0));
+}
+
+// Calls 'double f(double, double)' with the arguments in xmm0 and xmm1. All
+// XMM registers are caller-saved, so the allocated registers are spilled
+// across the call.
+static void emit_call(Asm *a, Opnd dst, Opnd l, Opnd r, void *f) {
+    emit_mov(a, xmm(0), l);
+    emit_mov(a, xmm(1), r);
+    emit_spill(a);
+    emit_mov_rax_imm(a, (uint64_t) f);
+    put(a, 0xff); put(a, 0xd0); // call rax
+    emit_reload(a);
+    emit_mov(a, dst, xmm(0));
+}
+
+static void emit_neg(Asm *a, Opnd dst, Opnd src) {
+    emit_mov(a, xmm(0), src);
+    emit_mov_rax_imm(a, (uint64_t) 1 << 63);
+    emit_movq_xmm_rax(a, 1);
+    emit_sse(a, 0x66, XORPD, 0, xmm(1));
+    emit_mov(a, dst, xmm(0));
+}
+
+// Emits a guard for a comparison instruction. 'taken' is whether the 'BC_JMP'
+// following the comparison was taken while recording.
+static void emit_cmp(Asm *a, TraceIns *r, Opnd l, Opnd rr, int taken) {
+    // Each comparison is phrased so that NaN operands give the same result as
+    // the C comparison in the interpreter (ordered compares are false)
+    int swap, cc;
+    switch (bc_op(r->ins)) {
+    case BC_LTVV: case BC_LTVN: swap = 0; cc = CC_AE; break; // Skip if l >= r
+    case BC_LEVV: case BC_LEVN: swap = 0; cc = CC_A;  break; // Skip if l > r
+    case BC_GTVV: case BC_GTVN: swap = 1; cc = CC_AE; break; // Skip if r >= l
+    case BC_GEVV: case BC_GEVN: swap = 1; cc = CC_A;  break; // Skip if r > l
+    default: UNREACHABLE(); return;
+    }
+    Opnd x = swap ? rr : l, y = swap ? l : rr;
+    if (x.xmm == NO_REG) {
+        emit_mov(a, xmm(0), x);
+        x = xmm(0);
+    }
+    emit_sse(a, 0x66, UCOMISD, x.xmm, y);
+    if (taken) { // Exit to the instruction after the jump if we'd skip it
+        emit_jcc_exit(a, (uint8_t) cc, add_exit(a, r->pc + 2, 1));
+    } else { // Exit to the jump itself if we wouldn't skip it
+        uint8_t inv = (cc == CC_AE) ? CC_B : CC_BE;
+        emit_jcc_exit(a, inv, add_exit(a, r->pc + 1, 1));
+    }
+}
+
+// Slot states during analysis
+enum { SLOT_ENTRY, SLOT_NUM };
+
+// Checks that every instruction in the trace is supported, works out which
+// slots need type guards on entry, and counts how often each slot is used.
+static int analyse(Trace *t, int *guard, int *uses) {
+    uint8_t state[UINT8_MAX + 1] = {0};
+    if (t->type != TRACE_LOOP) {
+        return 0;
+    }
+    for (int i = 0; i < t->num_ins; i++) {
+        TraceIns *r = &t->ins[i];
+        BcIns ins = r->ins;
+        if (r->fn != t->fn) {
+            return 0; // Traces through calls aren't supported yet
+        }
+        int reads[3], num_reads = 0, write = -1, write2 = -1;
+        uint8_t types[3];
+        switch (bc_op(ins)) {
+        case BC_NOP: case BC_JMP:
+            break;
+        case BC_MOV:
+            reads[num_reads] = bc_d(ins); types[num_reads++] = r->d;
+            write = bc_a(ins);
+            break;
+        case BC_KINT: case BC_KNUM:
+            write = bc_a(ins);
+            break;
+        case BC_NEG:
+            reads[num_reads] = bc_d(ins); types[num_reads++] = r->d;
+            write = bc_a(ins);
+            break;
+        case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV:
+        case BC_MODVV: case BC_POW:
+            reads[num_reads] = bc_c(ins); types[num_reads++] = r->c;
+            // Fall through
+        case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN:
+        case BC_MODVN: case BC_ADDVN_KX: case BC_SUBVN_KX:
+        case BC_MULVN_KX: case BC_DIVVN_KX: case BC_MODVN_KX:
+            reads[num_reads] = bc_b(ins); types[num_reads++] = r->b;
+            write = bc_a(ins);
+            break;
+        case BC_SUBNV: case BC_DIVNV: case BC_MODNV:
+        case BC_SUBNV_KX: case BC_DIVNV_KX: case BC_MODNV_KX:
+            reads[num_reads] = bc_c(ins); types[num_reads++] = r->c;
+            write = bc_a(ins);
+            break;
+        case BC_LTVV: case BC_LEVV: case BC_GTVV: case BC_GEVV:
+            reads[num_reads] = bc_d(ins); types[num_reads++] = r->d;
+            // Fall through
+        case BC_LTVN: case BC_LEVN: case BC_GTVN: case BC_GEVN:
+            reads[num_reads] = bc_a(ins); types[num_reads++] = r->a;
+            break;
+        case BC_FORLOOP:
+            // Only the index's type is recorded, but 'FORPREP' has already
+            // checked the limit and step, and nothing else can write to them
+            reads[num_reads] = bc_a(ins) + 2; types[num_reads++] = TY_NUM;
+            // Fall through
+        case BC_FORLOOPI:
+            reads[num_reads] = bc_a(ins); types[num_reads++] = r->a;
+            reads[num_reads] = bc_a(ins) + 1; types[num_reads++] = TY_NUM;
+            write = bc_a(ins);
+            write2 = bc_a(ins) + 3;
+            // Even 'BC_FORLOOPI' uses the step slot (see 'emit_for_entry')
+            uses[bc_a(ins) + 2]++;
+            break;
+        default:
+            return 0; // Unsupported instruction
+        }
+        for (int j = 0; j < num_reads; j++) {
+            int s = reads[j];
+            if (types[j] != TY_NUM) {
+                return 0; // Would be a runtime error in the interpreter
+            }
+            if (state[s] == SLOT_ENTRY) {
+                guard[s] = 1;
+                state[s] = SLOT_NUM;
+            }
+            uses[s]++;
+        }
+        if (write >= 0) {
+            state[write] = SLOT_NUM;
+            uses[write]++;
+        }
+        if (write2 >= 0) {
+            state[write2] = SLOT_NUM;
+            uses[write2]++;
+        }
+    }
+    return 1;
+}
+
+static void alloc_regs(Asm *a, int *uses) {
+    for (int s = 0; s <= UINT8_MAX; s++) {
+        a->reg[s] = NO_REG;
+    }
+    for (int r = 0; r < NUM_REGS; r++) { // Most used slots get registers
+        int best = -1;
+        for (int s = 0; s <= UINT8_MAX; s++) {
+            if (uses[s] > 0 && a->reg[s] == NO_REG &&
+                    (best < 0 || uses[s] > uses[best])) {
+                best = s;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        a->reg[best] = FIRST_REG + r;
+    }
+}
+
+// Returns the index of the constant operand of an arithmetic instruction:
+// 'B' for the 'NV' instructions and 'C' for the 'VN' ones, or the following
+// 'BC_KX' for wide instructions.
+static int arith_k(TraceIns *r) {
+    uint8_t op = bc_narrow(bc_op(r->ins));
+    uint8_t k8 = (op == BC_SUBNV || op == BC_DIVNV || op == BC_MODNV) ?
+        bc_b(r->ins) : bc_c(r->ins);
+    return (int) bc_k(&r->fn->ins[r->pc], k8);
+}
+
+static void emit_ins(Asm *a, int i) {
+    Trace *t = a->t;
+    TraceIns *r = &t->ins[i];
+    BcIns ins = r->ins;
+    Opnd dst = slot(a, bc_a(ins));
+    switch (bc_op(ins)) {
+    case BC_NOP: case BC_JMP:
+        break; // Jumps within the trace are implicit
+    case BC_MOV:
+        emit_mov(a, dst, slot(a, bc_d(ins)));
+        break;
+    case BC_KINT: {
+        double n = (double) ((int16_t) bc_d(ins));
+        uint64_t v;
+        memcpy(&v, &n, sizeof(v));
+        emit_mov_rax_imm(a, v);
+        if (dst.xmm != NO_REG) {
+            emit_movq_xmm_rax(a, dst.xmm);
+        } else {
+            put(a, 0x48); put(a, 0x89); put(a, 0x83); // mov [rbx + disp32], rax
+            put32(a, (uint32_t) dst.disp);
+        }
+        break;
+    }
+    case BC_KNUM:
+        emit_mov(a, dst, konst(bc_d(ins)));
+        break;
+    case BC_NEG:
+        emit_neg(a, dst, slot(a, bc_d(ins)));
+        break;
+
+#define ARITH(name, op)                                                     \
+    case BC_ ## name ## VV:                                                 \
+        emit_binop(a, op, dst, slot(a, bc_b(ins)), slot(a, bc_c(ins)));     \
+        break;                                                              \
+    case BC_ ## name ## VN: case BC_ ## name ## VN_KX:                      \
+        emit_binop(a, op, dst, slot(a, bc_b(ins)), konst(arith_k(r)));      \
+        break;
+    ARITH(ADD, ADDSD)
+    ARITH(SUB, SUBSD)
+    ARITH(MUL, MULSD)
+    ARITH(DIV, DIVSD)
+#undef ARITH
+    case BC_SUBNV: case BC_SUBNV_KX:
+        emit_binop(a, SUBSD, dst, konst(arith_k(r)), slot(a, bc_c(ins)));
+        break;
+    case BC_DIVNV: case BC_DIVNV_KX:
+        emit_binop(a, DIVSD, dst, konst(arith_k(r)), slot(a, bc_c(ins)));
+        break;
+    case BC_MODVV:
+        emit_call(a, dst, slot(a, bc_b(ins)), slot(a, bc_c(ins)), fmod);
+        break;
+    case BC_MODVN: case BC_MODVN_KX:
+        emit_call(a, dst, slot(a, bc_b(ins)), konst(arith_k(r)), fmod);
+        break;
+    case BC_MODNV: case BC_MODNV_KX:
+        emit_call(a, dst, konst(arith_k(r)), slot(a, bc_c(ins)), fmod);
+        break;
+    case BC_POW:
+        emit_call(a, dst, slot(a, bc_b(ins)), slot(a, bc_c(ins)), pow);
+        break;
+
+    case BC_LTVV: case BC_LEVV: case BC_GTVV: case BC_GEVV:
+    case BC_LTVN: case BC_LEVN: case BC_GTVN: case BC_GEVN: {
+        int is_vn = bc_op(ins) == BC_LTVN || bc_op(ins) == BC_LEVN ||
+                bc_op(ins) == BC_GTVN || bc_op(ins) == BC_GEVN;
+        Opnd l = slot(a, bc_a(ins));
+        Opnd rr = is_vn ? konst(bc_d(ins)) : slot(a, bc_d(ins));
+        // The jump was taken if it's the next instruction in the trace
+        int taken = i + 1 < t->num_ins && t->ins[i + 1].pc == r->pc + 1;
+        emit_cmp(a, r, l, rr, taken);
+        break;
+    }
+
+    case BC_FORLOOP: case BC_FORLOOPI: {
+        int base = bc_a(ins);
+        emit_mov(a, xmm(0), slot(a, base));
+        emit_sse(a, 0xf2, ADDSD, 0, slot(a, base + 2)); // See 'emit_for_entry'
+        emit_mov(a, slot(a, base), xmm(0));
+        emit_mov(a, slot(a, base + 3), xmm(0));
+        // Still in bounds if 'idx <= limit' (or 'limit <= idx' for a negative
+        // step), i.e., if the comparison is ordered and doesn't set CF
+        Opnd limit = slot(a, base + 1);
+        if (bc_op(ins) == BC_FORLOOP || (int16_t) bc_d(ins) > 0) {
+            if (limit.xmm == NO_REG) {
+                emit_mov(a, xmm(1), limit);
+                limit = xmm(1);
+            }
+            emit_sse(a, 0x66, UCOMISD, limit.xmm, xmm(0));
+        } else {
+            emit_sse(a, 0x66, UCOMISD, 0, limit);
+        }
+        int taken = i + 1 < t->num_ins && t->ins[i + 1].pc == r->pc + 1;
+        if (taken) { // Exit after the jump back if the loop finishes
+            emit_jcc_exit(a, CC_B, add_exit(a, r->pc + 2, 1));
+        } else { // Exit to the jump back if the loop keeps going
+            emit_jcc_exit(a, CC_AE, add_exit(a, r->pc + 1, 1));
+        }
+        break;
+    }
+    default: UNREACHABLE();
+    }
+}
+
+// 'BC_FORLOOP' in a trace is compiled for a positive step, so checks that
+// the step is positive on entry; it can't change inside the trace. The step
+// for 'BC_FORLOOPI' isn't kept on the stack, so it's stored into the (unused)
+// step slot instead, where it can be kept in a register.
+static void emit_for_entry(Asm *a, int exit) {
+    Trace *t = a->t;
+    for (int i = 0; i < t->num_ins; i++) {
+        BcIns ins = t->ins[i].ins;
+        Opnd step = slot_mem(bc_a(ins) + 2);
+        if (bc_op(ins) == BC_FORLOOP) {
+            emit_mov(a, xmm(0), step);
+            emit_sse(a, 0x66, XORPD, 1, xmm(1));
+            emit_sse(a, 0x66, UCOMISD, 0, xmm(1));
+            emit_jcc_exit(a, CC_BE, exit); // 'step <= 0' or NaN
+        } else if (bc_op(ins) == BC_FORLOOPI) {
+            double n = (double) ((int16_t) bc_d(ins));
+            uint64_t v;
+            memcpy(&v, &n, sizeof(v));
+            emit_mov_rax_imm(a, v);
+            put(a, 0x48); put(a, 0x89); put(a, 0x83); // mov [rbx + disp32], rax
+            put32(a, (uint32_t) step.disp);
+        }
+    }
+}
+
+static void * map_code(Asm *a, size_t *size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    *size = ((size_t) a->len + page - 1) & ~(page - 1);
+    void *p = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(p, a->code, a->len);
+    if (mprotect(p, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(p, *size);
+        return NULL;
+    }
+    return p;
+}
+
+int trace_compile(State *L, Trace *t) {
+    int guard[UINT8_MAX + 1] = {0};
+    int uses[UINT8_MAX + 1] = {0};
+    if (!analyse(t, guard, uses)) {
+        return 0;
+    }
+    Asm a;
+    a.L = L;
+    a.t = t;
+    a.len = 0;
+    a.max = 256;
+    a.code = mem_alloc(L, MEM_JIT, a.max);
+    a.num_exits = a.num_fixups = 0;
+    alloc_regs(&a, uses);
+
+    // Prologue; keeps the stack 16-byte aligned for calls
+    put(&a, 0x53);                               // push rbx
+    put(&a, 0x55);                               // push rbp
+    put(&a, 0x48); put(&a, 0x83); put(&a, 0xec); put(&a, 0x08); // sub rsp, 8
+    put(&a, 0x48); put(&a, 0x89); put(&a, 0xfb); // mov rbx, rdi
+    put(&a, 0x48); put(&a, 0x89); put(&a, 0xf5); // mov rbp, rsi
+
+    // Type guards; a value is a number if it's below 'TAG_OBJ'
+    int entry_exit = add_exit(&a, t->start_pc, 0);
+    put(&a, 0x48); put(&a, 0xb9); put64(&a, TAG_OBJ); // mov rcx, TAG_OBJ
+    for (int s = 0; s <= UINT8_MAX; s++) {
+        if (guard[s]) {
+            put(&a, 0x48); put(&a, 0x8b); put(&a, 0x83); // mov rax, [rbx + disp]
+            put32(&a, (uint32_t) (s * sizeof(uint64_t)));
+            put(&a, 0x48); put(&a, 0x39); put(&a, 0xc8); // cmp rax, rcx
+            emit_jcc_exit(&a, CC_AE, entry_exit);
+        }
+    }
+    emit_for_entry(&a, entry_exit);
+    emit_reload(&a);
+
+    // Loop body
+    int loop = a.len;
+    for (int i = 0; i < t->num_ins; i++) {
+        emit_ins(&a, i);
+    }
+    put(&a, 0xe9); // jmp loop
+    put32(&a, (uint32_t) (loop - (a.len + 4)));
+
+    // Side exits
+    int epilogue_fixups[TRACE_MAX_INS + 1];
+    for (int i = 0; i < a.num_exits; i++) {
+        Exit *e = &a.exits[i];
+        e->label = a.len;
+        if (e->spill) {
+            emit_spill(&a);
+        }
+        put(&a, 0xb8); put32(&a, (uint32_t) e->pc); // mov eax, pc
+        put(&a, 0xe9);                              // jmp epilogue
+        epilogue_fixups[i] = a.len;
+        put32(&a, 0);
+    }
+    int epilogue = a.len;
+    put(&a, 0x48); put(&a, 0x83); put(&a, 0xc4); put(&a, 0x08); // add rsp, 8
+    put(&a, 0x5d); // pop rbp
+    put(&a, 0x5b); // pop rbx
+    put(&a, 0xc3); // ret
+
+    for (int i = 0; i < a.num_exits; i++) {
+        int pos = epilogue_fixups[i];
+        patch32(&a, pos, (uint32_t) (epilogue - (pos + 4)));
+    }
+    for (int i = 0; i < a.num_fixups; i++) {
+        Fixup *f = &a.fixups[i];
+        patch32(&a, f->pos, (uint32_t) (a.exits[f->exit].label - (f->pos + 4)));
+    }
+
+    size_t size;
+    void *mcode = map_code(&a, &size);
+    mem_free(L, MEM_JIT, a.code, a.max);
+    if (!mcode) {
+        return 0;
+    }
+    t->mcode = mcode;
+    t->mcode_size = size;
+    return 1;
+}
+
+void trace_free_mcode(Trace *t) {
+    if (t->mcode) {
+        munmap(t->mcode, t->mcode_size);
+        t->mcode = NULL;
+    }
+}
+
+#else
+
+// No backend for this platform; traces are only recorded
+int trace_compile(State *L, Trace *t) {
+    (void) L; (void) t;
+    return 0;
+}
+
+void trace_free_mcode(Trace *t) {
+    (void) t;
+}
+
+#endif
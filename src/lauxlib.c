@@ -4,8 +4,20 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "state.h"
 
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define USE_MMAP 1
+#else
+#define USE_MMAP 0
+#endif
 
 static void * alloc_fn(void *ud, void *ptr, size_t osize, size_t nsize) {
     (void) ud; (void) osize; // unused
@@ -37,6 +49,59 @@ static const char * file_reader(lua_State *L, void *ud, size_t *size) {
     return *size > 0 ? r->buf : NULL;
 }
 
+#if USE_MMAP
+
+// Maps the whole of 'f' into memory, so it can be lexed in place without
+// copying it. Returns NULL if 'f' isn't a non-empty regular file.
+static char * map_file(FILE *f, size_t *size) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return NULL;
+    }
+    void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                   fileno(f), 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    return p;
+}
+
+static void unmap_file(char *p, size_t size) {
+    munmap(p, size);
+}
+
+#else
+
+static char * map_file(FILE *f, size_t *size) {
+    (void) f; (void) size;
+    return NULL;
+}
+
+static void unmap_file(char *p, size_t size) {
+    (void) p; (void) size;
+}
+
+#endif
+
+// Reads the whole of 'f' into memory, for when it can't be mapped. Returns
+// NULL if 'f' isn't a regular file (e.g., a pipe).
+static char * read_file(FILE *f, size_t *size) {
+    if (fseek(f, 0, SEEK_END) != 0) {
+        return NULL;
+    }
+    long len = ftell(f);
+    if (len < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        return NULL;
+    }
+    char *buf = malloc(len > 0 ? (size_t) len : 1);
+    if (!buf) {
+        return NULL;
+    }
+    *size = fread(buf, 1, (size_t) len, f);
+    return buf;
+}
+
 LUALIB_API int luaL_loadfile(lua_State *L, const char *filename) {
     FileReader r;
     if (!filename) {
@@ -45,10 +110,110 @@ LUALIB_API int luaL_loadfile(lua_State *L, const char *filename) {
     } else {
         r.f = fopen(filename, "r");
         if (!r.f) {
-            return LUA_ERRFILE; // TODO: error message on stack
+            lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+            return LUA_ERRFILE;
         }
     }
-    int err = lua_load(L, file_reader, &r, filename);
+    size_t size;
+    char *buf;
+    int err;
+    if ((buf = map_file(r.f, &size))) {
+        err = luaL_loadbuffer(L, buf, size, filename);
+        unmap_file(buf, size);
+    } else if ((buf = read_file(r.f, &size))) {
+        err = luaL_loadbuffer(L, buf, size, filename);
+        free(buf);
+    } else {
+        err = lua_load(L, file_reader, &r, filename);
+    }
+    if (r.f != stdin) {
+        fclose(r.f);
+    }
     return err;
 }
 
+LUALIB_API int luaL_loadbuffer(lua_State *L, const char *buff, size_t sz,
+                               const char *name) {
+    return load_buf(L, buff, sz, name);
+}
+
+// Functions keep a pointer to their chunk name rather than a copy, so unlike
+// Lua, the string itself isn't used as the name; it mightn't outlive them.
+LUALIB_API int luaL_loadstring(lua_State *L, const char *s) {
+    return luaL_loadbuffer(L, s, strlen(s), "[string]");
+}
+
+
+// ---- Errors and Argument Checks ----
+
+// Only level 1 (the Lua code that called the running C function) is
+// supported; there's no debug API to walk further up the call stack yet.
+LUALIB_API void luaL_where(lua_State *L, int lvl) {
+    ErrInfo info;
+    if (lvl == 1 && err_caller(L, &info) && info.line > 0) {
+        lua_pushfstring(L, "%s:%d: ",
+                        info.chunk_name ? info.chunk_name : "?", info.line);
+    } else {
+        lua_pushliteral(L, "");
+    }
+}
+
+LUALIB_API int luaL_error(lua_State *L, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    luaL_where(L, 1);
+    lua_pushvfstring(L, fmt, args);
+    va_end(args);
+    lua_concat(L, 2);
+    return lua_error(L);
+}
+
+// Function names aren't tracked for C functions, so unlike Lua, the message
+// doesn't say which function the argument was passed to.
+LUALIB_API int luaL_argerror(lua_State *L, int narg, const char *extramsg) {
+    return luaL_error(L, "bad argument #%d (%s)", narg, extramsg);
+}
+
+LUALIB_API int luaL_typerror(lua_State *L, int narg, const char *tname) {
+    const char *msg = lua_pushfstring(L, "%s expected, got %s",
+                                      tname, luaL_typename(L, narg));
+    return luaL_argerror(L, narg, msg);
+}
+
+LUALIB_API void luaL_checkany(lua_State *L, int narg) {
+    if (lua_type(L, narg) == LUA_TNONE) {
+        luaL_argerror(L, narg, "value expected");
+    }
+}
+
+LUALIB_API lua_Number luaL_checknumber(lua_State *L, int narg) {
+    lua_Number n = lua_tonumber(L, narg);
+    if (n == 0 && !lua_isnumber(L, narg)) { // Avoid extra test when n != 0
+        luaL_typerror(L, narg, lua_typename(L, LUA_TNUMBER));
+    }
+    return n;
+}
+
+LUALIB_API lua_Number luaL_optnumber(lua_State *L, int narg, lua_Number def) {
+    return lua_isnoneornil(L, narg) ? def : luaL_checknumber(L, narg);
+}
+
+// Sets the functions in 'l' as fields of the table on top of the stack, or if
+// 'libname' isn't NULL, of the global table with that name (which is created
+// if it doesn't exist, and left on top of the stack).
+LUALIB_API void luaL_register(lua_State *L, const char *libname,
+                              const luaL_Reg *l) {
+    if (libname) {
+        lua_getglobal(L, libname);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setglobal(L, libname);
+        }
+    }
+    for (; l->name; l++) {
+        lua_pushcfunction(L, l->func);
+        lua_setfield(L, -2, l->name);
+    }
+}
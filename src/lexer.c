@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
@@ -10,39 +11,47 @@
 #define FIRST_KEYWORD   TK_LOCAL
 
 // These must be in the same order as they appear in the enum in 'lexer.h'
-static char *KEYWORDS[] = {
+static char * const KEYWORDS[] = {
     "local", "function", "if", "else", "elseif", "then", "while", "do",
     "repeat", "until", "for", "end", "break", "return", "in", "and", "or",
     "not", "nil", "false", "true",
-    "assert", // TODO: temporary
 };
 
-typedef struct {
-    char *s;
-    int len, max;
-} StrBuf;
+// Perfect hash of a keyword's first and last characters, so an identifier is
+// only ever compared against one keyword.
+#define KEYWORD_HASH(first, last) (((first) * 7 + (last)) & 63)
 
-static StrBuf buf_new(State *L) {
-    StrBuf s = {0};
-    s.max = 8;
-    s.s = mem_alloc(L, sizeof(char) * s.max);
-    return s;
-}
-
-static void buf_free(State *L, StrBuf *s) {
-    mem_free(L, s->s, sizeof(char) * s->max);
-}
+// Keyword token for each hash, or 0
+static const int KEYWORD_TOKENS[64] = {
+    [KEYWORD_HASH('l', 'l')] = TK_LOCAL,
+    [KEYWORD_HASH('f', 'n')] = TK_FUNCTION,
+    [KEYWORD_HASH('i', 'f')] = TK_IF,
+    [KEYWORD_HASH('e', 'e')] = TK_ELSE,
+    [KEYWORD_HASH('e', 'f')] = TK_ELSEIF,
+    [KEYWORD_HASH('t', 'n')] = TK_THEN,
+    [KEYWORD_HASH('w', 'e')] = TK_WHILE,
+    [KEYWORD_HASH('d', 'o')] = TK_DO,
+    [KEYWORD_HASH('r', 't')] = TK_REPEAT,
+    [KEYWORD_HASH('u', 'l')] = TK_UNTIL,
+    [KEYWORD_HASH('f', 'r')] = TK_FOR,
+    [KEYWORD_HASH('e', 'd')] = TK_END,
+    [KEYWORD_HASH('b', 'k')] = TK_BREAK,
+    [KEYWORD_HASH('r', 'n')] = TK_RETURN,
+    [KEYWORD_HASH('i', 'n')] = TK_IN,
+    [KEYWORD_HASH('a', 'd')] = TK_AND,
+    [KEYWORD_HASH('o', 'r')] = TK_OR,
+    [KEYWORD_HASH('n', 't')] = TK_NOT,
+    [KEYWORD_HASH('n', 'l')] = TK_NIL,
+    [KEYWORD_HASH('f', 'e')] = TK_FALSE,
+    [KEYWORD_HASH('t', 'e')] = TK_TRUE,
+};
 
-static void buf_push(State *L, StrBuf *s, char c) {
-    if (s->len + 1 >= s->max) {
-        s->s = mem_realloc(
-                L,
-                s->s,
-                sizeof(char) * s->max,
-                sizeof(char) * s->max * 2);
-        s->max *= 2;
-    }
-    s->s[s->len++] = c;
+// Strings and numbers are built up in 'L->buf' (see 'buf_reserve'), so
+// lexing a token doesn't allocate anything unless the buffer needs to grow.
+static void buf_append(Lexer *l, size_t *len, const char *s, size_t n) {
+    char *buf = buf_reserve(l->L, *len + n);
+    memcpy(&buf[*len], s, n);
+    *len += n;
 }
 
 Lexer lexer_new(State *L, Reader *r) {
@@ -62,17 +71,15 @@ static void tk_new(Reader *r, Token *tk) {
     *tk = (Token) {0};
     tk->chunk_name = r->chunk_name;
     tk->line = r->line;
-    tk->col = r->col;
+    tk->col = reader_col(r);
 }
 
 static int lex_open_long_bracket(Lexer *l) {
     read_ch(l->r); // Skip first [
     int level = 0;
-    char c = peek_ch(l->r);
-    while (c == '=') {
+    while (peek_ch(l->r) == '=') {
         level++;
         read_ch(l->r);
-        c = peek_ch(l->r);
     }
     if (peek_ch(l->r) != '[') { // Invalid long bracket
         return -1;
@@ -81,31 +88,41 @@ static int lex_open_long_bracket(Lexer *l) {
     return level;
 }
 
-static void skip_block_comment(Lexer *l, int level) {
-    int n = -1;
-    char c = read_ch(l->r);
-    while (c != EOF) {
-        if (n < 0 && c == ']') { // Terminator not yet started
-            n = 0;
-        } else if (n >= 0 && c == '=') { // Another level for terminator
-            n++;
-        } else if (n == level && c == ']') { // Terminator finished
-            break;
-        } else if (n >= 0) { // Not a valid terminator
-            n = -1;
+// Reads up to and including the closing long bracket for 'level'. If 'len'
+// isn't NULL, the contents are saved in 'L->buf'. Returns 0 if the source
+// ended first.
+static int lex_long_bracket(Lexer *l, int level, size_t *len) {
+    Reader *r = l->r;
+    while (1) {
+        const char *start = r->p;
+        while (r->p < r->end && *r->p != ']' && *r->p != '\n' &&
+                *r->p != '\r') {
+            r->p++;
+        }
+        if (len) { // Save everything up to the newline or ']' in one go
+            buf_append(l, len, start, r->p - start);
+        }
+        if (r->p >= r->end) {
+            return 0;
+        } else if (*r->p == ']') {
+            const char *q = r->p + 1;
+            while (q < r->end && *q == '=') {
+                q++;
+            }
+            if (q < r->end && *q == ']' && q - r->p - 1 == level) {
+                r->p = q + 1; // Terminator finished
+                return 1;
+            }
+            r->p++; // Not a valid terminator
+            if (len) {
+                buf_append(l, len, "]", 1);
+            }
+        } else {
+            char c = (char) read_ch(r); // Normalises and counts the newline
+            if (len) {
+                buf_append(l, len, &c, 1);
+            }
         }
-        c = read_ch(l->r);
-    }
-    if (c == EOF) {
-        ErrInfo info = tk2err(&l->tk);
-        err_syntax(l->L, &info, "unterminated block comment");
-    }
-}
-
-static void skip_line_comment(Lexer *l) {
-    char c = read_ch(l->r);
-    while (c != '\n' && c != EOF) {
-        c = read_ch(l->r);
     }
 }
 
@@ -113,93 +130,108 @@ static void skip_comment(Lexer *l) {
     read_ch(l->r); read_ch(l->r); // Skip '--'
     if (peek_ch(l->r) == '[') {
         int level = lex_open_long_bracket(l);
-        if (level > 0) { // Has opening long bracket
-            skip_block_comment(l, level);
+        if (level >= 0) { // Has opening long bracket
+            if (!lex_long_bracket(l, level, NULL)) {
+                ErrInfo info = tk2err(&l->tk);
+                err_syntax(l->L, &info, "unterminated block comment");
+            }
             return;
         } // Don't have a long bracket, fall through to line comment...
     }
-    skip_line_comment(l);
+    Reader *r = l->r;
+    while (r->p < r->end && *r->p != '\n' && *r->p != '\r') {
+        r->p++; // The newline itself is skipped as whitespace
+    }
 }
 
 static void skip_spaces(Lexer *l) {
-    char c = peek_ch(l->r);
-    while (1) {
-        if (c == '-' && peek_ch2(l->r) == '-') { // Comment
+    Reader *r = l->r;
+    while (r->p < r->end) {
+        char c = *r->p;
+        if (c == ' ' || c == '\t') {
+            r->p++;
+        } else if (c == '-' && peek_ch2(r) == '-') { // Comment
             skip_comment(l);
-        } else if (isspace(c)) { // Whitespace
-            read_ch(l->r);
+        } else if (isspace((unsigned char) c)) { // Including newlines
+            read_ch(r);
         } else {
             break;
         }
-        c = peek_ch(l->r);
     }
 }
 
+// Identifier characters are ASCII only (as for Lua in the C locale), which
+// avoids going through the locale-dependent 'ctype.h' functions.
+static inline int is_ident_start(int c) {
+    return (unsigned) ((c | 0x20) - 'a') < 26 || c == '_';
+}
+
+static inline int is_ident_ch(int c) {
+    return is_ident_start(c) || (unsigned) (c - '0') < 10;
+}
+
+// The identifier is scanned in place in the reader's buffer, and interned
+// straight from there.
 static void lex_keyword_or_ident(Lexer *l) {
-    StrBuf s = buf_new(l->L);
-    char c = read_ch(l->r);
-    while (isalnum(c) || c == '_') {
-        buf_push(l->L, &s, (char) c);
-        c = read_ch(l->r);
+    Reader *r = l->r;
+    const char *start = r->p;
+    while (r->p < r->end && is_ident_ch((unsigned char) *r->p)) {
+        r->p++;
     }
-    undo_ch(l->r, c);
-    for (int i = 0; i < (int) (sizeof(KEYWORDS) / sizeof(KEYWORDS[0])); i++) {
-        char *keyword = KEYWORDS[i];
-        if (s.len == (int) strlen(keyword) &&
-                strncmp(s.s, keyword, s.len) == 0) {
-            l->tk.t = i + FIRST_KEYWORD;
-            buf_free(l->L, &s);
+    size_t len = (size_t) (r->p - start);
+    unsigned char first = (unsigned char) start[0];
+    unsigned char last = (unsigned char) start[len - 1];
+    int tk = KEYWORD_TOKENS[KEYWORD_HASH(first, last)];
+    if (tk != 0) {
+        char *keyword = KEYWORDS[tk - FIRST_KEYWORD];
+        if (strncmp(start, keyword, len) == 0 && keyword[len] == '\0') {
+            l->tk.t = tk;
             return;
         }
     }
     l->tk.t = TK_IDENT;
-    l->tk.s = str_new(l->L, s.len);
-    strncpy(str_val(l->tk.s), s.s, s.len);
-    buf_free(l->L, &s);
+    l->tk.s = str_new(l->L, start, len);
 }
 
 static void lex_number(Lexer *l) {
-    StrBuf s = buf_new(l->L);
-    char c = read_ch(l->r);
-    char last = c;
-    while (isalnum(c) || c == '.' || (strchr("eEpP", last) && strchr("+-", c))) {
-        buf_push(l->L, &s, (char) c);
+    Reader *r = l->r;
+    const char *start = r->p;
+    char last = '\0';
+    while (r->p < r->end) {
+        char c = *r->p;
+        int exp_sign = (c == '+' || c == '-') &&
+            (last == 'e' || last == 'E' || last == 'p' || last == 'P');
+        if (!isalnum((unsigned char) c) && c != '.' && !exp_sign) {
+            break;
+        }
         last = c;
-        c = read_ch(l->r);
+        r->p++;
     }
-    undo_ch(l->r, c);
-    buf_push(l->L, &s, '\0'); // strtod needs NULL terminator
 
-    // Convert to number
+    // Convert to number; strtod needs a NULL terminator
+    size_t len = 0;
+    buf_append(l, &len, start, r->p - start);
+    buf_append(l, &len, "", 1);
     char *end;
     l->tk.t = TK_NUM;
-    l->tk.num = strtod(s.s, &end);
-    if (end - s.s != s.len - 1) { // -1 for the NULL terminator
-        buf_free(l->L, &s);
+    l->tk.num = strtod(l->L->buf, &end);
+    if (end - l->L->buf != (ptrdiff_t) len - 1) { // -1 for the terminator
         ErrInfo info = tk2err(&l->tk);
         err_syntax(l->L, &info, "invalid symbol in number");
     }
-    buf_free(l->L, &s);
 }
 
 static char lex_num_esc_seq(Lexer *l) {
-    StrBuf s = buf_new(l->L);
-    char c = read_ch(l->r);
-    while (c >= '0' && c <= '9' && s.len < 3) { // Max of 3 digits
-        buf_push(l->L, &s, c);
-        c = read_ch(l->r);
+    int esc = 0;
+    for (int i = 0; i < 3 && isdigit(peek_ch(l->r)); i++) { // Max of 3 digits
+        esc = esc * 10 + (read_ch(l->r) - '0');
     }
-    undo_ch(l->r, c);
-    assert(s.len > 0);
-    buf_push(l->L, &s, '\0'); // strtol needs NULL terminator
-    char esc = (char) strtol(s.s, NULL, 10);
-    buf_free(l->L, &s);
-    return esc;
+    return (char) esc;
 }
 
 static char lex_esc_seq(Lexer *l) {
     ErrInfo info;
-    char c = read_ch(l->r);
+    int c = read_ch(l->r);
     switch (c) {
     case 'a': return '\a';
     case 'b': return '\b';
@@ -208,9 +240,9 @@ static char lex_esc_seq(Lexer *l) {
     case 'r': return '\r';
     case 't': return '\t';
     case 'v': return '\v';
-    case '\'': case '"': case '\\': case '\n': return c;
+    case '\'': case '"': case '\\': case '\n': return (char) c;
     case '0' ... '9':
-        undo_ch(l->r, c);
+        l->r->p--; // Not a newline, so the line count isn't affected
         return lex_num_esc_seq(l);
     default:
         info = tk2err(&l->tk);
@@ -219,25 +251,28 @@ static char lex_esc_seq(Lexer *l) {
 }
 
 static void lex_str(Lexer *l) {
-    char quote = read_ch(l->r); // Skip "
-    StrBuf s = buf_new(l->L);
-    char c = read_ch(l->r);
-    while (c != EOF && c != quote) {
-        if (c == '\\') {
-            c = lex_esc_seq(l);
+    Reader *r = l->r;
+    char quote = (char) read_ch(r); // Skip "
+    size_t len = 0;
+    while (1) {
+        const char *start = r->p;
+        while (r->p < r->end && *r->p != quote && *r->p != '\\' &&
+                *r->p != '\n' && *r->p != '\r') {
+            r->p++;
         }
-        buf_push(l->L, &s, c);
-        c = read_ch(l->r);
-    }
-    if (c == EOF) {
-        buf_free(l->L, &s);
-        ErrInfo info = tk2err(&l->tk);
-        err_syntax(l->L, &info, "unterminated string literal");
+        buf_append(l, &len, start, r->p - start);
+        int c = read_ch(r);
+        if (c == EOF) {
+            ErrInfo info = tk2err(&l->tk);
+            err_syntax(l->L, &info, "unterminated string literal");
+        } else if (c == quote) {
+            break;
+        }
+        char ch = c == '\\' ? lex_esc_seq(l) : (char) c;
+        buf_append(l, &len, &ch, 1);
     }
     l->tk.t = TK_STR;
-    l->tk.s = str_new(l->L, s.len);
-    strncpy(str_val(l->tk.s), s.s, s.len);
-    buf_free(l->L, &s);
+    l->tk.s = str_new(l->L, l->L->buf, len);
 }
 
 static void lex_long_str(Lexer *l) {
@@ -246,41 +281,20 @@ static void lex_long_str(Lexer *l) {
         ErrInfo info = tk2err(&l->tk);
         err_syntax(l->L, &info, "invalid long string delimiter");
     }
-    if (peek_ch(l->r) == '\n') {
+    if (peek_ch(l->r) == '\n' || peek_ch(l->r) == '\r') {
         read_ch(l->r); // Newline immediately following [[ is ignored
     }
-    int saved_len = 0;
-    int n = -1;
-    StrBuf s = buf_new(l->L);
-    char c = read_ch(l->r);
-    while (c != EOF) {
-        if (n < 0 && c == ']') { // Terminator not yet started
-            saved_len = s.len;
-            n = 0;
-        } else if (n >= 0 && c == '=') { // Another level for terminator
-            n++;
-        } else if (n == level && c == ']') { // Terminator finished
-            break;
-        } else if (n >= 0) { // Not a valid terminator
-            n = -1;
-        }
-        buf_push(l->L, &s, c); // Escape sequences aren't parsed in block strings
-        c = read_ch(l->r);
-    }
-    if (c == EOF) {
-        buf_free(l->L, &s);
+    size_t len = 0;
+    if (!lex_long_bracket(l, level, &len)) { // Escape sequences aren't parsed
         ErrInfo info = tk2err(&l->tk);
         err_syntax(l->L, &info, "unterminated string literal");
     }
-    s.len = saved_len; // Get rid of closing long bracket from string contents
     l->tk.t = TK_STR;
-    l->tk.s = str_new(l->L, s.len);
-    strncpy(str_val(l->tk.s), s.s, s.len);
-    buf_free(l->L, &s);
+    l->tk.s = str_new(l->L, l->L->buf, len);
 }
 
 static void lex_symbol(Lexer *l) {
-    int c = (int) read_ch(l->r);
+    int c = read_ch(l->r);
     switch (c) {
     case '=': if (peek_ch(l->r) == '=') { read_ch(l->r); c = TK_EQ; }  break;
     case '~': if (peek_ch(l->r) == '=') { read_ch(l->r); c = TK_NEQ; } break;
@@ -303,10 +317,10 @@ static void lex_symbol(Lexer *l) {
 static void next_tk(Lexer *l) {
     skip_spaces(l);
     tk_new(l->r, &l->tk);
-    char c = peek_ch(l->r);
+    int c = peek_ch(l->r);
     if (c == EOF) {
         l->tk.t = TK_EOF;
-    } else if (isalpha(c) || c == '_') {
+    } else if (is_ident_start(c)) {
         lex_keyword_or_ident(l);
     } else if (isdigit(c) || (c == '.' && isdigit(peek_ch2(l->r)))) {
         lex_number(l);
@@ -324,7 +338,12 @@ int read_tk(Lexer *l, Token *tk) {
     if (tk) {
         *tk = l->tk;
     }
-    next_tk(l);
+    if (l->has_ahead) {
+        l->tk = l->ahead;
+        l->has_ahead = 0;
+    } else {
+        next_tk(l);
+    }
     return t;
 }
 
@@ -335,7 +354,21 @@ int peek_tk(Lexer *l, Token *tk) {
     return l->tk.t;
 }
 
-static const char *TK_NAMES[] = {
+int peek_tk2(Lexer *l, Token *tk) {
+    if (!l->has_ahead) {
+        Token cur = l->tk;
+        next_tk(l);
+        l->ahead = l->tk;
+        l->tk = cur;
+        l->has_ahead = 1;
+    }
+    if (tk) {
+        *tk = l->ahead;
+    }
+    return l->ahead.t;
+}
+
+static const char * const TK_NAMES[] = {
     "'=='", "'!='", "'<='", "'>='", "'..'", "'...'",
     "'local'", "'function'", "'if'", "'else'", "'elseif'", "'then'", "'while'",
     "'do'", "'repeat'", "'until'", "'for'", "'end'", "'break'", "'return'",
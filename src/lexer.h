@@ -45,7 +45,6 @@ enum {
     TK_NIL,
     TK_FALSE,
     TK_TRUE,
-    TK_ASSERT, // TODO: temporary
 
     // Values
     TK_IDENT,
@@ -72,6 +71,8 @@ typedef struct {
     State *L;
     Reader *r;
     Token tk; // The most recently lexed token
+    Token ahead; // The token after 'tk', if 'has_ahead' is set
+    int has_ahead;
 } Lexer;
 
 Lexer lexer_new(State *L, Reader *r);
@@ -79,6 +80,7 @@ Lexer lexer_new(State *L, Reader *r);
 // Optionally return info about the token via the struct in 'tk'
 int read_tk(Lexer *l, Token *tk);
 int peek_tk(Lexer *l, Token *tk);
+int peek_tk2(Lexer *l, Token *tk); // Looks at the token after the next one
 void expect_tk(Lexer *l, int expected_tk, Token *tk);
 
 ErrInfo tk2err(Token *tk);
@@ -0,0 +1,159 @@
+
+// Basic library
+// Adapted from 'lbaselib.c' in the Lua source code
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static int base_assert(lua_State *L) {
+    luaL_checkany(L, 1);
+    if (!lua_toboolean(L, 1)) {
+        if (lua_isstring(L, 2)) {
+            return luaL_error(L, "%s", lua_tostring(L, 2));
+        }
+        return luaL_error(L, "assertion failed!");
+    }
+    return lua_gettop(L);
+}
+
+// Only levels 0 (no position) and 1 (the caller's position) are supported.
+static int base_error(lua_State *L) {
+    int level = luaL_optint(L, 2, 1);
+    lua_settop(L, 1);
+    if (lua_isstring(L, 1) && level > 0) {
+        luaL_where(L, level);
+        lua_insert(L, 1);
+        lua_concat(L, 2);
+    }
+    return lua_error(L);
+}
+
+// Only reached for calls from C, or with a value that can't be called (see
+// 'run' in 'vm.c').
+int base_pcall(lua_State *L) {
+    luaL_checkany(L, 1);
+    int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    lua_pushboolean(L, status == 0);
+    lua_insert(L, 1);
+    return lua_gettop(L); // Status plus the results or error message
+}
+
+static int base_print(lua_State *L) {
+    int n = lua_gettop(L);
+    for (int i = 1; i <= n; i++) {
+        if (i > 1) {
+            fputs("\t", stdout);
+        }
+        switch (lua_type(L, i)) {
+        case LUA_TNIL:     fputs("nil", stdout); break;
+        case LUA_TBOOLEAN:
+            fputs(lua_toboolean(L, i) ? "true" : "false", stdout);
+            break;
+        case LUA_TNUMBER:
+        case LUA_TSTRING:  fputs(lua_tostring(L, i), stdout); break;
+        default:
+            printf("%s: %p", luaL_typename(L, i), lua_topointer(L, i));
+            break;
+        }
+    }
+    fputs("\n", stdout);
+    return 0;
+}
+
+static int base_tonumber(lua_State *L) {
+    int base = luaL_optint(L, 2, 10);
+    if (base == 10) { // Standard conversion
+        luaL_checkany(L, 1);
+        if (lua_isnumber(L, 1)) {
+            lua_pushnumber(L, lua_tonumber(L, 1));
+            return 1;
+        }
+    } else {
+        luaL_argcheck(L, 2 <= base && base <= 36, 2, "base out of range");
+        const char *s = lua_tostring(L, 1);
+        if (!s) {
+            luaL_typerror(L, 1, lua_typename(L, LUA_TSTRING));
+        }
+        char *end;
+        unsigned long n = strtoul(s, &end, base);
+        if (s != end) { // At least one valid digit?
+            while (isspace((unsigned char) *end)) {
+                end++; // Skip trailing spaces
+            }
+            if (*end == '\0') { // No invalid trailing characters?
+                lua_pushnumber(L, (lua_Number) n);
+                return 1;
+            }
+        }
+    }
+    lua_pushnil(L); // Not a number
+    return 1;
+}
+
+static int base_tostring(lua_State *L) {
+    luaL_checkany(L, 1);
+    switch (lua_type(L, 1)) {
+    case LUA_TNUMBER:
+        lua_pushstring(L, lua_tostring(L, 1));
+        break;
+    case LUA_TSTRING:
+        lua_pushvalue(L, 1);
+        break;
+    case LUA_TBOOLEAN:
+        lua_pushstring(L, lua_toboolean(L, 1) ? "true" : "false");
+        break;
+    case LUA_TNIL:
+        lua_pushliteral(L, "nil");
+        break;
+    default:
+        lua_pushfstring(L, "%s: %p", luaL_typename(L, 1),
+                        lua_topointer(L, 1));
+        break;
+    }
+    return 1;
+}
+
+static int base_type(lua_State *L) {
+    luaL_checkany(L, 1);
+    lua_pushstring(L, luaL_typename(L, 1));
+    return 1;
+}
+
+static const luaL_Reg BASE_FNS[] = {
+    {"assert", base_assert},
+    {"error", base_error},
+    {"pcall", base_pcall},
+    {"print", base_print},
+    {"tonumber", base_tonumber},
+    {"tostring", base_tostring},
+    {"type", base_type},
+    {NULL, NULL},
+};
+
+LUALIB_API int luaopen_base(lua_State *L) {
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_setglobal(L, "_G");
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    luaL_register(L, NULL, BASE_FNS);
+    return 1;
+}
+
+static const luaL_Reg LIBS[] = {
+    {"", luaopen_base},
+    {LUA_COLIBNAME, luaopen_coroutine},
+    {LUA_MATHLIBNAME, luaopen_math},
+    {NULL, NULL},
+};
+
+LUALIB_API void luaL_openlibs(lua_State *L) {
+    for (const luaL_Reg *lib = LIBS; lib->func; lib++) {
+        lua_pushcfunction(L, lib->func);
+        lua_pushstring(L, lib->name);
+        lua_call(L, 1, 0);
+    }
+}
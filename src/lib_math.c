@@ -0,0 +1,121 @@
+
+// Mathematical functions library
+// Adapted from 'lmathlib.c' in the Lua source code
+
+#include <math.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "luaj.h"
+
+#undef PI
+#define PI (3.14159265358979323846)
+
+// Functions of a single number are registered as builtins: the interpreter
+// calls the 'fast' version directly when it's passed a number, and the C API
+// version handles everything else (string coercion and argument errors).
+#define UNARY(name, expr)                           \
+    static double fast_ ## name(double x) {         \
+        return (expr);                              \
+    }                                               \
+    static int math_ ## name(lua_State *L) {        \
+        double x = luaL_checknumber(L, 1);          \
+        lua_pushnumber(L, (expr));                  \
+        return 1;                                   \
+    }
+
+UNARY(abs, fabs(x))
+UNARY(sin, sin(x))
+UNARY(cos, cos(x))
+UNARY(tan, tan(x))
+UNARY(asin, asin(x))
+UNARY(acos, acos(x))
+UNARY(atan, atan(x))
+UNARY(ceil, ceil(x))
+UNARY(floor, floor(x))
+UNARY(sqrt, sqrt(x))
+UNARY(exp, exp(x))
+UNARY(log, log(x))
+UNARY(log10, log10(x))
+UNARY(deg, x / (PI / 180.0))
+UNARY(rad, x * (PI / 180.0))
+
+#undef UNARY
+
+static int math_atan2(lua_State *L) {
+    lua_pushnumber(L, atan2(luaL_checknumber(L, 1), luaL_checknumber(L, 2)));
+    return 1;
+}
+
+static int math_fmod(lua_State *L) {
+    lua_pushnumber(L, fmod(luaL_checknumber(L, 1), luaL_checknumber(L, 2)));
+    return 1;
+}
+
+static int math_pow(lua_State *L) {
+    lua_pushnumber(L, pow(luaL_checknumber(L, 1), luaL_checknumber(L, 2)));
+    return 1;
+}
+
+static int math_min(lua_State *L) {
+    int n = lua_gettop(L);
+    lua_Number min = luaL_checknumber(L, 1);
+    for (int i = 2; i <= n; i++) {
+        lua_Number d = luaL_checknumber(L, i);
+        if (d < min) {
+            min = d;
+        }
+    }
+    lua_pushnumber(L, min);
+    return 1;
+}
+
+static int math_max(lua_State *L) {
+    int n = lua_gettop(L);
+    lua_Number max = luaL_checknumber(L, 1);
+    for (int i = 2; i <= n; i++) {
+        lua_Number d = luaL_checknumber(L, i);
+        if (d > max) {
+            max = d;
+        }
+    }
+    lua_pushnumber(L, max);
+    return 1;
+}
+
+typedef struct {
+    const char *name;
+    lua_CFunction fn;
+    luaJ_Builtin fast;
+} Builtin;
+
+#define B(name) {#name, math_ ## name, fast_ ## name}
+
+static const Builtin MATH_FNS[] = {
+    B(abs), B(sin), B(cos), B(tan), B(asin), B(acos), B(atan), B(ceil),
+    B(floor), B(sqrt), B(exp), B(log), B(log10), B(deg), B(rad),
+    {"atan2", math_atan2, NULL},
+    {"fmod", math_fmod, NULL},
+    {"pow", math_pow, NULL},
+    {"min", math_min, NULL},
+    {"max", math_max, NULL},
+    {NULL, NULL, NULL},
+};
+
+#undef B
+
+LUALIB_API int luaopen_math(lua_State *L) {
+    lua_newtable(L);
+    for (const Builtin *b = MATH_FNS; b->name; b++) {
+        luaJ_pushbuiltin(L, b->fn, b->fast);
+        lua_setfield(L, -2, b->name);
+    }
+    lua_pushnumber(L, PI);
+    lua_setfield(L, -2, "pi");
+    lua_pushnumber(L, HUGE_VAL);
+    lua_setfield(L, -2, "huge");
+    lua_pushvalue(L, -1);
+    lua_setglobal(L, LUA_MATHLIBNAME);
+    return 1;
+}
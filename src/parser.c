@@ -6,6 +6,7 @@
 #include "parser.h"
 #include "lexer.h"
 #include "value.h"
+#include "table.h"
 
 // Used for 'BC_JMP' instructions that have been emitted but haven't had their
 // jump target set yet.
@@ -15,15 +16,38 @@ typedef struct BlockScope {
     struct BlockScope *outer;
     int first_local;
     int is_loop;
-    int breaks; // Jump-list for break statements
+    int breaks;   // Jump-list for break statements
+    int has_uclo; // Loops only: does a break skip a 'BC_UCLO'?
 } BlockScope;
 
+// Captured locals are only given a shared (open) upvalue if they're assigned
+// to after their definition. Read-only locals are copied into a closed upvalue
+// when the closure is created, and read-only locals initialised to a constant
+// are folded into the functions that capture them.
+typedef struct {
+    Str *name;
+    int first_k;  // 'fn->num_k' when defined; functions created later follow
+    int captured; // Used by a nested function?
+    int mutated;  // Assigned to after its definition?
+    int has_k;    // Initialised to the constant 'k'?
+    uint64_t k;
+} Local;
+
+typedef struct {
+    Str *name;
+    Local *local; // The local in an enclosing function that's captured
+} UpvalName;
+
 typedef struct FnScope {
     struct FnScope *outer;
     Fn *fn;
     int num_stack, num_locals;
-    Str *locals[LUAI_MAXVARS];
+    Local locals[LUAI_MAXVARS];
+    int num_upvals;
+    uint16_t upvals[LUAI_MAXUPVALUES]; // Descriptors (see 'UV_LOCAL')
+    UpvalName upval_names[LUAI_MAXUPVALUES];
     BlockScope *b;
+    Table *k_idx; // Maps each constant in 'fn->k' to its index
 } FnScope;
 
 typedef struct {
@@ -43,33 +67,379 @@ static int emit(Parser *p, BcIns ins, int line) {
     return fn_emit(p->L, p->f->fn, ins, line);
 }
 
+// Constants are shared between every instruction in a function that uses
+// them. Functions are never shared; neither are NaNs and -0, which can't be
+// table keys (or are the same key as 0).
+static int is_shared_k(uint64_t k) {
+    if (is_num(k)) {
+        double n = v2n(k);
+        return n == n && k != n2v(-0.0);
+    }
+    return !is_fn(k);
+}
+
+// Returns the index of 'k' in the constants table, or -1.
+static int find_k(Parser *p, uint64_t k) {
+    if (!is_shared_k(k)) {
+        return -1;
+    }
+    uint64_t idx = table_get(p->f->k_idx, k);
+    return is_nil(idx) ? -1 : (int) v2n(idx);
+}
+
 static int emit_k(Parser *p, uint64_t k) {
-    int idx = fn_emit_k(p->L, p->f->fn, k);
+    int idx = find_k(p, k);
+    if (idx >= 0) {
+        return idx;
+    }
+    idx = fn_emit_k(p->L, p->f->fn, k);
     if (idx > UINT16_MAX) {
         Token err;
         peek_tk(p->l, &err);
         ErrInfo info = tk2err(&err);
         err_syntax(p->L, &info, "too many constants in function");
     }
+    if (is_shared_k(k)) {
+        table_set(p->L, p->f->k_idx, k, n2v(idx));
+    }
     return idx;
 }
 
+// Emits 'op', an instruction with an 8-bit constant operand: 'B' for the 'NV'
+// arithmetic instructions, and 'C' otherwise. 'v' is its stack slot operand
+// and 'k' is the constant's index. If the index doesn't fit, the wide variant
+// of 'op' is emitted instead, followed by a 'BC_KX' holding the index (see
+// 'bytecode.h'). Returns the PC of the instruction.
+static int emit_k_op(Parser *p, uint8_t op, uint8_t a, uint8_t v, uint16_t k,
+                     int line) {
+    int nv = op == BC_SUBNV || op == BC_DIVNV || op == BC_MODNV;
+    if (k <= UINT8_MAX) {
+        return emit(p, nv ? ins3(op, a, k, v) : ins3(op, a, v, k), line);
+    }
+    int pc = emit(p, nv ? ins3(bc_wide(op), a, 0, v) :
+                          ins3(bc_wide(op), a, v, 0), line);
+    emit(p, ins1(BC_KX, k), line);
+    return pc;
+}
+
 static void enter_fn(Parser *p, FnScope *f, Str *name, int start_line) {
     *f = (FnScope) {0};
     f->outer = p->f;
     p->f = f;
     f->fn = fn_new(p->L, name, p->l->r->chunk_name);
     f->fn->start_line = start_line;
+    f->k_idx = table_new(p->L, 0, 0); // Not collected while parsing
+}
+
+// Returns the PC that a 'BC_JMP' at 'pc' jumps to.
+static int jmp_target(Fn *fn, int pc) {
+    return pc + (int) bc_e(fn->ins[pc]) - JMP_BIAS;
+}
+
+// Instructions that only store into their destination slots, and can be
+// removed if the value is never read.
+static int is_pure_write(uint8_t op) {
+    return op == BC_MOV || op == BC_KPRIM || op == BC_KINT || op == BC_KNUM ||
+        op == BC_KSTR || op == BC_KNIL;
+}
+
+// Updates 'dead' (the slots that are overwritten before they're next read) for
+// the instruction 'ins', going backwards. Returns 0 for instructions that
+// don't have a fixed set of operands (calls, returns, jumps, etc.), after
+// which nothing is known about any slot.
+static int update_dead(uint8_t *dead, BcIns ins) {
+    uint8_t op = bc_narrow(bc_op(ins)); // Wide constant operands are 0
+    uint8_t a = bc_a(ins);
+    if (op == BC_KNIL) {
+        memset(&dead[a], 1, bc_d(ins) - a + 1);
+    } else if (op == BC_MOV || op == BC_NEG || op == BC_NOT) {
+        dead[a] = 1;
+        dead[bc_d(ins)] = 0;
+    } else if (op == BC_KPRIM || op == BC_KINT || op == BC_KNUM ||
+               op == BC_KSTR || op == BC_KFN || op == BC_GGET ||
+               op == BC_UGET || op == BC_TNEW) {
+        dead[a] = 1;
+    } else if (op == BC_GSET || op == BC_USET) {
+        dead[a] = 0;
+    } else if ((op >= BC_ADDVV && op <= BC_POW) || op == BC_TGETV ||
+               op == BC_TGETS) {
+        dead[a] = 1;
+        dead[bc_b(ins)] = 0;
+        dead[bc_c(ins)] = 0; // Constant operands only make this conservative
+    } else if (op == BC_TSETV || op == BC_TSETS) {
+        dead[a] = dead[bc_b(ins)] = dead[bc_c(ins)] = 0;
+    } else {
+        return op == BC_NOP || op == BC_KX;
+    }
+    return 1;
+}
+
+// Removes NOPs, and 'BC_MOV's and constant loads into slots that are
+// overwritten before they're read, e.g. the extra 'BC_KPRIM' in 'a = nil; a =
+// 1'. Only looks within a basic block (between jumps and jump targets), and
+// treats calls and other instructions that read a range of slots as reading
+// every slot. Functions that create closures are skipped, since an upvalue
+// can see a stack slot from outside the block.
+static void remove_dead_writes(State *L, Fn *fn) {
+    for (int pc = 0; pc < fn->num_ins; pc++) {
+        if (bc_op(fn->ins[pc]) == BC_FNEW) {
+            return;
+        }
+    }
+    int *new_pc = mem_alloc(L, MEM_PARSER, sizeof(int) * (fn->num_ins + 1));
+    for (int pc = 0; pc <= fn->num_ins; pc++) {
+        new_pc[pc] = 0; // Jump target flag for now
+    }
+    for (int pc = 0; pc < fn->num_ins; pc++) {
+        if (bc_op(fn->ins[pc]) == BC_JMP) {
+            new_pc[jmp_target(fn, pc)] = 1;
+        }
+    }
+    uint8_t dead[UINT8_MAX + 1] = {0};
+    int removed = 0;
+    for (int pc = fn->num_ins - 1; pc >= 0; pc--) {
+        BcIns ins = fn->ins[pc];
+        uint8_t op = bc_op(ins);
+        int target = new_pc[pc];
+        new_pc[pc] = 0;
+        if (op == BC_NOP || (is_pure_write(op) && dead[bc_a(ins)] &&
+                (op != BC_KNIL || !memchr(&dead[bc_a(ins)], 0,
+                                          bc_d(ins) - bc_a(ins) + 1)))) {
+            new_pc[pc] = -1;
+            removed++;
+        } else if (!update_dead(dead, ins)) {
+            memset(dead, 0, sizeof(dead));
+        }
+        if (target) { // Start of a basic block
+            memset(dead, 0, sizeof(dead));
+        }
+    }
+    if (removed > 0) {
+        int n = 0;
+        for (int pc = 0; pc <= fn->num_ins; pc++) {
+            int keep = new_pc[pc] == 0;
+            new_pc[pc] = n; // Removed instructions map to the next one
+            n += keep;
+        }
+        for (int pc = 0; pc < fn->num_ins; pc++) {
+            if (new_pc[pc] == new_pc[pc + 1]) {
+                continue; // Removed
+            }
+            BcIns ins = fn->ins[pc];
+            if (bc_op(ins) == BC_JMP) {
+                int target = new_pc[jmp_target(fn, pc)];
+                bc_set_e(&ins, target - new_pc[pc] + JMP_BIAS);
+            }
+            fn->ins[new_pc[pc]] = ins;
+            fn->line_info[new_pc[pc]] = fn->line_info[pc];
+            fn->ic[new_pc[pc]] = fn->ic[pc];
+        }
+        fn->num_ins = new_pc[fn->num_ins];
+    }
+    mem_free(L, MEM_PARSER, new_pc, sizeof(int) * (fn->num_ins + removed + 1));
+}
+
+// Peephole pass that fuses conditional instructions with the 'BC_JMP' that
+// follows them (see 'bytecode.h'). Only forward jumps are fused, so that
+// backward jumps still go through 'BC_JMP' to count loop iterations.
+static void fuse_ins(Fn *fn) {
+    for (int pc = 0; pc + 1 < fn->num_ins; pc++) {
+        BcIns next = fn->ins[pc + 1];
+        if (bc_op(next) == BC_JMP && (int) bc_e(next) - JMP_BIAS >= 0) {
+            bc_set_op(&fn->ins[pc], bc_fuse(bc_op(fn->ins[pc])));
+        }
+    }
+}
+
+// The stack slots that are known to hold numbers at some point in a function,
+// as a bit set.
+typedef struct {
+    uint64_t bits[4];
+} NumSlots;
+
+static inline int is_num_slot(NumSlots *n, int slot) {
+    return (n->bits[slot >> 6] >> (slot & 63)) & 1;
+}
+
+static inline void set_num_slot(NumSlots *n, int slot, int is_num) {
+    uint64_t bit = (uint64_t) 1 << (slot & 63);
+    if (is_num) {
+        n->bits[slot >> 6] |= bit;
+    } else {
+        n->bits[slot >> 6] &= ~bit;
+    }
+}
+
+// Removes the slots from 'n' that aren't in 'other'. Returns 1 if 'n' changed.
+static int meet_num_slots(NumSlots *n, NumSlots *other) {
+    int changed = 0;
+    for (int i = 0; i < 4; i++) {
+        changed |= (n->bits[i] & ~other->bits[i]) != 0;
+        n->bits[i] &= other->bits[i];
+    }
+    return changed;
+}
+
+// Updates 'n' for the slots written by 'ins'. Instructions that aren't known
+// to leave the other slots alone forget everything. A call can change any
+// slot at or above its base, or any slot at all if the function creates
+// closures (which might assign to it through an open upvalue).
+static void update_num_slots(NumSlots *n, BcIns ins, int has_closures) {
+    uint8_t op = bc_narrow(bc_unfuse(bc_op(ins)));
+    uint8_t a = bc_a(ins);
+    if ((op >= BC_ADDVV && op <= BC_POW) || op == BC_NEG || op == BC_KINT ||
+            op == BC_KNUM || op == BC_FORLOOP || op == BC_FORLOOPI) {
+        set_num_slot(n, a, 1);
+    } else if (op == BC_MOV) {
+        set_num_slot(n, a, is_num_slot(n, bc_d(ins)));
+    } else if (op == BC_FORPREP || op == BC_FORPREPI) {
+        set_num_slot(n, a, 1);
+        set_num_slot(n, a + 1, 1);
+        set_num_slot(n, a + 2, op == BC_FORPREP); // Unused for 'FORPREPI'
+        set_num_slot(n, a + 3, 0); // Only set if the loop is entered
+    } else if (op == BC_KNIL) {
+        for (int slot = a; slot <= bc_d(ins); slot++) {
+            set_num_slot(n, slot, 0);
+        }
+    } else if (op == BC_CALL) {
+        for (int slot = has_closures ? 0 : a; slot <= UINT8_MAX; slot++) {
+            set_num_slot(n, slot, 0);
+        }
+    } else if (op == BC_KPRIM || op == BC_KSTR || op == BC_KFN ||
+               op == BC_FNEW || op == BC_GGET || op == BC_UGET ||
+               op == BC_TNEW || op == BC_TGETV || op == BC_TGETS ||
+               op == BC_NOT || op == BC_CONCAT || op == BC_ISTC ||
+               op == BC_ISFC) {
+        set_num_slot(n, a, 0);
+    } else if (!(op >= BC_IST && op <= BC_GEVN) && op != BC_JMP &&
+               op != BC_GSET && op != BC_USET && op != BC_TSETV &&
+               op != BC_TSETS && op != BC_UCLO && op != BC_NOP &&
+               op != BC_KX) {
+        *n = (NumSlots) {{0}};
+    }
+}
+
+// Returns 1 if every stack slot operand of an instruction that has a
+// specialised variant (see 'bc_num') is known to be a number.
+static int has_num_operands(NumSlots *n, BcIns ins) {
+    switch (bc_op(ins)) {
+    case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV:
+    case BC_MODVV: case BC_POW:
+        return is_num_slot(n, bc_b(ins)) && is_num_slot(n, bc_c(ins));
+    case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN: case BC_MODVN:
+        return is_num_slot(n, bc_b(ins));
+    case BC_SUBNV: case BC_DIVNV: case BC_MODNV:
+        return is_num_slot(n, bc_c(ins));
+    case BC_LTVV_JMP: case BC_LEVV_JMP: case BC_GTVV_JMP: case BC_GEVV_JMP:
+        return is_num_slot(n, bc_a(ins)) && is_num_slot(n, bc_d(ins));
+    case BC_LTVN_JMP: case BC_LEVN_JMP: case BC_GTVN_JMP: case BC_GEVN_JMP:
+        return is_num_slot(n, bc_a(ins));
+    default:
+        return 0;
+    }
 }
 
+// Runs through 'fn' once, working out the slots that are known to be numbers
+// before each instruction from 'in', the slots known at each jump target.
+// Jumps remove anything from their target's entry in 'in' that isn't known
+// when they're taken. Returns 1 if 'in' changed.
+static int propagate_num_slots(Fn *fn, int *targets, NumSlots *in,
+                               int has_closures, int specialise) {
+    NumSlots n = {{0}}; // Nothing is known about the arguments
+    int reachable = 1; // From the instruction before, rather than a jump
+    int changed = 0;
+    for (int pc = 0; pc < fn->num_ins; pc++) {
+        BcIns *ins = &fn->ins[pc];
+        if (targets[pc] >= 0) {
+            if (reachable) {
+                changed |= meet_num_slots(&in[targets[pc]], &n);
+            }
+            n = in[targets[pc]];
+            reachable = 1;
+        }
+        if (specialise && has_num_operands(&n, *ins)) {
+            bc_set_op(ins, bc_num(bc_op(*ins)));
+        }
+        update_num_slots(&n, *ins, has_closures);
+        uint8_t op = bc_op(*ins);
+        if (op == BC_JMP) {
+            // The 'for' instructions set the loop variable when they don't
+            // fall out of the loop, which is when 'FORLOOP's 'JMP' is taken,
+            // and when 'FORPREP's isn't
+            uint8_t prev = pc > 0 ? bc_unfuse(bc_op(ins[-1])) : BC_NOP;
+            int sets_var = pc > 0 && targets[pc] < 0;
+            NumSlots taken = n;
+            if (sets_var && (prev == BC_FORLOOP || prev == BC_FORLOOPI)) {
+                set_num_slot(&taken, bc_a(ins[-1]) + 3, 1);
+            }
+            changed |= meet_num_slots(&in[targets[jmp_target(fn, pc)]],
+                                      &taken);
+            if (sets_var && (prev == BC_FORPREP || prev == BC_FORPREPI)) {
+                set_num_slot(&n, bc_a(ins[-1]) + 3, 1);
+            }
+            reachable = (prev >= BC_IST && prev <= BC_GEVN) ||
+                (prev >= BC_FORPREP && prev <= BC_FORLOOPI);
+        } else if (op == BC_RET0 || op == BC_RET1 || op == BC_RET) {
+            reachable = 0;
+        }
+    }
+    return changed;
+}
+
+// Replaces arithmetic instructions and fused comparisons with variants that
+// don't check their operands' types, where every operand is known to be a
+// number (see 'bytecode.h'). Slots are tracked across the whole function:
+// what's known at a jump target is what's known on every path into it, which
+// is found by propagating through the function until nothing changes.
+static void specialise_num_ins(State *L, Fn *fn) {
+    int has_closures = 0;
+    int *targets = mem_alloc(L, MEM_PARSER, sizeof(int) * (fn->num_ins + 1));
+    for (int pc = 0; pc <= fn->num_ins; pc++) {
+        targets[pc] = -1;
+    }
+    int num_targets = 0;
+    for (int pc = 0; pc < fn->num_ins; pc++) {
+        uint8_t op = bc_op(fn->ins[pc]);
+        has_closures |= op == BC_FNEW;
+        if (op == BC_JMP && targets[jmp_target(fn, pc)] < 0) {
+            targets[jmp_target(fn, pc)] = num_targets++;
+        }
+    }
+    NumSlots *in = mem_alloc(L, MEM_PARSER, sizeof(NumSlots) * num_targets);
+    for (int i = 0; i < num_targets; i++) { // Shrinks down to a fixpoint
+        in[i] = (NumSlots) {{UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX}};
+    }
+    while (propagate_num_slots(fn, targets, in, has_closures, 0)) {}
+    propagate_num_slots(fn, targets, in, has_closures, 1);
+    mem_free(L, MEM_PARSER, in, sizeof(NumSlots) * num_targets);
+    mem_free(L, MEM_PARSER, targets, sizeof(int) * (fn->num_ins + 1));
+}
+
+// Forward declarations
+static int close_locals(Parser *p, int first_local);
+static void patch_jmps_here(Parser *p, int head);
+
 static void exit_fn(Parser *p, int end_line) {
     assert(p->f);
-    p->f->fn->end_line = end_line;
-    uint8_t last_op = bc_op(p->f->fn->ins[p->f->fn->num_ins - 1]);
+    FnScope *f = p->f;
+    f->fn->end_line = end_line;
+    uint8_t last_op = f->fn->num_ins > 0 ?
+        bc_op(f->fn->ins[f->fn->num_ins - 1]) : BC_NOP; // Empty chunk
     if (last_op != BC_RET0 && last_op != BC_RET1 && last_op != BC_RET) {
         emit(p, ins0(BC_RET0), end_line);
     }
-    p->f = p->f->outer;
+    remove_dead_writes(p->L, f->fn);
+    fuse_ins(f->fn);
+    specialise_num_ins(p->L, f->fn);
+    close_locals(p, 0); // Parameters; returns close their upvalues
+    if (f->num_upvals > 0) {
+        f->fn->upvals = mem_alloc(p->L, MEM_FN,
+                sizeof(uint16_t) * f->num_upvals);
+        memcpy(f->fn->upvals, f->upvals, sizeof(uint16_t) * f->num_upvals);
+        f->fn->num_upvals = f->num_upvals;
+    }
+    fn_finish(p->L, f->fn);
+    p->f = f->outer;
 }
 
 static void enter_block(Parser *p, BlockScope *b) {
@@ -87,9 +457,35 @@ static void enter_loop(Parser *p, BlockScope *b) {
 }
 
 static void exit_block(Parser *p) {
-    assert(p->f->b);
-    p->f->num_locals = p->f->num_stack = p->f->b->first_local;
-    p->f->b = p->f->b->outer;
+    BlockScope *b = p->f->b;
+    assert(b);
+    // Returns close the upvalues in the function's outermost block
+    if (close_locals(p, b->first_local) && b->outer) {
+        emit(p, ins2(BC_UCLO, 0, b->first_local), -1);
+        BlockScope *loop = b->outer;
+        while (loop && !loop->is_loop) {
+            loop = loop->outer;
+        }
+        if (loop) {
+            loop->has_uclo = 1;
+        }
+    }
+    p->f->num_locals = p->f->num_stack = b->first_local;
+    p->f->b = b->outer;
+}
+
+// Loops are exited after the jump back to the start of the loop, which is
+// where break statements land.
+static void exit_loop(Parser *p) {
+    BlockScope *loop = p->f->b;
+    assert(loop && loop->is_loop);
+    exit_block(p);
+    if (loop->has_uclo && loop->breaks != JMP_NONE) {
+        patch_jmps_here(p, loop->breaks); // Breaks skip the body's 'BC_UCLO'
+        emit(p, ins2(BC_UCLO, 0, loop->first_local), -1);
+    } else {
+        patch_jmps_here(p, loop->breaks);
+    }
 }
 
 static uint8_t reserve_slots(Parser *p, int n) {
@@ -101,13 +497,157 @@ static uint8_t reserve_slots(Parser *p, int n) {
     }
     uint8_t base = p->f->num_stack;
     p->f->num_stack += n;
+    if (p->f->num_stack > p->f->fn->max_stack) {
+        p->f->fn->max_stack = p->f->num_stack; // Frame size for 'BC_CALL'
+    }
     return base;
 }
 
-static void def_local(Parser *p, Str *name) {
-    p->f->locals[p->f->num_locals++] = name;
+static Local * def_local(Parser *p, Str *name) {
+    Local *l = &p->f->locals[p->f->num_locals++];
+    *l = (Local) {0};
+    l->name = name;
+    l->first_k = p->f->fn->num_k;
+    return l;
+}
+
+
+// ---- Upvalues ----
+
+// When a captured local goes out of scope, we know whether it was assigned to
+// after its definition. If it wasn't, the functions that capture it don't need
+// an open upvalue (see 'Local').
+
+// Loads the function in 'parent->k[k]' with 'BC_KFN' instead of 'BC_FNEW', if
+// all its upvalues were folded away.
+static void patch_fnew(Fn *parent, int k) {
+    Fn *child = v2fn(parent->k[k]);
+    for (int i = 0; i < child->num_upvals; i++) {
+        if (child->upvals[i] != UV_NONE) {
+            return;
+        }
+    }
+    for (int pc = 0; pc < parent->num_ins; pc++) {
+        BcIns *ins = &parent->ins[pc];
+        if (bc_op(*ins) == BC_FNEW && bc_d(*ins) == k) {
+            bc_set_op(ins, BC_KFN);
+        }
+    }
+}
+
+// Constants that can't be loaded with 'BC_KPRIM' or 'BC_KINT' have to go in
+// the constants table of each function that reads them.
+static int needs_k(uint64_t k) {
+    return is_str(k) || (is_num(k) && v2n(k) != (int16_t) v2n(k));
 }
 
+// Returns the index of 'k' in the constants table of a function that's
+// already been parsed (so its 'FnScope' is gone), or -1.
+static int find_fn_k(Fn *f, uint64_t k) {
+    for (int i = 0; i < f->num_k; i++) {
+        if (f->k[i] == k) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Checks that 'fold_upval' has room to add 'k' to the constants tables of
+// 'child' and the functions nested in it that also capture 'uv'.
+static int can_fold_upval(Fn *child, int uv, uint64_t k) {
+    if (needs_k(k) && child->num_k > UINT16_MAX) {
+        return 0;
+    }
+    for (int i = 0; i < child->num_k; i++) {
+        if (!is_fn(child->k[i])) {
+            continue;
+        }
+        Fn *f = v2fn(child->k[i]);
+        for (int j = 0; j < f->num_upvals; j++) {
+            if (f->upvals[j] == uv && !can_fold_upval(f, j, k)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Replaces each 'BC_UGET' for 'uv' in 'child' (and the functions nested in it
+// that also capture 'uv') with a load of the constant 'k'.
+static void fold_upval(State *L, Fn *child, int uv, uint64_t k) {
+    int idx = -1;
+    for (int pc = 0; pc < child->num_ins; pc++) {
+        BcIns *ins = &child->ins[pc];
+        if (bc_op(*ins) != BC_UGET || bc_d(*ins) != uv) {
+            continue;
+        }
+        uint8_t a = bc_a(*ins);
+        if (needs_k(k)) {
+            if (idx < 0) {
+                idx = find_fn_k(child, k);
+            }
+            if (idx < 0) {
+                idx = fn_emit_k(L, child, k);
+            }
+            *ins = ins2(is_str(k) ? BC_KSTR : BC_KNUM, a, (uint16_t) idx);
+        } else if (is_num(k)) {
+            *ins = ins2(BC_KINT, a, (uint16_t) (int16_t) v2n(k));
+        } else {
+            *ins = ins2(BC_KPRIM, a, (uint16_t) (k & ~TAG_PRIM));
+        }
+    }
+    for (int i = 0; i < child->num_k; i++) {
+        if (!is_fn(child->k[i])) {
+            continue;
+        }
+        Fn *f = v2fn(child->k[i]);
+        for (int j = 0; j < f->num_upvals; j++) {
+            if (f->upvals[j] == uv) {
+                fold_upval(L, f, j, k);
+                f->upvals[j] = UV_NONE;
+            }
+        }
+        patch_fnew(child, i);
+    }
+}
+
+// Decides how the functions that capture the locals from 'first_local'
+// onwards (which are going out of scope) get their upvalues. Returns 1 if any
+// of them need to be closed with 'BC_UCLO'.
+static int close_locals(Parser *p, int first_local) {
+    Fn *fn = p->f->fn;
+    int needs_uclo = 0;
+    for (int slot = first_local; slot < p->f->num_locals; slot++) {
+        Local *l = &p->f->locals[slot];
+        if (!l->captured) {
+            continue;
+        } else if (l->mutated) {
+            needs_uclo = 1; // Shares an open upvalue
+            continue;
+        }
+        for (int i = l->first_k; i < fn->num_k; i++) {
+            if (!is_fn(fn->k[i])) {
+                continue;
+            }
+            Fn *child = v2fn(fn->k[i]);
+            for (int j = 0; j < child->num_upvals; j++) {
+                if (child->upvals[j] != (UV_LOCAL | slot)) {
+                    continue;
+                }
+                if (l->has_k && can_fold_upval(child, j, l->k)) {
+                    fold_upval(p->L, child, j, l->k);
+                    child->upvals[j] = UV_NONE;
+                } else {
+                    child->upvals[j] |= UV_VALUE;
+                }
+            }
+            patch_fnew(fn, i);
+        }
+    }
+    return needs_uclo;
+}
+
+
 
 // ---- Expressions ----
 
@@ -130,6 +670,9 @@ enum {
     EXPR_NUM,
     EXPR_STR,
     EXPR_LOCAL,
+    EXPR_UPVAL,
+    EXPR_INDEX,     // A table index that hasn't been loaded or stored yet
+    EXPR_GLOBAL,    // A global variable that hasn't been loaded or stored yet
     EXPR_CALL,
     EXPR_NON_RELOC, // An expression result in a fixed stack slot
     EXPR_RELOC,     // An instruction without an assigned stack slot
@@ -144,7 +687,14 @@ typedef struct {
         double num;   // EXPR_NUM
         Str *s;       // EXPR_STR
         uint8_t slot; // EXPR_LOCAL, EXPR_NON_RELOC
+        uint8_t uv;   // EXPR_UPVAL
         int pc;       // EXPR_RELOC, EXPR_JMP, EXPR_CALL
+        uint16_t k;   // EXPR_GLOBAL: constant index of the name
+        struct {      // EXPR_INDEX
+            uint8_t t;     // Stack slot of the table
+            uint16_t k;    // Stack slot of the key, or constant string index
+            uint8_t k_str; // Is the key a constant string?
+        } idx;
     };
     int true_list, false_list;
 } Expr;
@@ -186,49 +736,49 @@ enum {
     X(TK_OR,     PREC_OR,     BC_NOP,    0, 0) \
     X(TK_CONCAT, PREC_CONCAT, BC_CONCAT, 0, 1)
 
-static int BINOP_PREC[TK_LAST] = {
+static const int BINOP_PREC[TK_LAST] = {
 #define X(tk, prec, _, __, ___) [tk] = prec,
     BINOPS
 #undef X
 };
 
-static int UNOP_PREC[TK_LAST] = {
+static const int UNOP_PREC[TK_LAST] = {
 #define X(tk, _) [tk] = PREC_UNARY,
     UNOPS
 #undef X
 };
 
-static int IS_COMMUTATIVE[TK_LAST] = {
+static const int IS_COMMUTATIVE[TK_LAST] = {
 #define X(tk, _, __, is_comm, ___) [tk] = is_comm,
     BINOPS
 #undef X
 };
 
-static int IS_RASSOC[TK_LAST] = {
+static const int IS_RASSOC[TK_LAST] = {
 #define X(tk, _, __, ___, rassoc) [tk] = rassoc,
     BINOPS
 #undef X
 };
 
-static uint8_t UNOP_BC[TK_LAST] = {
+static const uint8_t UNOP_BC[TK_LAST] = {
 #define X(tk, op) [tk] = op,
     UNOPS
 #undef X
 };
 
-static uint8_t BINOP_BC[TK_LAST] = {
+static const uint8_t BINOP_BC[TK_LAST] = {
 #define X(tk, _, op, __, ___) [tk] = op,
     BINOPS
 #undef X
 };
 
-static int INVERT_TK[TK_LAST] = {
+static const int INVERT_TK[TK_LAST] = {
     [TK_EQ] = TK_NEQ, [TK_NEQ] = TK_EQ,
     ['<'] = TK_GE, [TK_LE] = '>',
     ['>'] = TK_LE, [TK_GE] = '<',
 };
 
-static int INVERT_OP[BC_LAST] = {
+static const int INVERT_OP[BC_LAST] = {
     [BC_IST] = BC_ISF,    [BC_ISTC] = BC_ISFC,
     [BC_ISF] = BC_IST,    [BC_ISFC] = BC_ISTC,
     [BC_EQVV] = BC_NEQVV, [BC_EQVN] = BC_NEQVN,
@@ -400,11 +950,50 @@ static int jmps_need_fall_through(Parser *p, int head) {
     return 0;
 }
 
+// When calling this function, we know we won't be using 'slot' again. If it's
+// a temporary at the top of the stack, we can re-use it.
+static void free_slot(Parser *p, uint8_t slot) {
+    if (slot >= p->f->num_locals) {
+        p->f->num_stack--;
+        assert(slot == p->f->num_stack); // Make sure we freed the stack top
+    }
+}
+
+static void free_index_slots(Parser *p, Expr *e) {
+    assert(e->t == EXPR_INDEX);
+    if (!e->idx.k_str) {
+        free_slot(p, e->idx.k); // Key is above the table
+    }
+    free_slot(p, e->idx.t);
+}
+
 static void discharge(Parser *p, Expr *e) {
     switch (e->t) {
     case EXPR_LOCAL:
         e->t = EXPR_NON_RELOC;
         break;
+    case EXPR_INDEX: {
+        free_index_slots(p, e);
+        int pc;
+        if (e->idx.k_str) {
+            pc = emit_k_op(p, BC_TGETS, NO_SLOT, e->idx.t, e->idx.k,
+                           e->tk.line);
+        } else {
+            pc = emit(p, ins3(BC_TGETV, NO_SLOT, e->idx.t, e->idx.k),
+                      e->tk.line);
+        }
+        e->t = EXPR_RELOC;
+        e->pc = pc;
+        break;
+    }
+    case EXPR_UPVAL:
+        e->t = EXPR_RELOC;
+        e->pc = emit(p, ins2(BC_UGET, NO_SLOT, e->uv), e->tk.line);
+        break;
+    case EXPR_GLOBAL:
+        e->t = EXPR_RELOC;
+        e->pc = emit(p, ins2(BC_GGET, NO_SLOT, e->k), e->tk.line);
+        break;
     case EXPR_CALL:
         e->t = EXPR_NON_RELOC;
         e->slot = bc_a(p->f->fn->ins[e->pc]); // Base return slot
@@ -428,7 +1017,7 @@ static void to_slot(Parser *p, Expr *e, uint8_t dst) {
         emit(p, ins2(BC_KPRIM, dst, e->tag), e->tk.line);
         break;
     case EXPR_NUM:
-        if (is_int(e->num, &i) && i <= UINT16_MAX) {
+        if (is_int(e->num, &i) && i >= INT16_MIN && i <= INT16_MAX) {
             emit(p, ins2(BC_KINT, dst, (uint16_t) i), e->tk.line);
         } else {
             idx = emit_k(p, n2v(e->num));
@@ -474,9 +1063,8 @@ static void to_slot(Parser *p, Expr *e, uint8_t dst) {
 // When calling this function, we know we won't be using 'e's stack slot again.
 // If 'e' is at the top of the stack, we can re-use it.
 static void free_expr_slot(Parser *p, Expr *e) {
-    if (e->t == EXPR_NON_RELOC && e->slot >= p->f->num_locals) {
-        p->f->num_stack--;
-        assert(e->slot == p->f->num_stack); // Make sure we freed the stack top
+    if (e->t == EXPR_NON_RELOC) {
+        free_slot(p, e->slot);
     }
 }
 
@@ -503,14 +1091,6 @@ static uint8_t to_any_slot(Parser *p, Expr *e) {
     return to_next_slot(p, e);
 }
 
-static uint8_t inline_uint8_num(Parser *p, Expr *e) {
-    if (is_num_expr(e) && p->f->fn->num_k <= UINT8_MAX) {
-        return (uint8_t) emit_k(p, n2v(e->num));
-    } else {
-        return to_any_slot(p, e);
-    }
-}
-
 static uint16_t inline_uint16_num(Parser *p, Expr *e) {
     if (is_num_expr(e)) {
         int idx = emit_k(p, n2v(e->num));
@@ -699,13 +1279,13 @@ static void emit_arith(Parser *p, Token *op, Expr *l, Expr r) {
     if (IS_COMMUTATIVE[op->t] && ll->t != EXPR_NON_RELOC) {
         ll = &r, rr = l; // Constant on the right
     }
-    uint8_t b, c;
+    uint16_t b, c;
     if (op->t == '^') {
         c = to_any_slot(p, rr);
         b = to_any_slot(p, ll);
     } else {
-        c = inline_uint8_num(p, rr);
-        b = inline_uint8_num(p, ll);
+        c = inline_uint16_num(p, rr);
+        b = inline_uint16_num(p, ll);
     }
     if (b > c) { // Free top slot first
         free_expr_slot(p, ll);
@@ -715,8 +1295,16 @@ static void emit_arith(Parser *p, Token *op, Expr *l, Expr r) {
         free_expr_slot(p, ll);
     }
     int bc = BINOP_BC[op->t] + (rr->t == EXPR_NUM) + (ll->t == EXPR_NUM) * 2;
+    int pc;
+    if (rr->t == EXPR_NUM) {
+        pc = emit_k_op(p, bc, NO_SLOT, b, c, op->line);
+    } else if (ll->t == EXPR_NUM) {
+        pc = emit_k_op(p, bc, NO_SLOT, c, b, op->line);
+    } else {
+        pc = emit(p, ins3(bc, NO_SLOT, b, c), op->line);
+    }
     expr_new(l, EXPR_RELOC, *op);
-    l->pc = emit(p, ins3(bc, NO_SLOT, b, c), op->line);
+    l->pc = pc;
 }
 
 static int fold_eq(Token *op, Expr *l, Expr r) {
@@ -826,10 +1414,11 @@ static int fold_concat(Parser *p, Token *op, Expr *l, Expr r) {
     if (!is_str_expr(l) || !is_str_expr(&r)) {
         return 0;
     }
-    Str *s = str_new(p->L, (l->s->len + r.s->len) * sizeof(char));
-    char *concat = str_val(s);
-    strncpy(concat, str_val(l->s), l->s->len);
-    strncpy(&concat[l->s->len], str_val(r.s), r.s->len);
+    size_t len = l->s->len + r.s->len;
+    char *concat = buf_reserve(p->L, sizeof(char) * len);
+    memcpy(concat, str_val(l->s), l->s->len);
+    memcpy(&concat[l->s->len], str_val(r.s), r.s->len);
+    Str *s = str_new(p->L, concat, len);
     expr_new(l, EXPR_STR, *op);
     l->s = s;
     return 1;
@@ -875,21 +1464,124 @@ static void emit_binop(Parser *p, Token *op, Expr *l, Expr r) {
     }
 }
 
+static int find_local(FnScope *f, Str *name) {
+    for (int i = f->num_locals - 1; i >= 0; i--) { // In reverse
+        if (str_eq(name, f->locals[i].name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the index of the upvalue for 'name' in 'f', adding it if 'name' is
+// a local or upvalue in an enclosing function. Returns -1 for globals.
+static int find_upval(Parser *p, FnScope *f, Token *name) {
+    for (int i = 0; i < f->num_upvals; i++) {
+        if (str_eq(name->s, f->upval_names[i].name)) {
+            return i;
+        }
+    }
+    if (!f->outer) {
+        return -1;
+    }
+    uint16_t uv;
+    Local *l;
+    int slot = find_local(f->outer, name->s);
+    if (slot >= 0) {
+        l = &f->outer->locals[slot];
+        l->captured = 1;
+        uv = UV_LOCAL | slot;
+    } else {
+        int idx = find_upval(p, f->outer, name);
+        if (idx < 0) {
+            return -1;
+        }
+        l = f->outer->upval_names[idx].local;
+        uv = (uint16_t) idx;
+    }
+    if (f->num_upvals >= LUAI_MAXUPVALUES) {
+        ErrInfo info = tk2err(name);
+        err_syntax(p->L, &info, "too many upvalues in function");
+    }
+    f->upvals[f->num_upvals] = uv;
+    f->upval_names[f->num_upvals] = (UpvalName) {name->s, l};
+    return f->num_upvals++;
+}
+
 static void find_var(Parser *p, Expr *e, Token *name) {
-    for (int i = p->f->num_locals - 1; i >= 0; i--) { // In reverse
-        Str *l = p->f->locals[i];
-        if (name->s->len == l->len &&
-                strncmp(str_val(name->s), str_val(l), l->len) == 0) {
-            expr_new(e, EXPR_LOCAL, *name);
-            e->slot = i;
-            return;
+    int slot = find_local(p->f, name->s);
+    if (slot >= 0) {
+        expr_new(e, EXPR_LOCAL, *name);
+        e->slot = slot;
+        return;
+    }
+    int uv = find_upval(p, p->f, name);
+    if (uv >= 0) {
+        expr_new(e, EXPR_UPVAL, *name);
+        e->uv = uv;
+        return;
+    }
+    expr_new(e, EXPR_GLOBAL, *name);
+    e->k = emit_k(p, str2v(name->s));
+}
+
+// Records an assignment to the local or upvalue 'var', which means it has to
+// be captured by reference (see 'Local').
+static void mark_mutated(Parser *p, Expr *var) {
+    if (var->t == EXPR_LOCAL) {
+        p->f->locals[var->slot].mutated = 1;
+    } else if (var->t == EXPR_UPVAL) {
+        p->f->upval_names[var->uv].local->mutated = 1;
+    }
+}
+
+// Turns 'l' into an index expression for the table in stack slot 't' with the
+// key 'k'. Constant string keys are kept in the constants table if possible.
+static void index_expr(Parser *p, Expr *l, uint8_t t, Expr *k, Token tk) {
+    Expr e;
+    expr_new(&e, EXPR_INDEX, tk);
+    e.idx.t = t;
+    if (is_str_expr(k)) {
+        e.idx.k = emit_k(p, str2v(k->s));
+        e.idx.k_str = 1;
+    } else {
+        e.idx.k = to_any_slot(p, k);
+        e.idx.k_str = 0;
+    }
+    *l = e;
+}
+
+// Stores 'r' into the variable 'var' (a local, upvalue, global, or table
+// index).
+static void emit_store(Parser *p, Expr *var, Expr *r) {
+    mark_mutated(p, var);
+    if (var->t == EXPR_LOCAL) {
+        discharge(p, r);
+        free_expr_slot(p, r);
+        to_slot(p, r, var->slot);
+    } else if (var->t == EXPR_UPVAL) {
+        uint8_t v = to_any_slot(p, r);
+        free_expr_slot(p, r);
+        emit(p, ins2(BC_USET, v, var->uv), var->tk.line);
+    } else if (var->t == EXPR_GLOBAL) {
+        uint8_t v = to_any_slot(p, r);
+        free_expr_slot(p, r);
+        emit(p, ins2(BC_GSET, v, var->k), var->tk.line);
+    } else {
+        assert(var->t == EXPR_INDEX);
+        uint8_t v = to_any_slot(p, r);
+        free_expr_slot(p, r);
+        if (var->idx.k_str) {
+            emit_k_op(p, BC_TSETS, v, var->idx.t, var->idx.k, var->tk.line);
+        } else {
+            emit(p, ins3(BC_TSETV, v, var->idx.t, var->idx.k), var->tk.line);
         }
     }
-    assert(0); // TODO: upvalues and globals
 }
 
 // Forward declarations
 static void parse_block(Parser *p);
+static void parse_expr(Parser *p, Expr *e);
 static int parse_expr_list(Parser *p, Expr *e);
 static void parse_subexpr(Parser *p, Expr *l, int min_prec);
 
@@ -922,7 +1614,60 @@ static void parse_fn_body(Parser *p, Expr *l, Token *fn_tk, Str *fn_name) {
     exit_fn(p, end_tk.line);
     uint16_t idx = emit_k(p, fn2v(f.fn));
     expr_new(l, EXPR_RELOC, *fn_tk);
-    l->pc = emit(p, ins2(BC_KFN, NO_SLOT, idx), fn_tk->line);
+    uint8_t op = f.num_upvals > 0 ? BC_FNEW : BC_KFN;
+    l->pc = emit(p, ins2(op, NO_SLOT, idx), fn_tk->line);
+}
+
+static void parse_field(Parser *p, uint8_t t, int *num_arr, int *num_hash) {
+    Token tk;
+    Expr k;
+    if (peek_tk(p->l, &tk) == TK_IDENT && peek_tk2(p->l, NULL) == '=') {
+        read_tk(p->l, NULL); // 'name = value'
+        read_tk(p->l, NULL);
+        expr_new(&k, EXPR_STR, tk);
+        k.s = tk.s;
+        (*num_hash)++;
+    } else if (tk.t == '[') { // '[key] = value'
+        read_tk(p->l, NULL);
+        parse_expr(p, &k);
+        expect_tk(p->l, ']', NULL);
+        expect_tk(p->l, '=', NULL);
+        (*num_hash)++;
+    } else { // 'value'
+        // TODO: expand multiple return values from a call in the last field
+        expr_new(&k, EXPR_NUM, tk);
+        k.num = ++(*num_arr);
+    }
+    Expr var;
+    index_expr(p, &var, t, &k, tk);
+    Expr v;
+    parse_expr(p, &v);
+    emit_store(p, &var, &v);
+    if (!var.idx.k_str) {
+        free_slot(p, var.idx.k);
+    }
+}
+
+static void parse_table(Parser *p, Expr *l) {
+    Token tk;
+    expect_tk(p->l, '{', &tk);
+    uint8_t t = reserve_slots(p, 1);
+    int pc = emit(p, ins3(BC_TNEW, t, 0, 0), tk.line);
+    int num_arr = 0, num_hash = 0;
+    while (peek_tk(p->l, NULL) != '}') {
+        parse_field(p, t, &num_arr, &num_hash);
+        int sep = peek_tk(p->l, NULL);
+        if (sep != ',' && sep != ';') {
+            break;
+        }
+        read_tk(p->l, NULL);
+    }
+    expect_tk(p->l, '}', NULL);
+    BcIns *tnew = &p->f->fn->ins[pc]; // Pre-allocate space for the fields
+    bc_set_b(tnew, num_arr < UINT8_MAX ? num_arr : UINT8_MAX);
+    bc_set_c(tnew, num_hash < UINT8_MAX ? num_hash : UINT8_MAX);
+    expr_new(l, EXPR_NON_RELOC, tk);
+    l->slot = t;
 }
 
 static void parse_primary_expr(Parser *p, Expr *l) {
@@ -944,13 +1689,13 @@ static void parse_primary_expr(Parser *p, Expr *l) {
     }
 }
 
-static void parse_call_expr(Parser *p, Expr *l) {
-    uint8_t base = to_next_slot(p, l);
+// Parses the arguments to a call to the function in 'base'. The first
+// 'num_args' arguments have already been put on the stack.
+static void parse_args(Parser *p, Expr *l, uint8_t base, int num_args) {
     Token call;
     expect_tk(p->l, '(', &call);
-    int num_args = 0;
     if (peek_tk(p->l, NULL) != ')') {
-        num_args = parse_expr_list(p, l);
+        num_args += parse_expr_list(p, l);
         to_next_slot(p, l); // Contiguous slots for arguments
     }
     expect_tk(p->l, ')', NULL);
@@ -961,11 +1706,53 @@ static void parse_call_expr(Parser *p, Expr *l) {
     p->f->num_stack = base + 1;
 }
 
+static void parse_call_expr(Parser *p, Expr *l) {
+    uint8_t base = to_next_slot(p, l);
+    parse_args(p, l, base, 0);
+}
+
+// 'obj:name(...)' calls 'obj.name' with 'obj' as the first argument.
+static void parse_method_call(Parser *p, Expr *l) {
+    expect_tk(p->l, ':', NULL);
+    Token name;
+    expect_tk(p->l, TK_IDENT, &name);
+    uint8_t obj = to_any_slot(p, l);
+    free_expr_slot(p, l);
+    uint8_t base = reserve_slots(p, 2);
+    emit(p, ins2(BC_MOV, base + 1, obj), name.line); // 'obj' may be 'base'
+    uint16_t k = emit_k(p, str2v(name.s));
+    emit_k_op(p, BC_TGETS, base, base + 1, k, name.line);
+    parse_args(p, l, base, 1);
+}
+
+// 'l.name' or 'l[key]'
+static void parse_index(Parser *p, Expr *l) {
+    Token tk;
+    uint8_t t = to_any_slot(p, l); // Table goes in a slot before the key
+    Expr k;
+    if (read_tk(p->l, &tk) == '.') {
+        Token name;
+        expect_tk(p->l, TK_IDENT, &name);
+        expr_new(&k, EXPR_STR, name);
+        k.s = name.s;
+    } else {
+        parse_expr(p, &k);
+        expect_tk(p->l, ']', NULL);
+    }
+    index_expr(p, l, t, &k, tk);
+}
+
 static int parse_suffix(Parser *p, Expr *l) {
     switch (peek_tk(p->l, NULL)) {
     case '(': // Function call
         parse_call_expr(p, l);
         return 1;
+    case ':': // Method call
+        parse_method_call(p, l);
+        return 1;
+    case '.': case '[': // Table index
+        parse_index(p, l);
+        return 1;
     }
     return 0;
 }
@@ -1006,6 +1793,9 @@ static void parse_operand(Parser *p, Expr *l) {
         read_tk(p->l, NULL); // Skip 'function'
         parse_fn_body(p, l, &tk, NULL);
         return;
+    case '{':
+        parse_table(p, l);
+        return;
     default:
         parse_suffixed_expr(p, l);
         return;
@@ -1072,10 +1862,11 @@ static void parse_local_fn(Parser *p) {
     expect_tk(p->l, TK_FUNCTION, &fn_tk);
     Token name;
     expect_tk(p->l, TK_IDENT, &name);
-    def_local(p, name.s); // Def before body to allow recursion
-    Expr l;
-    parse_fn_body(p, &l, &fn_tk, name.s);
-    to_next_slot(p, &l);
+    Local *l = def_local(p, name.s); // Def before body to allow recursion
+    l->mutated = 1; // Assigned after the closure captures it
+    Expr e;
+    parse_fn_body(p, &e, &fn_tk, name.s);
+    to_next_slot(p, &e);
 }
 
 static void emit_knil(Parser *p, uint8_t base, int n, int line) {
@@ -1135,10 +1926,20 @@ static void parse_local_var(Parser *p) {
     expect_tk(p->l, '=', &assign);
     Expr r;
     int num_exprs = parse_expr_list(p, &r);
+    Expr k = r; // Before it's discharged
+    adjust_assign(p, num_vars, num_exprs, &r, assign.line);
     for (int i = 0; i < num_vars; i++) {
         def_local(p, names[i]);
     }
-    adjust_assign(p, num_vars, num_exprs, &r, assign.line);
+    if (num_vars == 1 && num_exprs == 1 && is_const_expr(&k)) {
+        Local *l = &p->f->locals[p->f->num_locals - 1];
+        l->has_k = 1;
+        switch (k.t) {
+            case EXPR_PRIM: l->k = prim2v(k.tag); break;
+            case EXPR_NUM:  l->k = n2v(k.num); break;
+            case EXPR_STR:  l->k = str2v(k.s); break;
+        }
+    }
     p->f->num_stack = p->f->num_locals; // Drop extra expressions
 }
 
@@ -1151,8 +1952,42 @@ static void parse_local(Parser *p) {
     }
 }
 
-static int parse_assign_lhs(Parser *p, Expr *l, Expr *vars) {
+static int is_var_expr(Expr *e) {
+    return e->t == EXPR_LOCAL || e->t == EXPR_UPVAL || e->t == EXPR_INDEX ||
+        e->t == EXPR_GLOBAL;
+}
+
+// The variables in an assignment are stored to in reverse order, so a table or
+// key in a local that's assigned by the same statement must be copied first,
+// e.g. 'i' in 't[i], i = 1, 2'. Otherwise 't[i]' would see the new value.
+static void check_conflict(Parser *p, Expr *vars, int num_vars, Expr *l) {
     if (l->t != EXPR_LOCAL) {
+        return;
+    }
+    int conflict = 0;
+    uint8_t copy = p->f->num_stack;
+    for (int i = 0; i < num_vars; i++) {
+        Expr *var = &vars[i];
+        if (var->t != EXPR_INDEX) {
+            continue;
+        }
+        if (var->idx.t == l->slot) {
+            conflict = 1;
+            var->idx.t = copy;
+        }
+        if (!var->idx.k_str && var->idx.k == l->slot) {
+            conflict = 1;
+            var->idx.k = copy;
+        }
+    }
+    if (conflict) {
+        reserve_slots(p, 1);
+        emit(p, ins2(BC_MOV, copy, l->slot), l->tk.line);
+    }
+}
+
+static int parse_assign_lhs(Parser *p, Expr *l, Expr *vars) {
+    if (!is_var_expr(l)) {
         ErrInfo info = tk2err(&l->tk);
         err_syntax(p->L, &info, "unexpected symbol");
     }
@@ -1167,45 +2002,83 @@ static int parse_assign_lhs(Parser *p, Expr *l, Expr *vars) {
             err_syntax(p->L, &info, "too many variables in assignment");
         }
         parse_suffixed_expr(p, l);
-        if (l->t != EXPR_LOCAL) {
+        if (!is_var_expr(l)) {
             ErrInfo info = tk2err(&l->tk);
             err_syntax(p->L, &info, "expected variable in assignment");
         }
+        check_conflict(p, vars, num_vars, l);
         vars[num_vars++] = *l;
     }
     return num_vars;
 }
 
+// Sets the value for the 'i'th variable in an assignment, or evaluates 'e' for
+// its side effects if there are more expressions than variables. Constants
+// aren't loaded until they're stored.
+static void assign_val(Parser *p, Expr *vals, int num_vars, int i, Expr *e) {
+    if (is_const_expr(e)) {
+        if (i < num_vars) {
+            vals[i] = *e;
+        }
+    } else if (i < num_vars) {
+        vals[i] = *e;
+        to_next_slot(p, &vals[i]);
+    } else {
+        to_next_slot(p, e); // Might have side effects (e.g., a call)
+        free_expr_slot(p, e);
+    }
+}
+
+// Every expression has to be evaluated before any of the variables are
+// assigned, so values generally go through temporary slots. Constants are
+// stored directly into their variables instead (e.g., a single 'BC_KINT' for a
+// local), as is the last expression if there's one for every variable.
 static void parse_assign(Parser *p, Expr *l) {
     Expr vars[LUAI_MAXVARS];
     int num_vars = parse_assign_lhs(p, l, vars);
     Token assign;
     expect_tk(p->l, '=', &assign);
+    Expr vals[LUAI_MAXVARS];
+    int num_exprs = 1;
     Expr r;
-    int num_exprs = parse_expr_list(p, &r);
-    if (num_vars == num_exprs) {
-        // Put last expression directly into the last variable
-        Expr *last_var = &vars[num_vars - 1];
-        discharge(p, &r);
-        free_expr_slot(p, &r);
-        to_slot(p, &r, last_var->slot);
-        num_exprs--;
-        num_vars--;
+    parse_expr(p, &r);
+    while (peek_tk(p->l, NULL) == ',') {
+        read_tk(p->l, NULL);
+        assign_val(p, vals, num_vars, num_exprs - 1, &r);
+        parse_expr(p, &r);
+        num_exprs++;
+    }
+    int num_vals = num_vars;
+    if (num_exprs == num_vars) { // Put last expression directly into its var
+        emit_store(p, &vars[num_vars - 1], &r);
+        num_vals--;
+    } else if (r.t == EXPR_CALL) {
+        int extra = num_vars - num_exprs;
+        bc_set_c(&p->f->fn->ins[r.pc], extra < 0 ? 0 : extra + 1);
+        if (extra > 0) {
+            uint8_t base = bc_a(p->f->fn->ins[r.pc]);
+            reserve_slots(p, extra);
+            for (int i = num_exprs - 1; i < num_vars; i++) {
+                expr_new(&vals[i], EXPR_NON_RELOC, r.tk);
+                vals[i].slot = base + i - (num_exprs - 1);
+            }
+        } else if (extra < 0) {
+            p->f->num_stack--; // Return value is discarded
+        }
     } else {
-        adjust_assign(p, num_vars, num_exprs, &r, assign.line);
-        if (num_exprs < num_vars) {
-            num_exprs = num_vars; // 'nil' is emitted for the missing vars
+        assign_val(p, vals, num_vars, num_exprs - 1, &r);
+        for (int i = num_exprs; i < num_vars; i++) { // Set extra vars to nil
+            expr_new(&vals[i], EXPR_PRIM, assign);
+            vals[i].tag = TAG_NIL;
         }
     }
-    for (int i = num_vars - 1; i >= 0; i--) {
-        uint8_t expr_slot = p->f->num_stack - num_exprs + i;
-        emit(p, ins2(BC_MOV, vars[i].slot, expr_slot), assign.line);
+    for (int i = num_vals - 1; i >= 0; i--) {
+        emit_store(p, &vars[i], &vals[i]);
     }
     p->f->num_stack = p->f->num_locals; // Drop expressions
 }
 
 static void parse_call(Parser *p, Expr *l) {
-    parse_suffixes(p, l);
     if (l->t != EXPR_CALL) {
         ErrInfo info = tk2err(&l->tk);
         err_syntax(p->L, &info, "expected assignment or function call");
@@ -1216,7 +2089,7 @@ static void parse_call(Parser *p, Expr *l) {
 
 static void parse_assign_or_call(Parser *p) {
     Expr l;
-    parse_primary_expr(p, &l);
+    parse_suffixed_expr(p, &l);
     if (peek_tk(p->l, NULL) == ',' || peek_tk(p->l, NULL) == '=') {
         parse_assign(p, &l);
     } else {
@@ -1271,8 +2144,7 @@ static void parse_while(Parser *p) {
     int end_jmp = emit_jmp(p);
     patch_jmps(p, end_jmp, start);
     patch_jmps_here(p, cond_false_list);
-    exit_block(p);
-    patch_jmps_here(p, loop.breaks);
+    exit_loop(p);
 }
 
 static void parse_repeat(Parser *p) {
@@ -1284,8 +2156,70 @@ static void parse_repeat(Parser *p) {
     expect_tk(p->l, TK_UNTIL, NULL);
     int cond_false_list = parse_cond_expr(p);
     patch_jmps(p, cond_false_list, start); // jump back if !cond
+    exit_loop(p);
+}
+
+// Hidden variables for a numeric 'for' loop's state; the names aren't valid
+// identifiers, so they can't be referred to in the loop body.
+static void def_for_local(Parser *p, const char *name) {
+    def_local(p, str_new(p->L, name, strlen(name)));
+}
+
+// Numeric 'for' loops keep the index, limit, and step in 3 consecutive hidden
+// locals, followed by the loop variable (a copy of the index that the body is
+// free to assign to). An integer constant step (including the default of 1)
+// is stored in the 'BC_FORPREPI' and 'BC_FORLOOPI' instructions instead.
+static void parse_for(Parser *p) {
+    Token for_tk, name;
+    expect_tk(p->l, TK_FOR, &for_tk);
+    expect_tk(p->l, TK_IDENT, &name);
+    expect_tk(p->l, '=', NULL);
+    BlockScope loop;
+    enter_loop(p, &loop);
+    Expr e;
+    parse_expr(p, &e);
+    uint8_t base = to_next_slot(p, &e); // Index
+    expect_tk(p->l, ',', NULL);
+    parse_expr(p, &e);
+    to_next_slot(p, &e); // Limit
+    int step = 1;
+    if (peek_tk(p->l, NULL) == ',') {
+        read_tk(p->l, NULL);
+        parse_expr(p, &e);
+        if (!is_num_expr(&e) || !is_int(e.num, &step) || step == 0 ||
+                step < INT16_MIN || step > INT16_MAX) {
+            step = 0; // Not an integer constant; check the sign at runtime
+            to_next_slot(p, &e);
+        }
+    }
+    if (step != 0) {
+        reserve_slots(p, 1); // Unused step slot, for the same frame layout
+    }
+    def_for_local(p, "(for index)");
+    def_for_local(p, "(for limit)");
+    def_for_local(p, "(for step)");
+    expect_tk(p->l, TK_DO, NULL);
+
+    BcIns prep = step ? ins2(BC_FORPREPI, base, (uint16_t) step) :
+        ins2(BC_FORPREP, base, 0);
+    emit(p, prep, for_tk.line);
+    int exit_jmp = emit_jmp(p); // Skipped if the loop runs at least once
+    int start = p->f->fn->num_ins;
+    BlockScope body;
+    enter_block(p, &body); // Loop variable is fresh each iteration
+    def_local(p, name.s);
+    reserve_slots(p, 1);
+    parse_block(p);
+    expect_tk(p->l, TK_END, NULL);
     exit_block(p);
-    patch_jmps_here(p, loop.breaks);
+
+    BcIns next = step ? ins2(BC_FORLOOPI, base, (uint16_t) step) :
+        ins2(BC_FORLOOP, base, 0);
+    emit(p, next, for_tk.line);
+    int loop_jmp = emit_jmp(p); // Skipped once the loop finishes
+    patch_jmps(p, loop_jmp, start);
+    patch_jmps_here(p, exit_jmp);
+    exit_loop(p);
 }
 
 static void parse_break(Parser *p) {
@@ -1325,18 +2259,6 @@ static void parse_return(Parser *p) {
     }
 }
 
-static void parse_assert(Parser *p) {
-    Token assert;
-    expect_tk(p->l, TK_ASSERT, &assert);
-    expect_tk(p->l, '(', NULL);
-    Expr l;
-    parse_expr(p, &l);
-    expect_tk(p->l, ')', NULL);
-    uint8_t slot = to_any_slot(p, &l);
-    free_expr_slot(p, &l);
-    emit(p, ins2(BC_ASSERT, 0, slot), assert.line);
-}
-
 static void parse_stmt(Parser *p) {
     switch (peek_tk(p->l, NULL)) {
         case TK_FUNCTION: assert(0); // TODO
@@ -1345,10 +2267,9 @@ static void parse_stmt(Parser *p) {
         case TK_IF:       parse_if(p); break;
         case TK_WHILE:    parse_while(p); break;
         case TK_REPEAT:   parse_repeat(p); break;
-        case TK_FOR:      assert(0); // TODO
+        case TK_FOR:      parse_for(p); break;
         case TK_BREAK:    parse_break(p); break;
         case TK_RETURN:   parse_return(p); break;
-        case TK_ASSERT:   parse_assert(p); break; // TODO: temporary
         default:          parse_assign_or_call(p); break;
     }
     // Make sure each statement cleans up after itself
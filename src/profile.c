@@ -0,0 +1,176 @@
+
+#include <assert.h>
+
+#include "profile.h"
+
+#define MIN_STACKS 64
+
+// Stack table is resized when more than 3/4 of its entries are in use
+#define MAX_LOAD(size) ((size) / 4 * 3)
+
+static void reset_countdown(Profile *p) {
+    p->rand ^= p->rand << 13; // xorshift32
+    p->rand ^= p->rand >> 17;
+    p->rand ^= p->rand << 5;
+    p->countdown = p->interval / 2 + (int) (p->rand % (uint32_t) p->interval);
+    if (p->countdown <= 0) {
+        p->countdown = 1;
+    }
+}
+
+void prof_start(State *L, FILE *out, int owns_out, int interval) {
+    prof_stop(L);
+    Profile *p = mem_alloc(L, MEM_OTHER, sizeof(Profile));
+    p->out = out;
+    p->owns_out = owns_out;
+    p->interval = interval > 0 ? interval : PROF_INTERVAL;
+    p->rand = 2463534242u;
+    p->stacks = mem_alloc(L, MEM_OTHER, sizeof(ProfStack) * MIN_STACKS);
+    for (int i = 0; i < MIN_STACKS; i++) {
+        p->stacks[i].count = 0;
+    }
+    p->stacks_size = MIN_STACKS;
+    p->num_stacks = 0;
+    p->frames = NULL;
+    p->num_frames = p->max_frames = 0;
+    reset_countdown(p);
+    L->prof = p;
+}
+
+
+// ---- Sampling ----
+
+static uint32_t hash_frames(ProfFrame *frames, int n) {
+    uint64_t h = 14695981039346656037u; // FNV-1a over the frames
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (uint64_t) (uintptr_t) frames[i].fn) * 1099511628211u;
+        h = (h ^ (uint64_t) frames[i].line) * 1099511628211u;
+    }
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static int stack_eq(Profile *p, ProfStack *s, uint32_t hash, int depth) {
+    if (s->hash != hash || s->depth != depth) {
+        return 0;
+    }
+    ProfFrame *a = &p->frames[s->first];
+    for (int i = 0; i < depth; i++) {
+        if (a[i].fn != p->sample[i].fn || a[i].line != p->sample[i].line) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void resize_stacks(State *L, Profile *p) {
+    uint32_t size = p->stacks_size * 2;
+    ProfStack *stacks = mem_alloc(L, MEM_OTHER, sizeof(ProfStack) * size);
+    for (uint32_t i = 0; i < size; i++) {
+        stacks[i].count = 0;
+    }
+    for (uint32_t i = 0; i < p->stacks_size; i++) {
+        ProfStack *s = &p->stacks[i];
+        if (s->count == 0) {
+            continue;
+        }
+        uint32_t j = s->hash & (size - 1);
+        while (stacks[j].count > 0) {
+            j = (j + 1) & (size - 1);
+        }
+        stacks[j] = *s;
+    }
+    mem_free(L, MEM_OTHER, p->stacks, sizeof(ProfStack) * p->stacks_size);
+    p->stacks = stacks;
+    p->stacks_size = size;
+}
+
+// Copies the stack in 'p->sample' into 'p->frames' for a new table entry.
+static int save_frames(State *L, Profile *p, int depth) {
+    if (p->num_frames + depth > p->max_frames) {
+        int max = p->max_frames > 0 ? p->max_frames * 2 : 256;
+        while (max < p->num_frames + depth) {
+            max *= 2;
+        }
+        p->frames = mem_realloc(L, MEM_OTHER, p->frames,
+                sizeof(ProfFrame) * p->max_frames,
+                sizeof(ProfFrame) * max);
+        p->max_frames = max;
+    }
+    int first = p->num_frames;
+    for (int i = 0; i < depth; i++) {
+        p->frames[first + i] = p->sample[i];
+    }
+    p->num_frames += depth;
+    return first;
+}
+
+void prof_sample(State *L, Fn *fn, BcIns *ip) {
+    Profile *p = L->prof;
+    assert(p);
+    reset_countdown(p);
+    int first_call = L->num_calls - PROF_MAX_DEPTH;
+    int depth = 0;
+    for (int i = first_call > 0 ? first_call : 0; i < L->num_calls; i++) {
+        CallInfo *c = &L->call_stack[i];
+        if (c->fn) { // NULL for C functions called from C
+            p->sample[depth++] = (ProfFrame) { c->fn, 0 };
+        }
+    }
+    int line = fn_line(fn, ip - fn->ins);
+    assert(line >= 0); // Jumps are given the line before them
+    p->sample[depth++] = (ProfFrame) { fn, line };
+
+    uint32_t hash = hash_frames(p->sample, depth);
+    uint32_t mask = p->stacks_size - 1;
+    uint32_t i = hash & mask;
+    while (p->stacks[i].count > 0) {
+        if (stack_eq(p, &p->stacks[i], hash, depth)) {
+            p->stacks[i].count++;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    ProfStack s = { hash, 1, save_frames(L, p, depth), depth };
+    p->stacks[i] = s;
+    p->num_stacks++;
+    if (p->num_stacks > MAX_LOAD(p->stacks_size)) {
+        resize_stacks(L, p);
+    }
+}
+
+
+// ---- Output ----
+
+// Folded stacks have one line per distinct stack: the frames from the
+// outermost caller inwards, separated by ';', and then the number of samples.
+static void write_stack(Profile *p, ProfStack *s) {
+    ProfFrame *frames = &p->frames[s->first];
+    for (int i = 0; i < s->depth; i++) {
+        if (i > 0) {
+            fputc(';', p->out);
+        }
+        print_fn_name(p->out, frames[i].fn);
+    }
+    fprintf(p->out, " (line %d) %d\n", frames[s->depth - 1].line, s->count);
+}
+
+void prof_stop(State *L) {
+    Profile *p = L->prof;
+    if (!p) {
+        return;
+    }
+    L->prof = NULL;
+    for (uint32_t i = 0; i < p->stacks_size; i++) {
+        if (p->stacks[i].count > 0) {
+            write_stack(p, &p->stacks[i]);
+        }
+    }
+    if (p->owns_out) {
+        fclose(p->out);
+    } else {
+        fflush(p->out);
+    }
+    mem_free(L, MEM_OTHER, p->stacks, sizeof(ProfStack) * p->stacks_size);
+    mem_free(L, MEM_OTHER, p->frames, sizeof(ProfFrame) * p->max_frames);
+    mem_free(L, MEM_OTHER, p, sizeof(Profile));
+}
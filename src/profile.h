@@ -0,0 +1,67 @@
+
+#ifndef LUAJ_PROFILE_H
+#define LUAJ_PROFILE_H
+
+// The profiler samples the interpreter by instruction count. While a profile
+// is running, 'execute' dispatches every instruction through 'PROFILE' (in the
+// same way as 'RECORD' for the trace recorder), which counts down
+// 'countdown' and takes a sample when it reaches 0. The interval is jittered
+// so that samples don't line up with loops whose length divides it.
+//
+// A sample is the running function and line, plus the functions on
+// 'L->call_stack' that called it. A sample taken on a jump (which has no line
+// of its own) counts towards the line before it (see 'fn_finish'). Samples
+// are aggregated by stack as they're taken, so memory use depends on the
+// number of distinct stacks rather than the length of the run. They're
+// written out as folded stacks (see 'luaJ_profile') when the profile is
+// stopped.
+//
+// Time spent in compiled traces or C functions isn't sampled: a 'BC_JLOOP' or
+// 'BC_CALL' counts as a single instruction. 'execute' checks whether to use
+// 'PROFILE' when it's entered, so a profile started by a C function only sees
+// the Lua functions that it calls.
+
+#include <stdio.h>
+
+#include "value.h"
+
+// Default number of instructions between samples
+#define PROF_INTERVAL 1000
+
+// Only the innermost callers are recorded for deeper call stacks
+#define PROF_MAX_DEPTH 128
+
+typedef struct {
+    Fn *fn;
+    int line; // Only for the running function; 0 for its callers
+} ProfFrame;
+
+typedef struct {
+    uint32_t hash;
+    int count;        // Number of samples; 0 for unused entries
+    int first, depth; // Frames in 'frames', outermost first
+} ProfStack;
+
+typedef struct Profile {
+    FILE *out;
+    int owns_out; // Opened from LUAJ_PROFILE, so closed when the profile stops
+    int interval;
+    int countdown; // Instructions until the next sample
+    uint32_t rand; // State for jittering 'countdown'
+    ProfStack *stacks; // Hash table of distinct stacks; size is a power of 2
+    uint32_t stacks_size, num_stacks;
+    ProfFrame *frames;
+    int num_frames, max_frames;
+    ProfFrame sample[PROF_MAX_DEPTH + 1]; // Stack being sampled
+} Profile;
+
+// Starts profiling into 'out', replacing any profile that's already running.
+void prof_start(State *L, FILE *out, int owns_out, int interval);
+
+// Writes the samples to the profile's sink and frees the profile.
+void prof_stop(State *L);
+
+// Records the stack for the instruction at 'ip' in the running function 'fn'.
+void prof_sample(State *L, Fn *fn, BcIns *ip);
+
+#endif
@@ -1,5 +1,5 @@
 
-#include <assert.h>
+#include <string.h>
 
 #include "reader.h"
 
@@ -14,69 +14,45 @@ Reader reader_new(
     r.ud = ud;
     r.chunk_name = chunk_name;
     r.line = 1;
-    r.col = 1;
     return r;
 }
 
-static char read_ch_raw(Reader *r) {
-    if (r->n == 0) {
-        r->p = (char *) r->fn(r->L, r->ud, &r->n);
-    }
-    if (!r->p || *r->p == EOF) {
-        return EOF;
-    }
-    char c = *(r->p++);
-    r->n--;
-    return c;
+Reader reader_new_buf(State *L, const char *s, size_t len, char *chunk_name) {
+    Reader r = reader_new(L, NULL, NULL, chunk_name);
+    r.p = r.line_start = s;
+    r.end = s + len;
+    return r;
 }
 
-char read_ch(Reader *r) {
-    char c;
-    if (r->buf_len > 0) {
-        c = r->buf[--r->buf_len];
-    } else {
-        c = read_ch_raw(r);
-    }
-    if (c == '\r') { // Turn '\r' into '\n'
-        char c2 = read_ch_raw(r);
-        if (c2 != '\n') { // Turn '\r\n' into '\n'
-            undo_ch(r, c2);
-        }
-        c = '\n';
-    }
-    if (c == '\n') {
-        r->line++;
-        r->col = 1;
-    } else if (c != EOF) {
-        r->col++;
-    }
-    return c;
+void reader_free(Reader *r) {
+    mem_free(r->L, MEM_PARSER, r->buf, r->buf_size);
+    r->buf = NULL;
+    r->buf_size = 0;
 }
 
-void undo_ch(Reader *r, char c) {
-    if (c == -1) {
-        return;
+void reader_load(Reader *r) {
+    if (!r->fn) {
+        return; // Already in memory
     }
-    assert(r->buf_len < MAX_CH_PEEK);
-    r->buf[r->buf_len++] = c;
-    if (c == '\n') { // Undo line and column update
-        r->col = 1;
-        r->line--;
-    } else {
-        r->col--;
+    size_t len = 0;
+    while (1) {
+        size_t n = 0;
+        const char *block = r->fn(r->L, r->ud, &n);
+        if (!block || n == 0) {
+            break;
+        }
+        if (len + n > r->buf_size) {
+            size_t size = r->buf_size > 0 ? r->buf_size : 4096;
+            while (size < len + n) {
+                size *= 2;
+            }
+            r->buf = mem_realloc(r->L, MEM_PARSER, r->buf, r->buf_size, size);
+            r->buf_size = size;
+        }
+        memcpy(&r->buf[len], block, n);
+        len += n;
     }
-}
-
-char peek_ch(Reader *r) {
-    char c = read_ch(r);
-    undo_ch(r, c);
-    return c;
-}
-
-char peek_ch2(Reader *r) {
-    char c1 = read_ch(r);
-    char c2 = read_ch(r);
-    undo_ch(r, c2);
-    undo_ch(r, c1);
-    return c2;
+    r->fn = NULL;
+    r->p = r->line_start = r->buf ? r->buf : "";
+    r->end = r->p + len;
 }
@@ -2,28 +2,33 @@
 #ifndef LUAJ_READER_H
 #define LUAJ_READER_H
 
-// A reader takes a file or string and spits out one character at a time. It
-// optionally lets you peek at the next character (or the one after) without
-// consuming it.
+// A reader holds the source code for a chunk as a contiguous window of bytes
+// ['p', 'end'), which the lexer can scan directly. 'read_ch' and 'peek_ch'
+// give it one character at a time where that's more convenient.
 //
-// It keeps track of the current line and column number for error messages.
+// Source that's already in memory is scanned in place (see 'reader_new_buf').
+// Otherwise, 'reader_load' reads the whole chunk from its 'lua_Reader' into a
+// buffer up front, so tokens never straddle two blocks.
+//
+// It keeps track of the current line for error messages; the column is
+// worked out from the start of the line when it's needed. Anything that
+// consumes a newline ('\n', '\r', or '\r\n') must go through 'read_ch' so the
+// line count stays correct.
 
 #include <stdio.h>
 
 #include "state.h"
 
-#define MAX_CH_PEEK 3
-
 typedef struct {
     State *L;
-    lua_Reader fn;
+    lua_Reader fn; // NULL once the whole chunk is in memory
     void *ud;
-    char *p;
-    size_t n; // Bytes remaining
+    const char *p, *end; // Bytes remaining
     char *chunk_name; // For error/debug messages
-    int line, col;
-    char buf[MAX_CH_PEEK];
-    int buf_len;
+    int line;
+    const char *line_start;
+    char *buf; // Source read from 'fn', owned by the reader
+    size_t buf_size;
 } Reader;
 
 Reader reader_new(
@@ -31,10 +36,40 @@ Reader reader_new(
         lua_Reader reader,
         void *ud,
         char *chunk_name);
+Reader reader_new_buf(State *L, const char *s, size_t len, char *chunk_name);
+void reader_free(Reader *r);
+
+// Reads the rest of the chunk from the 'lua_Reader' into memory. Must be
+// called before anything else is read.
+void reader_load(Reader *r);
+
+static inline int reader_col(Reader *r) {
+    return (int) (r->p - r->line_start) + 1;
+}
+
+static inline int peek_ch(Reader *r) {
+    return r->p < r->end ? (unsigned char) r->p[0] : EOF;
+}
+
+static inline int peek_ch2(Reader *r) {
+    return r->p + 1 < r->end ? (unsigned char) r->p[1] : EOF;
+}
 
-char read_ch(Reader *r);
-void undo_ch(Reader *r, char c);
-char peek_ch(Reader *r);
-char peek_ch2(Reader *r);
+// Newlines are always returned as '\n'.
+static inline int read_ch(Reader *r) {
+    if (r->p >= r->end) {
+        return EOF;
+    }
+    int c = (unsigned char) *(r->p++);
+    if (c == '\n' || c == '\r') {
+        if (c == '\r' && r->p < r->end && *r->p == '\n') {
+            r->p++; // Turn '\r\n' into '\n'
+        }
+        r->line++;
+        r->line_start = r->p;
+        c = '\n';
+    }
+    return c;
+}
 
 #endif
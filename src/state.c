@@ -3,6 +3,10 @@
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <luaj.h>
 
 #include "state.h"
 #include "reader.h"
@@ -10,6 +14,30 @@
 #include "parser.h"
 #include "value.h"
 #include "vm.h"
+#include "jit.h"
+#include "gc.h"
+#include "table.h"
+#include "coro.h"
+#include "dump.h"
+#include "debug.h"
+#include "profile.h"
+#include "stats.h"
+
+// Opens the sink named by an environment variable. Sets 'owns' if the file
+// has to be closed when we're done with it.
+static FILE * open_sink(const char *sink, int *owns) {
+    *owns = 0;
+    if (!sink || sink[0] == '\0') {
+        return NULL;
+    } else if (strcmp(sink, "stdout") == 0) {
+        return stdout;
+    } else if (strcmp(sink, "stderr") == 0) {
+        return stderr;
+    }
+    FILE *f = fopen(sink, "w");
+    *owns = f != NULL;
+    return f;
+}
 
 LUA_API lua_State * lua_newstate(lua_Alloc f, void *ud) {
     State *L = f(ud, NULL, 0, sizeof(State));
@@ -18,39 +46,134 @@ LUA_API lua_State * lua_newstate(lua_Alloc f, void *ud) {
     }
     L->alloc_fn = f;
     L->alloc_ud = ud;
+    L->pool = (Pool) {0};
+    L->mem = (Mem) {0};
+    L->mem.bytes[MEM_OTHER] = L->mem.peak = L->gc.total = sizeof(State);
+    L->mem.allocs[MEM_OTHER] = 1;
     L->err = NULL;
-    L->stack_size = 4096;
-    L->stack = L->top = mem_alloc(L, L->stack_size * sizeof(uint64_t));
-    L->max_calls = 256;
+    L->mem_err = NULL;
+    L->stack_size = STACK_MIN;
+    L->stack = L->top = mem_alloc(L, MEM_STACK,
+            L->stack_size * sizeof(uint64_t));
+    L->base = L->stack;
+    for (int i = 0; i < L->stack_size; i++) {
+        L->stack[i] = VAL_NIL; // The GC scans the whole stack
+    }
+    L->max_calls = CALLS_MIN;
     L->num_calls = 0;
-    L->call_stack = mem_alloc(L, L->max_calls * sizeof(CallInfo));
+    L->call_stack = mem_alloc(L, MEM_STACK, L->max_calls * sizeof(CallInfo));
+    L->open_upvals = NULL;
+    L->co = NULL;
+    L->buf = NULL;
+    L->buf_size = 0;
+    L->rec = NULL;
+    L->dump_bc = NULL;
+    L->owns_dump_bc = 0;
+    L->prof = NULL;
+#ifdef LUAJ_STATS
+    L->stats = NULL;
+#endif
+    gc_init(L);
+    str_table_init(L);
+#ifdef LUAJ_STATS
+    stats_init(L);
+#endif
+    L->mem_err = str_new(L, "not enough memory", 17);
+    L->globals = table2v(table_new(L, 0, 0));
+    L->dump_bc = open_sink(getenv("LUAJ_DUMP_BC"), &L->owns_dump_bc);
+    int owns_prof;
+    FILE *prof = open_sink(getenv("LUAJ_PROFILE"), &owns_prof);
+    if (prof) {
+        prof_start(L, prof, owns_prof, 0);
+    }
+    char *limit = getenv("LUAJ_MEM_LIMIT");
+    if (limit) {
+        luaJ_setmemlimit(L, (size_t) strtoull(limit, NULL, 10));
+    }
     return L;
 }
 
-LUA_API void lua_close(lua_State *L) {
-    mem_free(L, L->stack, L->stack_size * sizeof(uint64_t));
-    mem_free(L, L->call_stack, L->max_calls * sizeof(CallInfo));
-    mem_free(L, L, sizeof(State));
-}
-
-static void print_err(State *L, int status) {
-    if (status) { // TODO: move to CLI once stack manipulation API exposed
-        uint64_t err = stack_pop(L);
-        if (!is_nil(err)) {
-            assert(is_str(err));
-            Str *msg = v2str(err);
-            fprintf(stderr, "%.*s\n", (int) msg->len, str_val(msg));
-        }
+LUA_API void luaJ_dumpbc(lua_State *L, FILE *out) {
+    if (L->owns_dump_bc) {
+        fclose(L->dump_bc);
+    }
+    L->dump_bc = out;
+    L->owns_dump_bc = 0;
+}
+
+LUA_API void luaJ_profile(lua_State *L, FILE *out, int interval) {
+    if (out) {
+        prof_start(L, out, 0, interval);
+    } else {
+        prof_stop(L);
+    }
+}
+
+LUA_API void (luaJ_memstats) (lua_State *L, luaJ_MemStats *stats) {
+    stats->bytes = L->gc.total;
+    stats->peak = L->mem.peak;
+    stats->limit = L->mem.limit;
+    for (int i = 0; i < LUAJ_MEM_SITES; i++) {
+        stats->site_bytes[i] = L->mem.bytes[i];
+        stats->site_allocs[i] = L->mem.allocs[i];
     }
 }
 
+LUA_API size_t (luaJ_setmemlimit) (lua_State *L, size_t limit) {
+    size_t old = L->mem.limit;
+    L->mem.limit = limit;
+    return old;
+}
+
+LUA_API int (luaJ_stats) (lua_State *L, FILE *out) {
+#ifdef LUAJ_STATS
+    stats_write(L, out);
+    return 0;
+#else
+    (void) L; (void) out;
+    return -1;
+#endif
+}
+
+LUA_API void lua_close(lua_State *L) {
+    luaJ_dumpbc(L, NULL);
+    luaJ_profile(L, NULL, 0);
+    trace_abort(L);
+#ifdef LUAJ_STATS
+    stats_free(L);
+#endif
+    gc_free_all(L);
+    str_table_free(L);
+    mem_free(L, MEM_OTHER, L->buf, L->buf_size);
+    mem_free(L, MEM_STACK, L->stack, L->stack_size * sizeof(uint64_t));
+    mem_free(L, MEM_STACK, L->call_stack, L->max_calls * sizeof(CallInfo));
+    mem_free_pool(L);
+    L->alloc_fn(L->alloc_ud, L, sizeof(State), 0);
+}
+
 static void load_protected(State *L, void *ud) {
-    parse(L, (Reader *) ud);
+    Reader *r = (Reader *) ud;
+    reader_load(r);
+    if (is_dump(r)) {
+        fn_undump(L, r);
+    } else {
+        parse(L, r);
+    }
+}
+
+static int load(State *L, Reader *r) {
+    int status = pcall(L, load_protected, r);
+    reader_free(r);
+    if (!status && L->dump_bc) {
+        print_fn(L->dump_bc, v2fn(L->top[-1]));
+    }
+    return status;
 }
 
 // Loads a Lua chunk without running it. If there are no errors, 'lua_load '
 // pushes the compiled chunk as a Lua function on top of the stack. Otherwise,
-// it pushes an error message.
+// it pushes an error message. The chunk can be source code or a precompiled
+// chunk written by 'lua_dump'.
 //
 // 'chunk_name' is used in error and debug messages.
 LUA_API int lua_load(
@@ -59,9 +182,86 @@ LUA_API int lua_load(
         void *data,
         const char *chunk_name) {
     Reader r = reader_new(L, reader_fn, data, (char *) chunk_name);
-    int status = pcall(L, load_protected, &r);
-    print_err(L, status);
-    return status;
+    return load(L, &r);
+}
+
+int load_buf(State *L, const char *s, size_t len, const char *chunk_name) {
+    Reader r = reader_new_buf(L, s, len, (char *) chunk_name);
+    return load(L, &r);
+}
+
+// Dumps the function on top of the stack as a precompiled chunk, which can be
+// loaded again with 'lua_load'. 'writer' is called with successive pieces of
+// the chunk. Returns the error code from the last call to 'writer', or 1 if
+// the value on top of the stack isn't a function. The function isn't popped.
+LUA_API int (lua_dump) (State *L, lua_Writer writer, void *data) {
+    return luaJ_dump(L, writer, data, 0);
+}
+
+LUA_API int (luaJ_dump) (State *L, lua_Writer writer, void *data, int strip) {
+    if (L->top == L->stack || !is_fn(L->top[-1])) {
+        return 1;
+    }
+    return fn_dump(L, v2fn(L->top[-1]), writer, data, strip);
+}
+
+struct luaJ_Chunk {
+    char *data; // Written by 'lua_dump'
+    size_t size;
+    char *chunk_name;
+};
+
+static int chunk_writer(lua_State *L, const void *p, size_t size, void *ud) {
+    (void) L;
+    luaJ_Chunk *c = (luaJ_Chunk *) ud;
+    char *data = realloc(c->data, c->size + size);
+    if (!data) {
+        return 1;
+    }
+    memcpy(data + c->size, p, size);
+    c->data = data;
+    c->size += size;
+    return 0;
+}
+
+// Shared chunks are allocated with 'malloc' rather than the state's allocator,
+// since they can outlive the state that made them.
+LUA_API luaJ_Chunk * (luaJ_newchunk) (State *L) {
+    if (L->top == L->stack || !is_fn(L->top[-1])) {
+        return NULL;
+    }
+    luaJ_Chunk *c = malloc(sizeof(luaJ_Chunk));
+    if (!c) {
+        return NULL;
+    }
+    *c = (luaJ_Chunk) {0};
+    char *name = v2fn(L->top[-1])->chunk_name;
+    if (name) {
+        c->chunk_name = malloc(strlen(name) + 1);
+        if (!c->chunk_name) {
+            luaJ_freechunk(c);
+            return NULL;
+        }
+        strcpy(c->chunk_name, name);
+    }
+    if (fn_dump(L, v2fn(L->top[-1]), chunk_writer, c, 0) != 0) {
+        luaJ_freechunk(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Only reads from 'c', which is what makes it safe to share between threads.
+LUA_API int (luaJ_loadchunk) (State *L, const luaJ_Chunk *c) {
+    return load_buf(L, c->data, c->size, c->chunk_name);
+}
+
+LUA_API void (luaJ_freechunk) (luaJ_Chunk *c) {
+    if (c) {
+        free(c->data);
+        free(c->chunk_name);
+        free(c);
+    }
 }
 
 // The following protocol for function calls is used (from the Lua C API):
@@ -77,14 +277,24 @@ LUA_API int lua_load(
 // first result is pushed first), so that after the call the last result is on
 // the top of the stack.
 LUA_API void (lua_call) (State *L, int num_args, int num_results) {
-    // Ignores 'num_args' and 'num_results' now until function calls are
-    // implemented; just expects a function prototype to be on the stack
-    execute(L);
+    assert(L->top - L->base > num_args);
+    uint64_t *f = L->top - num_args - 1;
+    if (is_fn(*f) || is_closure(*f)) {
+        execute(L, f, num_results);
+    } else if (is_cfn(*f)) {
+        execute_c(L, f, num_results);
+    } else {
+        err_run(L, NULL, "attempt to call a %s value", type_name(*f));
+    }
 }
 
+typedef struct {
+    int num_args, num_results;
+} CallArgs;
+
 static void call_protected(State *L, void *ud) {
-    (void) ud;
-    execute(L);
+    CallArgs *args = (CallArgs *) ud;
+    lua_call(L, args->num_args, args->num_results);
 }
 
 // If there are no errors during the call, 'lua_pcall' behaves exactly like
@@ -107,28 +317,494 @@ LUA_API int (lua_pcall) (
         int num_args,
         int num_results,
         int err_handler_fn) {
-    // Ignores 'num_args' and 'num_results' now until function calls are
-    // implemented; just expects a function prototype to be on the stack
-    int status = pcall(L, call_protected, NULL);
-    print_err(L, status);
+    assert(err_handler_fn == 0); // Message handlers aren't supported yet
+    (void) err_handler_fn;
+    ptrdiff_t f = (L->top - num_args - 1) - L->stack;
+    if (is_fn(L->stack[f]) || is_closure(L->stack[f])) {
+        return execute_pcall(L, L->stack + f, num_results);
+    }
+    CallArgs args = { num_args, num_results };
+    int status = pcall(L, call_protected, &args);
+    if (status) { // Replace the function and arguments with the error
+        L->stack[f] = err_value(L, status);
+        L->top = L->stack + f + 1;
+    }
+    if (status == LUA_ERRMEM) {
+        mem_recover(L);
+    }
     return status;
 }
 
+// Concatenates the 'n' values on top of the stack, pops them, and leaves the
+// result on top. Numbers are converted to strings.
+LUA_API void (lua_concat) (State *L, int n) {
+    assert(n >= 0 && n <= L->top - L->base);
+    if (n == 0) {
+        stack_push(L, str2v(str_new(L, "", 0)));
+        return;
+    }
+    size_t len = 0;
+    for (int i = -n; i < 0; i++) {
+        if (!lua_isstring(L, i)) {
+            err_run(L, NULL, "attempt to concatenate a %s value",
+                    type_name(L->top[i]));
+        }
+        size_t l;
+        lua_tolstring(L, i, &l);
+        len += l;
+    }
+    if (n > 1) {
+        uint64_t *vals = L->top - n;
+        *vals = str2v(str_concat(L, vals, n, len));
+        L->top = vals + 1;
+    }
+}
+
+// Generates a Lua error, using the value on top of the stack as the error
+// object. Never returns.
+LUA_API int (lua_error) (State *L) {
+    err_throw(L);
+}
+
+
+// Controls the garbage collector. 'what' is one of the 'LUA_GC*' options.
+LUA_API int lua_gc(State *L, int what, int data) {
+    GC *gc = &L->gc;
+    int old;
+    switch (what) {
+    case LUA_GCSTOP:
+        gc->stopped = 1;
+        gc->threshold = SIZE_MAX;
+        return 0;
+    case LUA_GCRESTART:
+        gc->stopped = 0;
+        gc->threshold = gc->total;
+        return 0;
+    case LUA_GCCOLLECT:
+        gc_full(L);
+        return 0;
+    case LUA_GCCOUNT:
+        return (int) (gc->total >> 10); // In kilobytes
+    case LUA_GCCOUNTB:
+        return (int) (gc->total & 0x3ff); // Remainder in bytes
+    case LUA_GCSTEP: {
+        // Performs steps as if 'data' kilobytes had been allocated. Returns 1 if
+        // the step finished a cycle
+        size_t bytes = (size_t) data << 10;
+        gc->threshold = bytes <= gc->total ? gc->total - bytes : 0;
+        while (gc->threshold <= gc->total) {
+            gc_step(L);
+            if (gc->phase == GC_PAUSE) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    case LUA_GCSETPAUSE:
+        old = gc->pause;
+        gc->pause = data;
+        return old;
+    case LUA_GCSETSTEPMUL:
+        old = gc->stepmul;
+        gc->stepmul = data;
+        return old;
+    default:
+        return -1;
+    }
+}
+
+
+// ---- Stack Access ----
+
+// Stack indices in the C API are relative to the bottom of the current frame
+// ('L->base'): 1 is the first slot, and -1 is the top of the stack. Values
+// are read and written in place; nothing is copied or converted on the way.
+
+// Returned for valid but empty indices. It's shared by every state, so it's
+// read-only; the functions that write through a slot assert they weren't
+// given it.
+static const uint64_t NIL_SLOT = VAL_NIL;
+
+static uint64_t * index2slot(State *L, int idx) {
+    if (idx > 0) {
+        assert(idx <= L->top - L->base + LUA_MINSTACK);
+        uint64_t *slot = L->base + (idx - 1);
+        return slot < L->top ? slot : (uint64_t *) &NIL_SLOT;
+    }
+    if (idx == LUA_GLOBALSINDEX) {
+        return &L->globals;
+    }
+    assert(idx != 0 && -idx <= L->top - L->base); // No upvalues yet
+    return L->top + idx;
+}
+
+static inline uint64_t index2val(State *L, int idx) {
+    return *index2slot(L, idx);
+}
+
+LUA_API int (lua_gettop) (State *L) {
+    return (int) (L->top - L->base);
+}
+
+LUA_API void (lua_settop) (State *L, int idx) {
+    if (idx >= 0) {
+        uint64_t *top = stack_check(L, L->base, idx) + idx;
+        while (L->top < top) {
+            *(L->top++) = VAL_NIL;
+        }
+        L->top = top;
+    } else {
+        assert(-(idx + 1) <= L->top - L->base);
+        L->top += idx + 1;
+    }
+}
+
+LUA_API void (lua_pushvalue) (State *L, int idx) {
+    stack_push(L, index2val(L, idx));
+}
+
+LUA_API void (lua_remove) (State *L, int idx) {
+    uint64_t *slot = index2slot(L, idx);
+    assert(slot != &NIL_SLOT);
+    memmove(slot, slot + 1, sizeof(uint64_t) * (L->top - slot - 1));
+    L->top--;
+}
+
+LUA_API void (lua_insert) (State *L, int idx) {
+    uint64_t *slot = index2slot(L, idx);
+    assert(slot != &NIL_SLOT);
+    uint64_t v = L->top[-1];
+    memmove(slot + 1, slot, sizeof(uint64_t) * (L->top - slot - 1));
+    *slot = v;
+}
+
+LUA_API void (lua_replace) (State *L, int idx) {
+    uint64_t *slot = index2slot(L, idx);
+    assert(slot != &NIL_SLOT);
+    assert(slot != &L->globals || is_table(L->top[-1]));
+    *slot = *(--L->top);
+}
+
+LUA_API int (lua_checkstack) (State *L, int size) {
+    if (size > LUAI_MAXCSTACK || (L->top - L->base) + size > LUAI_MAXCSTACK) {
+        return 0;
+    }
+    stack_check(L, L->top, size);
+    return 1;
+}
+
+// Converts a string to a number, the same way Lua's 'tonumber' does. Returns
+// 0 if the string isn't a number.
+static int str2num(State *L, Str *str, double *n) {
+    char *s = buf_reserve(L, str->len + 1); // Might not be NULL terminated
+    memcpy(s, str_val(str), str->len);
+    s[str->len] = '\0';
+    char *end;
+    *n = lua_str2number(s, &end);
+    if (end == s) {
+        return 0;
+    }
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    return *end == '\0';
+}
+
+LUA_API int (lua_type) (State *L, int idx) {
+    uint64_t *slot = index2slot(L, idx);
+    uint64_t v = *slot;
+    if (slot == &NIL_SLOT) {
+        return LUA_TNONE;
+    } else if (is_num(v)) {
+        return LUA_TNUMBER;
+    } else if (is_nil(v)) {
+        return LUA_TNIL;
+    } else if (is_false(v) || is_true(v)) {
+        return LUA_TBOOLEAN;
+    } else if (is_str(v)) {
+        return LUA_TSTRING;
+    } else if (is_table(v)) {
+        return LUA_TTABLE;
+    } else if (is_fn(v) || is_closure(v) || is_cfn(v)) {
+        return LUA_TFUNCTION;
+    } else if (is_coro(v)) {
+        return LUA_TTHREAD;
+    }
+    UNREACHABLE();
+    return LUA_TNONE;
+}
+
+LUA_API const char * (lua_typename) (State *L, int type) {
+    (void) L;
+    static const char *NAMES[] = {
+        "no value", "nil", "boolean", "userdata", "number", "string", "table",
+        "function", "userdata", "thread",
+    };
+    return NAMES[type + 1];
+}
+
+LUA_API int (lua_isnumber) (State *L, int idx) {
+    uint64_t v = index2val(L, idx);
+    double n;
+    return is_num(v) || (is_str(v) && str2num(L, v2str(v), &n));
+}
+
+LUA_API int (lua_isstring) (State *L, int idx) {
+    uint64_t v = index2val(L, idx);
+    return is_str(v) || is_num(v);
+}
+
+LUA_API int (lua_rawequal) (State *L, int idx1, int idx2) {
+    uint64_t *a = index2slot(L, idx1);
+    uint64_t *b = index2slot(L, idx2);
+    return a != &NIL_SLOT && b != &NIL_SLOT && *a == *b;
+}
+
+LUA_API int (lua_equal) (State *L, int idx1, int idx2) {
+    return lua_rawequal(L, idx1, idx2); // No metatables
+}
+
+LUA_API int (lua_lessthan) (State *L, int idx1, int idx2) {
+    uint64_t *a = index2slot(L, idx1);
+    uint64_t *b = index2slot(L, idx2);
+    if (a == &NIL_SLOT || b == &NIL_SLOT) {
+        return 0;
+    } else if (is_num(*a) && is_num(*b)) {
+        return v2n(*a) < v2n(*b);
+    } else if (is_str(*a) && is_str(*b)) {
+        Str *l = v2str(*a), *r = v2str(*b);
+        size_t len = l->len < r->len ? l->len : r->len;
+        int cmp = memcmp(str_val(l), str_val(r), len);
+        return cmp < 0 || (cmp == 0 && l->len < r->len);
+    }
+    char *lt = type_name(*a);
+    char *rt = type_name(*b);
+    if (lt == rt) {
+        err_run(L, NULL, "attempt to compare two %s values", lt);
+    } else {
+        err_run(L, NULL, "attempt to compare %s with %s", lt, rt);
+    }
+}
+
+LUA_API lua_Number (lua_tonumber) (State *L, int idx) {
+    uint64_t v = index2val(L, idx);
+    double n;
+    if (is_num(v)) {
+        return v2n(v);
+    } else if (is_str(v) && str2num(L, v2str(v), &n)) {
+        return n;
+    }
+    return 0;
+}
+
+LUA_API lua_Integer (lua_tointeger) (State *L, int idx) {
+    return (lua_Integer) lua_tonumber(L, idx);
+}
+
+LUA_API int (lua_toboolean) (State *L, int idx) {
+    return compares_true(index2val(L, idx));
+}
+
+// Numbers are converted to strings in place, like in Lua.
+LUA_API const char * (lua_tolstring) (State *L, int idx, size_t *len) {
+    uint64_t *slot = index2slot(L, idx);
+    if (is_num(*slot)) {
+        char buf[LUAI_MAXNUMBER2STR];
+        int n = lua_number2str(buf, v2n(*slot));
+        *slot = str2v(str_new(L, buf, (size_t) n));
+    } else if (!is_str(*slot)) {
+        if (len) {
+            *len = 0;
+        }
+        return NULL;
+    }
+    Str *str = v2str(*slot);
+    if (len) {
+        *len = str->len;
+    }
+    return str_cstr(L, str);
+}
+
+LUA_API size_t (lua_objlen) (State *L, int idx) {
+    uint64_t v = index2val(L, idx);
+    if (is_str(v)) {
+        return v2str(v)->len;
+    } else if (is_table(v)) {
+        return v2table(v)->num_arr;
+    } else if (is_num(v)) {
+        size_t len;
+        lua_tolstring(L, idx, &len);
+        return len;
+    }
+    return 0;
+}
+
+LUA_API const void * (lua_topointer) (State *L, int idx) {
+    uint64_t v = index2val(L, idx);
+    return is_ptr(v) ? v2ptr(v) : NULL;
+}
+
+LUA_API void (lua_pushnil) (State *L) {
+    stack_push(L, VAL_NIL);
+}
+
+LUA_API void (lua_pushnumber) (State *L, lua_Number n) {
+    stack_push(L, n2v(n == n ? n : NAN)); // NaN payloads could look like tags
+}
+
+LUA_API void (lua_pushinteger) (State *L, lua_Integer n) {
+    stack_push(L, n2v((double) n));
+}
+
+LUA_API void (lua_pushlstring) (State *L, const char *s, size_t len) {
+    stack_push(L, str2v(str_new(L, s, len)));
+    gc_check(L);
+}
+
+LUA_API void (lua_pushstring) (State *L, const char *s) {
+    if (s) {
+        lua_pushlstring(L, s, strlen(s));
+    } else {
+        lua_pushnil(L);
+    }
+}
+
+// Unlike Lua, the format is passed straight to 'vsnprintf', so any of the C
+// conversions can be used.
+LUA_API const char * (lua_pushvfstring) (State *L, const char *fmt,
+                                         va_list args) {
+    va_list args2;
+    va_copy(args2, args);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    char *buf = buf_reserve(L, (size_t) len + 1);
+    vsnprintf(buf, (size_t) len + 1, fmt, args2);
+    va_end(args2);
+    Str *str = str_new(L, buf, (size_t) len);
+    stack_push(L, str2v(str));
+    return str_cstr(L, str);
+}
+
+LUA_API const char * (lua_pushfstring) (State *L, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const char *s = lua_pushvfstring(L, fmt, args);
+    va_end(args);
+    return s;
+}
+
+LUA_API void (lua_pushboolean) (State *L, int b) {
+    stack_push(L, b ? VAL_TRUE : VAL_FALSE);
+}
+
+LUA_API void (lua_pushcclosure) (State *L, lua_CFunction fn, int n) {
+    assert(n == 0); // No upvalues yet
+    (void) n;
+    luaJ_pushbuiltin(L, fn, NULL);
+}
+
+LUA_API void (luaJ_pushbuiltin) (State *L, lua_CFunction f,
+                                 luaJ_Builtin fast) {
+    stack_push(L, cfn2v(cfn_new(L, f, fast)));
+}
+
+LUA_API void (lua_createtable) (State *L, int num_arr, int num_hash) {
+    stack_push(L, table2v(table_new(L, num_arr, num_hash)));
+    gc_check(L);
+}
+
+static Table * check_table(State *L, uint64_t v) {
+    if (!is_table(v)) {
+        err_run(L, NULL, "attempt to index a %s value", type_name(v));
+    }
+    return v2table(v);
+}
+
+static void check_key(State *L, uint64_t k) {
+    if (is_nil(k)) {
+        err_run(L, NULL, "table index is nil");
+    } else if (is_num(k) && v2n(k) != v2n(k)) {
+        err_run(L, NULL, "table index is NaN");
+    }
+}
+
+LUA_API void (lua_rawget) (State *L, int idx) {
+    Table *t = check_table(L, index2val(L, idx));
+    L->top[-1] = table_get(t, L->top[-1]);
+}
+
+LUA_API void (lua_gettable) (State *L, int idx) {
+    lua_rawget(L, idx); // No metatables
+}
+
+LUA_API void (lua_getfield) (State *L, int idx, const char *k) {
+    Table *t = check_table(L, index2val(L, idx));
+    uint64_t key = str2v(str_new(L, k, strlen(k)));
+    stack_push(L, table_get(t, key));
+}
+
+LUA_API void (lua_rawgeti) (State *L, int idx, int n) {
+    Table *t = check_table(L, index2val(L, idx));
+    stack_push(L, table_get(t, n2v((double) n)));
+}
+
+LUA_API void (lua_rawset) (State *L, int idx) {
+    Table *t = check_table(L, index2val(L, idx));
+    check_key(L, L->top[-2]);
+    table_set(L, t, L->top[-2], L->top[-1]);
+    L->top -= 2;
+}
+
+LUA_API void (lua_settable) (State *L, int idx) {
+    lua_rawset(L, idx); // No metatables
+}
+
+LUA_API void (lua_setfield) (State *L, int idx, const char *k) {
+    Table *t = check_table(L, index2val(L, idx));
+    uint64_t key = str2v(str_new(L, k, strlen(k)));
+    table_set(L, t, key, L->top[-1]);
+    L->top--;
+}
+
+LUA_API void (lua_rawseti) (State *L, int idx, int n) {
+    Table *t = check_table(L, index2val(L, idx));
+    table_set(L, t, n2v((double) n), L->top[-1]);
+    L->top--;
+}
+
 
 // ---- Stack Manipulation ----
 
 void stack_push(State *L, uint64_t v) {
-    ptrdiff_t n = L->top - L->stack;
-    if (n >= L->stack_size) {
-        L->stack = mem_realloc(L, L->stack,
-                L->stack_size * sizeof(uint64_t),
-                L->stack_size * sizeof(uint64_t) * 2);
-        L->stack_size *= 2;
-        L->top = &L->stack[n];
-    }
+    L->top = stack_check(L, L->top, 1);
     *(L->top++) = v;
 }
 
+uint64_t * stack_grow(State *L, uint64_t *s, int n) {
+    ptrdiff_t needed = (s - L->stack) + n;
+    int size = L->stack_size;
+    while (size < needed) {
+        size *= 2;
+    }
+    uint64_t *old = L->stack;
+    L->stack = mem_realloc(L, MEM_STACK, L->stack,
+            L->stack_size * sizeof(uint64_t),
+            size * sizeof(uint64_t));
+    for (int i = L->stack_size; i < size; i++) {
+        L->stack[i] = VAL_NIL; // The GC scans the whole stack
+    }
+    L->stack_size = size;
+    L->top = L->stack + (L->top - old);
+    L->base = L->stack + (L->base - old);
+    for (int i = 0; i < L->num_calls; i++) { // Rebase the callers' frames
+        CallInfo *c = &L->call_stack[i];
+        c->s = L->stack + (c->s - old);
+    }
+    for (Upval *uv = L->open_upvals; uv; uv = uv->next_open) {
+        uv->v = L->stack + (uv->v - old);
+    }
+    return L->stack + (s - old);
+}
+
 uint64_t stack_pop(State *L) {
     assert(L->top > L->stack);
     return *(--L->top);
@@ -139,6 +815,8 @@ uint64_t stack_pop(State *L) {
 
 int pcall(State *L, ProtectedFn f, void *ud) {
     ptrdiff_t saved_top = L->top - L->stack; // Save stack
+    ptrdiff_t saved_base = L->base - L->stack;
+    int saved_calls = L->num_calls;
     Err err = {0};
     err.parent = L->err;
     L->err = &err;
@@ -147,19 +825,39 @@ int pcall(State *L, ProtectedFn f, void *ud) {
     )
     L->err = err.parent; // Restore previous error recovery point
     if (err.status) {
-        uint64_t err_msg = stack_pop(L);
-        L->top = L->stack + saved_top; // Restore stack
-        stack_push(L, err_msg);
+        err_recover(L, err.status, saved_top, saved_base, saved_calls);
     }
     return err.status;
 }
 
+uint64_t err_value(State *L, int status) {
+    return status == LUA_ERRMEM ? str2v(L->mem_err) : L->top[-1];
+}
+
+void err_recover(State *L, int status, ptrdiff_t top, ptrdiff_t base,
+                 int num_calls) {
+    uint64_t err_msg = err_value(L, status);
+    upvals_close(L, L->stack + top); // Before they're overwritten
+    L->top = L->stack + top; // Restore stack
+    L->base = L->stack + base;
+    L->num_calls = num_calls;
+    stack_push(L, err_msg);
+}
+
 __attribute__((noreturn))
 static void trigger(State *L, int status) {
     if (L->err) { // If there's an error recovery point
         L->err->status = status;
         LUAI_THROW(L, L->err);
     } else {
+        char *msg = "not enough memory"; // 'L->mem_err' might not exist yet
+        if (status != LUA_ERRMEM) {
+            uint64_t v = L->top[-1];
+            msg = is_str(v) ? str_val(v2str(v)) :
+                "error object is not a string";
+        }
+        fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+                msg);
         exit(status);
     }
 }
@@ -176,15 +874,15 @@ static char * err_prefix(State *L, ErrInfo *info, size_t *prefix_len) {
     char *prefix;
     if (info->line >= 1 && info->col >= 1) {
         *prefix_len = snprintf(NULL, 0, "%s:%d:%d: ", name, info->line, info->col);
-        prefix = mem_alloc(L, sizeof(char) * (*prefix_len + 1));
+        prefix = mem_alloc(L, MEM_OTHER, sizeof(char) * (*prefix_len + 1));
         sprintf(prefix, "%s:%d:%d: ", name, info->line, info->col);
     } else if (info->line >= 1) {
         *prefix_len = snprintf(NULL, 0, "%s:%d: ", name, info->line);
-        prefix = mem_alloc(L, sizeof(char) * (*prefix_len + 1));
+        prefix = mem_alloc(L, MEM_OTHER, sizeof(char) * (*prefix_len + 1));
         sprintf(prefix, "%s:%d: ", name, info->line);
     } else {
         *prefix_len = snprintf(NULL, 0, "%s: ", name);
-        prefix = mem_alloc(L, sizeof(char) * (*prefix_len + 1));
+        prefix = mem_alloc(L, MEM_OTHER, sizeof(char) * (*prefix_len + 1));
         sprintf(prefix, "%s: ", name);
     }
     return prefix;
@@ -196,13 +894,15 @@ static void err_msg(State *L, ErrInfo *info, char *fmt, va_list args) {
     va_list args2;
     va_copy(args2, args);
     size_t msg_len = vsnprintf(NULL, 0, fmt, args);
-    size_t len = prefix_len + msg_len + 1;
-    Str *str = str_new(L, len);
-    char *msg = str_val(str);
-    strncpy(msg, prefix, prefix_len);
+    size_t len = prefix_len + msg_len;
+    char *msg = buf_reserve(L, len + 1);
+    memcpy(msg, prefix, prefix_len);
     vsnprintf(&msg[prefix_len], msg_len + 1, fmt, args2);
     va_end(args2);
-    stack_push(L, str2v(str));
+    if (info) { // Otherwise 'prefix' is a string constant
+        mem_free(L, MEM_OTHER, prefix, sizeof(char) * (prefix_len + 1));
+    }
+    stack_push(L, str2v(str_new(L, msg, len)));
 }
 
 void err_syntax(State *L, ErrInfo *info, char *fmt, ...) {
@@ -225,6 +925,26 @@ void err_mem(State *L) {
     trigger(L, LUA_ERRMEM);
 }
 
+void err_throw(State *L) {
+    trigger(L, LUA_ERRRUN);
+}
+
+void err_rethrow(State *L, int status) {
+    trigger(L, status);
+}
+
+int err_caller(State *L, ErrInfo *info) {
+    if (L->num_calls == 0 || !L->call_stack[L->num_calls - 1].fn) {
+        return 0;
+    }
+    CallInfo *c = &L->call_stack[L->num_calls - 1];
+    Fn *fn = (Fn *) c->fn;
+    info->chunk_name = fn->chunk_name;
+    info->line = fn_line(fn, c->ip - fn->ins);
+    info->col = -1;
+    return 1;
+}
+
 
 // ---- Memory Allocation ----
 
@@ -242,14 +962,176 @@ static void * realloc_raw(
     return ptr;
 }
 
-void * mem_alloc(State *L, size_t bytes) {
+// AddressSanitizer can't see use-after-frees inside a pool, so sanitized
+// builds send everything to 'alloc_fn'
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_ENABLED 0
+#else
+#define POOL_ENABLED 1
+#endif
+
+static inline int is_pooled(size_t bytes) {
+    return POOL_ENABLED && bytes > 0 && bytes <= POOL_MAX;
+}
+
+static inline int pool_class(size_t bytes) {
+    return (int) ((bytes - 1) / POOL_ALIGN);
+}
+
+static void * pool_alloc(State *L, size_t bytes) {
+    Pool *pool = &L->pool;
+    int class = pool_class(bytes);
+    PoolBlock *b = pool->free[class];
+    if (b) {
+        pool->free[class] = b->next;
+    } else {
+        size_t size = (size_t) (class + 1) * POOL_ALIGN;
+        if ((size_t) (pool->bump_end - pool->bump) < size) {
+            void **chunk = L->alloc_fn(L->alloc_ud, NULL, 0, POOL_CHUNK);
+            if (!chunk) {
+                err_mem(L);
+            }
+            *chunk = pool->chunks; // Space up to POOL_ALIGN holds the link
+            pool->chunks = chunk;
+            pool->bump = (char *) chunk + POOL_ALIGN;
+            pool->bump_end = (char *) chunk + POOL_CHUNK;
+        }
+        b = (PoolBlock *) pool->bump;
+        pool->bump += size;
+    }
+    return b;
+}
+
+static void pool_free(State *L, void *ptr, size_t bytes) {
+    PoolBlock *b = ptr;
+    int class = pool_class(bytes);
+    b->next = L->pool.free[class];
+    L->pool.free[class] = b;
+}
+
+void mem_free_pool(State *L) {
+    void *chunk = L->pool.chunks;
+    while (chunk) {
+        void *next = *(void **) chunk;
+        L->alloc_fn(L->alloc_ud, chunk, POOL_CHUNK, 0);
+        chunk = next;
+    }
+    L->pool = (Pool) {0};
+}
+
+static void * alloc_raw(State *L, size_t bytes) {
+    if (is_pooled(bytes)) {
+        return pool_alloc(L, bytes);
+    }
     return realloc_raw(L, NULL, 0, bytes);
 }
 
-void * mem_realloc(State *L, void *ptr, size_t old_bytes, size_t new_bytes) {
-    return realloc_raw(L, ptr, old_bytes, new_bytes);
+static void free_raw(State *L, void *ptr, size_t bytes) {
+    if (is_pooled(bytes)) {
+        pool_free(L, ptr, bytes);
+    } else {
+        realloc_raw(L, ptr, bytes, 0);
+    }
+}
+
+// Raises an error before an allocation that grows a block from 'old_bytes'
+// to 'new_bytes' would take the bytes in use over the limit. If they're
+// already over it (e.g., it was lowered), anything that grows fails.
+static inline void check_limit(State *L, size_t old_bytes, size_t new_bytes) {
+    size_t limit = L->mem.limit;
+    if (limit && new_bytes > old_bytes &&
+            (L->gc.total >= limit ||
+             new_bytes - old_bytes > limit - L->gc.total)) {
+        err_mem(L);
+    }
+}
+
+// Counts an allocation against 'site' once it's been made.
+static inline void account(State *L, int site, size_t old_bytes,
+                           size_t new_bytes) {
+    L->gc.total = L->gc.total - old_bytes + new_bytes;
+    L->mem.bytes[site] = L->mem.bytes[site] - old_bytes + new_bytes;
+    if (L->gc.total > L->mem.peak) {
+        L->mem.peak = L->gc.total;
+    }
+    if (new_bytes > old_bytes) {
+        L->mem.allocs[site]++;
+    }
+}
+
+void * mem_alloc(State *L, int site, size_t bytes) {
+    check_limit(L, 0, bytes);
+    void *ptr = alloc_raw(L, bytes);
+    account(L, site, 0, bytes);
+    return ptr;
+}
+
+void * mem_realloc(
+        State *L,
+        int site,
+        void *ptr,
+        size_t old_bytes,
+        size_t new_bytes) {
+    check_limit(L, old_bytes, new_bytes);
+    void *new_ptr = ptr;
+    if (!is_pooled(old_bytes) && !is_pooled(new_bytes)) {
+        new_ptr = realloc_raw(L, ptr, old_bytes, new_bytes);
+    } else if (!is_pooled(old_bytes) || !is_pooled(new_bytes) ||
+            pool_class(old_bytes) != pool_class(new_bytes)) {
+        new_ptr = alloc_raw(L, new_bytes); // Keep 'ptr' if this fails
+        if (new_ptr && ptr) {
+            memcpy(new_ptr, ptr, old_bytes < new_bytes ? old_bytes : new_bytes);
+        }
+        free_raw(L, ptr, old_bytes);
+    } // Otherwise the block still fits
+    account(L, site, old_bytes, new_bytes);
+    return new_ptr;
+}
+
+void mem_free(State *L, int site, void *ptr, size_t bytes) {
+    free_raw(L, ptr, bytes);
+    account(L, site, bytes, 0);
 }
 
-void mem_free(State *L, void *ptr, size_t bytes) {
-    realloc_raw(L, ptr, bytes, 0);
+void * mem_realloc_try(
+        State *L,
+        int site,
+        void *ptr,
+        size_t old_bytes,
+        size_t new_bytes) {
+    assert(!is_pooled(old_bytes) && !is_pooled(new_bytes));
+    void *new_ptr = L->alloc_fn(L->alloc_ud, ptr, old_bytes, new_bytes);
+    if (new_bytes > 0 && !new_ptr) {
+        return NULL;
+    }
+    account(L, site, old_bytes, new_bytes);
+    return new_ptr;
+}
+
+static void gc_full_protected(State *L, void *ud) {
+    (void) ud;
+    gc_full(L);
+}
+
+void mem_recover(State *L) {
+    for (uint64_t *s = L->top; s < L->stack + L->stack_size; s++) {
+        *s = VAL_NIL;
+    }
+    // The collector doesn't raise errors, but this runs outside any 'pcall',
+    // where one would exit the process
+    if (pcall(L, gc_full_protected, NULL)) {
+        L->top--; // Error value
+    }
+}
+
+char * buf_reserve(State *L, size_t bytes) {
+    if (!L->buf || bytes > L->buf_size) {
+        size_t size = L->buf_size > 0 ? L->buf_size : 64;
+        while (size < bytes) {
+            size *= 2;
+        }
+        L->buf = mem_realloc(L, MEM_OTHER, L->buf, L->buf_size, size);
+        L->buf_size = size;
+    }
+    return L->buf;
 }
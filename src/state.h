@@ -8,8 +8,10 @@
 // This file also implements all the library methods from 'lua.h'.
 
 #include <lua.h>
+#include <luaj.h>
 
 #include <stdint.h>
+#include <stdio.h>
 #include <setjmp.h>
 
 #include "bytecode.h"
@@ -31,38 +33,173 @@ typedef struct Err {
 
 typedef void (*ProtectedFn)(struct lua_State *L, void *ud);
 
+// Initial size of the stack (in slots) and the call stack
+#define STACK_MIN 64
+#define CALLS_MIN 8
+
 typedef struct {
-    void *fn;    // Caller function (Fn *)
+    void *fn;    // Caller function (Fn *), or NULL if called from C
     BcIns *ip;   // Caller IP
     uint64_t *s; // Caller stack base pointer
     int num_rets;
+    int protect; // Call to 'pcall' from Lua, which catches errors above it
 } CallInfo;
 
+// Allocations of up to POOL_MAX bytes are served from per-state free lists,
+// one for each multiple of POOL_ALIGN, instead of going to 'alloc_fn'. Blocks
+// are carved out of POOL_CHUNK byte chunks (allocated with 'alloc_fn') and
+// are never returned to it until 'lua_close'.
+#define POOL_MAX     256
+#define POOL_ALIGN   16
+#define POOL_CHUNK   (16 * 1024)
+#define POOL_CLASSES (POOL_MAX / POOL_ALIGN)
+
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+    PoolBlock *free[POOL_CLASSES]; // Free list for each size class
+    void *chunks; // Linked list of chunks; each starts with the next pointer
+    char *bump, *bump_end; // Unused space at the end of the newest chunk
+} Pool;
+
+// Garbage collector state (see 'gc.h').
+typedef struct {
+    struct Obj *objs;  // Linked list of every GC object
+    int phase;
+    uint8_t white;     // Current white color
+    struct Obj **gray; // Stack of gray objects waiting to be traversed
+    int num_gray, max_gray;
+    int gray_lost; // Objects were left gray off the stack (see 'push_gray')
+    struct Obj **sweep; // Next object to sweep (pointer to a 'next' field)
+    size_t total;       // Total bytes allocated
+    size_t threshold;   // Perform a GC step when 'total' reaches this
+    size_t estimate;    // Estimate of bytes in use after the last collection
+    int pause, stepmul; // Tuning parameters; see 'lua_gc'
+    int stopped;
+    struct Coro *coros; // Every coroutine, linked through 'next_coro'
+} GC;
+
+// Every allocation is counted against a site, which is what the memory is
+// used for (see 'luaJ_memstats')
+enum {
+    MEM_STR = LUAJ_MEM_STRING,
+    MEM_TABLE = LUAJ_MEM_TABLE,
+    MEM_FN = LUAJ_MEM_FUNCTION,
+    MEM_STACK = LUAJ_MEM_STACK,
+    MEM_PARSER = LUAJ_MEM_PARSER,
+    MEM_JIT = LUAJ_MEM_JIT,
+    MEM_OTHER = LUAJ_MEM_OTHER,
+};
+
+// Memory accounting. The bytes in use are 'L->gc.total', which the GC paces
+// itself by.
+typedef struct {
+    size_t peak;  // Most bytes ever in use
+    size_t limit; // Allocations that would go over this fail; 0 for no limit
+    size_t bytes[LUAJ_MEM_SITES];  // In use for each site
+    size_t allocs[LUAJ_MEM_SITES]; // Allocations ever made for each site
+} Mem;
+
+// Hash table of every string (see 'str_new'). The size is a power of 2.
+typedef struct {
+    struct Str **hash; // Buckets, chained through 'Str.chain'
+    int size;
+    int num;
+} StrTable;
+
 typedef struct lua_State {
     // Memory allocation
     lua_Alloc alloc_fn;
     void *alloc_ud;
+    Pool pool;
+    Mem mem;
+    GC gc;
 
     // Error handling
     Err *err;
+    struct Str *mem_err; // LUA_ERRMEM's value, made up front
 
-    // Stack
+    // Stack; starts out at STACK_MIN slots and grows on demand (see
+    // 'stack_check'), so pointers into it are only valid until the next call
     uint64_t *stack;
     uint64_t *top;
+    uint64_t *base; // Stack index 1 for the C API
     int stack_size;
 
-    // Call stack
+    // Call stack; limited to LUAI_MAXCALLS nested calls
     CallInfo *call_stack;
     int num_calls, max_calls;
+
+    // Open upvalues, sorted by stack slot with the highest first
+    struct Upval *open_upvals;
+
+    // Running coroutine, or NULL for the main thread. The stacks and open
+    // upvalues above belong to whichever one is running (see 'coro.h')
+    struct Coro *co;
+
+    // Global variables; a table value, so that LUA_GLOBALSINDEX has a slot
+    uint64_t globals;
+
+    // Strings
+    StrTable strs;
+    char *buf; // Scratch buffer for building strings
+    size_t buf_size;
+
+    // JIT
+    void *rec; // Trace currently being recorded (Trace *), or NULL
+
+    // Debug listings (see 'luaJ_dumpbc')
+    FILE *dump_bc; // NULL if listings are off
+    int owns_dump_bc; // Opened from LUAJ_DUMP_BC, so closed by 'lua_close'
+
+    // Profiler (see 'profile.h')
+    struct Profile *prof; // NULL if the profiler is off
+
+#ifdef LUAJ_STATS
+    struct Stats *stats; // Interpreter counters (see 'stats.h')
+#endif
 } State;
 
-// Memory allocation
-void * mem_alloc(State *L, size_t bytes);
-void * mem_realloc(State *L, void *ptr, size_t old_bytes, size_t new_bytes);
-void mem_free(State *L, void *ptr, size_t bytes);
+// Memory allocation, counted against 'site' (one of the 'MEM_*' values). An
+// allocation that fails, or would go over 'L->mem.limit', raises an error.
+void * mem_alloc(State *L, int site, size_t bytes);
+void * mem_realloc(State *L, int site, void *ptr, size_t old_bytes,
+                   size_t new_bytes);
+void mem_free(State *L, int site, void *ptr, size_t bytes);
+void mem_free_pool(State *L);
+
+// Same as 'mem_realloc', but returns NULL rather than raising an error if
+// the allocation fails, and isn't held to the limit. Only for the collector's
+// own blocks, which must be too big for the pool (see 'push_gray').
+void * mem_realloc_try(State *L, int site, void *ptr, size_t old_bytes,
+                       size_t new_bytes);
+
+// Called once an out of memory error has been caught, with 'L->top' above
+// every live value. The stale copies of values above it are cleared, since
+// the GC would otherwise keep them alive (see 'mark_roots'), and a full
+// collection frees what the unwound calls were using.
+void mem_recover(State *L);
+
+// Returns 'L->buf' after growing it to at least 'bytes'. The contents are
+// preserved.
+char * buf_reserve(State *L, size_t bytes);
 
 // Protected calls and errors
 int pcall(State *L, ProtectedFn f, void *ud);
+
+// Returns the value of an error with 'status' that's just been raised. It's
+// on top of the stack, except for LUA_ERRMEM, which has a fixed message.
+uint64_t err_value(State *L, int status);
+
+// Recovers from an error with 'status' in a protected call, like 'pcall'
+// does. The stack is put back to 'top' and 'base' (offsets into the stack)
+// and the call stack to 'num_calls' entries, and the error value is moved to
+// the new top.
+void err_recover(State *L, int status, ptrdiff_t top, ptrdiff_t base,
+                 int num_calls);
+
 __attribute__((noreturn))
 void err_syntax(State *L, ErrInfo *info, char *fmt, ...);
 __attribute__((noreturn))
@@ -70,8 +207,37 @@ void err_run(State *L, ErrInfo *info, char *fmt, ...);
 __attribute__((noreturn))
 void err_mem(State *L);
 
+// Throws the value on top of the stack as a runtime error.
+__attribute__((noreturn))
+void err_throw(State *L);
+
+// Passes on an error with 'status' that was caught, whose error value (if
+// any) is still on top of the stack.
+__attribute__((noreturn))
+void err_rethrow(State *L, int status);
+
+// Sets 'info' to the location of the Lua code that called the running C
+// function. Returns 0 if there isn't one (e.g., it was called from C).
+int err_caller(State *L, ErrInfo *info);
+
+// Same as 'lua_load', but for a chunk that's already in memory. The source
+// is lexed in place rather than going through a 'lua_Reader'.
+int load_buf(State *L, const char *s, size_t len, const char *chunk_name);
+
 // Stack manipulation
 void stack_push(State *L, uint64_t v);
 uint64_t stack_pop(State *L);
 
+// Reallocates the stack so there are at least 'n' slots from 's' (a pointer
+// into the stack) onwards. 'L->top' and the saved 'CallInfo.s' pointers are
+// rebased onto the new stack; the rebased 's' is returned.
+uint64_t * stack_grow(State *L, uint64_t *s, int n);
+
+static inline uint64_t * stack_check(State *L, uint64_t *s, int n) {
+    if (L->stack_size - (s - L->stack) < n) {
+        return stack_grow(L, s, n);
+    }
+    return s;
+}
+
 #endif
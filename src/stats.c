@@ -0,0 +1,121 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#ifdef LUAJ_STATS
+
+static const char * const OP_NAMES[] = {
+#define X(name, _) #name,
+    BYTECODE
+#undef X
+};
+
+void stats_init(State *L) {
+    Stats *st = mem_alloc(L, MEM_OTHER, sizeof(Stats));
+    memset(st->ops, 0, sizeof(st->ops));
+    st->fns = NULL;
+    st->num_fns = st->max_fns = 0;
+    L->stats = st;
+}
+
+void stats_free(State *L) {
+    Stats *st = L->stats;
+    mem_free(L, MEM_OTHER, st->fns, sizeof(Fn *) * st->max_fns);
+    mem_free(L, MEM_OTHER, st, sizeof(Stats));
+    L->stats = NULL;
+}
+
+void stats_add_fn(State *L, Fn *fn) {
+    Stats *st = L->stats;
+    if (st->num_fns >= st->max_fns) {
+        int max = st->max_fns > 0 ? st->max_fns * 2 : 64;
+        st->fns = mem_realloc(L, MEM_OTHER, st->fns,
+                sizeof(Fn *) * st->max_fns, sizeof(Fn *) * max);
+        st->max_fns = max;
+    }
+    st->fns[st->num_fns++] = fn;
+}
+
+
+// ---- Output ----
+
+typedef struct {
+    int op;
+    uint64_t count;
+} OpCount;
+
+static int cmp_ops(const void *a, const void *b) {
+    const OpCount *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1; // Most executed first
+    }
+    return x->op - y->op;
+}
+
+static int cmp_fns(const void *a, const void *b) {
+    const Fn *x = *(Fn * const *) a, *y = *(Fn * const *) b;
+    if (x->num_calls != y->num_calls) {
+        return x->num_calls < y->num_calls ? 1 : -1; // Most called first
+    }
+    return 0;
+}
+
+static void write_str(FILE *out, const char *s, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void stats_write(State *L, FILE *out) {
+    Stats *st = L->stats;
+    OpCount ops[BC_LAST];
+    int num_ops = 0;
+    for (int i = 0; i < BC_LAST; i++) {
+        if (st->ops[i] > 0) {
+            ops[num_ops++] = (OpCount) { i, st->ops[i] };
+        }
+    }
+    qsort(ops, num_ops, sizeof(OpCount), cmp_ops);
+    fprintf(out, "{\"ops\": {");
+    for (int i = 0; i < num_ops; i++) {
+        fprintf(out, "%s\n  \"%s\": %llu", i > 0 ? "," : "",
+                OP_NAMES[ops[i].op], (unsigned long long) ops[i].count);
+    }
+    fprintf(out, "%s}, \"functions\": [", num_ops > 0 ? "\n" : "");
+    qsort(st->fns, st->num_fns, sizeof(Fn *), cmp_fns);
+    for (int i = 0; i < st->num_fns; i++) {
+        Fn *f = st->fns[i];
+        fprintf(out, "%s\n  {\"name\": ", i > 0 ? "," : "");
+        if (f->name) {
+            write_str(out, str_val(f->name), f->name->len);
+        } else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ", \"chunk\": ");
+        if (f->chunk_name) {
+            write_str(out, f->chunk_name, strlen(f->chunk_name));
+        } else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ", \"line\": %d, \"calls\": %llu, \"missing_args\": %llu, "
+                "\"missing_rets\": %llu}", f->start_line,
+                (unsigned long long) f->num_calls,
+                (unsigned long long) f->missing_args,
+                (unsigned long long) f->missing_rets);
+    }
+    fprintf(out, "%s]}\n", st->num_fns > 0 ? "\n" : "");
+    fflush(out);
+}
+
+#endif
@@ -0,0 +1,67 @@
+
+#ifndef LUAJ_STATS_H
+#define LUAJ_STATS_H
+
+// Interpreter counters, for working out which instructions and calls are
+// worth specialising. They're only compiled in with the LUAJ_STATS CMake
+// option; otherwise the macros below expand to nothing, and neither 'State'
+// nor 'Fn' has any of the fields.
+//
+// 'execute' counts every instruction it dispatches by opcode, which includes
+// the instructions a trace exits to, but not the ones the trace ran. Each
+// Lua function counts its calls, the calls that passed it fewer arguments
+// than it has parameters, and the returns from it with fewer values than its
+// caller wanted; the missing values in both cases are filled in with nil.
+//
+// A function is added to 'fns' the first time it's called, and the GC keeps
+// the functions there alive until the state is closed, so they can still be
+// reported after the chunk they're from has finished.
+
+#include <stdio.h>
+
+#include "value.h"
+#include "bytecode.h"
+
+#ifdef LUAJ_STATS
+
+typedef struct Stats {
+    uint64_t ops[BC_LAST]; // Instructions executed, by opcode
+    Fn **fns;
+    int num_fns, max_fns;
+} Stats;
+
+void stats_init(State *L);
+void stats_free(State *L);
+void stats_add_fn(State *L, Fn *fn);
+
+// Writes the counters as JSON (see 'luaJ_stats').
+void stats_write(State *L, FILE *out);
+
+#define STATS_OP(L, ins) ((L)->stats->ops[bc_op(ins)]++)
+
+#define STATS_CALL(L, fn, num_args)                     \
+    do {                                                \
+        if ((fn)->num_calls++ == 0) {                   \
+            stats_add_fn((L), (fn));                    \
+        }                                               \
+        if ((num_args) < (fn)->num_params) {            \
+            (fn)->missing_args++;                       \
+        }                                               \
+    } while (0)
+
+#define STATS_RET(fn, num_vals, num_wanted) \
+    do {                                    \
+        if ((num_vals) < (num_wanted)) {    \
+            (fn)->missing_rets++;           \
+        }                                   \
+    } while (0)
+
+#else
+
+#define STATS_OP(L, ins)                    ((void) 0)
+#define STATS_CALL(L, fn, num_args)         ((void) 0)
+#define STATS_RET(fn, num_vals, num_wanted) ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,226 @@
+
+#include <assert.h>
+
+#include "table.h"
+
+#define MIN_ARR  4
+#define MIN_HASH 4
+
+// Hash part is resized when more than 3/4 of its nodes are in use
+#define MAX_LOAD(size) ((size) / 4 * 3)
+
+Table * table_new(State *L, uint32_t num_arr, uint32_t num_hash) {
+    Table *t = (Table *) obj_new(L, OBJ_TABLE, sizeof(Table));
+    t->arr = NULL;
+    t->num_arr = t->max_arr = 0;
+    t->hash = NULL;
+    t->hash_size = t->num_hash = 0;
+    if (num_arr > 0) {
+        t->arr = mem_alloc(L, MEM_TABLE, sizeof(uint64_t) * num_arr);
+        t->max_arr = num_arr;
+    }
+    if (num_hash > 0) {
+        uint32_t size = MIN_HASH;
+        while (MAX_LOAD(size) < num_hash) {
+            size *= 2;
+        }
+        t->hash = mem_alloc(L, MEM_TABLE, sizeof(Node) * size);
+        for (uint32_t i = 0; i < size; i++) {
+            t->hash[i].k = t->hash[i].v = VAL_NIL;
+        }
+        t->hash_size = size;
+    }
+    return t;
+}
+
+void table_free(State *L, Table *t) {
+    mem_free(L, MEM_TABLE, t->arr, sizeof(uint64_t) * t->max_arr);
+    mem_free(L, MEM_TABLE, t->hash, sizeof(Node) * t->hash_size);
+    obj_free(L, (Obj *) t, sizeof(Table));
+}
+
+
+// ---- Hash Part ----
+
+static uint32_t hash_key(uint64_t k) {
+    if (is_str(k)) {
+        return v2str(k)->hash;
+    }
+    k ^= k >> 33; // MurmurHash3 finaliser
+    k *= 0xff51afd7ed558ccd;
+    k ^= k >> 33;
+    return (uint32_t) k;
+}
+
+// -0 and 0 are the same key
+static uint64_t normalise_key(uint64_t k) {
+    return k == n2v(-0.0) ? n2v(0.0) : k;
+}
+
+// Returns the index of the node with the key 'k', or -1.
+static int64_t find_node(Table *t, uint64_t k) {
+    if (t->hash_size == 0) {
+        return -1;
+    }
+    uint32_t mask = t->hash_size - 1;
+    for (uint32_t i = hash_key(k) & mask; ; i = (i + 1) & mask) {
+        Node *n = &t->hash[i];
+        if (n->k == k) {
+            return i;
+        } else if (is_nil(n->k)) {
+            return -1;
+        }
+    }
+}
+
+static void resize_hash(State *L, Table *t) {
+    uint32_t num_live = 1; // Including the key about to be inserted
+    for (uint32_t i = 0; i < t->hash_size; i++) {
+        num_live += !is_nil(t->hash[i].v);
+    }
+    uint32_t size = MIN_HASH;
+    while (MAX_LOAD(size) < num_live) {
+        size *= 2;
+    }
+    Node *hash = mem_alloc(L, MEM_TABLE, sizeof(Node) * size);
+    for (uint32_t i = 0; i < size; i++) {
+        hash[i].k = hash[i].v = VAL_NIL;
+    }
+    uint32_t mask = size - 1;
+    uint32_t num_hash = 0;
+    for (uint32_t i = 0; i < t->hash_size; i++) {
+        Node *n = &t->hash[i];
+        if (is_nil(n->v)) {
+            continue; // Drop nodes with nil values
+        }
+        uint32_t j = hash_key(n->k) & mask;
+        while (!is_nil(hash[j].k)) {
+            j = (j + 1) & mask;
+        }
+        hash[j] = *n;
+        num_hash++;
+    }
+    mem_free(L, MEM_TABLE, t->hash, sizeof(Node) * t->hash_size);
+    t->hash = hash;
+    t->hash_size = size;
+    t->num_hash = num_hash;
+}
+
+// Returns the index of the node for 'k', creating it if it doesn't exist.
+static uint32_t insert_node(State *L, Table *t, uint64_t k) {
+    int64_t idx = find_node(t, k);
+    if (idx >= 0) {
+        return (uint32_t) idx;
+    }
+    if (t->num_hash + 1 > MAX_LOAD(t->hash_size)) {
+        resize_hash(L, t);
+    }
+    uint32_t mask = t->hash_size - 1;
+    uint32_t i = hash_key(k) & mask;
+    while (!is_nil(t->hash[i].k) && !is_nil(t->hash[i].v)) {
+        i = (i + 1) & mask; // Find an unused node, or one with a nil value
+    }
+    if (is_nil(t->hash[i].k)) {
+        t->num_hash++;
+    }
+    t->hash[i].k = k;
+    t->hash[i].v = VAL_NIL;
+    return i;
+}
+
+
+// ---- Array Part ----
+
+// Returns 1 if 'k' is the integer key 'i + 1'.
+static inline int arr_idx(uint64_t k, uint32_t max, uint32_t *i) {
+    if (!is_num(k)) {
+        return 0;
+    }
+    double n = v2n(k);
+    if (n >= 1 && n <= max) {
+        *i = (uint32_t) n - 1;
+        return *i + 1 == n;
+    }
+    return 0;
+}
+
+// Appends 'v' to the array part, then pulls across any keys that follow from
+// the hash part.
+static void arr_push(State *L, Table *t, uint64_t v) {
+    do {
+        if (t->num_arr >= t->max_arr) {
+            uint32_t max = t->max_arr > 0 ? t->max_arr * 2 : MIN_ARR;
+            t->arr = mem_realloc(L, MEM_TABLE, t->arr,
+                    sizeof(uint64_t) * t->max_arr,
+                    sizeof(uint64_t) * max);
+            t->max_arr = max;
+        }
+        t->arr[t->num_arr++] = v;
+        int64_t idx = find_node(t, n2v((double) t->num_arr + 1));
+        if (idx < 0 || is_nil(t->hash[idx].v)) {
+            break;
+        }
+        v = t->hash[idx].v;
+        t->hash[idx].v = VAL_NIL;
+    } while (1);
+}
+
+
+// ---- Lookup and Assignment ----
+
+uint64_t table_get(Table *t, uint64_t k) {
+    uint32_t i;
+    if (arr_idx(k, t->num_arr, &i)) {
+        return t->arr[i];
+    }
+    int64_t idx = find_node(t, normalise_key(k));
+    return idx >= 0 ? t->hash[idx].v : VAL_NIL;
+}
+
+void table_set(State *L, Table *t, uint64_t k, uint64_t v) {
+    gc_barrier_back(L, (Obj *) t);
+    uint32_t i;
+    if (arr_idx(k, t->num_arr + 1, &i)) {
+        if (i < t->num_arr) {
+            t->arr[i] = v;
+            return;
+        } else if (!is_nil(v)) {
+            arr_push(L, t, v);
+            return;
+        }
+    }
+    k = normalise_key(k);
+    if (is_nil(v)) { // Don't create a node just to store nil
+        int64_t idx = find_node(t, k);
+        if (idx >= 0) {
+            t->hash[idx].v = VAL_NIL;
+        }
+        return;
+    }
+    uint32_t idx = insert_node(L, t, k); // May resize 't->hash'
+    t->hash[idx].v = v;
+}
+
+uint64_t table_get_str_slow(Table *t, uint64_t k, uint32_t *hint) {
+    int64_t idx = find_node(t, k);
+    if (idx < 0) {
+        return VAL_NIL;
+    }
+    *hint = (uint32_t) idx;
+    return t->hash[idx].v;
+}
+
+void table_set_str_slow(State *L, Table *t, uint64_t k, uint64_t v,
+                        uint32_t *hint) {
+    gc_barrier_back(L, (Obj *) t);
+    if (is_nil(v)) {
+        int64_t idx = find_node(t, k);
+        if (idx >= 0) {
+            t->hash[idx].v = VAL_NIL;
+        }
+        return;
+    }
+    uint32_t idx = insert_node(L, t, k);
+    t->hash[idx].v = v;
+    *hint = idx;
+}
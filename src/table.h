@@ -0,0 +1,77 @@
+
+#ifndef LUAJ_TABLE_H
+#define LUAJ_TABLE_H
+
+// Tables are split into an array part and a hash part.
+//
+// The array part stores the values for the integer keys 1 to 'num_arr'
+// contiguously. It grows when a value is assigned to the key 'num_arr + 1',
+// at which point any keys that follow on from it are moved out of the hash
+// part.
+//
+// Every other key lives in the hash part, which uses open addressing with
+// linear probing. Keys are compared by their NaN-boxed value, which works for
+// strings because they're interned. Assigning nil to a key leaves its node in
+// place (so probe sequences aren't broken); nodes with nil values are reused
+// by new keys and dropped when the hash part is resized.
+//
+// Since a key never moves around in the hash part until it's resized, the
+// interpreter caches the node index for constant string keys in each 'TGETS'
+// and 'TSETS' instruction (see 'table_get_str').
+
+#include "value.h"
+#include "gc.h"
+
+typedef struct {
+    uint64_t k, v; // Unused nodes have a nil key
+} Node;
+
+typedef struct {
+    ObjHeader;
+    uint64_t *arr; // 'arr[i]' holds the value for the key 'i + 1'
+    uint32_t num_arr, max_arr;
+    Node *hash;
+    uint32_t hash_size; // 0 or a power of 2
+    uint32_t num_hash;  // Number of nodes with a non-nil key
+} Table;
+
+Table * table_new(State *L, uint32_t num_arr, uint32_t num_hash);
+void table_free(State *L, Table *t);
+
+static inline uint64_t table2v(Table *t)  { return ptr2v(t); }
+static inline Table * v2table(uint64_t v) { return (Table *) v2ptr(v); }
+static inline int is_table(uint64_t v)    { return is_obj(v, OBJ_TABLE); }
+
+// Returns nil if the key doesn't exist.
+uint64_t table_get(Table *t, uint64_t k);
+
+// The caller must make sure that 'k' isn't nil or NaN.
+void table_set(State *L, Table *t, uint64_t k, uint64_t v);
+
+// Lookup and assignment for string keys. 'hint' is an inline cache: it's the
+// index of the node that held the key last time, and is updated when that's
+// no longer the case.
+uint64_t table_get_str_slow(Table *t, uint64_t k, uint32_t *hint);
+void table_set_str_slow(State *L, Table *t, uint64_t k, uint64_t v,
+                        uint32_t *hint);
+
+static inline uint64_t table_get_str(Table *t, uint64_t k, uint32_t *hint) {
+    uint32_t i = *hint;
+    if (i < t->hash_size && t->hash[i].k == k) {
+        return t->hash[i].v;
+    }
+    return table_get_str_slow(t, k, hint);
+}
+
+static inline void table_set_str(State *L, Table *t, uint64_t k, uint64_t v,
+                                 uint32_t *hint) {
+    uint32_t i = *hint;
+    if (i < t->hash_size && t->hash[i].k == k) {
+        gc_barrier_back(L, (Obj *) t);
+        t->hash[i].v = v;
+        return;
+    }
+    table_set_str_slow(L, t, k, v, hint);
+}
+
+#endif
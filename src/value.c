@@ -1,82 +1,433 @@
 
 #include <string.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <assert.h>
 
 #include "value.h"
+#include "jit.h"
+#include "gc.h"
 
-static Obj * obj_new(State *L, uint8_t type, size_t bytes) {
-    Obj *obj = mem_alloc(L, bytes);
+// The allocation site each type of object is counted against
+static const uint8_t OBJ_SITE[] = {
+    [OBJ_STR] = MEM_STR, [OBJ_FN] = MEM_FN, [OBJ_CLOSURE] = MEM_FN,
+    [OBJ_UPVAL] = MEM_FN, [OBJ_CFN] = MEM_FN, [OBJ_TABLE] = MEM_TABLE,
+    [OBJ_CORO] = MEM_STACK,
+};
+
+Obj * obj_new(State *L, uint8_t type, size_t bytes) {
+    Obj *obj = mem_alloc(L, OBJ_SITE[type], bytes);
     obj->type = type;
     obj->_pad1 = 0;
     obj->_pad2 = 0;
-    obj->_pad3 = 0;
+    gc_link(L, obj);
     return obj;
 }
 
-static void obj_free(State *L, Obj *obj, size_t bytes) {
-    mem_free(L, obj, bytes);
+void obj_free(State *L, Obj *obj, size_t bytes) {
+    mem_free(L, OBJ_SITE[obj->type], obj, bytes);
+}
+
+
+// ---- Strings ----
+
+#define STR_TABLE_MIN 64
+
+// Strings at least this long that are built by 'str_concat' use a 'StrBuf'
+#define STR_BUF_MIN 64
+
+// Same as Lua 5.1's hash function; long strings are sampled rather than
+// hashed in their entirety.
+static uint32_t str_hash(const char *s, size_t len) {
+    uint32_t h = (uint32_t) len;
+    size_t step = (len >> 5) + 1;
+    for (size_t i = len; i >= step; i -= step) {
+        h = h ^ ((h << 5) + (h >> 2) + (uint8_t) s[i - 1]);
+    }
+    return h;
+}
+
+static void str_table_resize(State *L, int size) {
+    StrTable *t = &L->strs;
+    Str **hash = mem_alloc(L, MEM_STR, sizeof(Str *) * size);
+    for (int i = 0; i < size; i++) {
+        hash[i] = NULL;
+    }
+    for (int i = 0; i < t->size; i++) {
+        Str *str = t->hash[i];
+        while (str) {
+            Str *next = str->chain;
+            int idx = (int) (str->hash & (size - 1));
+            str->chain = hash[idx];
+            hash[idx] = str;
+            str = next;
+        }
+    }
+    mem_free(L, MEM_STR, t->hash, sizeof(Str *) * t->size);
+    t->hash = hash;
+    t->size = size;
+}
+
+void str_table_init(State *L) {
+    L->strs.hash = NULL;
+    L->strs.size = L->strs.num = 0;
+    str_table_resize(L, STR_TABLE_MIN);
+}
+
+void str_table_free(State *L) {
+    assert(L->strs.num == 0); // All strings have been freed by the GC
+    mem_free(L, MEM_STR, L->strs.hash, sizeof(Str *) * L->strs.size);
+    L->strs.hash = NULL;
+    L->strs.size = 0;
 }
 
-Str * str_new(State *L, size_t len) {
-    Str *str = (Str *) obj_new(L, OBJ_STR, sizeof(Str) + sizeof(char) * len);
+static Str * str_find(State *L, const char *s, size_t len, uint32_t h) {
+    Str *str = L->strs.hash[h & (L->strs.size - 1)];
+    for (; str; str = str->chain) {
+        if (str->hash == h && str->len == len &&
+                memcmp(str_val(str), s, len) == 0) {
+            gc_revive(L, (Obj *) str);
+            return str;
+        }
+    }
+    return NULL;
+}
+
+static void str_link(State *L, Str *str, uint32_t h, size_t len) {
+    StrTable *t = &L->strs;
+    Str **bucket = &t->hash[h & (t->size - 1)];
+    str->hash = h;
     str->len = len;
+    str->chain = *bucket;
+    *bucket = str;
+    if (++t->num > t->size) {
+        str_table_resize(L, t->size * 2);
+    }
+}
+
+Str * str_new(State *L, const char *s, size_t len) {
+    uint32_t h = str_hash(s, len);
+    Str *str = str_find(L, s, len, h);
+    if (str) {
+        return str;
+    }
+    size_t bytes = sizeof(Str) + sizeof(char) * (len + 1);
+    str = (Str *) obj_new(L, OBJ_STR, bytes);
+    str->chars = (char *) (str + 1);
+    memcpy(str->chars, s, len);
+    str->chars[len] = '\0';
+    str_link(L, str, h, len);
+    return str;
+}
+
+// Returns the buffer holding the contents of 'str', or NULL if they're stored
+// after the struct. Strings always start at the beginning of a buffer.
+static StrBuf * str_buf(Str *str) {
+    if (str->chars == (char *) (str + 1)) {
+        return NULL;
+    }
+    return (StrBuf *) (str->chars - offsetof(StrBuf, chars));
+}
+
+static void free_buf(State *L, StrBuf *b) {
+    mem_free(L, MEM_STR, b, sizeof(StrBuf) + b->cap);
+}
+
+Str * str_concat(State *L, uint64_t *vals, int n, size_t len) {
+    if (len < STR_BUF_MIN) { // Short strings are just copied
+        char *dst = buf_reserve(L, len);
+        for (int i = 0; i < n; i++) {
+            Str *str = v2str(vals[i]);
+            memcpy(dst, str_val(str), str->len);
+            dst += str->len;
+        }
+        return str_new(L, L->buf, len);
+    }
+    Str *first = v2str(vals[0]);
+    StrBuf *b = str_buf(first);
+    size_t start = 0;
+    int i = 0;
+    if (b && b->len == first->len && len < b->cap) {
+        start = first->len; // 'first' is the longest in 'b'; append in place
+        i = 1;
+    } else { // Doubling the capacity keeps appends amortised linear
+        b = mem_alloc(L, MEM_STR, sizeof(StrBuf) + len * 2);
+        b->refs = 0;
+        b->len = 0;
+        b->cap = len * 2;
+    }
+    char *dst = &b->chars[start];
+    for (; i < n; i++) {
+        Str *str = v2str(vals[i]);
+        memcpy(dst, str_val(str), str->len);
+        dst += str->len;
+    }
+    b->chars[len] = '\0';
+    uint32_t h = str_hash(b->chars, len);
+    Str *str = str_find(L, b->chars, len, h);
+    if (!str) {
+        str = (Str *) obj_new(L, OBJ_STR, sizeof(Str));
+        str->chars = b->chars;
+        str_link(L, str, h, len);
+        b->refs++;
+        b->len = len;
+    } else if (b->refs == 0) { // Already interned; don't need a new buffer
+        free_buf(L, b);
+    }
     return str;
 }
 
+char * str_cstr(State *L, Str *str) {
+    StrBuf *b = str_buf(str);
+    if (str->chars[str->len] == '\0') { // Always the case if 'b' is NULL
+        if (b && b->len == str->len) {
+            b->len = SIZE_MAX; // Don't append over the terminator
+        }
+        return str->chars;
+    }
+    StrBuf *own = mem_alloc(L, MEM_STR, sizeof(StrBuf) + str->len + 1);
+    own->refs = 1;
+    own->len = str->len;
+    own->cap = str->len + 1;
+    memcpy(own->chars, str->chars, str->len);
+    own->chars[str->len] = '\0';
+    if (--b->refs == 0) {
+        free_buf(L, b);
+    }
+    str->chars = own->chars;
+    return str->chars;
+}
+
 void str_free(State *L, Str *str) {
-    obj_free(L, (Obj *) str, sizeof(Str) + sizeof(char) * str->len);
+    Str **p = &L->strs.hash[str->hash & (L->strs.size - 1)];
+    while (*p != str) {
+        p = &(*p)->chain;
+    }
+    *p = str->chain;
+    L->strs.num--;
+    StrBuf *b = str_buf(str);
+    if (b) {
+        if (--b->refs == 0) {
+            free_buf(L, b);
+        }
+        obj_free(L, (Obj *) str, sizeof(Str));
+    } else {
+        obj_free(L, (Obj *) str, sizeof(Str) + sizeof(char) * (str->len + 1));
+    }
 }
 
+
+// ---- Functions ----
+
+
 Fn * fn_new(State *L, Str *fn_name, char *chunk_name) {
     Fn *f = (Fn *) obj_new(L, OBJ_FN, sizeof(Fn));
     f->name = fn_name;
     f->chunk_name = chunk_name;
     f->start_line = f->end_line = -1;
     f->num_params = 0;
+    f->max_stack = 0;
     f->num_ins = 0;
     f->max_ins = 64;
-    f->ins = mem_alloc(L, sizeof(BcIns) * f->max_ins);
-    f->line_info = mem_alloc(L, sizeof(int) * f->max_ins);
+    f->ins = mem_alloc(L, MEM_FN, sizeof(BcIns) * f->max_ins);
+    f->line_info = mem_alloc(L, MEM_FN, sizeof(int) * f->max_ins);
+    f->lines = NULL;
+    f->num_lines = 0;
+    f->ic = mem_alloc(L, MEM_FN, sizeof(uint32_t) * f->max_ins);
     f->num_k = 0;
     f->max_k = 16;
-    f->k = mem_alloc(L, sizeof(uint64_t) * f->max_k);
+    f->k = mem_alloc(L, MEM_FN, sizeof(uint64_t) * f->max_k);
+    f->upvals = NULL;
+    f->num_upvals = 0;
+    for (int i = 0; i < HOT_LOOP_SLOTS; i++) {
+        f->hot_loops[i] = HOT_LOOP;
+    }
+    f->hot_call = HOT_CALL;
+    f->traces = NULL;
+#ifdef LUAJ_STATS
+    f->num_calls = f->missing_args = f->missing_rets = 0;
+#endif
     return f;
 }
 
 void fn_free(State *L, Fn *f) {
-    mem_free(L, f->ins, sizeof(BcIns) * f->max_ins);
-    mem_free(L, f->line_info, sizeof(int) * f->max_ins);
-    mem_free(L, f->k, sizeof(uint64_t) * f->max_k);
+    Trace *t = f->traces;
+    while (t) {
+        Trace *next = t->next;
+        trace_free(L, t);
+        t = next;
+    }
+    mem_free(L, MEM_FN, f->ins, sizeof(BcIns) * f->max_ins);
+    if (f->line_info) { // Freed before it's finished
+        mem_free(L, MEM_FN, f->line_info, sizeof(int) * f->max_ins);
+    }
+    mem_free(L, MEM_FN, f->lines, f->num_lines);
+    mem_free(L, MEM_FN, f->ic, sizeof(uint32_t) * f->max_ins);
+    mem_free(L, MEM_FN, f->k, sizeof(uint64_t) * f->max_k);
+    mem_free(L, MEM_FN, f->upvals, sizeof(uint16_t) * f->num_upvals);
     obj_free(L, (Obj *) f, sizeof(Fn));
 }
 
 int fn_emit(State *L, Fn *f, BcIns ins, int line) {
     if (f->num_ins >= f->max_ins) {
-        f->ins = mem_realloc(L, f->ins,
+        f->ins = mem_realloc(L, MEM_FN, f->ins,
                 f->max_ins * sizeof(BcIns),
                 f->max_ins * sizeof(BcIns) * 2);
-        f->line_info = mem_realloc(L, f->line_info,
+        f->line_info = mem_realloc(L, MEM_FN, f->line_info,
                 f->max_ins * sizeof(int),
                 f->max_ins * sizeof(int) * 2);
+        f->ic = mem_realloc(L, MEM_FN, f->ic,
+                f->max_ins * sizeof(uint32_t),
+                f->max_ins * sizeof(uint32_t) * 2);
         f->max_ins *= 2;
     }
     f->line_info[f->num_ins] = line;
+    f->ic[f->num_ins] = 0;
     f->ins[f->num_ins] = ins;
     return f->num_ins++;
 }
 
+void fn_finish(State *L, Fn *f) {
+    assert(f->line_info && !f->lines);
+    // Instructions emitted with a line of -1 (jumps and 'BC_UCLO's) take the
+    // line of the instruction before them, so they never need an escape
+    int size = 0; // Worked out first, so 'lines' is allocated only once
+    int prev = f->start_line;
+    for (int pc = 0; pc < f->num_ins; pc++) {
+        int line = f->line_info[pc] < 0 ? prev : f->line_info[pc];
+        int delta = line - prev;
+        size += delta > -LINE_ESCAPE && delta < LINE_ESCAPE ? 1 : 5;
+        prev = line;
+    }
+    f->lines = mem_alloc(L, MEM_FN, size);
+    f->num_lines = size;
+    uint8_t *p = f->lines;
+    prev = f->start_line;
+    for (int pc = 0; pc < f->num_ins; pc++) {
+        int32_t line = f->line_info[pc] < 0 ? prev : f->line_info[pc];
+        int delta = line - prev;
+        if (delta > -LINE_ESCAPE && delta < LINE_ESCAPE) {
+            *(p++) = (uint8_t) (int8_t) delta;
+        } else {
+            *(p++) = LINE_ESCAPE;
+            memcpy(p, &line, sizeof(line));
+            p += sizeof(line);
+        }
+        prev = line;
+    }
+    mem_free(L, MEM_FN, f->line_info, sizeof(int) * f->max_ins);
+    f->line_info = NULL;
+    f->ins = mem_realloc(L, MEM_FN, f->ins,
+            f->max_ins * sizeof(BcIns), f->num_ins * sizeof(BcIns));
+    f->ic = mem_realloc(L, MEM_FN, f->ic,
+            f->max_ins * sizeof(uint32_t), f->num_ins * sizeof(uint32_t));
+    f->max_ins = f->num_ins;
+}
+
+int fn_line(Fn *f, int pc) {
+    if (!f->lines) {
+        return 0;
+    }
+    const uint8_t *p = f->lines;
+    int line = f->start_line;
+    for (int i = 0; i <= pc; i++) {
+        if (*p == LINE_ESCAPE) {
+            int32_t l;
+            memcpy(&l, p + 1, sizeof(l));
+            line = l;
+            p += 1 + sizeof(l);
+        } else {
+            line += (int8_t) *(p++);
+        }
+    }
+    return line;
+}
+
 int fn_emit_k(State *L, Fn *f, uint64_t k) {
     if (f->num_k >= f->max_k) {
-        f->k = mem_realloc(L, f->k,
+        f->k = mem_realloc(L, MEM_FN, f->k,
                 f->max_k * sizeof(uint64_t),
                 f->max_k * sizeof(uint64_t) * 2);
         f->max_k *= 2;
     }
+    gc_barrier(L, (Obj *) f, k);
     f->k[f->num_k] = k;
     return f->num_k++;
 }
 
+
+// ---- Closures ----
+
+Upval * upval_find(State *L, uint64_t *slot) {
+    Upval **prev = &L->open_upvals;
+    while (*prev && (*prev)->v > slot) {
+        prev = &(*prev)->next_open;
+    }
+    if (*prev && (*prev)->v == slot) {
+        return *prev;
+    }
+    Upval *uv = (Upval *) obj_new(L, OBJ_UPVAL, sizeof(Upval));
+    uv->v = slot;
+    uv->closed = VAL_NIL;
+    uv->next_open = *prev;
+    *prev = uv;
+    return uv;
+}
+
+Upval * upval_new_closed(State *L, uint64_t v) {
+    Upval *uv = (Upval *) obj_new(L, OBJ_UPVAL, sizeof(Upval));
+    uv->closed = v;
+    uv->v = &uv->closed;
+    uv->next_open = NULL;
+    return uv;
+}
+
+void upval_free(State *L, Upval *uv) {
+    obj_free(L, (Obj *) uv, sizeof(Upval));
+}
+
+void upvals_close(State *L, uint64_t *level) {
+    while (L->open_upvals && L->open_upvals->v >= level) {
+        Upval *uv = L->open_upvals;
+        uv->closed = *uv->v;
+        uv->v = &uv->closed;
+        L->open_upvals = uv->next_open;
+        uv->next_open = NULL;
+        gc_barrier(L, (Obj *) uv, uv->closed); // The stack has no barrier
+    }
+}
+
+Closure * closure_new(State *L, Fn *fn) {
+    size_t size = sizeof(Closure) + sizeof(Upval *) * fn->num_upvals;
+    Closure *c = (Closure *) obj_new(L, OBJ_CLOSURE, size);
+    c->fn = fn;
+    c->num_upvals = fn->num_upvals;
+    for (int i = 0; i < c->num_upvals; i++) {
+        c->upvals[i] = NULL;
+    }
+    return c;
+}
+
+void closure_free(State *L, Closure *c) {
+    size_t size = sizeof(Closure) + sizeof(Upval *) * c->num_upvals;
+    obj_free(L, (Obj *) c, size);
+}
+
+
+// ---- C Functions ----
+
+CFn * cfn_new(State *L, lua_CFunction fn, luaJ_Builtin fast) {
+    CFn *f = (CFn *) obj_new(L, OBJ_CFN, sizeof(CFn));
+    f->fn = fn;
+    f->fast = fast;
+    return f;
+}
+
+void cfn_free(State *L, CFn *f) {
+    obj_free(L, (Obj *) f, sizeof(CFn));
+}
+
 char * type_name(uint64_t v) {
     if (is_num(v)) {
         if (is_nan(v)) {
@@ -90,108 +441,80 @@ char * type_name(uint64_t v) {
         return "boolean";
     } else if (is_str(v)) {
         return "string";
-    } else if (is_fn(v)) {
+    } else if (is_fn(v) || is_closure(v) || is_cfn(v)) {
         return "function";
+    } else if (is_obj(v, OBJ_TABLE)) {
+        return "table";
+    } else if (is_obj(v, OBJ_CORO)) {
+        return "thread";
     } else {
         return "object";
     }
 }
 
-static char * print_str(State *L, char *fmt, ...) {
-    va_list args1, args2;
-    va_start(args1, fmt);
-    va_copy(args2, args1);
-    size_t len = vsnprintf(NULL, 0, fmt, args1);
-    char *str = mem_alloc(L, len + 1);
-    vsnprintf(str, len + 1, fmt, args2);
-    va_end(args2);
-    va_end(args1);
-    return str;
-}
-
-static int quote_ch(char *s, char ch) {
-    int len = s ? 5 : 0;
+static void print_ch(FILE *out, char ch) {
     switch (ch) {
-    case '\\': return snprintf(s, len, "\\\\");
-    case '\"': return snprintf(s, len, "\\\"");
-    case '\'': return snprintf(s, len, "\\'");
-    case '\a': return snprintf(s, len, "\\a");
-    case '\b': return snprintf(s, len, "\\b");
-    case '\f': return snprintf(s, len, "\\f");
-    case '\n': return snprintf(s, len, "\\n");
-    case '\r': return snprintf(s, len, "\\r");
-    case '\t': return snprintf(s, len, "\\t");
-    case '\v': return snprintf(s, len, "\\v");
-    case 0:    return snprintf(s, len, "\\0");
+    case '\\': fprintf(out, "\\\\"); break;
+    case '\"': fprintf(out, "\\\""); break;
+    case '\'': fprintf(out, "\\'"); break;
+    case '\a': fprintf(out, "\\a"); break;
+    case '\b': fprintf(out, "\\b"); break;
+    case '\f': fprintf(out, "\\f"); break;
+    case '\n': fprintf(out, "\\n"); break;
+    case '\r': fprintf(out, "\\r"); break;
+    case '\t': fprintf(out, "\\t"); break;
+    case '\v': fprintf(out, "\\v"); break;
+    case 0:    fprintf(out, "\\0"); break;
     default:
-        if (iscntrl(ch)) {
-            return snprintf(s, len, "\\%03o", ch);
+        if (iscntrl((unsigned char) ch)) {
+            fprintf(out, "\\%03o", (unsigned char) ch);
         } else {
-            return snprintf(s, len, "%c", ch);
+            fputc(ch, out);
         }
     }
 }
 
-static char * quote_str(State *L, char *str, size_t len) {
-    size_t quoted_len = 0;
-    for (size_t i = 0; i < len; i++) {
-        quoted_len += quote_ch(NULL, str[i]);
-    }
-    char *v = mem_alloc(L, (quoted_len + 3) * sizeof(char));
-    char *s = v;
-    s += sprintf(s, "\"");
-    for (size_t i = 0; i < len; i++) {
-        s += quote_ch(s, str[i]);
-    }
-    s += sprintf(s, "\"");
-    return v;
-}
-
-char * print_fn_name(State *L, Fn *f) {
-    char *fn_name;
+void print_fn_name(FILE *out, Fn *f) {
     if (f->name) {
-        fn_name = print_str(L, "%.*s", (int) f->name->len, str_val(f->name));
+        fprintf(out, "%.*s", (int) f->name->len, str_val(f->name));
     } else {
-        fn_name = print_str(L, "<unknown>");
+        fprintf(out, "<unknown>");
     }
-    char *chunk_name;
-    if (f->chunk_name) {
-        chunk_name = print_str(L, "@%s", f->chunk_name);
-    } else {
-        chunk_name = print_str(L, "@<unknown>");
-    }
-    char *line;
+    fprintf(out, "@%s", f->chunk_name ? f->chunk_name : "<unknown>");
     if (f->start_line >= 1 && f->end_line >= 1) {
-        line = print_str(L, ":%d-%d", f->start_line, f->end_line);
-    } else {
-        line = print_str(L, "");
+        fprintf(out, ":%d-%d", f->start_line, f->end_line);
     }
-    char *v = print_str(L, "%s%s%s", fn_name, chunk_name, line);
-    mem_free(L, fn_name, (strlen(fn_name) + 1) * sizeof(char));
-    mem_free(L, chunk_name, (strlen(chunk_name) + 1) * sizeof(char));
-    mem_free(L, line, (strlen(line) + 1) * sizeof(char));
-    return v;
 }
 
-char * print_val(State *L, uint64_t v) {
+void print_val(FILE *out, uint64_t v) {
     if (is_num(v)) {
         if (is_nan(v)) {
-            return "NaN";
+            fprintf(out, "NaN");
         } else {
-            return print_str(L, "%g", v2n(v));
+            fprintf(out, "%g", v2n(v));
         }
     } else if (is_nil(v)) {
-        return "nil";
+        fprintf(out, "nil");
     } else if (is_false(v)) {
-        return "false";
+        fprintf(out, "false");
     } else if (is_true(v)) {
-        return "true";
+        fprintf(out, "true");
     } else if (is_str(v)) {
         Str *str = v2str(v);
-        return quote_str(L, str_val(str), str->len);
-    } else if (is_fn(v)) {
-        return print_fn_name(L, v2fn(v));
+        fputc('"', out);
+        for (size_t i = 0; i < str->len; i++) {
+            print_ch(out, str_val(str)[i]);
+        }
+        fputc('"', out);
+    } else if (is_fn(v) || is_closure(v)) {
+        print_fn_name(out, v2proto(v));
+    } else if (is_cfn(v)) {
+        fprintf(out, "builtin <%p>", v2ptr(v));
+    } else if (is_obj(v, OBJ_TABLE)) {
+        fprintf(out, "table <%p>", v2ptr(v));
+    } else if (is_obj(v, OBJ_CORO)) {
+        fprintf(out, "thread <%p>", v2ptr(v));
     } else {
-        return print_str(L, "object <%p>", v2ptr(v));
+        fprintf(out, "object <%p>", v2ptr(v));
     }
 }
@@ -3,8 +3,10 @@
 #define LUAJ_VALUE_H
 
 #include <lua.h>
+#include <luaj.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
 
 #include "state.h"
 #include "bytecode.h"
@@ -85,17 +87,27 @@ static inline uint64_t ptr2v(void *ptr) {
 
 // GC-collected objects are all pointers to heap-allocated structs that begin
 // with 'Header'. The header tells us the type of the object, as well as
-// contains info for the GC.
+// contains info for the GC (see 'gc.h').
 
 enum {
     OBJ_STR,
     OBJ_FN,
+    OBJ_CLOSURE,
+    OBJ_UPVAL,
+    OBJ_CFN,
+    OBJ_TABLE,
+    OBJ_CORO,
 };
 
-#define ObjHeader uint8_t type; uint8_t _pad1; uint16_t _pad2; uint32_t _pad3;
+#define ObjHeader                                               \
+    struct Obj *next; /* Next object in the GC's object list */ \
+    uint8_t type;                                               \
+    uint8_t color;    /* GC mark bits */                        \
+    uint16_t _pad1;                                             \
+    uint32_t _pad2;
 
 // A GC-collected object.
-typedef struct {
+typedef struct Obj {
     ObjHeader;
 } Obj;
 
@@ -105,48 +117,194 @@ static inline int is_obj(uint64_t v, int type) {
     return is_ptr(v) && ((Obj *) v2obj(v))->type == type;
 }
 
-// Immutable string. The contents of the string is stored after the struct.
-// The size of the whole object is 'sizeof(Str) + <length of string> + 1'.
-typedef struct {
+Obj * obj_new(State *L, uint8_t type, size_t bytes);
+void obj_free(State *L, Obj *obj, size_t bytes);
+
+// Immutable string. The contents of most strings are stored after the struct,
+// and the size of the whole object is 'sizeof(Str) + <length of string> + 1'.
+//
+// Long strings built by 'BC_CONCAT' are instead stored in a 'StrBuf' that's
+// shared with the strings it was built from (see 'str_concat'), so their
+// contents aren't necessarily followed by a NULL terminator.
+//
+// Every string is interned in the state's string table, so there's only ever
+// one copy of a string with the same contents, and two strings are equal if
+// and only if their pointers (and so their values) are equal.
+typedef struct Str {
     ObjHeader;
+    struct Str *chain; // Next string in the same string table bucket
+    uint32_t hash;
     size_t len;
+    char *chars; // Either just after the struct or in a 'StrBuf'
 } Str;
 
-Str * str_new(State *L, size_t len);
+// Growable buffer holding the contents of strings built by 'BC_CONCAT'. Every
+// string using the buffer is a prefix of its contents, so appending to the
+// longest one doesn't affect the others. Freed once none of them are left.
+typedef struct {
+    int refs;   // Number of strings using the buffer
+    size_t len; // Longest string using it, or SIZE_MAX if it's read only
+    size_t cap;
+    char chars[];
+} StrBuf;
+
+void str_table_init(State *L);
+void str_table_free(State *L);
+
+// Returns the interned string with the given contents, creating it if it
+// doesn't exist yet.
+Str * str_new(State *L, const char *s, size_t len);
 void str_free(State *L, Str *s);
 
+// Returns the interned concatenation of the 'n' strings in 'vals', whose
+// lengths add up to 'len'. Appending to the longest string in a 'StrBuf' is
+// done in place, so repeatedly appending to a string (e.g., 's = s .. x' in a
+// loop) takes linear rather than quadratic time.
+Str * str_concat(State *L, uint64_t *vals, int n, size_t len);
+
+// Returns the contents of 'str' followed by a NULL terminator (for the C
+// API). Moves them out of a shared 'StrBuf' into one of their own if needed.
+char * str_cstr(State *L, Str *str);
+
 static inline uint64_t str2v(Str *s)  { return ptr2v(s); }
 static inline Str * v2str(uint64_t v) { return (Str *) v2ptr(v); }
 static inline int is_str(uint64_t v)  { return is_obj(v, OBJ_STR); }
-static inline char * str_val(Str *s)  { return (char *) (s + 1); }
-static inline int str_eq(Str *a, Str *b) {
-    return a->len == b->len && strncmp(str_val(a), str_val(b), a->len) == 0;
-}
+static inline char * str_val(Str *s)  { return s->chars; }
+static inline int str_eq(Str *a, Str *b) { return a == b; }
+
+// Number of hotness counters for loops in each function (see 'jit.h'). Must
+// be a power of 2.
+#define HOT_LOOP_SLOTS 16
 
 // Function prototype.
+//
+// The line of each instruction is only needed for error messages and the
+// profiler, so it's stored compactly in 'lines': one byte per instruction,
+// holding the difference from the previous instruction's line (or for the
+// first, from 'start_line') as a signed 8-bit number. A difference that
+// doesn't fit is stored as LINE_ESCAPE followed by the 4 byte line itself.
+// Jumps don't have a line of their own, so they repeat the previous one.
+// 'fn_line' decodes it from the start each time. While the function is being
+// parsed, its lines are kept in 'line_info' instead, since the parser's
+// passes move instructions around; 'fn_finish' then encodes them.
 typedef struct {
     ObjHeader;
     Str *name;
     char *chunk_name;
     int start_line, end_line;
     int num_params;
+    int max_stack; // Number of stack slots used by the function's frame
     BcIns *ins;
-    int *line_info;
     int num_ins, max_ins;
+    int *line_info; // Line of each instruction; NULL once it's finished
+    uint8_t *lines; // NULL if there's no line info (e.g., it was stripped)
+    int num_lines;  // Bytes in 'lines'
+    uint32_t *ic; // Inline cache for each instruction (see 'table_get_str')
     uint64_t *k;
     int num_k, max_k;
+    uint16_t *upvals; // Where 'BC_FNEW' finds each upvalue (see 'UV_LOCAL')
+    int num_upvals;
+
+    // JIT hotness counters and recorded traces
+    uint16_t hot_loops[HOT_LOOP_SLOTS];
+    uint16_t hot_call;
+    struct Trace *traces;
+
+#ifdef LUAJ_STATS
+    uint64_t num_calls, missing_args, missing_rets; // See 'stats.h'
+#endif
 } Fn;
 
+#define LINE_ESCAPE 0x80
+
 Fn * fn_new(State *L, Str *fn_name, char *chunk_name);
 void fn_free(State *L, Fn *f);
 int fn_emit(State *L, Fn *f, BcIns ins, int line);
 int fn_emit_k(State *L, Fn *f, uint64_t k);
 
+// Called once the parser has emitted every instruction in 'f'. Encodes its
+// line info, and shrinks the arrays that grow with each instruction.
+void fn_finish(State *L, Fn *f);
+
+// Returns the line of the instruction at 'pc', or 0 if it isn't known.
+int fn_line(Fn *f, int pc);
+
 static inline uint64_t fn2v(Fn *f)  { return ptr2v(f); }
 static inline Fn * v2fn(uint64_t v) { return (Fn *) v2ptr(v); }
 static inline int is_fn(uint64_t v) { return is_obj(v, OBJ_FN);  }
 
+// Upvalue descriptors in 'Fn.upvals'. The low byte is a stack slot in the
+// enclosing function if UV_LOCAL is set, or otherwise an index into the
+// enclosing closure's upvalues. The parser sets UV_VALUE for locals that are
+// never assigned to after being captured, so 'BC_FNEW' can copy their value
+// instead of sharing an open upvalue; and UV_NONE for upvalues it folded into
+// constants, which aren't created at all.
+#define UV_LOCAL 0x100
+#define UV_VALUE 0x200
+#define UV_NONE  0x400
+
+// A local variable captured by a closure. While the variable is still on the
+// stack, the upvalue is "open": 'v' points to its stack slot and it's linked
+// into 'L->open_upvals', which is sorted by slot (highest first). Once the
+// variable goes out of scope, the upvalue is closed: its value is copied into
+// 'closed', and 'v' points there instead.
+typedef struct Upval {
+    ObjHeader;
+    uint64_t *v;
+    uint64_t closed;
+    struct Upval *next_open;
+} Upval;
+
+// Returns the open upvalue for 'slot', creating it if it doesn't exist.
+Upval * upval_find(State *L, uint64_t *slot);
+
+// Returns a new upvalue that's already closed over 'v'.
+Upval * upval_new_closed(State *L, uint64_t v);
+void upval_free(State *L, Upval *uv);
+
+// Closes every open upvalue for a stack slot at or above 'level'.
+void upvals_close(State *L, uint64_t *level);
+
+// A function prototype with upvalues, created at runtime by 'BC_FNEW'.
+// Functions that don't capture anything stay bare prototypes ('BC_KFN').
+typedef struct {
+    ObjHeader;
+    Fn *fn;
+    int num_upvals;
+    Upval *upvals[]; // NULL for UV_NONE upvalues
+} Closure;
+
+Closure * closure_new(State *L, Fn *fn);
+void closure_free(State *L, Closure *c);
+
+static inline uint64_t closure2v(Closure *c)  { return ptr2v(c); }
+static inline Closure * v2closure(uint64_t v) { return (Closure *) v2ptr(v); }
+static inline int is_closure(uint64_t v) { return is_obj(v, OBJ_CLOSURE); }
+
+// Returns the prototype for a Lua function value (a 'Fn' or 'Closure').
+static inline Fn * v2proto(uint64_t v) {
+    return is_closure(v) ? v2closure(v)->fn : v2fn(v);
+}
+
+// C function, called with the Lua C API calling convention (see 'BC_CALL').
+typedef struct {
+    ObjHeader;
+    lua_CFunction fn;
+    luaJ_Builtin fast; // Single number argument fast path, or NULL
+} CFn;
+
+CFn * cfn_new(State *L, lua_CFunction fn, luaJ_Builtin fast);
+void cfn_free(State *L, CFn *f);
+
+static inline uint64_t cfn2v(CFn *f)  { return ptr2v(f); }
+static inline CFn * v2cfn(uint64_t v) { return (CFn *) v2ptr(v); }
+static inline int is_cfn(uint64_t v)  { return is_obj(v, OBJ_CFN); }
+
 char * type_name(uint64_t v);
-char * print_val(State *L, uint64_t v);
+// Prints a value for debug output.
+void print_val(FILE *out, uint64_t v);
+
+// Prints 'name@chunk:start-end' for the function prototype 'f'.
+void print_fn_name(FILE *out, Fn *f);
 
 #endif
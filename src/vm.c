@@ -1,38 +1,231 @@
 
 #include <assert.h>
 #include <math.h>
-#include <stdio.h>
 
 #include "vm.h"
 #include "value.h"
-#include "debug.h"
+#include "jit.h"
+#include "gc.h"
+#include "table.h"
+#include "profile.h"
+#include "stats.h"
 
+#ifdef LUAJ_STATS
+#define DISPATCH() do { STATS_OP(L, *ip); goto *dispatch[bc_op(*ip)]; } while (0)
+#define NEXT()     do { ++ip; DISPATCH(); } while (0)
+#else
 #define DISPATCH() goto *dispatch[bc_op(*ip)]
 #define NEXT()     goto *dispatch[bc_op(*(++ip))]
+#endif
 
+// The error value is pushed on top of the stack, which is moved above the
+// frame first so the callers' frames survive if a 'pcall' catches the error
 #define ERR(msg, ...)                            \
-    int line = fn->line_info[ip - fn->ins];      \
+    int line = fn_line(fn, ip - fn->ins);        \
     ErrInfo info = { fn->chunk_name, line, -1 }; \
+    L->top = s + fn->max_stack;                  \
     err_run(L, &info, msg, ## __VA_ARGS__);
 
-#define ERR_UNOP(msg, l)      \
-    char *t = type_name((l)); \
-    ERR("attempt to " msg " %s value", t)
+#define UNLIKELY(cond) __builtin_expect(!!(cond), 0)
 
-#define ERR_BINOP(msg, l, r)                               \
-    char *lt = type_name((l));                             \
-    char *rt = type_name((r));                             \
-    if (lt == rt) {                                        \
-        ERR("attempt to " msg " two %s values", lt)        \
-    } else {                                               \
-        ERR("attempt to " msg " %s and %s value", lt, rt)  \
+// The type checks only test and branch in 'execute'; the errors are raised
+// out of line (see 'err_type' and 'err_for').
+#define CHECK_V(l)     if (UNLIKELY(!is_num((l)))) { err_type(L, fn, ip, s, l, l); }
+#define CHECK_S(l)     if (UNLIKELY(!is_str((l)))) { err_type(L, fn, ip, s, l, l); }
+#define CHECK_T(l)     if (UNLIKELY(!is_table((l)))) { err_type(L, fn, ip, s, l, l); }
+#define CHECK_VV(l, r) if (UNLIKELY(!is_num((l)) || !is_num((r)))) { err_type(L, fn, ip, s, l, r); }
+#define CHECK_VN(l, r) if (UNLIKELY(!is_num((l)))) { err_type(L, fn, ip, s, l, r); }
+#define CHECK_NV(l, r) if (UNLIKELY(!is_num((r)))) { err_type(L, fn, ip, s, l, r); }
+#define CHECK_FOR(r, n)                                                 \
+    if (UNLIKELY(!is_num((r)[0]) || !is_num((r)[1]) ||                  \
+                 ((n) > 2 && !is_num((r)[2])))) {                       \
+        err_for(L, fn, ip, s, r);                                       \
     }
 
-#define CHECK_V(msg, l)     if (!is_num((l))) { ERR_UNOP(msg, l) }
-#define CHECK_S(msg, l)     if (!is_str((l))) { ERR_UNOP(msg, l) }
-#define CHECK_VV(msg, l, r) if (!is_num((l)) || !is_num((r))) { ERR_BINOP(msg, l, r) }
-#define CHECK_VN(msg, l, r) if (!is_num((l))) { ERR_BINOP(msg, l, r) }
-#define CHECK_NV(msg, l, r) if (!is_num((r))) { ERR_BINOP(msg, l, r) }
+// Raises the error for the instruction at 'ip' when its operands 'l' and 'r'
+// have the wrong types ('r' is ignored for instructions with one operand that
+// gets checked). The message is worked out from the opcode. Like 'ERR', the
+// top of the stack is moved above the frame at 's' first.
+__attribute__((noreturn, noinline, cold))
+static void err_type(State *L, Fn *fn, BcIns *ip, uint64_t *s, uint64_t l,
+                     uint64_t r) {
+    char *op = NULL;
+    int unary = 0;
+    switch (bc_narrow(bc_unfuse(bc_op(*ip)))) {
+    case BC_NEG:    op = "negate"; unary = 1; break;
+    case BC_CONCAT: op = "concatenate"; unary = 1; break;
+    case BC_TGETV: case BC_TGETS: case BC_TSETV: case BC_TSETS:
+        op = "index";
+        unary = 1;
+        break;
+    case BC_ADDVV: case BC_ADDVN: op = "add"; break;
+    case BC_SUBVV: case BC_SUBVN: case BC_SUBNV: op = "subtract"; break;
+    case BC_MULVV: case BC_MULVN: op = "multiply"; break;
+    case BC_DIVVV: case BC_DIVVN: case BC_DIVNV: op = "divide"; break;
+    case BC_MODVV: case BC_MODVN: case BC_MODNV: op = "modulo"; break;
+    case BC_POW:   op = "perform exponentiation on"; break;
+    case BC_LTVV: case BC_LTVN: op = "compare less than"; break;
+    case BC_LEVV: case BC_LEVN: op = "compare less than or equal"; break;
+    case BC_GTVV: case BC_GTVN: op = "compare greater than"; break;
+    case BC_GEVV: case BC_GEVN: op = "compare greater than or equal"; break;
+    default: assert(0);
+    }
+    int line = fn_line(fn, ip - fn->ins);
+    ErrInfo info = { fn->chunk_name, line, -1 };
+    L->top = s + fn->max_stack;
+    char *lt = type_name(l);
+    char *rt = type_name(r);
+    if (unary) {
+        err_run(L, &info, "attempt to %s %s value", op, lt);
+    } else if (lt == rt) {
+        err_run(L, &info, "attempt to %s two %s values", op, lt);
+    } else {
+        err_run(L, &info, "attempt to %s %s and %s value", op, lt, rt);
+    }
+}
+
+// Raises the error for a 'FORPREP' or 'FORPREPI' whose index, limit, or step
+// (in 'r') isn't a number.
+__attribute__((noreturn, noinline, cold))
+static void err_for(State *L, Fn *fn, BcIns *ip, uint64_t *s, uint64_t *r) {
+    char *what = !is_num(r[0]) ? "initial value" :
+                 !is_num(r[1]) ? "limit" : "step";
+    int line = fn_line(fn, ip - fn->ins);
+    ErrInfo info = { fn->chunk_name, line, -1 };
+    L->top = s + fn->max_stack;
+    err_run(L, &info, "'for' %s must be a number", what);
+}
+
+// Closes any upvalues that are still open in the function's frame (before a
+// return)
+#define CLOSE_UPVALS()                              \
+    if (L->open_upvals && L->open_upvals->v >= s) { \
+        upvals_close(L, s);                         \
+    }
+
+// Makes room for another entry on the call stack. Returns 0 if we're already
+// at LUAI_MAXCALLS.
+static int grow_calls(State *L) {
+    if (L->num_calls + 1 < L->max_calls) {
+        return 1;
+    } else if (L->max_calls >= LUAI_MAXCALLS) {
+        return 0;
+    }
+    int max = L->max_calls * 2;
+    max = max < LUAI_MAXCALLS ? max : LUAI_MAXCALLS;
+    L->call_stack = mem_realloc(L, MEM_STACK, L->call_stack,
+            L->max_calls * sizeof(CallInfo),
+            max * sizeof(CallInfo));
+    L->max_calls = max;
+    return 1;
+}
+
+// Calls the C function at 'f' with the arguments above it up to 'L->top'. The
+// caller must have pushed a 'CallInfo' for it. The arguments become the C
+// function's frame ('L->base' onwards), and its results replace 'f' and the
+// arguments like in 'execute'. 'L->base' is restored afterwards.
+static void call_c(State *L, uint64_t *f, int num_results) {
+    ptrdiff_t fi = f - L->stack;
+    ptrdiff_t base = L->base - L->stack;
+    L->base = f + 1;
+    L->top = stack_check(L, L->top, LUA_MINSTACK);
+    int num_rets = v2cfn(*f)->fn(L);
+    assert(num_rets >= 0 && num_rets <= L->top - L->base);
+    if (num_results == LUA_MULTRET) {
+        num_results = num_rets;
+    }
+    ptrdiff_t r = (L->top - num_rets) - L->stack;
+    f = stack_check(L, L->stack + fi, num_results); // Stack may have moved
+    uint64_t *rets = L->stack + r;
+    for (int i = 0; i < num_results; i++) { // Results are above 'f'
+        f[i] = i < num_rets ? rets[i] : VAL_NIL;
+    }
+    L->top = f + num_results;
+    L->base = L->stack + base;
+}
+
+void execute_c(State *L, uint64_t *f, int num_results) {
+    assert(f >= L->stack && f < L->top && is_cfn(*f));
+    if (!grow_calls(L)) {
+        err_run(L, NULL, "stack overflow");
+    }
+    CallInfo *c = &L->call_stack[L->num_calls++];
+    c->fn = NULL;
+    c->ip = NULL;
+    c->s = f + 1;
+    c->num_rets = num_results;
+    c->protect = 0;
+    call_c(L, f, num_results);
+    L->num_calls--;
+}
+
+// An entry into the interpreter from C (see 'execute' and 'execute_resume').
+// 'run' starts interpreting at 'fn', 'ip', and 's', and stops once the thread
+// it was entered on returns from the frame it started in (or yields, if it
+// was resumed from C), leaving the values it passed in 'rets'.
+//
+// 'fn' and 'ip' are kept apart on purpose: next to each other, GCC packs them
+// into one vector register in 'run', which slows down every call.
+typedef struct {
+    Coro *co;       // Thread it was entered on; NULL for the main thread
+    int base_calls; // Depth of the call stack for 'co' to return at
+    int resumable;  // Entered by 'coroutine.resume', so 'co' can yield to C
+    int yielded;
+    int num_results; // Wanted by the C caller, or LUA_MULTRET
+    ptrdiff_t base;  // Offset of 'L->base' while 'co' runs Lua code
+    Fn *fn;
+    uint64_t *rets; // Values returned or yielded to C
+    BcIns *ip;
+    int num_rets;
+    uint64_t *s;
+} Exec;
+
+// Copies 'n' values into the 'num_rets' results of a call at 'rets', setting
+// the missing ones to nil.
+static inline void move_rets(uint64_t *rets, int num_rets, uint64_t *vals,
+                             int n) {
+    for (int i = 0; i < num_rets; i++) {
+        rets[i] = i < n ? vals[i] : VAL_NIL;
+    }
+}
+
+// Switches to the suspended coroutine 'co' and passes it the 'n' values in
+// 'vals': the arguments for its function if it hasn't started yet, or else
+// the results of its call to 'coroutine.yield'. Sets 'e' to the position to
+// carry on interpreting from in the coroutine.
+static void resume_coro(State *L, Exec *e, Coro *co, uint64_t *vals, int n) {
+    coro_enter(L, co);
+    if (L->num_calls == 0) { // Function is at the bottom of its stack
+        Fn *fn = v2proto(L->stack[0]);
+        e->fn = fn;
+        e->ip = &fn->ins[0];
+        e->s = stack_check(L, L->stack + 1, fn->max_stack);
+        move_rets(e->s, fn->num_params, vals, n);
+        STATS_CALL(L, fn, n);
+    } else {
+        CallInfo *c = &L->call_stack[--L->num_calls];
+        move_rets(c->s + bc_a(*c->ip), c->num_rets, vals, n);
+        e->fn = c->fn;
+        e->ip = c->ip + 1;
+        e->s = c->s;
+    }
+}
+
+// Switches from a coroutine that was resumed from Lua back to its resumer,
+// giving the coroutine 'status' (see 'coro_leave'). The resumer's call to
+// 'coroutine.resume' returns 'ok' followed by the 'n' values in 'vals'. Sets
+// 'e' to the position to carry on interpreting from in the resumer.
+static void leave_coro(State *L, Exec *e, int status, uint64_t ok,
+                       uint64_t *vals, int n) {
+    coro_leave(L, status);
+    CallInfo *c = &L->call_stack[--L->num_calls];
+    uint64_t *rets = c->s + bc_a(*c->ip);
+    rets[0] = ok; // Always in the frame, even if no results are used
+    move_rets(rets + 1, c->num_rets - 1, vals, n);
+    e->fn = c->fn;
+    e->ip = c->ip + 1;
+    e->s = c->s;
+}
 
 // The interpreter is written using computed gotos, which places individual
 // branch instructions at the end of each opcode (rather than using a loop with
@@ -40,36 +233,59 @@
 // at the end of each opcode. This results in faster performance because certain
 // opcode pairs are more common than others (e.g., conditional instructions
 // followed by JMP).
-void execute(State *L) {
-    static void *DISPATCH[] = {
+//
+// While a trace is being recorded, 'dispatch' points to 'RECORD' instead, which
+// sends every instruction through the trace recorder before executing it.
+// Similarly, 'PROFILE' counts instructions for the profiler (see 'profile.h')
+// while it's running; samples aren't taken while recording.
+static void run(State *L, Exec *e) {
+    static void * const DISPATCH[] = {
 #define X(name, nargs) &&OP_ ## name,
         BYTECODE
 #undef X
     };
-    void **dispatch = DISPATCH;
+    static void * const RECORD[] = {
+#define X(name, nargs) &&record,
+        BYTECODE
+#undef X
+    };
+    static void * const PROFILE[] = {
+#define X(name, nargs) &&profile,
+        BYTECODE
+#undef X
+    };
+    void * const *interp = L->prof ? PROFILE : DISPATCH; // When not recording
+    void * const *dispatch = interp;
+    trace_abort(L); // Can't record across calls into 'execute'
 
-    uint64_t fn_v = stack_pop(L);
-    assert(is_fn(fn_v));
-    Fn *fn = v2fn(fn_v);
-    print_fn(L, fn);
-    uint64_t *s = L->stack;
+    Fn *fn = e->fn;
+    BcIns *ip = e->ip;
+    uint64_t *s = e->s;
     uint64_t *k = fn->k;
-    BcIns *ip = &fn->ins[0];
 
-    CallInfo *cs = &L->call_stack[L->num_calls];
+    CallInfo *cs = L->call_stack;
+    // Return to C once we're back to this depth; coroutines resumed in this
+    // loop instead switch back to their resumer at depth 0
+    int base_calls = L->co == e->co ? e->base_calls : 0;
+    uint64_t *rets; // Values returned to C
+    int num_rets;
     DISPATCH();
 
-OP_NOP:
-    NEXT();
+record:
+    if (trace_record(L, fn, ip, s)) {
+        dispatch = interp; // Finished or aborted
+    }
+    goto *DISPATCH[bc_op(*ip)];
 
-OP_ASSERT:
-    // TODO: temporary
-    // 'ASSERT' is a temporary instruction that allows us to build some tests
-    // for the parser and interpreter without having to implement tables and
-    // C function calls
-    if (!compares_true(s[bc_d(*ip)])) {
-        ERR("assertion failed")
+profile:
+    if (!L->prof) { // Stopped by a C function
+        interp = dispatch = DISPATCH;
+    } else if (--L->prof->countdown == 0) {
+        prof_sample(L, fn, ip);
     }
+    goto *DISPATCH[bc_op(*ip)];
+
+OP_NOP:
     NEXT();
 
 
@@ -89,6 +305,33 @@ OP_KSTR:
 OP_KFN:
     s[bc_a(*ip)] = k[bc_d(*ip)];
     NEXT();
+OP_FNEW: {
+    Closure *c = closure_new(L, v2fn(k[bc_d(*ip)]));
+    for (int i = 0; i < c->num_upvals; i++) {
+        uint16_t uv = c->fn->upvals[i];
+        if (uv & UV_NONE) {
+            continue;
+        } else if (uv & UV_VALUE) {
+            c->upvals[i] = upval_new_closed(L, s[uv & 0xff]);
+        } else if (uv & UV_LOCAL) {
+            c->upvals[i] = upval_find(L, &s[uv & 0xff]);
+        } else {
+            c->upvals[i] = v2closure(s[-1])->upvals[uv];
+        }
+    }
+    s[bc_a(*ip)] = closure2v(c);
+    gc_check(L);
+    NEXT();
+}
+OP_UGET:
+    s[bc_a(*ip)] = *v2closure(s[-1])->upvals[bc_d(*ip)]->v;
+    NEXT();
+OP_USET: {
+    Upval *uv = v2closure(s[-1])->upvals[bc_d(*ip)];
+    *uv->v = s[bc_a(*ip)];
+    gc_barrier(L, (Obj *) uv, s[bc_a(*ip)]);
+    NEXT();
+}
 OP_KNIL:
     for (int n = bc_a(*ip); n <= bc_d(*ip); n++) {
         s[n] = VAL_NIL;
@@ -98,90 +341,209 @@ OP_KNIL:
 
     // ---- Arithmetic ----
 
+    // The specialised '_NUM' instructions (see 'bytecode.h') start just after
+    // the type checks of the instructions they were made from, here and for
+    // the fused comparisons.
+
 OP_NEG:
-    CHECK_V("negate", s[bc_d(*ip)])
+    CHECK_V(s[bc_d(*ip)])
     s[bc_a(*ip)] = n2v(-v2n(s[bc_d(*ip)]));
     NEXT();
 
 OP_ADDVV:
-    CHECK_VV("add", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_ADDVV_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) + v2n(s[bc_c(*ip)]));
     NEXT();
 OP_ADDVN:
-    CHECK_VN("add", s[bc_b(*ip)], k[bc_c(*ip)])
+    CHECK_VN(s[bc_b(*ip)], k[bc_c(*ip)])
+OP_ADDVN_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) + v2n(k[bc_c(*ip)]));
     NEXT();
 
 OP_SUBVV:
-    CHECK_VV("subtract", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_SUBVV_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) - v2n(s[bc_c(*ip)]));
     NEXT();
 OP_SUBVN:
-    CHECK_VN("subtract", s[bc_b(*ip)], k[bc_c(*ip)])
+    CHECK_VN(s[bc_b(*ip)], k[bc_c(*ip)])
+OP_SUBVN_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) - v2n(k[bc_c(*ip)]));
     NEXT();
 OP_SUBNV:
-    CHECK_NV("subtract", k[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_NV(k[bc_b(*ip)], s[bc_c(*ip)])
+OP_SUBNV_NUM:
     s[bc_a(*ip)] = n2v(v2n(k[bc_b(*ip)]) - v2n(s[bc_c(*ip)]));
     NEXT();
 
 OP_MULVV:
-    CHECK_VV("multiply", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_MULVV_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) * v2n(s[bc_c(*ip)]));
     NEXT();
 OP_MULVN:
-    CHECK_VN("multiply", s[bc_b(*ip)], k[bc_c(*ip)])
+    CHECK_VN(s[bc_b(*ip)], k[bc_c(*ip)])
+OP_MULVN_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) * v2n(k[bc_c(*ip)]));
     NEXT();
 
 OP_DIVVV:
-    CHECK_VV("divide", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_DIVVV_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) / v2n(s[bc_c(*ip)]));
     NEXT();
 OP_DIVVN:
-    CHECK_VN("divide", s[bc_b(*ip)], k[bc_c(*ip)])
+    CHECK_VN(s[bc_b(*ip)], k[bc_c(*ip)])
+OP_DIVVN_NUM:
     s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) / v2n(k[bc_c(*ip)]));
     NEXT();
 OP_DIVNV:
-    CHECK_NV("divide", k[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_NV(k[bc_b(*ip)], s[bc_c(*ip)])
+OP_DIVNV_NUM:
     s[bc_a(*ip)] = n2v(v2n(k[bc_b(*ip)]) / v2n(s[bc_c(*ip)]));
     NEXT();
 
 OP_MODVV:
-    CHECK_VV("modulo", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_MODVV_NUM:
     s[bc_a(*ip)] = n2v(fmod(v2n(s[bc_b(*ip)]), v2n(s[bc_c(*ip)])));
     NEXT();
 OP_MODVN:
-    CHECK_VN("modulo", s[bc_b(*ip)], k[bc_c(*ip)])
+    CHECK_VN(s[bc_b(*ip)], k[bc_c(*ip)])
+OP_MODVN_NUM:
     s[bc_a(*ip)] = n2v(fmod(v2n(s[bc_b(*ip)]), v2n(k[bc_c(*ip)])));
     NEXT();
 OP_MODNV:
-    CHECK_NV("modulo", k[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_NV(k[bc_b(*ip)], s[bc_c(*ip)])
+OP_MODNV_NUM:
     s[bc_a(*ip)] = n2v(fmod(v2n(k[bc_b(*ip)]), v2n(s[bc_c(*ip)])));
     NEXT();
 
 OP_POW:
-    CHECK_VV("perform exponentiation on", s[bc_b(*ip)], s[bc_c(*ip)])
+    CHECK_VV(s[bc_b(*ip)], s[bc_c(*ip)])
+OP_POW_NUM:
     s[bc_a(*ip)] = n2v(pow(v2n(s[bc_b(*ip)]), v2n(s[bc_c(*ip)])));
     NEXT();
 
 OP_CONCAT: {
     size_t len = 0;
     for (uint8_t i = bc_b(*ip); i <= bc_c(*ip); i++) {
-        CHECK_S("concatenate", s[i])
-        Str *str = v2str(s[i]);
-        len += str->len;
+        CHECK_S(s[i])
+        len += v2str(s[i])->len;
     }
-    Str *v = str_new(L, len);
-    char *concat = str_val(v);
-    for (uint8_t i = bc_b(*ip); i <= bc_c(*ip); i++) {
-        Str *str = v2str(s[i]);
-        memcpy(concat, str_val(str), str->len);
-        concat += str->len;
+    int n = bc_c(*ip) - bc_b(*ip) + 1;
+    s[bc_a(*ip)] = str2v(str_concat(L, &s[bc_b(*ip)], n, len));
+    gc_check(L);
+    NEXT();
+}
+
+
+    // ---- Tables ----
+
+OP_TNEW:
+    s[bc_a(*ip)] = table2v(table_new(L, bc_b(*ip), bc_c(*ip)));
+    gc_check(L);
+    NEXT();
+
+OP_TGETV:
+    CHECK_T(s[bc_b(*ip)])
+    s[bc_a(*ip)] = table_get(v2table(s[bc_b(*ip)]), s[bc_c(*ip)]);
+    NEXT();
+OP_TGETS:
+    CHECK_T(s[bc_b(*ip)])
+    s[bc_a(*ip)] = table_get_str(v2table(s[bc_b(*ip)]), k[bc_c(*ip)],
+                                 &fn->ic[ip - fn->ins]);
+    NEXT();
+
+OP_TSETV: {
+    CHECK_T(s[bc_b(*ip)])
+    uint64_t key = s[bc_c(*ip)];
+    if (is_nil(key)) {
+        ERR("table index is nil")
+    } else if (is_num(key) && v2n(key) != v2n(key)) {
+        ERR("table index is NaN")
     }
-    s[bc_a(*ip)] = str2v(v);
+    table_set(L, v2table(s[bc_b(*ip)]), key, s[bc_a(*ip)]);
     NEXT();
 }
+OP_TSETS:
+    CHECK_T(s[bc_b(*ip)])
+    table_set_str(L, v2table(s[bc_b(*ip)]), k[bc_c(*ip)], s[bc_a(*ip)],
+                  &fn->ic[ip - fn->ins]);
+    NEXT();
+
+OP_GGET:
+    s[bc_a(*ip)] = table_get_str(v2table(L->globals), k[bc_d(*ip)],
+                                 &fn->ic[ip - fn->ins]);
+    NEXT();
+OP_GSET:
+    table_set_str(L, v2table(L->globals), k[bc_d(*ip)], s[bc_a(*ip)],
+                  &fn->ic[ip - fn->ins]);
+    NEXT();
+
+
+    // ---- Wide ----
+
+    // The constant index is in the 'BC_KX' after the instruction, which is
+    // skipped over along with it.
+
+OP_ADDVN_KX:
+    CHECK_VN(s[bc_b(*ip)], k[bc_e(ip[1])])
+    s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) + v2n(k[bc_e(ip[1])]));
+    ip++;
+    NEXT();
+OP_SUBVN_KX:
+    CHECK_VN(s[bc_b(*ip)], k[bc_e(ip[1])])
+    s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) - v2n(k[bc_e(ip[1])]));
+    ip++;
+    NEXT();
+OP_SUBNV_KX:
+    CHECK_NV(k[bc_e(ip[1])], s[bc_c(*ip)])
+    s[bc_a(*ip)] = n2v(v2n(k[bc_e(ip[1])]) - v2n(s[bc_c(*ip)]));
+    ip++;
+    NEXT();
+OP_MULVN_KX:
+    CHECK_VN(s[bc_b(*ip)], k[bc_e(ip[1])])
+    s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) * v2n(k[bc_e(ip[1])]));
+    ip++;
+    NEXT();
+OP_DIVVN_KX:
+    CHECK_VN(s[bc_b(*ip)], k[bc_e(ip[1])])
+    s[bc_a(*ip)] = n2v(v2n(s[bc_b(*ip)]) / v2n(k[bc_e(ip[1])]));
+    ip++;
+    NEXT();
+OP_DIVNV_KX:
+    CHECK_NV(k[bc_e(ip[1])], s[bc_c(*ip)])
+    s[bc_a(*ip)] = n2v(v2n(k[bc_e(ip[1])]) / v2n(s[bc_c(*ip)]));
+    ip++;
+    NEXT();
+OP_MODVN_KX:
+    CHECK_VN(s[bc_b(*ip)], k[bc_e(ip[1])])
+    s[bc_a(*ip)] = n2v(fmod(v2n(s[bc_b(*ip)]), v2n(k[bc_e(ip[1])])));
+    ip++;
+    NEXT();
+OP_MODNV_KX:
+    CHECK_NV(k[bc_e(ip[1])], s[bc_c(*ip)])
+    s[bc_a(*ip)] = n2v(fmod(v2n(k[bc_e(ip[1])]), v2n(s[bc_c(*ip)])));
+    ip++;
+    NEXT();
+
+OP_TGETS_KX:
+    CHECK_T(s[bc_b(*ip)])
+    s[bc_a(*ip)] = table_get_str(v2table(s[bc_b(*ip)]), k[bc_e(ip[1])],
+                                 &fn->ic[ip - fn->ins]);
+    ip++;
+    NEXT();
+OP_TSETS_KX:
+    CHECK_T(s[bc_b(*ip)])
+    table_set_str(L, v2table(s[bc_b(*ip)]), k[bc_e(ip[1])], s[bc_a(*ip)],
+                  &fn->ic[ip - fn->ins]);
+    ip++;
+    NEXT();
+
+OP_KX:
+    NEXT();
 
 
     // ---- Conditions ----
@@ -225,8 +587,8 @@ OP_EQVP:
 OP_EQVN:
     if (s[bc_a(*ip)] != k[bc_d(*ip)]) { ip++; }
     NEXT();
-OP_EQVS:
-    if (!str_eq(v2str(s[bc_a(*ip)]), v2str(k[bc_d(*ip)]))) { ip++; }
+OP_EQVS: // Strings are interned
+    if (s[bc_a(*ip)] != k[bc_d(*ip)]) { ip++; }
     NEXT();
 
 OP_NEQVV:
@@ -239,79 +601,341 @@ OP_NEQVN:
     if (s[bc_a(*ip)] == k[bc_d(*ip)]) { ip++; }
     NEXT();
 OP_NEQVS:
-    if (str_eq(v2str(s[bc_a(*ip)]), v2str(k[bc_d(*ip)]))) { ip++; }
+    if (s[bc_a(*ip)] == k[bc_d(*ip)]) { ip++; }
     NEXT();
 
 OP_LTVV:
-    CHECK_VV("compare less than", s[bc_a(*ip)], s[bc_d(*ip)])
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) >= v2n(s[bc_d(*ip)])) { ip++; }
     NEXT();
 OP_LTVN:
-    CHECK_VN("compare less than", s[bc_a(*ip)], k[bc_d(*ip)])
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) >= v2n(k[bc_d(*ip)])) { ip++; }
     NEXT();
 
 OP_LEVV:
-    CHECK_VV("compare less than or equal", s[bc_a(*ip)], s[bc_d(*ip)])
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) > v2n(s[bc_d(*ip)])) { ip++; }
     NEXT();
 OP_LEVN:
-    CHECK_VN("compare less than or equal", s[bc_a(*ip)], k[bc_d(*ip)])
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) > v2n(k[bc_d(*ip)])) { ip++; }
     NEXT();
 
 OP_GTVV:
-    CHECK_VV("compare greater than", s[bc_a(*ip)], s[bc_d(*ip)])
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) <= v2n(s[bc_d(*ip)])) { ip++; }
     NEXT();
 OP_GTVN:
-    CHECK_VN("compare greater than", s[bc_a(*ip)], k[bc_d(*ip)])
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) <= v2n(k[bc_d(*ip)])) { ip++; }
     NEXT();
 
 OP_GEVV:
-    CHECK_VV("compare greater than or equal", s[bc_a(*ip)], s[bc_d(*ip)])
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) < v2n(s[bc_d(*ip)])) { ip++; }
     NEXT();
 OP_GEVN:
-    CHECK_VN("compare greater than or equal", s[bc_a(*ip)], k[bc_d(*ip)])
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
     if (v2n(s[bc_a(*ip)]) < v2n(k[bc_d(*ip)])) { ip++; }
     NEXT();
 
 
+    // ---- Fused ----
+
+    // A fused comparison reads the jump offset from the 'BC_JMP' that follows
+    // it, and skips over the 'BC_JMP' if the condition is false.
+
+#define FUSED_JMP(cond) \
+    ip += (cond) ? 1 + (int) bc_e(ip[1]) - JMP_BIAS : 2; \
+    DISPATCH();
+
+OP_IST_JMP:
+    FUSED_JMP(compares_true(s[bc_d(*ip)]))
+OP_ISF_JMP:
+    FUSED_JMP(!compares_true(s[bc_d(*ip)]))
+
+OP_EQVV_JMP:
+    FUSED_JMP(s[bc_a(*ip)] == s[bc_d(*ip)])
+OP_EQVP_JMP:
+    FUSED_JMP(s[bc_a(*ip)] == prim2v(bc_d(*ip)))
+OP_EQVN_JMP:
+    FUSED_JMP(s[bc_a(*ip)] == k[bc_d(*ip)])
+OP_EQVS_JMP:
+    FUSED_JMP(s[bc_a(*ip)] == k[bc_d(*ip)])
+
+OP_NEQVV_JMP:
+    FUSED_JMP(s[bc_a(*ip)] != s[bc_d(*ip)])
+OP_NEQVP_JMP:
+    FUSED_JMP(s[bc_a(*ip)] != prim2v(bc_d(*ip)))
+OP_NEQVN_JMP:
+    FUSED_JMP(s[bc_a(*ip)] != k[bc_d(*ip)])
+OP_NEQVS_JMP:
+    FUSED_JMP(s[bc_a(*ip)] != k[bc_d(*ip)])
+
+OP_LTVV_JMP:
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
+OP_LTVV_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) >= v2n(s[bc_d(*ip)])))
+OP_LTVN_JMP:
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
+OP_LTVN_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) >= v2n(k[bc_d(*ip)])))
+
+OP_LEVV_JMP:
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
+OP_LEVV_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) > v2n(s[bc_d(*ip)])))
+OP_LEVN_JMP:
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
+OP_LEVN_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) > v2n(k[bc_d(*ip)])))
+
+OP_GTVV_JMP:
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
+OP_GTVV_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) <= v2n(s[bc_d(*ip)])))
+OP_GTVN_JMP:
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
+OP_GTVN_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) <= v2n(k[bc_d(*ip)])))
+
+OP_GEVV_JMP:
+    CHECK_VV(s[bc_a(*ip)], s[bc_d(*ip)])
+OP_GEVV_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) < v2n(s[bc_d(*ip)])))
+OP_GEVN_JMP:
+    CHECK_VN(s[bc_a(*ip)], k[bc_d(*ip)])
+OP_GEVN_JMP_NUM:
+    FUSED_JMP(!(v2n(s[bc_a(*ip)]) < v2n(k[bc_d(*ip)])))
+
+#undef FUSED_JMP
+
+
     // ---- Control Flow ----
 
-OP_JMP:
-    ip += (int) bc_e(*ip) - JMP_BIAS;
+OP_JMP: {
+    int offset = (int) bc_e(*ip) - JMP_BIAS;
+    ip += offset;
+    if (offset < 0 && --fn->hot_loops[HOT_SLOT(ip - fn->ins)] == 0) {
+        if (trace_start(L, fn, ip, TRACE_LOOP)) { // Hot loop
+            dispatch = RECORD;
+        }
+    }
+    DISPATCH();
+}
+OP_JLOOP:
+    ip = trace_enter(fn, ip, s);
     DISPATCH();
 
+    // The loop's stack slots are the index, limit, step, and loop variable.
+    // Like the comparisons, the 'for' instructions skip the 'BC_JMP' that
+    // follows them to fall out of the loop (or into the body for 'FORPREP').
+
+OP_FORPREP: {
+    uint64_t *r = &s[bc_a(*ip)];
+    CHECK_FOR(r, 3)
+    if (v2n(r[2]) > 0 ? v2n(r[0]) <= v2n(r[1]) : v2n(r[1]) <= v2n(r[0])) {
+        r[3] = r[0];
+        ip++;
+    }
+    NEXT();
+}
+OP_FORPREPI: {
+    uint64_t *r = &s[bc_a(*ip)];
+    CHECK_FOR(r, 2)
+    if ((int16_t) bc_d(*ip) > 0 ? v2n(r[0]) <= v2n(r[1]) :
+                                  v2n(r[1]) <= v2n(r[0])) {
+        r[3] = r[0];
+        ip++;
+    }
+    NEXT();
+}
+OP_FORLOOP: {
+    uint64_t *r = &s[bc_a(*ip)];
+    double step = v2n(r[2]);
+    double idx = v2n(r[0]) + step;
+    r[0] = n2v(idx);
+    if (step > 0 ? idx <= v2n(r[1]) : v2n(r[1]) <= idx) {
+        r[3] = r[0];
+    } else {
+        ip++;
+    }
+    NEXT();
+}
+OP_FORLOOPI: {
+    uint64_t *r = &s[bc_a(*ip)];
+    int16_t step = (int16_t) bc_d(*ip);
+    double idx = v2n(r[0]) + step;
+    r[0] = n2v(idx);
+    if (step > 0 ? idx <= v2n(r[1]) : v2n(r[1]) <= idx) {
+        r[3] = r[0];
+    } else {
+        ip++;
+    }
+    NEXT();
+}
+
 OP_CALL: {
-    CallInfo *c = &cs[L->num_calls++];
-    if (L->num_calls >= L->max_calls) {
-        L->call_stack = cs = mem_realloc(L, cs,
-                L->max_calls * sizeof(CallInfo),
-                L->max_calls * sizeof(CallInfo) * 2);
-        L->max_calls *= 2;
+    uint64_t *f = &s[bc_a(*ip)];
+    if (!is_fn(*f) && !is_closure(*f)) {
+        if (!is_cfn(*f)) {
+            ERR("attempt to call a %s value", type_name(*f))
+        }
+        CFn *cfn = v2cfn(*f);
+        if (cfn->fast && bc_b(*ip) == 1 && is_num(f[1])) { // Fast path
+            double n = cfn->fast(v2n(f[1]));
+            f[0] = n2v(n == n ? n : NAN); // NaN payloads could look like tags
+            for (int i = 1; i < bc_c(*ip); i++) {
+                f[i] = VAL_NIL;
+            }
+            NEXT();
+        } else if (cfn->fn == coro_resume && bc_b(*ip) >= 1 &&
+                   is_coro(f[1]) && v2coro(f[1])->status == CO_SUSPENDED) {
+            goto resume;
+        } else if (cfn->fn == coro_yield &&
+                   (L->co != e->co || e->resumable)) {
+            goto yield;
+        } else if (cfn->fn == base_pcall && bc_b(*ip) >= 1 &&
+                   (is_fn(f[1]) || is_closure(f[1]) || is_cfn(f[1]))) {
+            goto pcall;
+        }
     }
+    if (!grow_calls(L)) {
+        ERR("stack overflow")
+    }
+    cs = L->call_stack;
+    CallInfo *c = &cs[L->num_calls++];
     c->fn = fn;
     c->ip = ip;
     c->s = s;
     c->num_rets = bc_c(*ip);
-    fn = v2fn(s[bc_a(*ip)]);
-    s = &s[bc_a(*ip) + 1]; // Function itself is at 's[bc_a(*ip)]'
+    c->protect = 0;
+    if (is_cfn(*f)) {
+        L->top = f + 1 + bc_b(*ip);
+        call_c(L, f, bc_c(*ip));
+        cs = L->call_stack; // The C function may have grown either stack
+        s = cs[--L->num_calls].s;
+        NEXT();
+    }
+    fn = v2proto(*f);
+    // Function itself is at 's[bc_a(*ip)]'; its frame may not fit in the stack
+    s = stack_check(L, f + 1, fn->max_stack);
     for (int i = bc_b(*ip); i < fn->num_params; i++) { // Set missing args to nil
         s[i] = VAL_NIL;
     }
+    STATS_CALL(L, fn, bc_b(*ip));
+    k = fn->k;
+    ip = &fn->ins[0];
+    if (--fn->hot_call == 0 && trace_start(L, fn, ip, TRACE_CALL)) {
+        dispatch = RECORD; // Hot function
+    }
+    DISPATCH();
+}
+
+    // Calls to 'coroutine.resume' and 'coroutine.yield' switch coroutines
+    // without leaving the loop. Like any call, they push a 'CallInfo' for the
+    // caller, which is where the coroutine that's switched to later returns to
+    // (see 'coro.h'). The library functions handle any other calls (e.g.,
+    // with the wrong arguments, or a yield to C that has to raise an error).
+#define SWITCHED()                                   \
+    fn = e->fn;                                      \
+    ip = e->ip;                                      \
+    s = e->s;                                        \
+    k = fn->k;                                       \
+    cs = L->call_stack;                              \
+    base_calls = L->co == e->co ? e->base_calls : 0; \
+    DISPATCH();
+
+resume: {
+    uint64_t *f = &s[bc_a(*ip)];
+    if (!grow_calls(L)) {
+        ERR("stack overflow")
+    }
+    CallInfo *c = &L->call_stack[L->num_calls++];
+    c->fn = fn;
+    c->ip = ip;
+    c->s = s;
+    c->num_rets = bc_c(*ip);
+    c->protect = 0;
+    resume_coro(L, e, v2coro(f[1]), f + 2, bc_b(*ip) - 1);
+    SWITCHED()
+}
+
+yield: {
+    uint64_t *f = &s[bc_a(*ip)];
+    if (!grow_calls(L)) {
+        ERR("stack overflow")
+    }
+    CallInfo *c = &L->call_stack[L->num_calls++];
+    c->fn = fn;
+    c->ip = ip;
+    c->s = s;
+    c->num_rets = bc_c(*ip);
+    c->protect = 0;
+    if (L->co == e->co) { // Resumed from C (see 'execute_resume')
+        e->yielded = 1;
+        e->rets = f + 1;
+        e->num_rets = bc_b(*ip);
+        return;
+    }
+    leave_coro(L, e, CO_SUSPENDED, VAL_TRUE, f + 1, bc_b(*ip));
+    SWITCHED()
+}
+
+    // Calls to 'pcall' push a 'CallInfo' marked as protected, and then call the
+    // function one slot up, leaving room for the 'true' that's returned first.
+    // Errors are caught by unwinding the call stack to the marker (see
+    // 'catch_err'), so a protected call costs no more than any other call.
+pcall: {
+    uint64_t *f = &s[bc_a(*ip)];
+    if (!grow_calls(L)) {
+        ERR("stack overflow")
+    }
+    cs = L->call_stack;
+    CallInfo *c = &cs[L->num_calls++];
+    c->fn = fn;
+    c->ip = ip;
+    c->s = s;
+    int num_results = bc_c(*ip) > 1 ? bc_c(*ip) - 1 : 0; // Without the status
+    c->num_rets = num_results;
+    c->protect = 1;
+    f[0] = VAL_TRUE; // Replaced by false if there's an error
+    f++; // Function being called, followed by its 'bc_b(*ip) - 1' arguments
+    if (is_cfn(*f)) {
+        L->top = f + bc_b(*ip);
+        call_c(L, f, num_results);
+        cs = L->call_stack; // The C function may have grown either stack
+        s = cs[--L->num_calls].s;
+        NEXT();
+    }
+    fn = v2proto(*f);
+    s = stack_check(L, f + 1, fn->max_stack);
+    for (int i = bc_b(*ip) - 1; i < fn->num_params; i++) { // Missing args
+        s[i] = VAL_NIL;
+    }
+    STATS_CALL(L, fn, bc_b(*ip) - 1);
     k = fn->k;
     ip = &fn->ins[0];
+    if (--fn->hot_call == 0 && trace_start(L, fn, ip, TRACE_CALL)) {
+        dispatch = RECORD; // Hot function
+    }
     DISPATCH();
 }
 
+OP_UCLO:
+    upvals_close(L, &s[bc_d(*ip)]);
+    NEXT();
+
 OP_RET0: {
-    if (L->num_calls == 0) {
+    CLOSE_UPVALS()
+    if (L->num_calls == base_calls) {
+        rets = s;
+        num_rets = 0;
         goto end;
     }
     CallInfo *c = &cs[--L->num_calls];
+    STATS_RET(fn, 0, c->num_rets);
     for (int i = -1; i < c->num_rets - 1; i++) { // Set missing returns to nil
         s[i] = VAL_NIL; // Return values start at s[-1]
     }
@@ -323,10 +947,14 @@ OP_RET0: {
 }
 
 OP_RET1: {
-    if (L->num_calls == 0) {
+    CLOSE_UPVALS()
+    if (L->num_calls == base_calls) {
+        rets = &s[bc_d(*ip)];
+        num_rets = 1;
         goto end;
     }
     CallInfo *c = &cs[--L->num_calls];
+    STATS_RET(fn, 1, c->num_rets);
     s[-1] = s[bc_d(*ip)]; // Return values start at s[-1]
     for (int i = 0; i < c->num_rets - 1; i++) { // Set the rest to nil
         s[i] = VAL_NIL;
@@ -339,10 +967,14 @@ OP_RET1: {
 }
 
 OP_RET: {
-    if (L->num_calls == 0) {
+    CLOSE_UPVALS()
+    if (L->num_calls == base_calls) {
+        rets = &s[bc_a(*ip)];
+        num_rets = bc_d(*ip);
         goto end;
     }
     CallInfo *c = &cs[--L->num_calls];
+    STATS_RET(fn, bc_d(*ip), c->num_rets);
     int i = 0;
     while (i < bc_d(*ip)) { // Copy return values
         s[-1 + i] = s[bc_a(*ip) + i]; // Return values start at s[-1]
@@ -360,5 +992,186 @@ OP_RET: {
 }
 
 end:
-    printf("first stack: %g\n", v2n(s[1]));
+    if (L->co != e->co) { // Function of a coroutine resumed in this loop
+        leave_coro(L, e, CO_DEAD, VAL_TRUE, rets, num_rets);
+        SWITCHED()
+    }
+    e->s = s;
+    e->rets = rets;
+    e->num_rets = num_rets;
+}
+
+#undef SWITCHED
+
+// Sets up the stack frame for a call from C to 'e->fn', whose arguments start
+// at 'e->s' and go up to 'L->top'. There's room for the caller's results as
+// well, so placing them afterwards can't raise an error.
+static void start_call(State *L, Exec *e) {
+    Fn *fn = e->fn;
+    int num_args = (int) (L->top - e->s);
+    int size = fn->max_stack > e->num_results ? fn->max_stack : e->num_results;
+    e->s = stack_check(L, e->s, size); // Fn stays at 's[-1]'
+    for (int i = num_args; i < fn->num_params; i++) { // Set missing args to nil
+        e->s[i] = VAL_NIL;
+    }
+    STATS_CALL(L, fn, num_args);
+    e->ip = &fn->ins[0];
+}
+
+// Runs the interpreter with an error recovery point of its own, so errors in
+// the coroutines it resumes and the calls to 'pcall' it makes can be caught
+// without a 'setjmp' for each one. Returns the status of the error, if there
+// is one.
+static int run_protected(State *L, Exec *e) {
+    Err err = {0};
+    err.parent = L->err;
+    L->err = &err;
+    LUAI_TRY(L, &err,
+        if (!e->ip) { // Not started yet (see 'exec_init')
+            start_call(L, e);
+        }
+        run(L, e);
+    )
+    L->err = err.parent;
+    return err.status;
+}
+
+// Returns from the call to 'pcall' whose 'CallInfo' is at 'i' on the call
+// stack, after an error in one of the calls above it. The call returns false
+// and the error value (see 'err_value'); 'e' is set up to carry on after it.
+static void catch_pcall(State *L, Exec *e, int i, int status) {
+    CallInfo *c = &L->call_stack[i];
+    uint64_t *f = c->s + bc_a(*c->ip);
+    uint64_t err = err_value(L, status);
+    upvals_close(L, f + 1); // Before the called function's frame is reused
+    L->num_calls = i;
+    // Only C functions move 'L->base', and they've all been unwound. Lua code
+    // in a coroutine resumed from this loop runs at the base 'coro_new' gave it
+    L->base = L->co == e->co ? L->stack + e->base : L->stack + 1;
+    f[0] = VAL_FALSE;
+    move_rets(f + 1, c->num_rets, &err, 1);
+    L->top = f + 1 + c->num_rets;
+    e->fn = c->fn;
+    e->ip = c->ip + 1;
+    e->s = c->s;
+    if (status == LUA_ERRMEM) {
+        mem_recover(L);
+    }
+}
+
+// Handles an error with 'status' that stopped 'run'. The innermost call to
+// 'pcall' from Lua above the frame 'e' started in catches it. Failing that, if
+// it was raised in a coroutine that was resumed from Lua, the coroutine is
+// dead and its call to 'coroutine.resume' returns false and the error value.
+// Either way, 'e' is set up to carry on from there and 1 is returned.
+// Otherwise, the error is back on the thread 'e' was entered on, and 0 is
+// returned so it gets passed on.
+static int catch_err(State *L, Exec *e, int status) {
+    int limit = L->co == e->co ? e->base_calls : 0;
+    for (int i = L->num_calls - 1; i >= limit; i--) {
+        if (L->call_stack[i].protect) {
+            catch_pcall(L, e, i, status);
+            return 1;
+        }
+    }
+    if (L->co == e->co) {
+        return 0;
+    }
+    uint64_t err = err_value(L, status);
+    leave_coro(L, e, CO_DEAD, VAL_FALSE, &err, 1);
+    if (status == LUA_ERRMEM) {
+        L->top = e->s + e->fn->max_stack; // Above the resumer's frame
+        mem_recover(L);
+    }
+    return 1;
+}
+
+// Runs 'e' to completion, catching the errors that can be caught on the way.
+// Returns the status of an error that couldn't be, if there is one.
+static int run_all(State *L, Exec *e) {
+    int status;
+    while ((status = run_protected(L, e)) != 0 && catch_err(L, e, status)) {
+        // Carry on from wherever the error was caught
+    }
+    trace_abort(L);
+    return status;
+}
+
+// Sets up 'e' to call the Lua function at 'f' from C. The frame is set up
+// once 'run_protected' starts, so that any error in doing so is caught too.
+static void exec_init(State *L, Exec *e, uint64_t *f, int num_results) {
+    e->co = L->co;
+    e->base_calls = L->num_calls;
+    e->resumable = 0;
+    e->yielded = 0;
+    e->num_results = num_results;
+    e->base = L->base - L->stack;
+    e->fn = v2proto(*f); // The closure (if any) stays at 's[-1]'
+    e->ip = NULL;
+    e->s = f + 1;
+}
+
+// Replaces the function called by 'e' and its arguments with its results.
+static void exec_results(State *L, Exec *e, int num_results) {
+    if (num_results == LUA_MULTRET) {
+        num_results = e->num_rets;
+    }
+    ptrdiff_t r = e->rets - e->s;
+    uint64_t *s = stack_check(L, e->s - 1, num_results); // Already has room
+    for (int i = 0; i < num_results; i++) {
+        s[i] = i < e->num_rets ? s[1 + r + i] : VAL_NIL;
+    }
+    L->top = s + num_results;
+}
+
+void execute(State *L, uint64_t *f, int num_results) {
+    assert(f >= L->stack && f < L->top && (is_fn(*f) || is_closure(*f)));
+    Exec e;
+    exec_init(L, &e, f, num_results);
+    int status = run_all(L, &e);
+    if (status) {
+        err_rethrow(L, status);
+    }
+    exec_results(L, &e, num_results);
+}
+
+int execute_pcall(State *L, uint64_t *f, int num_results) {
+    assert(f >= L->stack && f < L->top && (is_fn(*f) || is_closure(*f)));
+    ptrdiff_t fi = f - L->stack;
+    Exec e;
+    exec_init(L, &e, f, num_results);
+    int status = run_all(L, &e);
+    if (status) { // Error value replaces the function and its arguments
+        err_recover(L, status, fi, e.base, e.base_calls);
+        if (status == LUA_ERRMEM) {
+            mem_recover(L);
+        }
+        return status;
+    }
+    exec_results(L, &e, num_results);
+    return 0;
+}
+
+int execute_resume(State *L, Coro *co, int num_args) {
+    uint64_t *args = L->top - num_args;
+    L->top = args; // Popped from the resumer's stack
+    Exec e;
+    e.co = co;
+    e.base_calls = 0;
+    e.resumable = 1;
+    e.yielded = 0;
+    e.num_results = LUA_MULTRET; // Unused, since it's already started
+    resume_coro(L, &e, co, args, num_args);
+    e.base = L->base - L->stack;
+    int status = run_all(L, &e);
+    // The error value or results stay on the coroutine's stack after leaving
+    uint64_t err = status ? err_value(L, status) : VAL_NIL;
+    uint64_t *vals = status ? &err : e.rets;
+    int n = status ? 1 : e.num_rets;
+    coro_leave(L, !status && e.yielded ? CO_SUSPENDED : CO_DEAD);
+    L->top = stack_check(L, L->top, n);
+    for (int i = 0; i < n; i++) {
+        *(L->top++) = vals[i];
+    }
+    return status;
 }
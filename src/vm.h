@@ -3,9 +3,32 @@
 #define LUAJ_VM_H
 
 #include "state.h"
+#include "coro.h"
 
-// Expects a function prototype to be on top of the stack; pops the function
-// and executes it.
-void execute(State *L);
+// Calls the function at 'f', with the arguments above it up to 'L->top'. The
+// arguments are used in place as the bottom of the function's stack frame.
+// Afterwards, the function and its arguments are replaced by 'num_results'
+// results (or all of them, for LUA_MULTRET) and 'L->top' is left just above.
+void execute(State *L, uint64_t *f, int num_results);
+
+// Same as 'execute', but errors are caught: the function and its arguments
+// are replaced by the error value instead, and the error's status is returned
+// (or 0 if there wasn't one). Used by 'lua_pcall' for Lua functions, so only
+// this call's error recovery point is needed between C and the interpreter.
+int execute_pcall(State *L, uint64_t *f, int num_results);
+
+// Same as 'execute', but for a C function called from C.
+void execute_c(State *L, uint64_t *f, int num_results);
+
+// Resumes the suspended coroutine 'co' from C, passing it the 'num_args'
+// values on top of the stack (which are popped). Once it yields or returns,
+// the values it passed are pushed and 0 is returned. If it raises an error
+// instead, the error value is pushed, its status is returned, and the
+// coroutine is dead.
+int execute_resume(State *L, Coro *co, int num_args);
+
+// The 'pcall' library function (see 'lib_base.c'), which the interpreter
+// recognises in calls from Lua.
+int base_pcall(lua_State *L);
 
 #endif
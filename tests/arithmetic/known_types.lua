@@ -0,0 +1,87 @@
+-- Arithmetic on values that the parser can prove are numbers skips the type
+-- checks, so anything it can't prove must still be checked
+
+-- Numbers on every path into a jump target
+local a = 1
+if a > 0 then a = a + 1 else a = a * 2 end
+assert(a + a == 4)
+
+-- A number on only one path
+local function on_one_path(c)
+  local b = 1
+  if c then b = "x" end
+  return b + 1
+end
+assert(on_one_path(false) == 2)
+assert(not pcall(on_one_path, true))
+
+-- The loop variable is reassigned inside a nested loop that starts the body
+local function reassign_var()
+  local sum = 0
+  for i = 1, 3 do
+    while sum < 10 do
+      sum = sum + i
+      i = "x"
+    end
+    sum = sum + i
+  end
+  return sum
+end
+assert(not pcall(reassign_var))
+
+-- A call can change a local through an open upvalue
+local function through_upval()
+  local n = 1
+  local function set() n = "x" end
+  n = n + 1
+  set()
+  return n + 1
+end
+assert(not pcall(through_upval))
+
+-- Arguments and call results could be anything
+local function add(x, y) return x + y end
+assert(add(1, 2) == 3)
+assert(not pcall(add, 1, "x"))
+local function one() return 1 end
+local function str() return "x" end
+local c = one() + 1
+assert(c == 2)
+assert(not pcall(function() local d = 1; d = str(); return d < 1 end))
+
+-- Loops where the types are known all the way round
+local sum, x = 0, 1.5
+for i = 1, 10 do
+  sum = sum + i * x
+  if sum > 20 then sum = sum - 20 end
+end
+assert(sum == 2.5)
+local p = sum
+while p < 100 do p = p * 2 end
+assert(p == 160)
+
+-- A value that's a number on entry to a loop but not after the back edge
+local function repeat_header()
+  local x, t, n = 1, {}, 0
+  repeat
+    local y = x + 1
+    n = n + 1
+    x = t
+  until n == 2
+end
+assert(not pcall(repeat_header))
+
+local function while_header()
+  local i = 0
+  while i < 3 do i = "x" end
+end
+assert(not pcall(while_header))
+
+local function for_header()
+  local v = 1
+  for i = 1, 3 do
+    v = v * 2
+    if i == 2 then v = "x" end
+  end
+end
+assert(not pcall(for_header))
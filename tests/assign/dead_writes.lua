@@ -0,0 +1,27 @@
+-- Dead writes are removed, and jumps to a removed instruction land on the
+-- next one that's kept
+
+-- The loop starts with a 'NOP' from the discarded value of 'not'
+local c = 0
+repeat
+  local z = not (3 or c)
+  c = c + 1
+until c > 3
+assert(c == 4)
+
+-- A dead constant load at the start of a loop body
+local n, v = 0, 0
+while n < 3 do
+  v = 1
+  v = n
+  n = n + 1
+end
+assert(n == 3 and v == 2)
+
+-- Forward jumps over a removed write
+local w = 5
+if n > 1 then
+  w = nil
+  w = 7
+end
+assert(w == 7)
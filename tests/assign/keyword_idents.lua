@@ -0,0 +1,9 @@
+-- Identifiers that start and end like keywords, or contain them
+local lol, fin, iff, ende, elsef, tun, woe, dodo = 1, 2, 3, 4, 5, 6, 7, 8
+local rest, unl, fr, ed, bk, rn, i_n, ad = 9, 10, 11, 12, 13, 14, 15, 16
+local oar, nt, nl, fe, te, _end, End, local_ = 17, 18, 19, 20, 21, 22, 23, 24
+assert(lol + fin + iff + ende + elsef + tun + woe + dodo == 36)
+assert(rest + unl + fr + ed + bk + rn + i_n + ad == 100)
+assert(oar + nt + nl + fe + te + _end + End + local_ == 164)
+local x9_Z = true
+assert(x9_Z)
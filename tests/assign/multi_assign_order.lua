@@ -0,0 +1,66 @@
+local a = 1
+local b = 2
+a, b = b, a
+assert(a == 2)
+assert(b == 1)
+
+-- Tables and keys are read before any variable is assigned
+local t = {}
+local i = 1
+t[i], i = 10, 2
+assert(t[1] == 10)
+assert(i == 2)
+t.x, t = 5, 6
+assert(t == 6)
+
+-- Constants mixed with other expressions
+t = {}
+a, t.y, b = a + 1, 7, a
+assert(a == 3)
+assert(t.y == 7)
+assert(b == 2)
+g, a = a, "s"
+assert(g == 3)
+assert(a == "s")
+
+-- Extra expressions are still evaluated
+local calls = 0
+local function f()
+  calls = calls + 1
+  return 1, 2
+end
+a = 1, f()
+assert(a == 1)
+assert(calls == 1)
+a, b, i = 0, f()
+assert(a == 0)
+assert(b == 1)
+assert(i == 2)
+
+-- Values overwritten before they're read (in a function without closures,
+-- so the stores can be removed)
+local function overwrite()
+  local a = 1
+  a = 2
+  assert(a == 2)
+  local b = nil
+  b = a
+  assert(b == 2)
+  while a < 10 do
+    b = 0
+    a = a + 1
+    b = a
+  end
+  assert(a == 10)
+  assert(b == 10)
+end
+overwrite()
+
+-- Temporaries for extra expressions are dropped
+local x, y = 1, 2
+a, b = x + 1, y + 1, x + y
+assert(a == 2)
+assert(b == 3)
+a, b = x + 1, y + 1, f()
+assert(a == 2)
+assert(b == 3)
@@ -0,0 +1,39 @@
+assert(type(1) == "number")
+assert(type("a") == "string")
+assert(type(nil) == "nil")
+assert(type(type) == "function")
+assert(tostring(12) == "12")
+assert(tonumber("10") == 10)
+assert(tonumber("ff", 16) == 255)
+assert(tonumber("z") == nil)
+
+local ok, err = pcall(error, "boom", 0)
+assert(not ok and err == "boom")
+local function add(a, b)
+    return a + b
+end
+local ok2, sum = pcall(add, 2, 3)
+assert(ok2 and sum == 5)
+assert(not pcall(add, 2, nil))
+
+-- Fast path for a single number argument, and the C API path otherwise
+assert(math.sqrt(16) == 4)
+assert(math.floor(3.7) == 3)
+assert(math.floor("3.7") == 3)
+assert(not pcall(math.floor, nil))
+assert(math.max(1, 5, 3) == 5)
+local i = 0
+local s = 0
+while i < 200 do
+    s = s + math.abs(-i)
+    i = i + 1
+end
+assert(s == 19900)
+
+count = 0
+local function inc()
+    count = count + 1
+end
+inc()
+inc()
+assert(count == 2)
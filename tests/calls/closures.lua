@@ -0,0 +1,124 @@
+-- Counters share a single upvalue that outlives the call that created it
+local function counter()
+  local n = 0
+  return function()
+    n = n + 1
+    return n
+  end
+end
+local c1 = counter()
+local c2 = counter()
+assert(c1() == 1)
+assert(c1() == 2)
+assert(c2() == 1)
+assert(c1() == 3)
+
+-- Closures created in the same scope share upvalues
+local function pair()
+  local v = 10
+  local function get() return v end
+  local function set(x) v = x end
+  return get, set
+end
+local get, set = pair()
+assert(get() == 10)
+set(42)
+assert(get() == 42)
+
+-- Each loop iteration gets a fresh local
+local fns = {}
+local i = 1
+while i <= 3 do
+  local j = i
+  fns[i] = function() return j end
+  i = i + 1
+end
+assert(fns[1]() == 1)
+assert(fns[2]() == 2)
+assert(fns[3]() == 3)
+
+-- Mutated locals captured in a loop are closed on every iteration and when
+-- breaking out of the loop
+local incs = {}
+i = 1
+while true do
+  local k = i * 10
+  incs[i] = function() k = k + 1; return k end
+  if i == 2 then
+    break
+  end
+  i = i + 1
+end
+assert(incs[1]() == 11)
+assert(incs[1]() == 12)
+assert(incs[2]() == 21)
+assert(incs[2]() == 22)
+local r = 0
+repeat
+  local m = 5
+  local f = function() m = m * 2; return m end
+  r = f()
+until r > 0
+assert(r == 10)
+
+-- Upvalues of upvalues
+local function outer()
+  local x = 1
+  return function()
+    return function()
+      x = x + 1
+      return x
+    end
+  end
+end
+local inner = outer()()
+assert(inner() == 2)
+assert(inner() == 3)
+
+-- Read-only captures, including parameters and constants
+local function adder(a)
+  return function(b) return a + b end
+end
+local add5 = adder(5)
+assert(add5(1) == 6)
+assert(adder(-1)(1) == 0)
+
+local limit = 100
+local big = 1.5e10
+local name = "test"
+local flag = false
+local function consts()
+  return function()
+    return limit, big, name, flag
+  end
+end
+local a, b, c, d = consts()()
+assert(a == 100)
+assert(b == 1.5e10)
+assert(c == "test")
+assert(d == false)
+
+-- A local assigned after it's captured isn't folded
+local late = 1
+local function get_late() return late end
+late = 2
+assert(get_late() == 2)
+
+-- Recursive local functions capture themselves
+local function fib(n)
+  if n < 2 then
+    return n
+  end
+  return fib(n - 1) + fib(n - 2)
+end
+assert(fib(10) == 55)
+
+-- Upvalues are closed when an error unwinds the stack
+local function thrower()
+  local x = 1
+  error(function() x = x + 1; return x end)
+end
+local ok, inc = pcall(thrower)
+assert(not ok)
+assert(inc() == 2)
+assert(inc() == 3)
@@ -0,0 +1,163 @@
+-- Values are passed both ways through resume and yield
+local co = coroutine.create(function(a, b)
+  assert(type(coroutine.running()) == "thread")
+  local c, d = coroutine.yield(a + b, a * b)
+  local e = coroutine.yield(c .. d)
+  return e, "done"
+end)
+assert(type(co) == "thread")
+assert(coroutine.status(co) == "suspended")
+local ok, x, y = coroutine.resume(co, 3, 4)
+assert(ok == true and x == 7 and y == 12)
+ok, x = coroutine.resume(co, "a", "b")
+assert(ok == true and x == "ab")
+ok, x, y = coroutine.resume(co, 5)
+assert(ok == true and x == 5 and y == "done")
+assert(coroutine.status(co) == "dead")
+ok, x = coroutine.resume(co)
+assert(ok == false and x == "cannot resume dead coroutine")
+assert(coroutine.running() == nil)
+
+-- Missing values are nil
+co = coroutine.create(function(a, b)
+  assert(a == 1 and b == nil)
+  local c, d = coroutine.yield()
+  assert(c == nil and d == nil)
+end)
+ok, x = coroutine.resume(co, 1)
+assert(ok == true and x == nil)
+ok, x = coroutine.resume(co)
+assert(ok == true and x == nil)
+
+-- Yields from functions called by the coroutine
+local function gen(n)
+  local i = 1
+  while i <= n do
+    coroutine.yield(i)
+    i = i + 1
+  end
+end
+co = coroutine.create(function() gen(3) return 0 end)
+local sum = 0
+local n = 0
+while coroutine.status(co) ~= "dead" do
+  local ok, v = coroutine.resume(co)
+  assert(ok)
+  sum = sum + v
+  n = n + 1
+end
+assert(sum == 6 and n == 4)
+
+-- Nested coroutines, and their statuses
+local outer = nil
+local inner = coroutine.create(function()
+  assert(coroutine.status(outer) == "normal")
+  coroutine.yield(1)
+  return 2
+end)
+outer = coroutine.create(function()
+  assert(coroutine.status(outer) == "running")
+  local ok, v = coroutine.resume(inner)
+  assert(ok and v == 1)
+  coroutine.yield(v)
+  ok, v = coroutine.resume(inner)
+  assert(ok and v == 2)
+  return v + 1
+end)
+ok, x = coroutine.resume(outer)
+assert(ok and x == 1)
+assert(coroutine.status(inner) == "suspended")
+ok, x = coroutine.resume(outer)
+assert(ok and x == 3)
+assert(coroutine.status(inner) == "dead")
+
+-- A coroutine can't resume itself
+co = coroutine.create(function()
+  local ok, e = coroutine.resume(co)
+  return ok, e
+end)
+ok, x, y = coroutine.resume(co)
+assert(ok == true and x == false and y == "cannot resume non-suspended coroutine")
+
+-- Errors kill the coroutine and are returned by resume
+co = coroutine.create(function(a)
+  coroutine.yield(a)
+  error("boom", 0)
+end)
+ok, x = coroutine.resume(co, 1)
+assert(ok and x == 1)
+ok, x = coroutine.resume(co)
+assert(ok == false and x == "boom")
+assert(coroutine.status(co) == "dead")
+co = coroutine.create(function() local t = nil; return t.x end)
+ok, x = coroutine.resume(co)
+assert(ok == false and type(x) == "string")
+
+-- Errors only go as far as the innermost coroutine
+outer = coroutine.create(function()
+  local inner = coroutine.create(function() error("inner", 0) end)
+  local ok, e = coroutine.resume(inner)
+  assert(ok == false and e == "inner")
+  coroutine.yield("still running")
+  error("outer", 0)
+end)
+ok, x = coroutine.resume(outer)
+assert(ok and x == "still running")
+ok, x = coroutine.resume(outer)
+assert(ok == false and x == "outer")
+
+-- Yielding outside a coroutine or across a C function
+ok, x = pcall(coroutine.yield, 1)
+assert(ok == false)
+co = coroutine.create(function()
+  local ok, e = pcall(coroutine.yield, 1)
+  assert(ok == false)
+  return "after"
+end)
+ok, x = coroutine.resume(co)
+assert(ok and x == "after")
+
+-- Resumed from C (through pcall)
+co = coroutine.create(function(a)
+  local inner = coroutine.create(function(b) coroutine.yield(b * 2) end)
+  local ok, v = coroutine.resume(inner, a)
+  local c = coroutine.yield(v + 1)
+  error("from " .. c, 0)
+end)
+local pok, ok, v = pcall(coroutine.resume, co, 10)
+assert(pok and ok and v == 21)
+pok, ok, v = pcall(coroutine.resume, co, "c")
+assert(pok and ok == false and v == "from c")
+ok, x = pcall(coroutine.resume, 1)
+assert(ok == false)
+ok, x = pcall(coroutine.create, print)
+assert(ok == false)
+
+-- Upvalues are shared with the coroutine, and closed when it dies
+local shared = 0
+local get = nil
+co = coroutine.create(function()
+  local mine = 1
+  get = function() return mine end
+  shared = shared + 1
+  coroutine.yield()
+  mine = 2
+  shared = shared + 1
+end)
+coroutine.resume(co)
+assert(shared == 1 and get() == 1)
+coroutine.resume(co)
+assert(shared == 2 and get() == 2)
+
+-- Deep calls grow the coroutine's stacks
+local function depth(n)
+  if n == 0 then
+    return coroutine.yield(0)
+  end
+  return depth(n - 1) + 1
+end
+co = coroutine.create(depth)
+ok, x = coroutine.resume(co, 500)
+assert(ok and x == 0)
+ok, x = coroutine.resume(co, 1)
+assert(ok and x == 501)
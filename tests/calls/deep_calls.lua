@@ -0,0 +1,22 @@
+-- Recurses by passing the function to itself, so the stack has to grow well
+-- past its initial size
+local function count(self, n)
+    if n == 0 then
+        return 0
+    end
+    return self(self, n - 1) + 1
+end
+assert(count(count, 10000) == 10000)
+
+-- Frames with lots of locals
+local function wide(self, n)
+    local a, b, c, d, e, f, g, h = 1, 2, 3, 4, 5, 6, 7, 8
+    local i, j, k, l, m, o, p, q = 9, 10, 11, 12, 13, 14, 15, 16
+    if n == 0 then
+        return a + b + c + d + e + f + g + h + i + j + k + l + m + o + p + q
+    end
+    local r = self(self, n - 1)
+    assert(a + q == 17)
+    return r
+end
+assert(wide(wide, 500) == 136)
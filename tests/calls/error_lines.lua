@@ -0,0 +1,329 @@
+-- Runtime errors and 'error' report the line they were raised on, which is
+-- the same for both when they're on the same line
+local function same_line()
+  local ok1, e1 = pcall(function() local t = nil; return t.x end) local ok2, e2 = pcall(function() error("attempt to index nil value") end)
+  assert(ok1 == false and ok2 == false)
+  assert(e1 == e2)
+  return e1
+end
+local first = same_line()
+
+-- Lines further apart than a byte can hold
+local function far()
+  local ok1, e1 = pcall(function() local t = nil; return t.x end) local ok2, e2 = pcall(function() error("attempt to index nil value") end)
+  assert(e1 == e2)
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  -- Padding
+  local ok3, e3 = pcall(function() local t = nil; return t.x end) local ok4, e4 = pcall(function() error("attempt to index nil value") end)
+  assert(e3 == e4 and e3 ~= e1)
+  return e3
+end
+local second = far()
+assert(first ~= second)
+
+-- Backwards to an earlier line, from the end of a loop
+local msgs = {}
+for i = 1, 2 do
+  local ok, e = pcall(function() local t = nil; return t.x end) local ok2, e2 = pcall(function() error("attempt to index nil value") end)
+  assert(e == e2)
+  msgs[i] = e
+end
+assert(msgs[1] == msgs[2])
@@ -0,0 +1,93 @@
+-- Results follow the status, and missing ones are nil
+local function three(a) return a, a + 1, a + 2 end
+local ok, x, y, z = pcall(three, 1)
+assert(ok == true and x == 1 and y == 2 and z == 3)
+ok, x = pcall(three, 1)
+assert(ok == true and x == 1)
+local a, b, c, d, e = pcall(three, 1)
+assert(a == true and d == 3 and e == nil)
+ok = pcall(three, 1)
+assert(ok == true)
+pcall(three, 1)
+
+-- Errors unwind to the innermost pcall, leaving the caller's frame intact
+local before = "kept"
+local function fail(n)
+  if n == 0 then
+    local t = nil
+    return t.x
+  end
+  return fail(n - 1) + 1
+end
+ok, x, y = pcall(fail, 20)
+assert(ok == false and type(x) == "string" and y == nil)
+assert(before == "kept")
+ok, x = pcall(error, "boom", 0)
+assert(ok == false and x == "boom")
+ok, x = pcall(error, {code = 1})
+assert(ok == false and x.code == 1)
+assert(not pcall(1))
+
+-- Nested pcalls catch their own errors, and carry on afterwards
+local function inner()
+  local ok, e = pcall(error, "inner", 0)
+  assert(ok == false and e == "inner")
+  error("outer", 0)
+end
+ok, x = pcall(inner)
+assert(ok == false and x == "outer")
+ok, x = pcall(pcall, error, "both", 0)
+assert(ok == true and x == false)
+
+-- Errors in C functions called by Lua functions under a pcall
+local function sum(t)
+  local s = 0
+  for i = 1, 3 do
+    s = s + t[i]
+  end
+  return s
+end
+ok, x = pcall(sum, {1, 2, 3})
+assert(ok and x == 6)
+ok, x = pcall(sum, {1, "a", 3})
+assert(ok == false)
+ok, x = pcall(function() return ("x"):bad() end)
+assert(ok == false)
+
+-- Upvalues of the unwound frames are closed
+local get = nil
+ok = pcall(function(v)
+  local w = v * 2
+  get = function() return v + w end
+  error("unwind")
+end, 5)
+assert(ok == false)
+local junk = {1, 2, 3, 4, 5, 6, 7, 8}
+assert(get() == 15)
+
+-- Many protected calls in a loop
+local n = 0
+for i = 1, 1000 do
+  local ok = pcall(fail, i % 3)
+  if not ok then
+    n = n + 1
+  end
+end
+assert(n == 1000)
+
+-- Errors in a coroutine are caught by a pcall inside it first
+local co = coroutine.create(function()
+  local ok, e = pcall(error, "in coroutine", 0)
+  coroutine.yield(e)
+  ok, e = pcall(function()
+    coroutine.yield("across pcall")
+    error("after yield", 0)
+  end)
+  return e
+end)
+ok, x = coroutine.resume(co)
+assert(ok and x == "in coroutine")
+ok, x = coroutine.resume(co)
+assert(ok and x == "across pcall")
+ok, x = coroutine.resume(co)
+assert(ok and x == "after yield")
@@ -0,0 +1,28 @@
+local s = "a"
+local t = true
+local f = false
+local n = 0 / 0
+local i = 0
+local c = 0
+while i < 200 do
+    i = i + 1
+    if i == 100 then c = c + 1 end
+    if i ~= 100 then c = c + 1 end
+    if i < 50 then c = c + 1 end
+    if i <= 50 then c = c + 1 end
+    if i > 150 then c = c + 1 end
+    if i >= 150 then c = c + 1 end
+    if i == i then c = c + 1 end
+    if s == "a" then c = c + 1 end
+    if s ~= "b" then c = c + 1 end
+    if t then c = c + 1 end
+    if not f then c = c + 1 end
+    if t == nil then c = c + 1000 end
+    if n < 1 then c = c + 1 end
+end
+assert(c == 1 + 199 + 49 + 50 + 50 + 51 + 200 * 5)
+local x = 3
+if x > 2 and x < 4 then x = 10 elseif x == 3 then x = 20 else x = 30 end
+assert(x == 10)
+if not (x ~= 10) then x = 11 end
+assert(x == 11)
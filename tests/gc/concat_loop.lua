@@ -0,0 +1,15 @@
+local keep = "a" .. "b"
+local s = "start"
+local t = ""
+local i = 0
+while i < 20000 do
+    t = s .. "x"
+    if i % 10 == 0 then
+        s = "start"
+    else
+        s = t
+    end
+    i = i + 1
+end
+assert(keep == "ab")
+assert(s == "startxxxxxxxxx")
@@ -0,0 +1,48 @@
+-- Values on the stacks of suspended coroutines stay alive
+local cos = {}
+local i = 1
+while i <= 200 do
+    local co = coroutine.create(function(n)
+        local t = {value = n, s = "v" .. "x"}
+        coroutine.yield()
+        assert(t.value == n and t.s == "vx")
+        return t.value
+    end)
+    coroutine.resume(co, i)
+    cos[i] = co
+    i = i + 1
+end
+i = 1
+while i <= 5000 do
+    local garbage = {i, i + 1, name = "garbage"}
+    i = i + 1
+end
+i = 1
+while i <= 200 do
+    local ok, v = coroutine.resume(cos[i])
+    assert(ok and v == i)
+    i = i + 1
+end
+
+-- Upvalues of coroutines that are collected while suspended are closed
+local getters = {}
+i = 1
+while i <= 200 do
+    local co = coroutine.create(function(n)
+        local x = {n}
+        getters[n] = function() return x[1] end
+        coroutine.yield()
+    end)
+    coroutine.resume(co, i)
+    i = i + 1
+end
+i = 1
+while i <= 5000 do
+    local garbage = {i, i + 1, name = "garbage"}
+    i = i + 1
+end
+i = 1
+while i <= 200 do
+    assert(getters[i]() == i)
+    i = i + 1
+end
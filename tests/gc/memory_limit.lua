@@ -0,0 +1,45 @@
+-- env: LUAJ_MEM_LIMIT=300000
+
+-- Going over the limit raises an error that pcall catches, and collections
+-- near the limit still keep everything that's reachable. The scratch tables
+-- are freed once the error is caught, which leaves room to carry on
+local keep = {}
+local ok, e = pcall(function()
+  local scratch = {}
+  for i = 1, 2000 do
+    scratch[i] = {i}
+  end
+  for i = 1, 1e6 do
+    keep[i] = {i}
+  end
+end)
+assert(ok == false and e == "not enough memory")
+local n = 0
+while keep[n + 1] do
+  n = n + 1
+  assert(type(keep[n]) == "table" and keep[n][1] == n)
+end
+assert(n > 1000)
+
+-- Once it's unreachable, the memory can be used again
+keep = nil
+local function fill()
+  local t = {}
+  for i = 1, 1e6 do
+    t[i] = {i}
+  end
+end
+for i = 1, 3 do
+  ok, e = pcall(fill)
+  assert(ok == false and e == "not enough memory")
+end
+
+-- A coroutine that runs out of memory is dead
+local co = coroutine.create(fill)
+ok, e = coroutine.resume(co)
+assert(ok == false and e == "not enough memory")
+assert(coroutine.status(co) == "dead")
+local t = {}
+for i = 1, 1000 do
+  t[i] = {i}
+end
@@ -0,0 +1,13 @@
+local keep = {}
+local i = 1
+while i <= 5000 do
+    local garbage = {i, i + 1, name = "garbage"}
+    keep[i] = {value = i, s = "v" .. "x"}
+    i = i + 1
+end
+i = 1
+while i <= 5000 do
+    assert(keep[i].value == i)
+    assert(keep[i].s == "vx")
+    i = i + 1
+end
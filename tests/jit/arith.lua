@@ -0,0 +1,18 @@
+local i = 0
+local a = 0
+local b = 100
+local c = 1
+while i < 1000 do
+    i = i + 1
+    a = a + i * 2 - 1
+    b = b - 0.5
+    c = 3 / (c + 1)
+    local d = -b
+    local e = 10 - d
+    local f = i % 3
+    local g = f ^ 2
+    a = a + g - g
+end
+assert(a == 1000000)
+assert(b == -400)
+assert(c > 1.3 and c < 1.31)
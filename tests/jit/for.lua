@@ -0,0 +1,51 @@
+-- Hot numeric 'for' loops, with constant and variable steps
+local n = 0
+for i = 1, 1000 do
+    n = n + i
+end
+assert(n == 500500)
+n = 0
+for i = 1000, 1, -1 do
+    n = n + i * 2
+end
+assert(n == 1001000)
+local step = 0.5
+n = 0
+for i = 1, 1000, step do
+    n = n + i
+end
+assert(n == 1000499.5)
+
+-- A variable negative step can't use the compiled trace
+step = -3
+n = 0
+for i = 1000, 1, step do
+    n = n + 1
+end
+assert(n == 334)
+
+-- Side exits in the middle of the loop, and from inner loops
+n = 0
+for i = 1, 1000 do
+    if i > 500 then
+        n = n + 2
+    else
+        n = n + 1
+    end
+end
+assert(n == 1500)
+n = 0
+for i = 1, 100 do
+    for j = 1, 100 do
+        n = n + j
+    end
+end
+assert(n == 505000)
+
+-- The loop variable can be assigned in the body
+n = 0
+for i = 1, 200 do
+    i = i * 2
+    n = n + i
+end
+assert(n == 40200)
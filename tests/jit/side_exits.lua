@@ -0,0 +1,27 @@
+local i = 0
+local x = 0
+local y = 1
+while i < 100000 do
+    i = i + 1
+    if i > 50000 then x = x + 2 else x = x * 1.0001 end
+    y = -y
+    local z = i % 7
+    local w = 2 ^ 3
+    x = x + z - w + 8 / 2 - 4
+end
+assert(i == 100000)
+assert(y == 1)
+local j = 0
+repeat j = j + 0.5 until j >= 1000
+assert(j == 1000)
+local n = 0/0
+local c = 0
+while c < 100 do
+  if n < 1 then c = 1000 end
+  c = c + 1
+end
+assert(c == 100)
+local s = 0
+local k = 1
+while k <= 300 do s = s + k; k = k + 1 end
+assert(s == 45150)
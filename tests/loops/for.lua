@@ -0,0 +1,66 @@
+local n = 0
+for i = 1, 10 do
+    n = n + i
+end
+assert(n == 55)
+
+-- Negative, fractional, and variable steps
+n = 0
+for i = 10, 1, -2 do
+    n = n + i
+end
+assert(n == 30)
+n = 0
+for i = 0, 1, 0.25 do
+    n = n + i
+end
+assert(n == 2.5)
+local step = -1
+n = 0
+for i = 3, 1, step do
+    n = n * 10 + i
+end
+assert(n == 321)
+
+-- Loops that don't run
+for i = 1, 0 do
+    assert(false)
+end
+for i = 0, 1, -1 do
+    assert(false)
+end
+
+-- The limit and step are only evaluated once, and assigning to the loop
+-- variable doesn't change the number of iterations
+local limit = 5
+n = 0
+for i = 1, limit do
+    limit = 1
+    i = i * 100
+    n = n + 1
+end
+assert(n == 5)
+
+-- Break, and nested loops
+n = 0
+for i = 1, 100 do
+    if i > 3 then
+        break
+    end
+    for j = i, 3 do
+        n = n + 1
+    end
+end
+assert(n == 6)
+
+-- Each iteration gets a fresh loop variable
+local fns = {}
+for i = 1, 3 do
+    fns[i] = function() return i end
+end
+assert(fns[1]() == 1)
+assert(fns[3]() == 3)
+
+assert(not pcall(function() for i = "a", 2 do end end))
+assert(not pcall(function() for i = 1, nil do end end))
+assert(not pcall(function() local s = {} for i = 1, 2, s do end end))
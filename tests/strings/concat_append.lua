@@ -0,0 +1,27 @@
+-- Long strings built by appending share a buffer, but must still compare and
+-- index like any other string
+local ten = "0123456789"
+local s = ""
+local i = 0
+while i < 20 do
+    s = s .. ten
+    i = i + 1
+end
+local forty = ten .. ten .. ten .. ten
+local eighty = forty .. forty
+assert(s == eighty .. forty .. eighty)
+
+-- Appending to a shorter prefix mustn't change the longer string
+local a = eighty .. "a"
+local b = eighty .. "b"
+local ab = a .. "b"
+assert(a ~= b)
+assert(a == eighty .. "a")
+assert(b == eighty .. "b")
+assert(ab == eighty .. "ab")
+
+-- Building a string that already exists gives the interned one
+local t = {}
+t[eighty .. "a"] = 1
+t[a] = t[a] + 1
+assert(t[eighty .. "a"] == 2)
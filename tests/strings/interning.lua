@@ -0,0 +1,16 @@
+local a = "hello"
+local b = "hel"
+local c = b .. "lo"
+assert(a == c)
+assert(c == "hello")
+assert(not (c ~= a))
+local d = "he" .. "llo"
+assert(d == c)
+local x = "x"
+local e = x .. x
+local f = x .. x
+assert(e == f)
+assert(e == "xx")
+assert(e ~= "xxx")
+local n = 3
+assert(n ~= "3")
@@ -0,0 +1,17 @@
+--[[ A block comment
+that spans lines ]] local a = "a\tb\\c\"d\'e"
+--[==[ Another ]] one ]==]
+assert(a == 'a\tb\\c"d\'e')
+local b = [[
+first
+second]]
+assert(b == "first\nsecond")
+local c = [==[x]]y]=]z]==]
+assert(c == "x]]y]=]z")
+assert("\65\066\0677" == "ABC7")
+assert("line\
+break" == "line\nbreak")
+local d = 0x10 + 1e2 + 2.5e-1 + .5
+assert(d == 16 + 100 + 0.25 + 0.5)
+local long_identifier_name_for_the_lexer_to_scan = 1 -- Trailing comment
+assert(long_identifier_name_for_the_lexer_to_scan == 1)
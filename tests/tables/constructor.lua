@@ -0,0 +1,20 @@
+local t = {}
+assert(t.x == nil)
+local a = {1, 2, 3}
+assert(a[1] == 1)
+assert(a[2] == 2)
+assert(a[3] == 3)
+assert(a[4] == nil)
+local b = {x = 1, y = "hi", ["z"] = 3}
+assert(b.x == 1)
+assert(b.y == "hi")
+assert(b.z == 3)
+local k = "key"
+local c = {[k] = 10, 20, [3 + 4] = 30; 40}
+assert(c.key == 10)
+assert(c[1] == 20)
+assert(c[2] == 40)
+assert(c[7] == 30)
+local d = {inner = {1, 2}, 3}
+assert(d.inner[2] == 2)
+assert(d[1] == 3)
@@ -0,0 +1,36 @@
+local t = {}
+t.x = 3
+assert(t.x == 3)
+t["y"] = t.x + 1
+assert(t.y == 4)
+t.x = nil
+assert(t.x == nil)
+assert(t.y == 4)
+local i = 1
+while i <= 100 do
+    t[i] = i * 2
+    i = i + 1
+end
+assert(t[1] == 2)
+assert(t[50] == 100)
+assert(t[100] == 200)
+assert(t[101] == nil)
+t[0] = "zero"
+t[-0] = "negative zero"
+assert(t[0] == "negative zero")
+t[1.5] = "half"
+assert(t[1.5] == "half")
+local n = {}
+n.a = {}
+n.a.b = {}
+n.a.b.c = 5
+assert(n.a.b.c == 5)
+local key = "a"
+assert(n[key].b.c == 5)
+local x, y = {}, {}
+x.v, y.v = 1, 2
+assert(x.v == 1)
+assert(y.v == 2)
+t[x] = "table key"
+assert(t[x] == "table key")
+assert(t[y] == nil)
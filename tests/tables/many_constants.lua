@@ -0,0 +1,666 @@
+
+-- Functions with more than 256 distinct constants, where constants are
+-- re-used after the 8-bit constant operand range runs out
+
+local t = {}
+t.key1 = 1.5
+t.key2 = 2.5
+t.key3 = 3.5
+t.key4 = 4.5
+t.key5 = 5.5
+t.key6 = 6.5
+t.key7 = 7.5
+t.key8 = 8.5
+t.key9 = 9.5
+t.key10 = 10.5
+t.key11 = 11.5
+t.key12 = 12.5
+t.key13 = 13.5
+t.key14 = 14.5
+t.key15 = 15.5
+t.key16 = 16.5
+t.key17 = 17.5
+t.key18 = 18.5
+t.key19 = 19.5
+t.key20 = 20.5
+t.key21 = 21.5
+t.key22 = 22.5
+t.key23 = 23.5
+t.key24 = 24.5
+t.key25 = 25.5
+t.key26 = 26.5
+t.key27 = 27.5
+t.key28 = 28.5
+t.key29 = 29.5
+t.key30 = 30.5
+t.key31 = 31.5
+t.key32 = 32.5
+t.key33 = 33.5
+t.key34 = 34.5
+t.key35 = 35.5
+t.key36 = 36.5
+t.key37 = 37.5
+t.key38 = 38.5
+t.key39 = 39.5
+t.key40 = 40.5
+t.key41 = 41.5
+t.key42 = 42.5
+t.key43 = 43.5
+t.key44 = 44.5
+t.key45 = 45.5
+t.key46 = 46.5
+t.key47 = 47.5
+t.key48 = 48.5
+t.key49 = 49.5
+t.key50 = 50.5
+t.key51 = 51.5
+t.key52 = 52.5
+t.key53 = 53.5
+t.key54 = 54.5
+t.key55 = 55.5
+t.key56 = 56.5
+t.key57 = 57.5
+t.key58 = 58.5
+t.key59 = 59.5
+t.key60 = 60.5
+t.key61 = 61.5
+t.key62 = 62.5
+t.key63 = 63.5
+t.key64 = 64.5
+t.key65 = 65.5
+t.key66 = 66.5
+t.key67 = 67.5
+t.key68 = 68.5
+t.key69 = 69.5
+t.key70 = 70.5
+t.key71 = 71.5
+t.key72 = 72.5
+t.key73 = 73.5
+t.key74 = 74.5
+t.key75 = 75.5
+t.key76 = 76.5
+t.key77 = 77.5
+t.key78 = 78.5
+t.key79 = 79.5
+t.key80 = 80.5
+t.key81 = 81.5
+t.key82 = 82.5
+t.key83 = 83.5
+t.key84 = 84.5
+t.key85 = 85.5
+t.key86 = 86.5
+t.key87 = 87.5
+t.key88 = 88.5
+t.key89 = 89.5
+t.key90 = 90.5
+t.key91 = 91.5
+t.key92 = 92.5
+t.key93 = 93.5
+t.key94 = 94.5
+t.key95 = 95.5
+t.key96 = 96.5
+t.key97 = 97.5
+t.key98 = 98.5
+t.key99 = 99.5
+t.key100 = 100.5
+t.key101 = 101.5
+t.key102 = 102.5
+t.key103 = 103.5
+t.key104 = 104.5
+t.key105 = 105.5
+t.key106 = 106.5
+t.key107 = 107.5
+t.key108 = 108.5
+t.key109 = 109.5
+t.key110 = 110.5
+t.key111 = 111.5
+t.key112 = 112.5
+t.key113 = 113.5
+t.key114 = 114.5
+t.key115 = 115.5
+t.key116 = 116.5
+t.key117 = 117.5
+t.key118 = 118.5
+t.key119 = 119.5
+t.key120 = 120.5
+t.key121 = 121.5
+t.key122 = 122.5
+t.key123 = 123.5
+t.key124 = 124.5
+t.key125 = 125.5
+t.key126 = 126.5
+t.key127 = 127.5
+t.key128 = 128.5
+t.key129 = 129.5
+t.key130 = 130.5
+t.key131 = 131.5
+t.key132 = 132.5
+t.key133 = 133.5
+t.key134 = 134.5
+t.key135 = 135.5
+t.key136 = 136.5
+t.key137 = 137.5
+t.key138 = 138.5
+t.key139 = 139.5
+t.key140 = 140.5
+t.key141 = 141.5
+t.key142 = 142.5
+t.key143 = 143.5
+t.key144 = 144.5
+t.key145 = 145.5
+t.key146 = 146.5
+t.key147 = 147.5
+t.key148 = 148.5
+t.key149 = 149.5
+t.key150 = 150.5
+t.key151 = 151.5
+t.key152 = 152.5
+t.key153 = 153.5
+t.key154 = 154.5
+t.key155 = 155.5
+t.key156 = 156.5
+t.key157 = 157.5
+t.key158 = 158.5
+t.key159 = 159.5
+t.key160 = 160.5
+t.key161 = 161.5
+t.key162 = 162.5
+t.key163 = 163.5
+t.key164 = 164.5
+t.key165 = 165.5
+t.key166 = 166.5
+t.key167 = 167.5
+t.key168 = 168.5
+t.key169 = 169.5
+t.key170 = 170.5
+t.key171 = 171.5
+t.key172 = 172.5
+t.key173 = 173.5
+t.key174 = 174.5
+t.key175 = 175.5
+t.key176 = 176.5
+t.key177 = 177.5
+t.key178 = 178.5
+t.key179 = 179.5
+t.key180 = 180.5
+t.key181 = 181.5
+t.key182 = 182.5
+t.key183 = 183.5
+t.key184 = 184.5
+t.key185 = 185.5
+t.key186 = 186.5
+t.key187 = 187.5
+t.key188 = 188.5
+t.key189 = 189.5
+t.key190 = 190.5
+t.key191 = 191.5
+t.key192 = 192.5
+t.key193 = 193.5
+t.key194 = 194.5
+t.key195 = 195.5
+t.key196 = 196.5
+t.key197 = 197.5
+t.key198 = 198.5
+t.key199 = 199.5
+t.key200 = 200.5
+t.key201 = 201.5
+t.key202 = 202.5
+t.key203 = 203.5
+t.key204 = 204.5
+t.key205 = 205.5
+t.key206 = 206.5
+t.key207 = 207.5
+t.key208 = 208.5
+t.key209 = 209.5
+t.key210 = 210.5
+t.key211 = 211.5
+t.key212 = 212.5
+t.key213 = 213.5
+t.key214 = 214.5
+t.key215 = 215.5
+t.key216 = 216.5
+t.key217 = 217.5
+t.key218 = 218.5
+t.key219 = 219.5
+t.key220 = 220.5
+t.key221 = 221.5
+t.key222 = 222.5
+t.key223 = 223.5
+t.key224 = 224.5
+t.key225 = 225.5
+t.key226 = 226.5
+t.key227 = 227.5
+t.key228 = 228.5
+t.key229 = 229.5
+t.key230 = 230.5
+t.key231 = 231.5
+t.key232 = 232.5
+t.key233 = 233.5
+t.key234 = 234.5
+t.key235 = 235.5
+t.key236 = 236.5
+t.key237 = 237.5
+t.key238 = 238.5
+t.key239 = 239.5
+t.key240 = 240.5
+t.key241 = 241.5
+t.key242 = 242.5
+t.key243 = 243.5
+t.key244 = 244.5
+t.key245 = 245.5
+t.key246 = 246.5
+t.key247 = 247.5
+t.key248 = 248.5
+t.key249 = 249.5
+t.key250 = 250.5
+t.key251 = 251.5
+t.key252 = 252.5
+t.key253 = 253.5
+t.key254 = 254.5
+t.key255 = 255.5
+t.key256 = 256.5
+t.key257 = 257.5
+t.key258 = 258.5
+t.key259 = 259.5
+t.key260 = 260.5
+t.key261 = 261.5
+t.key262 = 262.5
+t.key263 = 263.5
+t.key264 = 264.5
+t.key265 = 265.5
+t.key266 = 266.5
+t.key267 = 267.5
+t.key268 = 268.5
+t.key269 = 269.5
+t.key270 = 270.5
+t.key271 = 271.5
+t.key272 = 272.5
+t.key273 = 273.5
+t.key274 = 274.5
+t.key275 = 275.5
+t.key276 = 276.5
+t.key277 = 277.5
+t.key278 = 278.5
+t.key279 = 279.5
+t.key280 = 280.5
+t.key281 = 281.5
+t.key282 = 282.5
+t.key283 = 283.5
+t.key284 = 284.5
+t.key285 = 285.5
+t.key286 = 286.5
+t.key287 = 287.5
+t.key288 = 288.5
+t.key289 = 289.5
+t.key290 = 290.5
+t.key291 = 291.5
+t.key292 = 292.5
+t.key293 = 293.5
+t.key294 = 294.5
+t.key295 = 295.5
+t.key296 = 296.5
+t.key297 = 297.5
+t.key298 = 298.5
+t.key299 = 299.5
+t.key300 = 300.5
+
+local sum = 0
+for i = 1, 300 do
+  sum = sum + 0.5
+end
+assert(sum == 150)
+
+-- 'key1' and '1.5' were among the first constants, 'key300' wasn't
+assert(t.key1 == 1.5)
+assert(t.key1 + 1.5 == 3)
+assert(t.key300 == 300.5)
+assert(t.key300 + 300.5 == 601)
+assert(t.key150 - 0.5 == 150)
+t.key300 = t.key300 * 2.5
+assert(t.key300 == 751.25)
+
+local s = 0
+s = s + t.key1
+s = s + t.key2
+s = s + t.key3
+s = s + t.key4
+s = s + t.key5
+s = s + t.key6
+s = s + t.key7
+s = s + t.key8
+s = s + t.key9
+s = s + t.key10
+s = s + t.key11
+s = s + t.key12
+s = s + t.key13
+s = s + t.key14
+s = s + t.key15
+s = s + t.key16
+s = s + t.key17
+s = s + t.key18
+s = s + t.key19
+s = s + t.key20
+s = s + t.key21
+s = s + t.key22
+s = s + t.key23
+s = s + t.key24
+s = s + t.key25
+s = s + t.key26
+s = s + t.key27
+s = s + t.key28
+s = s + t.key29
+s = s + t.key30
+s = s + t.key31
+s = s + t.key32
+s = s + t.key33
+s = s + t.key34
+s = s + t.key35
+s = s + t.key36
+s = s + t.key37
+s = s + t.key38
+s = s + t.key39
+s = s + t.key40
+s = s + t.key41
+s = s + t.key42
+s = s + t.key43
+s = s + t.key44
+s = s + t.key45
+s = s + t.key46
+s = s + t.key47
+s = s + t.key48
+s = s + t.key49
+s = s + t.key50
+s = s + t.key51
+s = s + t.key52
+s = s + t.key53
+s = s + t.key54
+s = s + t.key55
+s = s + t.key56
+s = s + t.key57
+s = s + t.key58
+s = s + t.key59
+s = s + t.key60
+s = s + t.key61
+s = s + t.key62
+s = s + t.key63
+s = s + t.key64
+s = s + t.key65
+s = s + t.key66
+s = s + t.key67
+s = s + t.key68
+s = s + t.key69
+s = s + t.key70
+s = s + t.key71
+s = s + t.key72
+s = s + t.key73
+s = s + t.key74
+s = s + t.key75
+s = s + t.key76
+s = s + t.key77
+s = s + t.key78
+s = s + t.key79
+s = s + t.key80
+s = s + t.key81
+s = s + t.key82
+s = s + t.key83
+s = s + t.key84
+s = s + t.key85
+s = s + t.key86
+s = s + t.key87
+s = s + t.key88
+s = s + t.key89
+s = s + t.key90
+s = s + t.key91
+s = s + t.key92
+s = s + t.key93
+s = s + t.key94
+s = s + t.key95
+s = s + t.key96
+s = s + t.key97
+s = s + t.key98
+s = s + t.key99
+s = s + t.key100
+s = s + t.key101
+s = s + t.key102
+s = s + t.key103
+s = s + t.key104
+s = s + t.key105
+s = s + t.key106
+s = s + t.key107
+s = s + t.key108
+s = s + t.key109
+s = s + t.key110
+s = s + t.key111
+s = s + t.key112
+s = s + t.key113
+s = s + t.key114
+s = s + t.key115
+s = s + t.key116
+s = s + t.key117
+s = s + t.key118
+s = s + t.key119
+s = s + t.key120
+s = s + t.key121
+s = s + t.key122
+s = s + t.key123
+s = s + t.key124
+s = s + t.key125
+s = s + t.key126
+s = s + t.key127
+s = s + t.key128
+s = s + t.key129
+s = s + t.key130
+s = s + t.key131
+s = s + t.key132
+s = s + t.key133
+s = s + t.key134
+s = s + t.key135
+s = s + t.key136
+s = s + t.key137
+s = s + t.key138
+s = s + t.key139
+s = s + t.key140
+s = s + t.key141
+s = s + t.key142
+s = s + t.key143
+s = s + t.key144
+s = s + t.key145
+s = s + t.key146
+s = s + t.key147
+s = s + t.key148
+s = s + t.key149
+s = s + t.key150
+s = s + t.key151
+s = s + t.key152
+s = s + t.key153
+s = s + t.key154
+s = s + t.key155
+s = s + t.key156
+s = s + t.key157
+s = s + t.key158
+s = s + t.key159
+s = s + t.key160
+s = s + t.key161
+s = s + t.key162
+s = s + t.key163
+s = s + t.key164
+s = s + t.key165
+s = s + t.key166
+s = s + t.key167
+s = s + t.key168
+s = s + t.key169
+s = s + t.key170
+s = s + t.key171
+s = s + t.key172
+s = s + t.key173
+s = s + t.key174
+s = s + t.key175
+s = s + t.key176
+s = s + t.key177
+s = s + t.key178
+s = s + t.key179
+s = s + t.key180
+s = s + t.key181
+s = s + t.key182
+s = s + t.key183
+s = s + t.key184
+s = s + t.key185
+s = s + t.key186
+s = s + t.key187
+s = s + t.key188
+s = s + t.key189
+s = s + t.key190
+s = s + t.key191
+s = s + t.key192
+s = s + t.key193
+s = s + t.key194
+s = s + t.key195
+s = s + t.key196
+s = s + t.key197
+s = s + t.key198
+s = s + t.key199
+s = s + t.key200
+s = s + t.key201
+s = s + t.key202
+s = s + t.key203
+s = s + t.key204
+s = s + t.key205
+s = s + t.key206
+s = s + t.key207
+s = s + t.key208
+s = s + t.key209
+s = s + t.key210
+s = s + t.key211
+s = s + t.key212
+s = s + t.key213
+s = s + t.key214
+s = s + t.key215
+s = s + t.key216
+s = s + t.key217
+s = s + t.key218
+s = s + t.key219
+s = s + t.key220
+s = s + t.key221
+s = s + t.key222
+s = s + t.key223
+s = s + t.key224
+s = s + t.key225
+s = s + t.key226
+s = s + t.key227
+s = s + t.key228
+s = s + t.key229
+s = s + t.key230
+s = s + t.key231
+s = s + t.key232
+s = s + t.key233
+s = s + t.key234
+s = s + t.key235
+s = s + t.key236
+s = s + t.key237
+s = s + t.key238
+s = s + t.key239
+s = s + t.key240
+s = s + t.key241
+s = s + t.key242
+s = s + t.key243
+s = s + t.key244
+s = s + t.key245
+s = s + t.key246
+s = s + t.key247
+s = s + t.key248
+s = s + t.key249
+s = s + t.key250
+s = s + t.key251
+s = s + t.key252
+s = s + t.key253
+s = s + t.key254
+s = s + t.key255
+s = s + t.key256
+s = s + t.key257
+s = s + t.key258
+s = s + t.key259
+s = s + t.key260
+s = s + t.key261
+s = s + t.key262
+s = s + t.key263
+s = s + t.key264
+s = s + t.key265
+s = s + t.key266
+s = s + t.key267
+s = s + t.key268
+s = s + t.key269
+s = s + t.key270
+s = s + t.key271
+s = s + t.key272
+s = s + t.key273
+s = s + t.key274
+s = s + t.key275
+s = s + t.key276
+s = s + t.key277
+s = s + t.key278
+s = s + t.key279
+s = s + t.key280
+s = s + t.key281
+s = s + t.key282
+s = s + t.key283
+s = s + t.key284
+s = s + t.key285
+s = s + t.key286
+s = s + t.key287
+s = s + t.key288
+s = s + t.key289
+s = s + t.key290
+s = s + t.key291
+s = s + t.key292
+s = s + t.key293
+s = s + t.key294
+s = s + t.key295
+s = s + t.key296
+s = s + t.key297
+s = s + t.key298
+s = s + t.key299
+s = s + t.key300
+assert(s == 45150 + 150 + 450.75)
+
+-- Constants that don't fit in an 8-bit operand use the wide instructions
+local x = 4
+assert(x + 1000.25 == 1004.25)
+assert(x - 1000.25 == -996.25)
+assert(1000.5 - x == 996.5)
+assert(x * 1000.75 == 4003)
+assert(x / 0.125 == 32)
+assert(1001 / x == 250.25)
+assert(x % 3.5 == 0.5)
+assert(1002.5 % x == 2.5)
+
+t.method_after_256 = function(self, n) return self.key300 + n end
+assert(t:method_after_256(0.75) == 752)
+t.key_after_256 = 5
+assert(t.key_after_256 == 5)
+t.key_after_256 = t.key_after_256 + 1
+assert(t.key_after_256 == 6)
+
+-- Long enough for the loops to be compiled
+local acc = 0
+for i = 1, 200 do
+  acc = acc + 2000.5
+  acc = acc - 2000.25
+end
+assert(acc == 50)
+
+local y = 0
+for i = 1, 200 do
+  y = 3000.5 - y
+end
+assert(y == 0)
+
+local z = 0
+for i = 1, 200 do
+  z = (z + 1) % 7
+end
+assert(z == 4)
+
+for i = 1, 200 do
+  t.loop_key_after_256 = i
+end
+assert(t.loop_key_after_256 == 200)
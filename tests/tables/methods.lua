@@ -0,0 +1,11 @@
+local obj = {n = 10}
+obj.get = function(self)
+    return self.n
+end
+obj.add = function(self, a, b)
+    return self.n + a + b
+end
+assert(obj:get() == 10)
+assert(obj:add(1, 2) == 13)
+local other = {n = 1, get = obj.get}
+assert(other:get() == 1)
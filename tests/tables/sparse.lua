@@ -0,0 +1,30 @@
+local t = {}
+t[3] = 3
+t[2] = 2
+t[1] = 1
+assert(t[1] == 1)
+assert(t[2] == 2)
+assert(t[3] == 3)
+local i = 1
+while i <= 50 do
+    t["k" .. "x"] = i
+    t[i * 1000] = i
+    i = i + 1
+end
+assert(t.kx == 50)
+assert(t[50000] == 50)
+i = 1
+while i <= 50 do
+    t[i * 1000] = nil
+    i = i + 1
+end
+assert(t[1000] == nil)
+assert(t[3] == 3)
+local g = {}
+i = 1
+while i <= 2000 do
+    g[i] = {i}
+    i = i + 1
+end
+assert(g[1][1] == 1)
+assert(g[2000][1] == 2000)
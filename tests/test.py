@@ -36,12 +36,24 @@ def print_error(message):
 	print_color(COLOR_NONE)
 	print(message)
 
+# Returns the environment to run a test with. A first line of the form
+# `-- env: NAME=VALUE ...` sets extra environment variables (e.g.,
+# LUAJ_MEM_LIMIT) for that test
+def test_env(source):
+	env = dict(os.environ)
+	match = re.match(r"--\s*env:(.*)", source)
+	if match:
+		for pair in match.group(1).split():
+			name, _, value = pair.partition("=")
+			env[name] = value
+	return env
+
 # Runs a test program from its path. Returns the exit code for the process and
 # what was written to the standard output. Returns -1 for the error code if the
 # process timed out
-def run_test(path):
+def run_test(path, env):
 	# Create the process
-	proc = Popen([cli_path, path], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+	proc = Popen([cli_path, path], stdin=PIPE, stdout=PIPE, stderr=PIPE, env=env)
 
 	# Kill test cases that take longer than `timeout` seconds
 	timed_out = [False]
@@ -106,7 +118,7 @@ def test(path):
 	source = input_file.read()
 	input_file.close()
 
-	output, error, exit_code = run_test(path)
+	output, error, exit_code = run_test(path, test_env(source))
 	return validate(path, output, error, exit_code)
 
 # Tests all Lua files in a directory. Returns the total number of tests and the